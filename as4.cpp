@@ -3,12 +3,44 @@
 #include <string>
 #include <fstream>
 #include <sstream>
+#include <charconv>
+#include <chrono>
+#include <filesystem>
+#include <algorithm>
+#include <memory>
+#include <map>
+#include <set>
+#include <deque>
+#include <tuple>
+#include <stddef.h>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <random>
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <float.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
 
 
 #include <glm/glm.hpp>
@@ -19,8 +51,89 @@
 const float SCREEN_WIDTH = 1280;
 const float SCREEN_HEIGHT = 720;
 const float FOV = 45.0f;
-const float CAMERA_MOVE_SPEED = 0.05f;
-const float CAMERA_ROTATION_SPEED = 1.0f;
+// Units and degrees per second
+const float CAMERA_MOVE_SPEED = 3.0f;
+const float CAMERA_ROTATION_SPEED = 60.0f;
+// The camera is moved this many times a second on the main thread, separately from drawing (see SimulationSnapshot)
+const float SIMULATION_RATE = 120.0f;
+// Stop the camera this far from any triangle it's moving towards instead of letting it go through (see moveCamera)
+const bool CAMERA_COLLISION = true;
+const float CAMERA_RADIUS = 0.1f;
+
+// How vertex positions are stored on the GPU (see packMesh)
+enum PositionFormat{
+	POSITION_FLOAT,	// 3 floats, exactly what was in the PLY file
+	POSITION_HALF,	// 3 half floats
+	POSITION_UNORM16	// 3 16-bit values spanning the mesh's bounding box
+};
+const PositionFormat VERTEX_POSITION_FORMAT = POSITION_UNORM16;
+// The mesh shader doesn't do any lighting, so normals are left out of the GPU vertex buffer
+const bool VERTEX_NORMALS = false;
+// Weld duplicate vertices and reorder triangles for the vertex cache and overdraw after loading (see optimizeMesh)
+const bool OPTIMIZE_MESHES = true;
+// Draw the scene with a few glMultiDrawElementsIndirect calls instead of one draw per mesh (see BatchedScene)
+const bool BATCH_DRAWS = true;
+// Skip meshes (and pieces of big meshes) that are outside the view (see SceneBVH)
+const bool FRUSTUM_CULLING = true;
+// Meshes are split into meshlets with at most this many vertices and triangles, which get culled separately
+const size_t MESHLET_MAX_VERTICES = 64;
+const size_t MESHLET_MAX_TRIANGLES = 124;
+// Meshlets of meshes marked onesided only take triangles facing within this many degrees of their first one
+const float MESHLET_CONE_ANGLE = 45.0f;
+// Skip meshlets that face completely away from the camera, for meshes marked onesided in the manifest (see DrawCluster)
+const bool CONE_CULLING = true;
+// Upload textures over several frames from worker threads instead of all at once while loading (see TextureStreamer)
+const bool STREAM_TEXTURES = true;
+// Size of the ring buffer textures are streamed through, and how much of it can be uploaded each frame
+const size_t TEXTURE_STREAM_BUFFER_SIZE = 16 << 20;
+const size_t TEXTURE_STREAM_BYTES_PER_FRAME = 4 << 20;
+// Free every mesh's CPU copies of its vertices, faces and texels once all of them are on the GPU (see Scene::draw).
+// Camera collision and picking keep working, since their BVH is built from the copies before they go.
+const bool GPU_RESIDENT = false;
+// Build simplified copies of each mesh with about these fractions of its triangles (see simplifyMesh), and draw the
+// coarsest one whose simplification error would cover less than LOD_PIXEL_ERROR pixels on screen
+const bool GENERATE_LODS = true;
+const std::vector<float> LOD_TRIANGLE_RATIOS = {0.5f, 0.25f, 0.1f};
+const float LOD_PIXEL_ERROR = 1.0f;
+// How long a mesh takes to dither from one LOD to the next instead of popping
+const float LOD_FADE_SECONDS = 0.25f;
+// Leave out meshes hidden behind other meshes when their bounding boxes were last tested (see OcclusionCuller)
+const bool OCCLUSION_CULLING = true;
+// Do the culling above, the LOD choice and the draw commands in compute shaders instead of on the CPU (see GPUCuller).
+// Needs BATCH_DRAWS and GL_ARB_indirect_parameters, and occlusion is tested against a depth pyramid instead. Off by
+// default, since it's slower than the CPU path on llvmpipe.
+const bool GPU_CULLING = false;
+// Width and height in pixels of the tiles the software renderer splits the screen into (see SoftwareRenderer)
+const int SOFTWARE_TILE_SIZE = 32;
+// Multiply in the lighting from --bake-lightmaps for meshes that have an up to date .lightmap file (see bakeLightmaps)
+const bool LIGHTMAPS = true;
+// Width and height of every mesh's lightmap, and how many texels are left empty around each chart so filtering
+// doesn't bleed between them
+const int LIGHTMAP_SIZE = 512;
+const int LIGHTMAP_PADDING = 2;
+// The baked lighting is one point light (with shadows) plus ambient light scaled by ambient occlusion: how many of
+// LIGHTMAP_AO_RAYS rays get LIGHTMAP_AO_DISTANCE away without hitting anything
+const glm::vec3 LIGHTMAP_LIGHT_POSITION = glm::vec3(0.0f, 0.9f, 0.3f);
+const glm::vec3 LIGHTMAP_LIGHT_COLOUR = glm::vec3(1.0f, 0.92f, 0.8f);
+const glm::vec3 LIGHTMAP_AMBIENT = glm::vec3(0.38f, 0.4f, 0.45f);
+const int LIGHTMAP_AO_RAYS = 32;
+const float LIGHTMAP_AO_DISTANCE = 0.3f;
+// Show the profiler's per-zone timings over the scene when the window opens (P toggles it, see ProfilerOverlay)
+const bool PROFILER_OVERLAY = false;
+// Draw the scene offscreen at a resolution that keeps the GPU's time per frame inside the budget and scale it up to
+// the window (see DynamicResolution). MSAA is dropped for a cheaper edge smoothing pass before the resolution is.
+const bool DYNAMIC_RESOLUTION = true;
+const float FRAME_TIME_BUDGET_MS = 16.0f;
+// Smallest fraction of the window's width and height the scene is drawn at
+const float MIN_RESOLUTION_SCALE = 0.5f;
+// How much the upscale sharpens, 0 for plain bilinear
+const float UPSCALE_SHARPNESS = 0.25f;
+
+// Manifest listing every mesh in the scene, with its texture and where it goes (see loadSceneManifest). --scene
+// picks a different one.
+const std::string SCENE_MANIFEST = "./scene.txt";
+// Watch the manifest and the files it lists while the window is open, and reload whatever changes (see SceneWatcher)
+const bool HOT_RELOAD = true;
 
 GLFWwindow* window;
 
@@ -36,81 +149,593 @@ struct TriData{
 	GLuint v1, v2, v3;
 };
 
+// Binary PLY files and GL buffers are read as raw arrays of these, so they can't have any padding
+static_assert(sizeof(VertexData) == sizeof(float) * 11, "VertexData must be 11 tightly packed floats");
+static_assert(sizeof(TriData) == sizeof(GLuint) * 3, "TriData must be 3 tightly packed indices");
+
 /*
-	Loads data from a PLY file
-	Returns 0 if successful, -1 for file IO error, -2 for file format error
+	Read-only memory mapping of an entire file. The mapping is released when the object is destroyed.
+	Move-only, since two copies would both try to unmap the same pages.
 */
-int loadPLY(std::string path, std::vector<VertexData>& vertices, std::vector<TriData>& faces){
-	// Try to open the file
-	printf("Reading PLY file %s\n", path.data());
-	std::ifstream file(path);
-	if (file.fail()){
-		printf("Error opening file\n");
-		return -1;
+struct MappedFile{
+	const unsigned char* data = nullptr;
+	size_t size = 0;
+
+	MappedFile(){}
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	MappedFile(MappedFile&& other) noexcept : data(other.data), size(other.size){
+		other.data = nullptr;
+		other.size = 0;
+	}
+	MappedFile& operator=(MappedFile&& other) noexcept{
+		if (this != &other){
+			close();
+			data = other.data;
+			size = other.size;
+			other.data = nullptr;
+			other.size = 0;
+		}
+		return *this;
+	}
+	~MappedFile(){
+		close();
 	}
 
-	// Read the file header
-	std::string currentLine;
-	std::string currentWord;
-	// Check for the "ply" line
-	std::getline(file, currentLine);
-	if (currentLine != "ply"){
-		printf("Invalid PLY file: Missing PLY header line\n");
-		return -2;
+	/*
+		Maps the file at path into memory
+		Returns true if successful
+	*/
+	bool open(const std::string& path){
+		close();
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0){
+			return false;
+		}
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size == 0){
+			::close(fd);
+			return false;
+		}
+		void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		// The mapping stays valid after the descriptor is closed
+		::close(fd);
+		if (mapping == MAP_FAILED){
+			return false;
+		}
+		data = (const unsigned char*) mapping;
+		size = st.st_size;
+		return true;
 	}
 
-	int numVertices = 0;
-	int numFaces = 0;
+	void close(){
+		if (data != nullptr){
+			munmap((void*) data, size);
+		}
+		data = nullptr;
+		size = 0;
+	}
+};
 
-	while (std::getline(file, currentLine)){
-		std::istringstream iss(currentLine);
-		
-		// Create a list of all the words in the line
-		std::vector<std::string> words;
-		while (std::getline(iss, currentWord, ' ')){
-			words.push_back(currentWord);
+/*
+	Vertex and face data for a mesh.
+	The vertices and faces normally live in the vertices and faces vectors, but they can also be used straight from a
+	memory-mapped file (mappedVertices/mappedFaces point into mapping). That happens for binary PLY files whose vertex
+	properties match the VertexData layout exactly, and for baked assets. Anything that changes the vertices calls
+	detach() first, which copies them anyway, so for PLY files it only saves the copy when the mesh isn't optimized or
+	moved (OPTIMIZE_MESHES off and no manifest transform). Baked assets are already optimized and keep their mapping.
+	Use vertexData(), vertexCount(), faceData() and faceCount() to read them without caring where they are.
+*/
+struct MeshData{
+	std::vector<VertexData> vertices;
+	std::vector<TriData> faces;
+	// Per-vertex coordinates in the mesh's lightmap, or empty if it doesn't have one (see applyLightmap)
+	std::vector<glm::vec2> lightmapUVs;
+	MappedFile mapping;
+	const VertexData* mappedVertices = nullptr;
+	size_t numMappedVertices = 0;
+	const TriData* mappedFaces = nullptr;
+	size_t numMappedFaces = 0;
+
+	const VertexData* vertexData() const{
+		return mappedVertices != nullptr ? mappedVertices : vertices.data();
+	}
+	size_t vertexCount() const{
+		return mappedVertices != nullptr ? numMappedVertices : vertices.size();
+	}
+	const TriData* faceData() const{
+		return mappedFaces != nullptr ? mappedFaces : faces.data();
+	}
+	size_t faceCount() const{
+		return mappedFaces != nullptr ? numMappedFaces : faces.size();
+	}
+
+	// Copies mapped vertices and faces into the vectors so they can be modified, and releases the mapping
+	void detach(){
+		if (mappedVertices != nullptr){
+			vertices.assign(mappedVertices, mappedVertices + numMappedVertices);
+			mappedVertices = nullptr;
+			numMappedVertices = 0;
 		}
+		if (mappedFaces != nullptr){
+			faces.assign(mappedFaces, mappedFaces + numMappedFaces);
+			mappedFaces = nullptr;
+			numMappedFaces = 0;
+		}
+		mapping.close();
+	}
+};
 
-		// Ignore the format line, comments, and property lines (since all the files have the properties in the same order)
-		if (words[0] == "format" || words[0] == "comment" || words[0] == "property"){
-			continue;
+/*
+	64-bit FNV-1a hash of a block of bytes
+	Pass the previous result as hash to combine several blocks into one hash
+*/
+uint64_t hashBytes(const unsigned char* data, size_t size, uint64_t hash = 14695981039346656037ull){
+	for (size_t i = 0; i < size; i++){
+		hash ^= data[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+/*
+	Records how long named zones of code take, on the CPU and (optionally) on the GPU
+	CPU zones are steady_clock times and can come from any thread. GPU zones put a GL_TIMESTAMP query at each end,
+	and the results are read back two frames later (queries are double-buffered across frames) so reading them never
+	waits on the GPU. Results that still aren't ready by then are thrown away instead of stalling.
+	Keeps a per-zone average over roughly the last half second (see averages()), and if tracing is on, every zone as
+	an event that writeTrace() saves in Chrome's trace format (open it in chrome://tracing or Perfetto).
+	Zones are usually made with ProfileZone rather than by calling begin/end directly.
+*/
+class Profiler{
+		struct Event{
+			std::string name;
+			// Microseconds since the profiler was created
+			double start, duration;
+			// Small thread number, or 0 for the GPU
+			int thread;
+		};
+
+		struct GPUQuery{
+			GLuint begin, end;
+			std::string name;
+		};
+
+		// GPU queries made during one frame
+		struct FrameQueries{
+			std::vector<GPUQuery> queries;
+			size_t used = 0;
+		};
+
+		// Time spent in a zone since the last time averages were worked out
+		struct ZoneTotal{
+			double milliseconds = 0;
+			bool gpu = false;
+		};
+
+		std::chrono::steady_clock::time_point startTime;
+		std::mutex mutex;
+		std::vector<Event> events;
+		std::map<std::thread::id, int> threadNumbers;
+		std::map<std::string, ZoneTotal> totals;
+		std::vector<std::pair<std::string, double>> averageList;
+		std::chrono::steady_clock::time_point lastAverage;
+		int framesSinceAverage = 0;
+
+		// GPU state, only touched from the thread with the GL context
+		FrameQueries frames[2];
+		int currentFrame = 0;
+		int gpuSupport = -1;
+		// GPU timestamp (nanoseconds) at the moment startTime was taken, to line GPU events up with CPU ones
+		double gpuEpoch = 0;
+		size_t droppedQueries = 0;
+
+		static const size_t MAX_EVENTS = 1 << 20;
+
+		int threadNumber(){
+			std::map<std::thread::id, int>::iterator found = threadNumbers.find(std::this_thread::get_id());
+			if (found != threadNumbers.end()){
+				return found->second;
+			}
+			int number = threadNumbers.size() + 1;
+			threadNumbers[std::this_thread::get_id()] = number;
+			return number;
 		}
-		// For "element" lines, save the number of elements
-		else if (words[0] == "element"){
-			if (words[1] == "vertex"){
-				try{
-					numVertices = std::stoi(words[2]);
+
+		void record(const std::string& name, double start, double duration, int thread, bool gpu){
+			ZoneTotal& total = totals[gpu ? "gpu " + name : name];
+			total.milliseconds += duration / 1000.0;
+			total.gpu = gpu;
+			if (tracing && events.size() < MAX_EVENTS){
+				events.push_back({name, start, duration, thread});
+			}
+		}
+
+		bool gpuSupported(){
+			if (gpuSupport < 0){
+				gpuSupport = glewIsSupported("GL_VERSION_3_3") || glewIsSupported("GL_ARB_timer_query");
+				if (gpuSupport){
+					GLint64 gpuNow = 0;
+					glGetInteger64v(GL_TIMESTAMP, &gpuNow);
+					gpuEpoch = gpuNow - now() * 1000.0;
 				}
-				catch (...){
-					printf("Invalid PLY file: Missing or invalid vertex count\n");
-					return -2;
+			}
+			return gpuSupport == 1;
+		}
+
+		// Reads back one frame's GPU queries if they're all done, otherwise drops them
+		void collectGPUQueries(FrameQueries& frame){
+			if (frame.used == 0){
+				return;
+			}
+			GLint available = GL_FALSE;
+			glGetQueryObjectiv(frame.queries[frame.used - 1].end, GL_QUERY_RESULT_AVAILABLE, &available);
+			if (available){
+				std::lock_guard<std::mutex> lock(mutex);
+				for (size_t i = 0; i < frame.used; i++){
+					GLuint64 begin = 0, end = 0;
+					glGetQueryObjectui64v(frame.queries[i].begin, GL_QUERY_RESULT, &begin);
+					glGetQueryObjectui64v(frame.queries[i].end, GL_QUERY_RESULT, &end);
+					record(frame.queries[i].name, (begin - gpuEpoch) / 1000.0, (end - begin) / 1000.0, 0, true);
 				}
 			}
-			else if (words[1] == "face"){
-				try{
-					numFaces = std::stoi(words[2]);
+			else{
+				droppedQueries += frame.used;
+			}
+			frame.used = 0;
+		}
+
+	public:
+
+		// Whether to keep every event for writeTrace(), which uses more memory the longer it runs
+		bool tracing = false;
+
+		Profiler() : startTime(std::chrono::steady_clock::now()), lastAverage(startTime){}
+
+		// Microseconds since the profiler was created
+		double now() const{
+			return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - startTime).count();
+		}
+
+		void recordCPU(const std::string& name, double start, double end){
+			std::lock_guard<std::mutex> lock(mutex);
+			record(name, start, end - start, threadNumber(), false);
+		}
+
+		// Starts a GPU zone and returns its number for endGPU, or -1 if there's no timer query support
+		int beginGPU(const std::string& name){
+			if (!gpuSupported()){
+				return -1;
+			}
+			FrameQueries& frame = frames[currentFrame];
+			if (frame.used == frame.queries.size()){
+				GPUQuery query;
+				glGenQueries(1, &query.begin);
+				glGenQueries(1, &query.end);
+				frame.queries.push_back(query);
+			}
+			GPUQuery& query = frame.queries[frame.used];
+			query.name = name;
+			glQueryCounter(query.begin, GL_TIMESTAMP);
+			return frame.used++;
+		}
+
+		void endGPU(int zone){
+			if (zone >= 0){
+				glQueryCounter(frames[currentFrame].queries[zone].end, GL_TIMESTAMP);
+			}
+		}
+
+		/*
+			Call once per frame, from the thread with the GL context, before anything is drawn
+			Switches to the other set of GPU queries (reading back what it held two frames ago) and updates the
+			averages every half second.
+		*/
+		void beginFrame(){
+			if (gpuSupport == 1){
+				currentFrame = 1 - currentFrame;
+				collectGPUQueries(frames[currentFrame]);
+			}
+			std::lock_guard<std::mutex> lock(mutex);
+			framesSinceAverage++;
+			std::chrono::steady_clock::time_point current = std::chrono::steady_clock::now();
+			if (current - lastAverage > std::chrono::milliseconds(500)){
+				averageList.clear();
+				for (std::pair<const std::string, ZoneTotal>& total : totals){
+					averageList.push_back({total.first, total.second.milliseconds / framesSinceAverage});
 				}
-				catch (...){
-					printf("Invalid PLY file: Missing or invalid face count\n");
+				totals.clear();
+				framesSinceAverage = 0;
+				lastAverage = current;
+			}
+		}
+
+		// Average milliseconds per frame for each zone, as of the last update. GPU zones start with "gpu ".
+		std::vector<std::pair<std::string, double>> averages(){
+			std::lock_guard<std::mutex> lock(mutex);
+			return averageList;
+		}
+
+		/*
+			Writes every event recorded while tracing was on as a Chrome trace JSON file
+			Returns 0 if successful, -1 if the file couldn't be written
+		*/
+		int writeTrace(std::string path){
+			// Anything the GPU has finished by now is worth keeping
+			if (gpuSupport == 1){
+				glFinish();
+				collectGPUQueries(frames[1 - currentFrame]);
+				collectGPUQueries(frames[currentFrame]);
+			}
+			std::lock_guard<std::mutex> lock(mutex);
+			FILE* file = fopen(path.data(), "w");
+			if (!file){
+				printf("Couldn't write trace %s\n", path.data());
+				return -1;
+			}
+			fprintf(file, "{\"traceEvents\":[\n");
+			fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"GPU\"}}");
+			for (const std::pair<const std::thread::id, int>& thread : threadNumbers){
+				fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}", thread.second, thread.second);
+			}
+			for (const Event& event : events){
+				// Zone names are file paths and fixed strings, but keep the JSON valid whatever they are
+				std::string name = event.name;
+				for (char& c : name){
+					if (c == '"' || c == '\\' || (unsigned char) c < 0x20){
+						c = '_';
+					}
+				}
+				fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+					name.data(), event.thread, event.start, event.duration);
+			}
+			fprintf(file, "\n]}\n");
+			bool ok = fclose(file) == 0;
+			printf("Wrote %zu trace events to %s (%zu GPU queries weren't ready in time and were dropped)\n", events.size(), path.data(), droppedQueries);
+			return ok ? 0 : -1;
+		}
+};
+
+Profiler profiler;
+
+/*
+	Times the scope it's declared in as a profiler zone
+	With gpu set, it's also timed on the GPU, which needs the GL context to be current on this thread.
+*/
+class ProfileZone{
+		std::string name;
+		double start;
+		int gpuZone = -1;
+
+	public:
+
+		ProfileZone(std::string zoneName, bool gpu = false) : name(std::move(zoneName)), start(profiler.now()){
+			if (gpu){
+				gpuZone = profiler.beginGPU(name);
+			}
+		}
+
+		~ProfileZone(){
+			profiler.endGPU(gpuZone);
+			profiler.recordCPU(name, start, profiler.now());
+		}
+
+		ProfileZone(const ProfileZone&) = delete;
+		ProfileZone& operator=(const ProfileZone&) = delete;
+};
+
+// Scalar types that can appear in a PLY header
+enum PLYType{
+	PLY_INVALID,
+	PLY_CHAR,
+	PLY_UCHAR,
+	PLY_SHORT,
+	PLY_USHORT,
+	PLY_INT,
+	PLY_UINT,
+	PLY_FLOAT,
+	PLY_DOUBLE
+};
+
+struct PLYProperty{
+	std::string name;
+	PLYType type;
+	PLYType countType;	// Type of the element count for list properties, PLY_INVALID otherwise
+};
+
+PLYType parsePLYType(const std::string& name){
+	if (name == "char" || name == "int8") return PLY_CHAR;
+	if (name == "uchar" || name == "uint8") return PLY_UCHAR;
+	if (name == "short" || name == "int16") return PLY_SHORT;
+	if (name == "ushort" || name == "uint16") return PLY_USHORT;
+	if (name == "int" || name == "int32") return PLY_INT;
+	if (name == "uint" || name == "uint32") return PLY_UINT;
+	if (name == "float" || name == "float32") return PLY_FLOAT;
+	if (name == "double" || name == "float64") return PLY_DOUBLE;
+	return PLY_INVALID;
+}
+
+int plyTypeSize(PLYType type){
+	switch (type){
+		case PLY_CHAR: case PLY_UCHAR: return 1;
+		case PLY_SHORT: case PLY_USHORT: return 2;
+		case PLY_INT: case PLY_UINT: case PLY_FLOAT: return 4;
+		case PLY_DOUBLE: return 8;
+		default: return 0;
+	}
+}
+
+/*
+	Reads one binary PLY value of the given type from p, byte swapping it first if swap is set
+	memcpy is used since values in a PLY file have no particular alignment
+*/
+double readPLYValue(const unsigned char* p, PLYType type, bool swap){
+	unsigned char bytes[8];
+	int size = plyTypeSize(type);
+	for (int i = 0; i < size; i++){
+		bytes[i] = swap ? p[size - 1 - i] : p[i];
+	}
+	switch (type){
+		case PLY_CHAR: { int8_t v; memcpy(&v, bytes, 1); return v; }
+		case PLY_UCHAR: { uint8_t v; memcpy(&v, bytes, 1); return v; }
+		case PLY_SHORT: { int16_t v; memcpy(&v, bytes, 2); return v; }
+		case PLY_USHORT: { uint16_t v; memcpy(&v, bytes, 2); return v; }
+		case PLY_INT: { int32_t v; memcpy(&v, bytes, 4); return v; }
+		case PLY_UINT: { uint32_t v; memcpy(&v, bytes, 4); return v; }
+		case PLY_FLOAT: { float v; memcpy(&v, bytes, 4); return v; }
+		case PLY_DOUBLE: { double v; memcpy(&v, bytes, 8); return v; }
+		default: return 0;
+	}
+}
+
+/*
+	Returns which float in VertexData a PLY vertex property is stored in (0 for x up to 10 for v), or -1 if it isn't used
+*/
+int vertexFieldIndex(const std::string& name){
+	static const char* fieldNames[11][3] = {
+		{"x", "x", "x"},
+		{"y", "y", "y"},
+		{"z", "z", "z"},
+		{"nx", "nx", "nx"},
+		{"ny", "ny", "ny"},
+		{"nz", "nz", "nz"},
+		{"red", "r", "red"},
+		{"green", "g", "green"},
+		{"blue", "b", "blue"},
+		{"u", "s", "texture_u"},
+		{"v", "t", "texture_v"}
+	};
+	for (int i = 0; i < 11; i++){
+		for (int j = 0; j < 3; j++){
+			if (name == fieldNames[i][j]){
+				return i;
+			}
+		}
+	}
+	return -1;
+}
+
+/*
+	Reads the vertex and face data of a binary PLY file, starting at dataOffset in the mapped file
+	Returns 0 if successful, -2 for file format error
+*/
+int loadBinaryPLYBody(MeshData& mesh, size_t dataOffset, bool bigEndian, int numVertices, int numFaces,
+		const std::vector<PLYProperty>& vertexProperties, const std::vector<PLYProperty>& faceProperties){
+	const unsigned char* data = mesh.mapping.data;
+	size_t fileSize = mesh.mapping.size;
+	bool swap = bigEndian != (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__);
+
+	// Vertices have a fixed size, so the whole vertex block can be located up front
+	size_t vertexStride = 0;
+	bool matchesVertexData = !swap && vertexProperties.size() == 11;
+	for (size_t i = 0; i < vertexProperties.size(); i++){
+		if (vertexProperties[i].countType != PLY_INVALID){
+			printf("Invalid PLY file: List properties are not supported for vertices\n");
+			return -2;
+		}
+		vertexStride += plyTypeSize(vertexProperties[i].type);
+		if (vertexProperties[i].type != PLY_FLOAT || vertexFieldIndex(vertexProperties[i].name) != (int) i){
+			matchesVertexData = false;
+		}
+	}
+	if (dataOffset + vertexStride * numVertices > fileSize){
+		printf("Invalid PLY file: File is too short for the vertex count\n");
+		return -2;
+	}
+
+	if (matchesVertexData && dataOffset % alignof(VertexData) == 0){
+		// Same layout as VertexData, so the vertices can be used right out of the mapping. optimizeMesh and
+		// transformMesh detach() them again though, so with OPTIMIZE_MESHES on this only puts the copy off until then.
+		mesh.mappedVertices = (const VertexData*) (data + dataOffset);
+		mesh.numMappedVertices = numVertices;
+	}
+	else{
+		mesh.vertices.resize(numVertices);
+		const unsigned char* p = data + dataOffset;
+		for (int i = 0; i < numVertices; i++){
+			VertexData vd = {};
+			float* fields = (float*) &vd;
+			for (const PLYProperty& prop : vertexProperties){
+				int field = vertexFieldIndex(prop.name);
+				if (field >= 0){
+					double value = readPLYValue(p, prop.type, swap);
+					// Integer colours are 0-255, but VertexData colours are 0-1
+					if (field >= 6 && field <= 8 && prop.type == PLY_UCHAR){
+						value /= 255.0;
+					}
+					fields[field] = (float) value;
+				}
+				p += plyTypeSize(prop.type);
+			}
+			mesh.vertices[i] = vd;
+		}
+	}
+	size_t offset = dataOffset + vertexStride * numVertices;
+
+	// Faces have variable size since they are lists, but the common "uchar uint vertex_indices" triangle layout
+	// is 13 bytes per face and can be read with one memcpy each
+	mesh.faces.resize(numFaces);
+	bool triangleFastPath = !swap && faceProperties.size() == 1 && faceProperties[0].countType == PLY_UCHAR
+		&& (faceProperties[0].type == PLY_UINT || faceProperties[0].type == PLY_INT);
+	for (int i = 0; i < numFaces; i++){
+		if (triangleFastPath && offset + 13 <= fileSize && data[offset] == 3){
+			memcpy(&mesh.faces[i], data + offset + 1, sizeof(TriData));
+			offset += 13;
+		}
+		else{
+			bool haveIndices = false;
+			for (const PLYProperty& prop : faceProperties){
+				int countSize = plyTypeSize(prop.countType);
+				int valueSize = plyTypeSize(prop.type);
+				if (offset + countSize > fileSize){
+					printf("Invalid PLY file: File is too short for the face count\n");
+					return -2;
+				}
+				size_t count = countSize > 0 ? (size_t) readPLYValue(data + offset, prop.countType, swap) : 1;
+				offset += countSize;
+				if (offset + count * valueSize > fileSize){
+					printf("Invalid PLY file: File is too short for the face count\n");
 					return -2;
 				}
+				if (prop.name == "vertex_indices" || prop.name == "vertex_index"){
+					if (count < 3){
+						printf("Invalid PLY file: Not enough vertices to form a triangle\n");
+						return -2;
+					}
+					mesh.faces[i].v1 = (GLuint) readPLYValue(data + offset, prop.type, swap);
+					mesh.faces[i].v2 = (GLuint) readPLYValue(data + offset + valueSize, prop.type, swap);
+					mesh.faces[i].v3 = (GLuint) readPLYValue(data + offset + valueSize * 2, prop.type, swap);
+					haveIndices = true;
+				}
+				offset += count * valueSize;
 			}
-			else{
-				printf("Invalid PLY file: Missing or invalid element type\n");
+			if (!haveIndices){
+				printf("Invalid PLY file: Missing face vertex indices\n");
 				return -2;
 			}
 		}
-		// Break out of the loop once the end_header line is read
-		else if (words[0] == "end_header"){
-			break;
+		if (mesh.faces[i].v1 >= (GLuint) numVertices || mesh.faces[i].v2 >= (GLuint) numVertices || mesh.faces[i].v3 >= (GLuint) numVertices){
+			printf("Invalid PLY file: Face vertex index out of range\n");
+			return -2;
 		}
 	}
 
-	// If either numFaces or numVertices is zero after the header, the file is bad
-	if (numFaces == 0 || numVertices == 0){
-		printf("Invalid PLY file: Missing face or vertex count\n");
-		return -2;
+	// Nothing points into the mapping if the vertices were converted, so there's no reason to keep it around
+	if (mesh.mappedVertices == nullptr){
+		mesh.mapping.close();
 	}
+	return 0;
+}
+
+/*
+	Reads the vertex and face lines of an ASCII PLY file one line at a time with istringstream and stof
+	This was the original ASCII reader. loadPLY uses parseASCIIPLYBody now, but this is kept as a reference
+	for --bench-ply since it's much easier to convince yourself it's correct.
+	Returns 0 if successful, -2 for file format error
+*/
+int parseASCIIPLYBodyReference(std::istream& file, int numVertices, int numFaces, std::vector<VertexData>& vertices, std::vector<TriData>& faces){
+	std::string currentLine;
+	std::string currentWord;
 
 	// Read the vertices
 	for (int i = 0; i < numVertices; i++){
@@ -133,7 +758,7 @@ int loadPLY(std::string path, std::vector<VertexData>& vertices, std::vector<Tri
 		}
 
 		// If we made it this far, there are 8 valid numbers, so create a VertexData from them and add it to the list
-		VertexData vd;
+		VertexData vd = {};
 		vd.x = values[0];
 		vd.y = values[1];
 		vd.z = values[2];
@@ -171,7 +796,7 @@ int loadPLY(std::string path, std::vector<VertexData>& vertices, std::vector<Tri
 			}
 		}
 
-		if (values.size() != vertexCount){
+		if (values.size() != (size_t) vertexCount){
 			printf("Invalid PLY file: Number of vertices does not match specified vertex count\n");
 			return -2;
 		}
@@ -189,335 +814,10195 @@ int loadPLY(std::string path, std::vector<VertexData>& vertices, std::vector<Tri
 	return 0;
 }
 
-/**
- * Given a file path imagepath, read the data in that bitmapped image
- * and return the raw bytes of color in the data pointer.
- * The width and height of the image are returned in the weight and height pointers,
- * respectively.
- *
- * usage:
- *
- * unsigned char* imageData;
- * unsigned int width, height;
- * loadARGB_BMP("mytexture.bmp", &imageData, &width, &height);
- *
- * Modified from https://github.com/opengl-tutorials/ogl.
- */
-void loadARGB_BMP(const char* imagepath, unsigned char** data, unsigned int* width, unsigned int* height) {
-
-    printf("Reading image %s\n", imagepath);
-
-    // Data read from the header of the BMP file
-    unsigned char header[54];
-    unsigned int dataPos;
-    unsigned int imageSize;
-    // Actual RGBA data
-
-    // Open the file
-    FILE * file = fopen(imagepath,"rb");
-    if (!file){
-        printf("%s could not be opened. Are you in the right directory?\n", imagepath);
-        getchar();
-        return;
-    }
-
-    // Read the header, i.e. the 54 first bytes
-
-    // If less than 54 bytes are read, problem
-    if ( fread(header, 1, 54, file)!=54 ){
-        printf("Not a correct BMP file1\n");
-        fclose(file);
-        return;
-    }
-
-    // Read the information about the image
-    dataPos    = *(int*)&(header[0x0A]);
-    imageSize  = *(int*)&(header[0x22]);
-    *width      = *(int*)&(header[0x12]);
-    *height     = *(int*)&(header[0x16]);
-    // A BMP files always begins with "BM"
-    if ( header[0]!='B' || header[1]!='M' ){
-        printf("Not a correct BMP file2\n");
-        fclose(file);
-        return;
-    }
-    // Make sure this is a 32bpp file
-    if ( *(int*)&(header[0x1E])!=3  ) {
-        printf("Not a correct BMP file3\n");
-        fclose(file);
-        return;
-    }
-    // fprintf(stderr, "header[0x1c]: %d\n", *(int*)&(header[0x1c]));
-    // if ( *(int*)&(header[0x1C])!=32 ) {
-    //     printf("Not a correct BMP file4\n");
-    //     fclose(file);
-    //     return;
-    // }
-
-    // Some BMP files are misformatted, guess missing information
-    if (imageSize==0)    imageSize=(*width)* (*height)*4; // 4 : one byte for each Red, Green, Blue, Alpha component
-    if (dataPos==0)      dataPos=54; // The BMP header is done that way
-
-    // Create a buffer
-    *data = new unsigned char [imageSize];
-
-    if (dataPos != 54) {
-        fread(header, 1, dataPos - 54, file);
-    }
-
-    // Read the actual data from the file into the buffer
-    fread(*data,1,imageSize,file);
-
-    // Everything is in memory now, the file can be closed.
-    fclose (file);
+// Whitespace that can separate values on a line of an ASCII PLY file
+static inline bool isPLYSpace(char c){
+	return c == ' ' || c == '\t' || c == '\r';
 }
 
+static inline const char* skipPLYSpaces(const char* p, const char* end){
+	while (p < end && isPLYSpace(*p)){
+		p++;
+	}
+	return p;
+}
 
-class TexturedMesh {	
-		std::string PLYPath, texturePath;
-		std::vector<VertexData> vertices;
-		std::vector<TriData> faces;
-		GLuint vertexVBO, textureVBO, vertexIndicesVBO, textureObj, meshVAO, programID;
-		
-		unsigned char* textureData;
-		unsigned int textureWidth, textureHeight;
-
-	public:
-		
-		TexturedMesh(std::string ply_path, std::string tex_path){
-			PLYPath = ply_path;
-			texturePath = tex_path;
-			loadARGB_BMP(texturePath.data(), &textureData, &textureWidth, &textureHeight);
-			loadPLY(PLYPath, vertices, faces);
+/*
+	Parses one number starting at p with std::from_chars, which doesn't allocate, use the locale or throw
+	Returns a pointer just past the number, or nullptr if there isn't a valid number there
+*/
+template <typename T>
+static inline const char* parsePLYNumber(const char* p, const char* end, T& value){
+	// from_chars doesn't accept a leading +, but stof/stoi did
+	if (p < end && *p == '+'){
+		p++;
+	}
+	std::from_chars_result result = std::from_chars(p, end, value);
+	if (result.ec != std::errc() || (result.ptr < end && !isPLYSpace(*result.ptr) && *result.ptr != '\n')){
+		return nullptr;
+	}
+	return result.ptr;
+}
 
+/*
+	Reads the vertex and face lines of an ASCII PLY file from a single buffer without any allocations per value
+	The vertices and faces vectors are sized once up front and every number is parsed in place with std::from_chars.
+	Returns 0 if successful, -2 for file format error
+*/
+int parseASCIIPLYBody(const char* p, const char* end, int numVertices, int numFaces, std::vector<VertexData>& vertices, std::vector<TriData>& faces){
+	// Every value takes at least 2 bytes (a digit and a space or newline), and each vertex line has at least 8 values
+	// and each face line at least 4 (the very last one may skip its newline), so counts that can't fit in what's left
+	// of the file are rejected before anything is sized for them
+	if (((uint64_t) numVertices * 8 + (uint64_t) numFaces * 4) * 2 > (uint64_t) (end - p) + 1){
+		printf("Invalid PLY file: File is too short for the vertex and face counts\n");
+		return -2;
+	}
+	size_t firstVertex = vertices.size();
+	size_t firstFace = faces.size();
+	vertices.resize(firstVertex + numVertices);
+	faces.resize(firstFace + numFaces);
 
-			// Create VAO
-			glGenVertexArrays(1, &meshVAO);
-			glBindVertexArray(meshVAO);
+	// Read the vertices
+	for (int i = 0; i < numVertices; i++){
+		// The first 8 values are x, y, z, nx, ny, nz, u, v (colours aren't in any of our files)
+		float values[8];
+		for (int j = 0; j < 8; j++){
+			p = skipPLYSpaces(p, end);
+			if (p == end || *p == '\n'){
+				printf("Invalid PLY file: Wrong number of vertex properties\n");
+				return -2;
+			}
+			p = parsePLYNumber(p, end, values[j]);
+			if (p == nullptr){
+				printf("Invalid PLY file: Missing or invalid vertex property value\n");
+				return -2;
+			}
+		}
 
-			// Create VBOs
-			// Vertices
-			glGenBuffers(1, &vertexVBO);
-			glBindBuffer(GL_ARRAY_BUFFER, vertexVBO);
-			glBufferData(GL_ARRAY_BUFFER, sizeof(GL_FLOAT) * 11 * vertices.size(), &(vertices[0]), GL_STATIC_DRAW);
-			glEnableVertexAttribArray(0);
-			glVertexAttribPointer(
-				0,
-				3,
-				GL_FLOAT,
-				GL_FALSE,
-				sizeof(GL_FLOAT) * 11,
-				(void*) 0
-			);
+		// Any extra values on the line still have to be numbers
+		while (true){
+			p = skipPLYSpaces(p, end);
+			if (p == end || *p == '\n'){
+				break;
+			}
+			float extra;
+			p = parsePLYNumber(p, end, extra);
+			if (p == nullptr){
+				printf("Invalid PLY file: Missing or invalid vertex property value\n");
+				return -2;
+			}
+		}
+		if (p < end){
+			p++;
+		}
 
-			// Texture coordinates
-			glGenBuffers(1, &textureVBO);
-			glBindBuffer(GL_ARRAY_BUFFER, textureVBO);
-			glBufferData(GL_ARRAY_BUFFER, sizeof(GL_FLOAT) * 11 * vertices.size(), &(vertices[0]), GL_STATIC_DRAW);
-			glEnableVertexAttribArray(1);
-			glVertexAttribPointer(
-				1,
-				2,
-				GL_FLOAT,
-				GL_FALSE,
-				sizeof(GL_FLOAT) * 11,
-				(void*) 36
-			);
-			
+		VertexData& vd = vertices[firstVertex + i];
+		vd = {};
+		vd.x = values[0];
+		vd.y = values[1];
+		vd.z = values[2];
+		vd.nx = values[3];
+		vd.ny = values[4];
+		vd.nz = values[5];
+		vd.u = values[6];
+		vd.v = values[7];
+	}
 
-			// Face vertex indices
-			glGenBuffers(1, &vertexIndicesVBO);
-			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, vertexIndicesVBO);
-			glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GL_UNSIGNED_INT) * 3 * faces.size(), &(faces[0]), GL_STATIC_DRAW);
+	// Read the faces
+	for (int i = 0; i < numFaces; i++){
+		// Get the vertex count from the first entry in the line
+		int vertexCount = 0;
+		p = skipPLYSpaces(p, end);
+		p = parsePLYNumber(p, end, vertexCount);
+		if (p == nullptr){
+			printf("Invalid PLY file: Invalid face vertex count\n");
+			return -2;
+		}
 
+		// Only the first 3 indices are kept, but the rest are still counted and checked
+		GLuint indices[3] = {0, 0, 0};
+		int numIndices = 0;
+		while (true){
+			p = skipPLYSpaces(p, end);
+			if (p == end || *p == '\n'){
+				break;
+			}
+			int index;
+			p = parsePLYNumber(p, end, index);
+			if (p == nullptr){
+				printf("Invalid PLY file: Missing or invalid face vertex index value\n");
+				return -2;
+			}
+			if (index < 0 || index >= numVertices){
+				printf("Invalid PLY file: Face vertex index out of range\n");
+				return -2;
+			}
+			if (numIndices < 3){
+				indices[numIndices] = index;
+			}
+			numIndices++;
+		}
+		if (p < end){
+			p++;
+		}
+
+		if (numIndices != vertexCount){
+			printf("Invalid PLY file: Number of vertices does not match specified vertex count\n");
+			return -2;
+		}
+
+		if (vertexCount < 3){
+			printf("Invalid PLY file: Not enough vertices to form a triangle\n");
+			return -2;
+		}
+
+		TriData& td = faces[firstFace + i];
+		td.v1 = indices[0];
+		td.v2 = indices[1];
+		td.v3 = indices[2];
+	}
+	return 0;
+}
+
+/*
+	Loads data from a PLY file
+	Supports ASCII and binary (little or big endian) files
+	Returns 0 if successful, -1 for file IO error, -2 for file format error
+*/
+int loadPLY(std::string path, MeshData& mesh){
+	// Try to open the file
+	printf("Reading PLY file %s\n", path.data());
+	std::ifstream file(path, std::ios::binary);
+	if (file.fail()){
+		printf("Error opening file\n");
+		return -1;
+	}
+
+	// Read the file header
+	std::string currentLine;
+	std::string currentWord;
+	// Check for the "ply" line
+	std::getline(file, currentLine);
+	if (currentLine != "ply"){
+		printf("Invalid PLY file: Missing PLY header line\n");
+		return -2;
+	}
+
+	int numVertices = 0;
+	int numFaces = 0;
+	bool binary = false;
+	bool bigEndian = false;
+	std::vector<PLYProperty> vertexProperties;
+	std::vector<PLYProperty> faceProperties;
+	std::vector<PLYProperty>* currentProperties = nullptr;
+	bool foundEndHeader = false;
+
+	while (std::getline(file, currentLine)){
+		// Files written on Windows may have \r\n line endings
+		if (!currentLine.empty() && currentLine.back() == '\r'){
+			currentLine.pop_back();
+		}
+		std::istringstream iss(currentLine);
+		
+		// Create a list of all the words in the line
+		std::vector<std::string> words;
+		while (std::getline(iss, currentWord, ' ')){
+			words.push_back(currentWord);
+		}
+		if (words.empty()){
+			continue;
+		}
+
+		// Ignore comments
+		if (words[0] == "comment" || words[0] == "obj_info"){
+			continue;
+		}
+		// Check which format the data is stored in
+		else if (words[0] == "format"){
+			if (words.size() < 2){
+				printf("Invalid PLY file: Missing format\n");
+				return -2;
+			}
+			if (words[1] == "binary_little_endian" || words[1] == "binary_big_endian"){
+				binary = true;
+				bigEndian = words[1] == "binary_big_endian";
+			}
+			else if (words[1] != "ascii"){
+				printf("Invalid PLY file: Unknown format %s\n", words[1].data());
+				return -2;
+			}
+		}
+		// Save the property names and types of the current element
+		else if (words[0] == "property"){
+			PLYProperty prop;
+			if (words.size() == 5 && words[1] == "list"){
+				prop.countType = parsePLYType(words[2]);
+				prop.type = parsePLYType(words[3]);
+				prop.name = words[4];
+			}
+			else if (words.size() == 3){
+				prop.countType = PLY_INVALID;
+				prop.type = parsePLYType(words[1]);
+				prop.name = words[2];
+			}
+			else{
+				prop.type = PLY_INVALID;
+			}
+			if (prop.type == PLY_INVALID || (words[1] == "list" && prop.countType == PLY_INVALID) || currentProperties == nullptr){
+				printf("Invalid PLY file: Invalid property\n");
+				return -2;
+			}
+			currentProperties->push_back(prop);
+		}
+		// For "element" lines, save the number of elements
+		else if (words[0] == "element"){
+			if (words.size() < 3){
+				printf("Invalid PLY file: Missing or invalid element type\n");
+				return -2;
+			}
+			if (words[1] == "vertex"){
+				try{
+					numVertices = std::stoi(words[2]);
+				}
+				catch (...){
+					printf("Invalid PLY file: Missing or invalid vertex count\n");
+					return -2;
+				}
+				currentProperties = &vertexProperties;
+			}
+			else if (words[1] == "face"){
+				try{
+					numFaces = std::stoi(words[2]);
+				}
+				catch (...){
+					printf("Invalid PLY file: Missing or invalid face count\n");
+					return -2;
+				}
+				currentProperties = &faceProperties;
+			}
+			else{
+				printf("Invalid PLY file: Missing or invalid element type\n");
+				return -2;
+			}
+		}
+		// Break out of the loop once the end_header line is read
+		else if (words[0] == "end_header"){
+			foundEndHeader = true;
+			break;
+		}
+	}
+
+	if (!foundEndHeader){
+		printf("Invalid PLY file: Missing end_header line\n");
+		return -2;
+	}
+
+	// If either numFaces or numVertices is zero after the header, the file is bad
+	if (numFaces <= 0 || numVertices <= 0){
+		printf("Invalid PLY file: Missing face or vertex count\n");
+		return -2;
+	}
+
+	if (binary){
+		// The data starts right after the end_header line, so map the file and read it from there
+		size_t dataOffset = (size_t) file.tellg();
+		file.close();
+		if (!mesh.mapping.open(path)){
+			printf("Error opening file\n");
+			return -1;
+		}
+		return loadBinaryPLYBody(mesh, dataOffset, bigEndian, numVertices, numFaces, vertexProperties, faceProperties);
+	}
+
+	// Map the whole file and parse the ASCII data in place, starting right after the end_header line
+	size_t dataOffset = (size_t) file.tellg();
+	file.close();
+	MappedFile mapping;
+	if (!mapping.open(path)){
+		printf("Error opening file\n");
+		return -1;
+	}
+	const char* begin = (const char*) mapping.data;
+	return parseASCIIPLYBody(begin + dataOffset, begin + mapping.size, numVertices, numFaces, mesh.vertices, mesh.faces);
+}
+
+/*
+	Loads data from a PLY file into separate vertex and face lists
+	Returns 0 if successful, -1 for file IO error, -2 for file format error
+*/
+int loadPLY(std::string path, std::vector<VertexData>& vertices, std::vector<TriData>& faces){
+	MeshData mesh;
+	int result = loadPLY(path, mesh);
+	mesh.detach();
+	vertices = std::move(mesh.vertices);
+	faces = std::move(mesh.faces);
+	return result;
+}
+
+/*
+	Average number of vertex shader runs per triangle (ACMR) for a FIFO post-transform cache of cacheSize entries
+	3.0 means every vertex of every triangle is a miss. 0.5 is about the best possible for a large regular grid.
+*/
+float simulateACMR(const std::vector<TriData>& faces, size_t numVertices, int cacheSize = 16){
+	if (faces.empty()){
+		return 0;
+	}
+	// Each vertex remembers when it was added; it's still cached if fewer than cacheSize misses happened since
+	std::vector<size_t> addedAt(numVertices, SIZE_MAX);
+	size_t misses = 0;
+	for (const TriData& face : faces){
+		GLuint indices[3] = {face.v1, face.v2, face.v3};
+		for (GLuint index : indices){
+			if (addedAt[index] == SIZE_MAX || misses - addedAt[index] >= (size_t) cacheSize){
+				addedAt[index] = misses;
+				misses++;
+			}
+		}
+	}
+	return (float) misses / faces.size();
+}
+
+// Hashes the raw bytes of a VertexData so identical vertices can be found with an unordered_map
+struct VertexDataHash{
+	size_t operator()(const VertexData& vd) const{
+		return hashBytes((const unsigned char*) &vd, sizeof(VertexData));
+	}
+};
+struct VertexDataEqual{
+	bool operator()(const VertexData& a, const VertexData& b) const{
+		return memcmp(&a, &b, sizeof(VertexData)) == 0;
+	}
+};
+
+/*
+	Merges vertices whose VertexData is exactly the same and points the faces at the merged copies
+	Comparing bytes means only true duplicates are merged (a seam with different UVs or normals stays split).
+*/
+void weldVertices(MeshData& mesh){
+	mesh.detach();
+	std::vector<VertexData>& vertices = mesh.vertices;
+	std::unordered_map<VertexData, GLuint, VertexDataHash, VertexDataEqual> unique;
+	unique.reserve(vertices.size());
+	std::vector<GLuint> remap(vertices.size());
+	std::vector<VertexData> welded;
+	welded.reserve(vertices.size());
+	for (size_t i = 0; i < vertices.size(); i++){
+		std::pair<std::unordered_map<VertexData, GLuint, VertexDataHash, VertexDataEqual>::iterator, bool> inserted
+			= unique.emplace(vertices[i], (GLuint) welded.size());
+		if (inserted.second){
+			welded.push_back(vertices[i]);
+		}
+		remap[i] = inserted.first->second;
+	}
+	for (TriData& face : mesh.faces){
+		face.v1 = remap[face.v1];
+		face.v2 = remap[face.v2];
+		face.v3 = remap[face.v3];
+	}
+	vertices = std::move(welded);
+}
+
+/*
+	Reorders triangles so consecutive triangles share vertices, using Tom Forsyth's "Linear-Speed Vertex Cache
+	Optimisation". Vertices are scored by their position in a simulated LRU cache and by how many unused triangles
+	they still have, and the highest scoring triangle touching the cache is always emitted next.
+*/
+void optimizeVertexCache(std::vector<TriData>& faces, size_t numVertices){
+	const int CACHE_SIZE = 32;
+	size_t numFaces = faces.size();
+	if (numFaces == 0){
+		return;
+	}
+
+	// Triangle lists per vertex, stored back to back (adjacencyStart[v] up to adjacencyStart[v] + valence[v])
+	std::vector<GLuint> valence(numVertices, 0);
+	for (const TriData& face : faces){
+		valence[face.v1]++;
+		valence[face.v2]++;
+		valence[face.v3]++;
+	}
+	std::vector<size_t> adjacencyStart(numVertices + 1, 0);
+	for (size_t v = 0; v < numVertices; v++){
+		adjacencyStart[v + 1] = adjacencyStart[v] + valence[v];
+	}
+	std::vector<GLuint> adjacency(adjacencyStart[numVertices]);
+	std::vector<GLuint> filled(numVertices, 0);
+	for (size_t t = 0; t < numFaces; t++){
+		GLuint indices[3] = {faces[t].v1, faces[t].v2, faces[t].v3};
+		for (GLuint v : indices){
+			adjacency[adjacencyStart[v] + filled[v]++] = t;
+		}
+	}
+
+	auto vertexScore = [&](int cachePosition, GLuint remaining){
+		if (remaining == 0){
+			return -1.0f;
+		}
+		float score = 0;
+		if (cachePosition >= 0){
+			// The last triangle's vertices get a fixed score so the next triangle doesn't just reuse them in a strip
+			if (cachePosition < 3){
+				score = 0.75f;
+			}
+			else{
+				score = powf(1.0f - (float) (cachePosition - 3) / (CACHE_SIZE - 3), 1.5f);
+			}
+		}
+		// Vertices with few triangles left get a boost so they're finished off instead of left behind
+		return score + 2.0f * powf((float) remaining, -0.5f);
+	};
+
+	std::vector<int> cachePosition(numVertices, -1);
+	std::vector<float> score(numVertices);
+	for (size_t v = 0; v < numVertices; v++){
+		score[v] = vertexScore(-1, valence[v]);
+	}
+	std::vector<float> triangleScore(numFaces);
+	std::vector<bool> emitted(numFaces, false);
+	for (size_t t = 0; t < numFaces; t++){
+		triangleScore[t] = score[faces[t].v1] + score[faces[t].v2] + score[faces[t].v3];
+	}
+
+	std::vector<TriData> result;
+	result.reserve(numFaces);
+	std::vector<GLuint> cache, newCache;
+	size_t nextUnemitted = 0;
+	long bestTriangle = -1;
+	while (result.size() < numFaces){
+		// Nothing in the cache has triangles left, so start again with the best of the rest
+		if (bestTriangle < 0){
+			float bestScore = -1;
+			for (size_t t = nextUnemitted; t < numFaces; t++){
+				if (!emitted[t] && triangleScore[t] > bestScore){
+					bestScore = triangleScore[t];
+					bestTriangle = t;
+				}
+			}
+		}
+
+		TriData face = faces[bestTriangle];
+		emitted[bestTriangle] = true;
+		result.push_back(face);
+		while (nextUnemitted < numFaces && emitted[nextUnemitted]){
+			nextUnemitted++;
+		}
+
+		// Remove the triangle from its vertices' lists
+		GLuint indices[3] = {face.v1, face.v2, face.v3};
+		for (GLuint v : indices){
+			GLuint* begin = &adjacency[adjacencyStart[v]];
+			GLuint* end = begin + valence[v];
+			*std::find(begin, end, (GLuint) bestTriangle) = *(end - 1);
+			valence[v]--;
+		}
+
+		// Move the triangle's vertices to the front of the LRU cache
+		newCache.assign(indices, indices + 3);
+		for (GLuint v : cache){
+			if (v != indices[0] && v != indices[1] && v != indices[2]){
+				newCache.push_back(v);
+			}
+		}
+		for (size_t i = CACHE_SIZE; i < newCache.size(); i++){
+			cachePosition[newCache[i]] = -1;
+			score[newCache[i]] = vertexScore(-1, valence[newCache[i]]);
+		}
+		if (newCache.size() > (size_t) CACHE_SIZE){
+			newCache.resize(CACHE_SIZE);
+		}
+		cache.swap(newCache);
+
+		// Rescore everything in the cache and pick the best triangle that uses any of it
+		for (size_t i = 0; i < cache.size(); i++){
+			cachePosition[cache[i]] = i;
+			score[cache[i]] = vertexScore(i, valence[cache[i]]);
+		}
+		bestTriangle = -1;
+		float bestScore = -1;
+		for (GLuint v : cache){
+			for (size_t i = adjacencyStart[v]; i < adjacencyStart[v] + valence[v]; i++){
+				GLuint t = adjacency[i];
+				triangleScore[t] = score[faces[t].v1] + score[faces[t].v2] + score[faces[t].v3];
+				if (triangleScore[t] > bestScore){
+					bestScore = triangleScore[t];
+					bestTriangle = t;
+				}
+			}
+		}
+	}
+	faces.swap(result);
+}
+
+/*
+	Reorders groups of triangles to cut down on overdraw without undoing optimizeVertexCache
+	This is the clustering part of Sander et al. "Fast Triangle Reordering for Vertex Locality and Reduced Overdraw":
+	the cache-ordered list is split wherever a triangle shares no vertices with the cache (so moving the pieces
+	around costs almost nothing), then pieces that face away from the middle of the mesh are drawn first, since
+	they're the ones most likely to be in front of everything else.
+*/
+void optimizeOverdraw(std::vector<TriData>& faces, const VertexData* vertices, size_t numVertices){
+	const int CACHE_SIZE = 16;
+	const size_t MIN_CLUSTER_SIZE = 8;
+	size_t numFaces = faces.size();
+	if (numFaces == 0){
+		return;
+	}
+
+	// Split into clusters
+	std::vector<size_t> clusterStarts;
+	std::vector<size_t> addedAt(numVertices, SIZE_MAX);
+	size_t misses = 0;
+	for (size_t t = 0; t < numFaces; t++){
+		GLuint indices[3] = {faces[t].v1, faces[t].v2, faces[t].v3};
+		int triangleMisses = 0;
+		for (GLuint index : indices){
+			if (addedAt[index] == SIZE_MAX || misses - addedAt[index] >= (size_t) CACHE_SIZE){
+				addedAt[index] = misses;
+				misses++;
+				triangleMisses++;
+			}
+		}
+		if (triangleMisses == 3 && (clusterStarts.empty() || t - clusterStarts.back() >= MIN_CLUSTER_SIZE)){
+			clusterStarts.push_back(t);
+		}
+	}
+	clusterStarts.push_back(numFaces);
+
+	// Area weighted centre of the whole mesh
+	auto position = [&](GLuint index){
+		return glm::vec3(vertices[index].x, vertices[index].y, vertices[index].z);
+	};
+	glm::vec3 meshCentre(0.0f);
+	float meshArea = 0;
+	for (const TriData& face : faces){
+		glm::vec3 a = position(face.v1), b = position(face.v2), c = position(face.v3);
+		float area = glm::length(glm::cross(b - a, c - a));
+		meshCentre += (a + b + c) * (area / 3.0f);
+		meshArea += area;
+	}
+	if (meshArea > 0){
+		meshCentre /= meshArea;
+	}
+
+	// Sort clusters by how much they face away from the centre
+	struct Cluster{
+		size_t start, end;
+		float sortKey;
+	};
+	std::vector<Cluster> clusters;
+	for (size_t i = 0; i + 1 < clusterStarts.size(); i++){
+		Cluster cluster = {clusterStarts[i], clusterStarts[i + 1], 0};
+		glm::vec3 centre(0.0f), normal(0.0f);
+		float area = 0;
+		for (size_t t = cluster.start; t < cluster.end; t++){
+			glm::vec3 a = position(faces[t].v1), b = position(faces[t].v2), c = position(faces[t].v3);
+			glm::vec3 areaNormal = glm::cross(b - a, c - a);
+			float triangleArea = glm::length(areaNormal);
+			centre += (a + b + c) * (triangleArea / 3.0f);
+			normal += areaNormal;
+			area += triangleArea;
+		}
+		if (area > 0){
+			centre /= area;
+		}
+		float normalLength = glm::length(normal);
+		if (normalLength > 0){
+			cluster.sortKey = glm::dot(centre - meshCentre, normal / normalLength);
+		}
+		clusters.push_back(cluster);
+	}
+	std::stable_sort(clusters.begin(), clusters.end(), [](const Cluster& a, const Cluster& b){
+		return a.sortKey > b.sortKey;
+	});
+
+	std::vector<TriData> result;
+	result.reserve(numFaces);
+	for (const Cluster& cluster : clusters){
+		result.insert(result.end(), faces.begin() + cluster.start, faces.begin() + cluster.end);
+	}
+	faces.swap(result);
+}
+
+/*
+	Renumbers vertices in the order the index buffer first uses them, so vertex fetches walk through memory in order
+	Vertices no faces use are dropped.
+*/
+void optimizeVertexFetch(MeshData& mesh){
+	mesh.detach();
+	const GLuint UNUSED = UINT32_MAX;
+	std::vector<GLuint> remap(mesh.vertices.size(), UNUSED);
+	std::vector<VertexData> reordered;
+	reordered.reserve(mesh.vertices.size());
+	for (TriData& face : mesh.faces){
+		GLuint* indices[3] = {&face.v1, &face.v2, &face.v3};
+		for (GLuint* index : indices){
+			if (remap[*index] == UNUSED){
+				remap[*index] = reordered.size();
+				reordered.push_back(mesh.vertices[*index]);
+			}
+			*index = remap[*index];
+		}
+	}
+	mesh.vertices = std::move(reordered);
+}
+
+/*
+	Runs every optimization stage on a freshly loaded mesh: welding, vertex cache order, overdraw order, fetch order
+	Prints the vertex count and ACMR before and after so the effect on each mesh is visible.
+*/
+void optimizeMesh(MeshData& mesh, const std::string& name){
+	mesh.detach();
+	size_t verticesBefore = mesh.vertices.size();
+	float acmrBefore = simulateACMR(mesh.faces, mesh.vertices.size());
+
+	weldVertices(mesh);
+	optimizeVertexCache(mesh.faces, mesh.vertices.size());
+	optimizeOverdraw(mesh.faces, mesh.vertices.data(), mesh.vertices.size());
+	optimizeVertexFetch(mesh);
+
+	float acmrAfter = simulateACMR(mesh.faces, mesh.vertices.size());
+	printf("Optimized %s: %zu -> %zu vertices, ACMR %.3f -> %.3f\n", name.data(), verticesBefore, mesh.vertices.size(), acmrBefore, acmrAfter);
+}
+
+/*
+	Keeps track of the meshlet being built while going through triangles in draw order: a meshlet can have at most
+	MESHLET_MAX_VERTICES different vertices and MESHLET_MAX_TRIANGLES triangles
+	orderMeshlets and buildDrawClusters both use it, so going through the order orderMeshlets made, buildDrawClusters
+	starts a new meshlet at exactly the triangles orderMeshlets did.
+*/
+class MeshletCounter{
+		const VertexData* vertices;
+		bool limitNormals;
+		// The meshlet each vertex was last counted in, so shared vertices are only counted once per meshlet
+		std::vector<size_t> lastMeshlet;
+		size_t meshlet = 0;
+		size_t numVertices = 0, numTriangles = 0;
+		glm::vec3 firstNormal;
+
+	public:
+
+		MeshletCounter(const MeshData& mesh, bool oneSided) : vertices(mesh.vertexData()), limitNormals(oneSided), lastMeshlet(mesh.vertexCount(), SIZE_MAX){}
+
+		// Unit normal of a triangle, or 0 if it has no area
+		glm::vec3 normal(const TriData& face) const{
+			glm::vec3 a(vertices[face.v1].x, vertices[face.v1].y, vertices[face.v1].z);
+			glm::vec3 b(vertices[face.v2].x, vertices[face.v2].y, vertices[face.v2].z);
+			glm::vec3 c(vertices[face.v3].x, vertices[face.v3].y, vertices[face.v3].z);
+			glm::vec3 n = glm::cross(b - a, c - a);
+			float length = glm::length(n);
+			return length > 0.0f ? n / length : glm::vec3(0.0f);
+		}
+
+		// How many vertices the triangle would add to the meshlet
+		size_t newVertices(const TriData& face) const{
+			GLuint indices[3] = {face.v1, face.v2, face.v3};
+			size_t count = 0;
+			for (int k = 0; k < 3; k++){
+				if (lastMeshlet[indices[k]] != meshlet && (k == 0 || indices[k] != indices[0]) && (k < 2 || indices[k] != indices[1])){
+					count++;
+				}
+			}
+			return count;
+		}
+
+		/*
+			Whether the triangle can go in the meshlet without going over either limit, and for one-sided meshes,
+			without facing more than MESHLET_CONE_ANGLE away from the meshlet's first triangle (so every meshlet gets
+			a narrow enough normal cone to be culled with)
+		*/
+		bool fits(const TriData& face) const{
+			if (numTriangles == 0){
+				return true;
+			}
+			if (numTriangles >= MESHLET_MAX_TRIANGLES || numVertices + newVertices(face) > MESHLET_MAX_VERTICES){
+				return false;
+			}
+			glm::vec3 n = normal(face);
+			return !limitNormals || glm::length(n) == 0.0f || glm::length(firstNormal) == 0.0f
+				|| glm::dot(n, firstNormal) >= cos(glm::radians(MESHLET_CONE_ANGLE));
+		}
+
+		void add(const TriData& face){
+			if (numTriangles == 0){
+				firstNormal = normal(face);
+			}
+			numVertices += newVertices(face);
+			numTriangles++;
+			lastMeshlet[face.v1] = lastMeshlet[face.v2] = lastMeshlet[face.v3] = meshlet;
+		}
+
+		// Starts the next meshlet
+		void next(){
+			meshlet++;
+			numVertices = numTriangles = 0;
+		}
+};
+
+/*
+	Reorders a mesh's triangles into meshlets that are small and face one way, so they cull well (see DrawCluster)
+	Each meshlet grows from one triangle by adding whichever triangle touching it adds the fewest new vertices and
+	has the normal closest to the meshlet's average, until the next one doesn't fit (see MeshletCounter, which also
+	keeps one-sided meshes' meshlets within MESHLET_CONE_ANGLE). If nothing touches it, whichever of the next 1024
+	triangles in the old order is unused and closest to its centre goes next (the vertex cache order already keeps
+	nearby triangles close together, and a search of the whole mesh for every separate piece of it could take a long
+	time). Only the order of the triangles changes, so it can run after a lightmap has been applied. Growing the
+	meshlets loses most of the vertex cache order, so afterwards optimizeVertexCache reorders the triangles inside
+	each meshlet (the meshlets themselves stay the same). The overdraw order is lost.
+*/
+void orderMeshlets(MeshData& mesh, bool oneSided, const std::string& name){
+	mesh.detach();
+	std::vector<TriData>& faces = mesh.faces;
+	size_t numFaces = faces.size();
+	size_t numVertices = mesh.vertices.size();
+	float acmrBefore = simulateACMR(faces, numVertices);
+
+	MeshletCounter counter(mesh, oneSided);
+	std::vector<glm::vec3> normals(numFaces), centres(numFaces);
+	for (size_t t = 0; t < numFaces; t++){
+		const VertexData& a = mesh.vertices[faces[t].v1], & b = mesh.vertices[faces[t].v2], & c = mesh.vertices[faces[t].v3];
+		normals[t] = counter.normal(faces[t]);
+		centres[t] = glm::vec3(a.x + b.x + c.x, a.y + b.y + c.y, a.z + b.z + c.z) / 3.0f;
+	}
+	// The faces using each vertex: vertexFaces[vertexStart[v]] to vertexFaces[vertexStart[v + 1]]
+	std::vector<size_t> vertexStart(numVertices + 1, 0), vertexFaces(numFaces * 3);
+	for (const TriData& face : faces){
+		vertexStart[face.v1 + 1]++;
+		vertexStart[face.v2 + 1]++;
+		vertexStart[face.v3 + 1]++;
+	}
+	for (size_t v = 0; v < numVertices; v++){
+		vertexStart[v + 1] += vertexStart[v];
+	}
+	std::vector<size_t> filled(vertexStart.begin(), vertexStart.end() - 1);
+	for (size_t t = 0; t < numFaces; t++){
+		vertexFaces[filled[faces[t].v1]++] = t;
+		vertexFaces[filled[faces[t].v2]++] = t;
+		vertexFaces[filled[faces[t].v3]++] = t;
+	}
+
+	std::vector<TriData> ordered;
+	ordered.reserve(numFaces);
+	std::vector<size_t> meshletStarts = {0};
+	std::vector<bool> used(numFaces, false);
+	// Unused triangles touching the meshlet (with repeats)
+	std::vector<size_t> candidates;
+	glm::vec3 normalSum(0.0f), centreSum(0.0f);
+	size_t meshletTriangles = 0, firstUnused = 0;
+	while (ordered.size() < numFaces){
+		glm::vec3 axis = glm::length(normalSum) > 0.0f ? glm::normalize(normalSum) : glm::vec3(0.0f);
+		size_t best = SIZE_MAX;
+		float bestScore = 0.0f;
+		size_t kept = 0;
+		for (size_t candidate : candidates){
+			if (used[candidate]){
+				continue;
+			}
+			candidates[kept++] = candidate;
+			// A normal pointing the other way costs as much as 4 new vertices
+			float score = counter.newVertices(faces[candidate]) + 2.0f * (1.0f - glm::dot(normals[candidate], axis));
+			if (best == SIZE_MAX || score < bestScore){
+				best = candidate;
+				bestScore = score;
+			}
+		}
+		candidates.resize(kept);
+		if (best == SIZE_MAX){
+			while (used[firstUnused]){
+				firstUnused++;
+			}
+			best = firstUnused;
+			if (meshletTriangles > 0){
+				glm::vec3 centre = centreSum / (float) meshletTriangles;
+				float bestDistance = glm::length(centres[best] - centre);
+				for (size_t t = firstUnused + 1; t < std::min(numFaces, firstUnused + 1024); t++){
+					float distance = glm::length(centres[t] - centre);
+					if (!used[t] && distance < bestDistance){
+						best = t;
+						bestDistance = distance;
+					}
+				}
+			}
+		}
+
+		if (!counter.fits(faces[best])){
+			counter.next();
+			meshletStarts.push_back(ordered.size());
+			candidates.clear();
+			normalSum = centreSum = glm::vec3(0.0f);
+			meshletTriangles = 0;
+		}
+		counter.add(faces[best]);
+		used[best] = true;
+		ordered.push_back(faces[best]);
+		normalSum += normals[best];
+		centreSum += centres[best];
+		meshletTriangles++;
+		GLuint indices[3] = {faces[best].v1, faces[best].v2, faces[best].v3};
+		for (GLuint index : indices){
+			for (size_t i = vertexStart[index]; i < vertexStart[index + 1]; i++){
+				if (!used[vertexFaces[i]]){
+					candidates.push_back(vertexFaces[i]);
+				}
+			}
+		}
+	}
+	meshletStarts.push_back(numFaces);
+
+	/*
+		Put each meshlet's triangles in vertex cache order, with the meshlet's vertices numbered from 0 so
+		optimizeVertexCache only has to look at those. In one-sided meshes the first triangle has to stay first, since
+		their meshlets are only within MESHLET_CONE_ANGLE of that one and buildDrawClusters has to find the same
+		meshlets again. The order the meshlet grew in is often just as good already (and the new one doesn't know
+		what the meshlet before left in the cache), so whichever order misses the cache less, going on from the
+		meshlets before it, is kept. That's the same FIFO cache simulateACMR uses. Picking the best order one meshlet
+		at a time can still come out worse overall, and then the order they grew in is kept for the whole mesh.
+	*/
+	std::vector<TriData> grownOrder = ordered;
+	const GLuint UNUSED = UINT32_MAX;
+	std::vector<GLuint> localIndex(numVertices, UNUSED), globalIndex;
+	std::vector<TriData> meshlet;
+	const size_t CACHE_SIZE = 16;
+	std::vector<size_t> addedAt(numVertices, SIZE_MAX);
+	size_t misses = 0;
+	std::vector<std::pair<GLuint, size_t>> undo;
+	// Cache misses for drawing the triangles next, which are only kept in the simulated cache if commit is true
+	auto simulate = [&](const std::vector<TriData>& run, bool commit){
+		size_t start = misses;
+		undo.clear();
+		for (const TriData& face : run){
+			GLuint indices[3] = {globalIndex[face.v1], globalIndex[face.v2], globalIndex[face.v3]};
+			for (GLuint index : indices){
+				if (addedAt[index] == SIZE_MAX || misses - addedAt[index] >= CACHE_SIZE){
+					undo.push_back({index, addedAt[index]});
+					addedAt[index] = misses;
+					misses++;
+				}
+			}
+		}
+		size_t runMisses = misses - start;
+		if (!commit){
+			for (size_t i = undo.size(); i-- > 0;){
+				addedAt[undo[i].first] = undo[i].second;
+			}
+			misses = start;
+		}
+		return runMisses;
+	};
+	for (size_t m = 0; m + 1 < meshletStarts.size(); m++){
+		meshlet.clear();
+		globalIndex.clear();
+		for (size_t t = meshletStarts[m]; t < meshletStarts[m + 1]; t++){
+			GLuint indices[3] = {ordered[t].v1, ordered[t].v2, ordered[t].v3};
+			for (GLuint& index : indices){
+				if (localIndex[index] == UNUSED){
+					localIndex[index] = globalIndex.size();
+					globalIndex.push_back(index);
+				}
+				index = localIndex[index];
+			}
+			meshlet.push_back({indices[0], indices[1], indices[2]});
+		}
+		std::vector<TriData> grown = meshlet;
+		optimizeVertexCache(meshlet, globalIndex.size());
+		for (size_t t = 0; oneSided && t < meshlet.size(); t++){
+			if (meshlet[t].v1 == grown[0].v1 && meshlet[t].v2 == grown[0].v2 && meshlet[t].v3 == grown[0].v3){
+				std::rotate(meshlet.begin(), meshlet.begin() + t, meshlet.begin() + t + 1);
+				break;
+			}
+		}
+		if (simulate(meshlet, false) >= simulate(grown, false)){
+			meshlet.swap(grown);
+		}
+		simulate(meshlet, true);
+		for (size_t t = 0; t < meshlet.size(); t++){
+			ordered[meshletStarts[m] + t] = {globalIndex[meshlet[t].v1], globalIndex[meshlet[t].v2], globalIndex[meshlet[t].v3]};
+		}
+		for (GLuint index : globalIndex){
+			localIndex[index] = UNUSED;
+		}
+	}
+	if (simulateACMR(ordered, numVertices) > simulateACMR(grownOrder, numVertices)){
+		ordered.swap(grownOrder);
+	}
+	faces.swap(ordered);
+	printf("Meshlets for %s: ACMR %.3f -> %.3f\n", name.data(), acmrBefore, simulateACMR(faces, numVertices));
+}
+
+/*
+	Quadric error metric (Garland and Heckbert): the sum of squared distances from a point to a set of planes
+	Stored as the 10 unique values of the symmetric 4x4 matrix, in doubles since they get added up a lot. weight is the
+	total weight of the planes, so error() / weight is the average squared distance.
+*/
+struct Quadric{
+	double a2 = 0, ab = 0, ac = 0, ad = 0, b2 = 0, bc = 0, bd = 0, c2 = 0, cd = 0, d2 = 0;
+	double weight = 0;
+
+	// Adds the plane normal . p + d = 0, with a unit length normal
+	void addPlane(const glm::vec3& normal, float d, double planeWeight){
+		double a = normal.x, b = normal.y, c = normal.z;
+		a2 += planeWeight * a * a;
+		ab += planeWeight * a * b;
+		ac += planeWeight * a * c;
+		ad += planeWeight * a * d;
+		b2 += planeWeight * b * b;
+		bc += planeWeight * b * c;
+		bd += planeWeight * b * d;
+		c2 += planeWeight * c * c;
+		cd += planeWeight * c * d;
+		d2 += planeWeight * d * d;
+		weight += planeWeight;
+	}
+	void add(const Quadric& other){
+		a2 += other.a2;
+		ab += other.ab;
+		ac += other.ac;
+		ad += other.ad;
+		b2 += other.b2;
+		bc += other.bc;
+		bd += other.bd;
+		c2 += other.c2;
+		cd += other.cd;
+		d2 += other.d2;
+		weight += other.weight;
+	}
+	double error(const glm::vec3& p) const{
+		double x = p.x, y = p.y, z = p.z;
+		double result = a2 * x * x + 2 * ab * x * y + 2 * ac * x * z + 2 * ad * x
+			+ b2 * y * y + 2 * bc * y * z + 2 * bd * y
+			+ c2 * z * z + 2 * cd * z + d2;
+		// Rounding can make it slightly negative
+		return std::max(result, 0.0);
+	}
+};
+
+/*
+	Simplifies a mesh with quadric error metrics, keeping a copy of the triangles each time the count gets down to
+	the next of targetRatios (fractions of the original triangle count, largest first)
+	Only half-edge collapses are done (a vertex moves onto a neighbour), so every level still indexes the original
+	vertex buffer. Split vertices (the copies of a position on a UV or lightmap seam) all move at once, each onto the
+	copy of the new position it shares an edge with, so a seam vertex can only slide along the seam and both sides
+	keep their own UVs. To keep the texture mapping intact, vertices on an open border only slide along the border,
+	and each collapse also pays for how far it slides the texture (see textureError). Collapses that would flip a
+	triangle over are skipped. errors gets, for each level, the largest error (in model units) of any collapse so
+	far. Stops early if nothing more can be collapsed, so there can be fewer levels than targets.
+*/
+void simplifyMesh(const MeshData& mesh, const std::vector<float>& targetRatios, std::vector<std::vector<TriData>>& levels, std::vector<float>& errors){
+	const VertexData* vertices = mesh.vertexData();
+	size_t numVertices = mesh.vertexCount();
+	std::vector<TriData> faces(mesh.faceData(), mesh.faceData() + mesh.faceCount());
+	size_t numOriginalFaces = faces.size();
+	levels.clear();
+	errors.clear();
+	auto position = [&](GLuint v){
+		return glm::vec3(vertices[v].x, vertices[v].y, vertices[v].z);
+	};
+
+	// Split vertices are the same point in space, so edges are compared by position rather than by vertex
+	std::map<std::tuple<float, float, float>, GLuint> positions;
+	std::vector<GLuint> positionID(numVertices);
+	for (size_t v = 0; v < numVertices; v++){
+		positionID[v] = positions.emplace(std::make_tuple(vertices[v].x, vertices[v].y, vertices[v].z), (GLuint) positions.size()).first->second;
+	}
+	size_t numPositions = positions.size();
+	// Every vertex at each position, with position p's at copyList[firstCopy[p]] to copyList[firstCopy[p + 1]]
+	std::vector<size_t> firstCopy(numPositions + 1, 0);
+	std::vector<GLuint> copyList(numVertices);
+	for (size_t v = 0; v < numVertices; v++){
+		firstCopy[positionID[v] + 1]++;
+	}
+	for (size_t p = 0; p < numPositions; p++){
+		firstCopy[p + 1] += firstCopy[p];
+	}
+	std::vector<size_t> nextCopy(firstCopy.begin(), firstCopy.end() - 1);
+	for (size_t v = 0; v < numVertices; v++){
+		copyList[nextCopy[positionID[v]]++] = v;
+	}
+	auto edgeKey = [&](GLuint a, GLuint b){
+		uint64_t pa = positionID[a], pb = positionID[b];
+		return pa < pb ? (pa << 32) | pb : (pb << 32) | pa;
+	};
+	// How many of the current triangles use each edge. Edges used once are on a border.
+	std::unordered_map<uint64_t, int> edgeUses;
+	auto countEdges = [&](){
+		edgeUses.clear();
+		for (const TriData& face : faces){
+			edgeUses[edgeKey(face.v1, face.v2)]++;
+			edgeUses[edgeKey(face.v2, face.v3)]++;
+			edgeUses[edgeKey(face.v3, face.v1)]++;
+		}
+	};
+	countEdges();
+
+	// Per position, so every copy of a split vertex gets the same one
+	enum VertexKind : unsigned char{
+		MANIFOLD,	// Free to move onto any neighbour
+		BORDER,	// Only moves along border edges
+		LOCKED	// Never moves
+	};
+	std::vector<unsigned char> kind(numPositions, MANIFOLD);
+	for (const TriData& face : faces){
+		GLuint corners[3] = {face.v1, face.v2, face.v3};
+		for (int i = 0; i < 3; i++){
+			GLuint a = corners[i], b = corners[(i + 1) % 3];
+			int uses = edgeUses[edgeKey(a, b)];
+			unsigned char edgeKind = uses == 1 ? BORDER : uses > 2 ? LOCKED : MANIFOLD;
+			kind[positionID[a]] = std::max(kind[positionID[a]], edgeKind);
+			kind[positionID[b]] = std::max(kind[positionID[b]], edgeKind);
+		}
+	}
+
+	// Each position starts with the planes of its triangles (weighted by area), plus planes at right angles to border
+	// edges so borders keep their shape
+	const double BORDER_WEIGHT = 10.0;
+	std::vector<Quadric> quadrics(numPositions);
+	for (const TriData& face : faces){
+		GLuint corners[3] = {face.v1, face.v2, face.v3};
+		glm::vec3 p[3] = {position(face.v1), position(face.v2), position(face.v3)};
+		glm::vec3 normal = glm::cross(p[1] - p[0], p[2] - p[0]);
+		float length = glm::length(normal);
+		if (length == 0){
+			continue;
+		}
+		normal /= length;
+		for (int i = 0; i < 3; i++){
+			quadrics[positionID[corners[i]]].addPlane(normal, -glm::dot(normal, p[0]), length * 0.5);
+		}
+		for (int i = 0; i < 3; i++){
+			GLuint a = corners[i], b = corners[(i + 1) % 3];
+			if (edgeUses[edgeKey(a, b)] != 1){
+				continue;
+			}
+			glm::vec3 edge = p[(i + 1) % 3] - p[i];
+			glm::vec3 borderNormal = glm::cross(edge, normal);
+			float borderLength = glm::length(borderNormal);
+			if (borderLength == 0){
+				continue;
+			}
+			borderNormal /= borderLength;
+			double borderWeight = glm::dot(edge, edge) * BORDER_WEIGHT;
+			quadrics[positionID[a]].addPlane(borderNormal, -glm::dot(borderNormal, p[i]), borderWeight);
+			quadrics[positionID[b]].addPlane(borderNormal, -glm::dot(borderNormal, p[i]), borderWeight);
+		}
+	}
+
+	/*
+		How far the texture would slide if from moved onto to, squared and in model units: the UV the new triangles
+		around from's old position interpolate there, compared to from's own UV, scaled by how much model space a
+		unit of UV covers on that triangle. Zero when the UVs are a linear function of position (like a flat floor
+		with a planar mapping), so those collapses stay free.
+	*/
+	auto textureError = [&](GLuint from, GLuint to, const std::vector<size_t>& firstFace, const std::vector<GLuint>& vertexFaces){
+		glm::vec3 p = position(from);
+		glm::vec2 uv(vertices[from].u, vertices[from].v);
+		double best = DBL_MAX;
+		for (size_t i = firstFace[from]; i < firstFace[from + 1]; i++){
+			const TriData& face = faces[vertexFaces[i]];
+			if (face.v1 == to || face.v2 == to || face.v3 == to){
+				continue;
+			}
+			GLuint corners[3] = {face.v1 == from ? to : face.v1, face.v2 == from ? to : face.v2, face.v3 == from ? to : face.v3};
+			glm::vec3 a = position(corners[0]), ab = position(corners[1]) - a, ac = position(corners[2]) - a, ap = p - a;
+			glm::vec2 uvA(vertices[corners[0]].u, vertices[corners[0]].v);
+			glm::vec2 uvAB = glm::vec2(vertices[corners[1]].u, vertices[corners[1]].v) - uvA;
+			glm::vec2 uvAC = glm::vec2(vertices[corners[2]].u, vertices[corners[2]].v) - uvA;
+			// Barycentric coordinates of p in the triangle's plane, clamped so p is treated as its nearest point inside
+			float d00 = glm::dot(ab, ab), d01 = glm::dot(ab, ac), d11 = glm::dot(ac, ac);
+			float d20 = glm::dot(ap, ab), d21 = glm::dot(ap, ac);
+			float denominator = d00 * d11 - d01 * d01;
+			float uvArea = fabsf(uvAB.x * uvAC.y - uvAB.y * uvAC.x);
+			if (denominator <= 0 || uvArea <= 0){
+				continue;
+			}
+			float v = glm::clamp((d11 * d20 - d01 * d21) / denominator, 0.0f, 1.0f);
+			float w = glm::clamp((d00 * d21 - d01 * d20) / denominator, 0.0f, 1.0f - v);
+			glm::vec2 offset = uvA + uvAB * v + uvAC * w - uv;
+			double unitsPerUV = sqrt(sqrt(denominator) / uvArea);
+			best = std::min(best, glm::dot(offset, offset) * unitsPerUV * unitsPerUV);
+		}
+		return best == DBL_MAX ? 0.0 : best;
+	};
+
+	/*
+		Pairs every copy of from's position that's still used with the copy of to's position it shares an edge with,
+		which is where it moves. Returns false if any of them has none (the edge crosses a seam rather than running
+		along it, so one side would tear) or more than one.
+	*/
+	const GLuint UNMATCHED = UINT32_MAX;
+	auto matchCopies = [&](GLuint from, GLuint to, const std::vector<size_t>& firstFace, const std::vector<GLuint>& vertexFaces,
+			std::vector<std::pair<GLuint, GLuint>>& pairs){
+		pairs.clear();
+		GLuint target = positionID[to];
+		for (size_t c = firstCopy[positionID[from]]; c < firstCopy[positionID[from] + 1]; c++){
+			GLuint copy = copyList[c];
+			if (firstFace[copy] == firstFace[copy + 1]){
+				continue;
+			}
+			GLuint match = UNMATCHED;
+			for (size_t i = firstFace[copy]; i < firstFace[copy + 1]; i++){
+				const TriData& face = faces[vertexFaces[i]];
+				GLuint corners[3] = {face.v1, face.v2, face.v3};
+				for (GLuint corner : corners){
+					if (positionID[corner] == target){
+						if (match != UNMATCHED && match != corner){
+							return false;
+						}
+						match = corner;
+					}
+				}
+			}
+			if (match == UNMATCHED){
+				return false;
+			}
+			pairs.push_back({copy, match});
+		}
+		return true;
+	};
+
+	struct Collapse{
+		GLuint from, to;
+		double cost;
+	};
+	std::vector<Collapse> collapses;
+	std::vector<std::pair<GLuint, GLuint>> pairs;
+	std::vector<GLuint> remap(numVertices);
+	std::vector<unsigned char> touched(numVertices);
+	std::vector<size_t> firstVertexFace(numVertices + 1);
+	std::vector<GLuint> vertexFaces;
+	double maxError = 0;
+
+	for (float ratio : targetRatios){
+		size_t target = (size_t) (numOriginalFaces * ratio);
+		size_t facesBefore = faces.size();
+		while (faces.size() > target){
+			// Triangles around each vertex, for the flip test
+			std::fill(firstVertexFace.begin(), firstVertexFace.end(), 0);
+			for (const TriData& face : faces){
+				firstVertexFace[face.v1 + 1]++;
+				firstVertexFace[face.v2 + 1]++;
+				firstVertexFace[face.v3 + 1]++;
+			}
+			for (size_t v = 0; v < numVertices; v++){
+				firstVertexFace[v + 1] += firstVertexFace[v];
+			}
+			vertexFaces.resize(faces.size() * 3);
+			std::vector<size_t> fill(firstVertexFace.begin(), firstVertexFace.end() - 1);
+			for (size_t f = 0; f < faces.size(); f++){
+				vertexFaces[fill[faces[f].v1]++] = f;
+				vertexFaces[fill[faces[f].v2]++] = f;
+				vertexFaces[fill[faces[f].v3]++] = f;
+			}
+
+			// Every allowed collapse along every edge, cheapest first
+			collapses.clear();
+			for (const TriData& face : faces){
+				GLuint corners[3] = {face.v1, face.v2, face.v3};
+				for (int i = 0; i < 3; i++){
+					GLuint a = corners[i], b = corners[(i + 1) % 3];
+					bool border = edgeUses[edgeKey(a, b)] == 1;
+					GLuint ends[2][2] = {{a, b}, {b, a}};
+					for (const auto& end : ends){
+						GLuint from = end[0], to = end[1];
+						unsigned char fromKind = kind[positionID[from]];
+						if (fromKind == LOCKED || (fromKind == BORDER && !border)){
+							continue;
+						}
+						if (!matchCopies(from, to, firstVertexFace, vertexFaces, pairs)){
+							continue;
+						}
+						Quadric combined = quadrics[positionID[from]];
+						combined.add(quadrics[positionID[to]]);
+						double cost = combined.error(position(to)) / std::max(combined.weight, 1e-30);
+						// Each side of a seam has its own texture, so the one that slides furthest counts
+						double slide = 0;
+						for (const std::pair<GLuint, GLuint>& pair : pairs){
+							slide = std::max(slide, textureError(pair.first, pair.second, firstVertexFace, vertexFaces));
+						}
+						collapses.push_back({from, to, cost + slide});
+					}
+				}
+			}
+			std::sort(collapses.begin(), collapses.end(), [](const Collapse& a, const Collapse& b){
+				return a.cost < b.cost;
+			});
+
+			// Do as many as possible in one pass, as long as none of them touch the same triangles. Each collapse
+			// removes about two triangles. Collapses that are much more expensive than the cheapest ones wait for a
+			// later pass, where cheaper ones may have opened up again. (Each edge is in the list about 4 times.)
+			size_t budget = (faces.size() - target) / 2 + 1;
+			double costLimit = collapses.empty() ? 0 : collapses[std::min(collapses.size() - 1, budget * 4)].cost;
+			size_t done = 0;
+			for (size_t v = 0; v < numVertices; v++){
+				remap[v] = v;
+			}
+			std::fill(touched.begin(), touched.end(), 0);
+			for (const Collapse& collapse : collapses){
+				if (done >= budget || (collapse.cost > costLimit && done > 0)){
+					break;
+				}
+				// The faces haven't changed since the list was made, so this finds the same copies again
+				matchCopies(collapse.from, collapse.to, firstVertexFace, vertexFaces, pairs);
+				bool blocked = false;
+				for (const std::pair<GLuint, GLuint>& pair : pairs){
+					blocked = blocked || touched[pair.first] || touched[pair.second];
+				}
+				if (blocked){
+					continue;
+				}
+				glm::vec3 destination = position(collapse.to);
+				bool flips = false;
+				for (const std::pair<GLuint, GLuint>& pair : pairs){
+					for (size_t i = firstVertexFace[pair.first]; i < firstVertexFace[pair.first + 1] && !flips; i++){
+						const TriData& face = faces[vertexFaces[i]];
+						if (face.v1 == pair.second || face.v2 == pair.second || face.v3 == pair.second){
+							continue;
+						}
+						glm::vec3 before[3] = {position(face.v1), position(face.v2), position(face.v3)};
+						glm::vec3 after[3] = {before[0], before[1], before[2]};
+						after[face.v1 == pair.first ? 0 : face.v2 == pair.first ? 1 : 2] = destination;
+						glm::vec3 normalBefore = glm::cross(before[1] - before[0], before[2] - before[0]);
+						glm::vec3 normalAfter = glm::cross(after[1] - after[0], after[2] - after[0]);
+						flips = glm::dot(normalBefore, normalAfter) <= 0.25f * glm::length(normalBefore) * glm::length(normalAfter);
+					}
+				}
+				if (flips){
+					continue;
+				}
+				quadrics[positionID[collapse.to]].add(quadrics[positionID[collapse.from]]);
+				maxError = std::max(maxError, collapse.cost);
+				for (const std::pair<GLuint, GLuint>& pair : pairs){
+					remap[pair.first] = pair.second;
+					for (size_t i = firstVertexFace[pair.first]; i < firstVertexFace[pair.first + 1]; i++){
+						const TriData& face = faces[vertexFaces[i]];
+						touched[face.v1] = touched[face.v2] = touched[face.v3] = 1;
+					}
+				}
+				done++;
+			}
+			if (done == 0){
+				break;
+			}
+
+			// Move the collapsed vertices and drop the triangles that became degenerate
+			size_t kept = 0;
+			for (const TriData& face : faces){
+				TriData moved = {remap[face.v1], remap[face.v2], remap[face.v3]};
+				if (moved.v1 != moved.v2 && moved.v2 != moved.v3 && moved.v3 != moved.v1){
+					faces[kept++] = moved;
+				}
+			}
+			faces.resize(kept);
+			countEdges();
+		}
+		// A level that's barely smaller than the last one isn't worth drawing
+		if (faces.empty() || faces.size() > facesBefore * 0.9){
+			break;
+		}
+		levels.push_back(faces);
+		errors.push_back(sqrt(maxError));
+	}
+}
+
+/*
+	Builds the LOD_TRIANGLE_RATIOS levels of detail for a mesh with simplifyMesh and orders each one for the vertex
+	cache. Prints the triangle count of each level.
+*/
+void generateLODs(const MeshData& mesh, const std::string& name, std::vector<std::vector<TriData>>& levels, std::vector<float>& errors){
+	simplifyMesh(mesh, LOD_TRIANGLE_RATIOS, levels, errors);
+	std::string counts = std::to_string(mesh.faceCount());
+	for (size_t i = 0; i < levels.size(); i++){
+		optimizeVertexCache(levels[i], mesh.vertexCount());
+		counts += " -> " + std::to_string(levels[i].size());
+	}
+	printf("LODs for %s: %s triangles\n", name.data(), counts.data());
+}
+
+/*
+	Converts a float to an IEEE half float, rounding to nearest even
+	Values too big for a half become infinity, and values too small become zero (or a denormal)
+*/
+uint16_t floatToHalf(float value){
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	uint32_t sign = (bits >> 16) & 0x8000;
+	int32_t exponent = (int32_t) ((bits >> 23) & 0xff) - 127 + 15;
+	uint32_t mantissa = bits & 0x7fffff;
+
+	if (((bits >> 23) & 0xff) == 0xff){
+		// Infinity or NaN
+		return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+	}
+	if (exponent >= 31){
+		return sign | 0x7c00;
+	}
+	if (exponent <= 0){
+		if (exponent < -10){
+			return sign;
+		}
+		// Denormal: shift the mantissa (with its implicit 1) down and round
+		mantissa |= 0x800000;
+		uint32_t shift = 14 - exponent;
+		uint32_t half = mantissa >> shift;
+		uint32_t remainder = mantissa & ((1u << shift) - 1);
+		uint32_t halfway = 1u << (shift - 1);
+		if (remainder > halfway || (remainder == halfway && (half & 1))){
+			half++;
+		}
+		return sign | half;
+	}
+	uint32_t half = sign | (exponent << 10) | (mantissa >> 13);
+	uint32_t remainder = mantissa & 0x1fff;
+	// Rounding up can carry into the exponent, which is still the correct result
+	if (remainder > 0x1000 || (remainder == 0x1000 && (half & 1))){
+		half++;
+	}
+	return half;
+}
+
+/*
+	Packs a normal into two 16-bit signed normalized values using the octahedral mapping
+	In a shader, with e = the two values as a vec2 in [-1, 1]:
+		vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+		if (n.z < 0) n.xy = (1.0 - abs(n.yx)) * sign(n.xy);
+		n = normalize(n);
+*/
+void packOctahedralNormal(float nx, float ny, float nz, int16_t* out){
+	float sum = fabsf(nx) + fabsf(ny) + fabsf(nz);
+	if (sum == 0){
+		out[0] = 0;
+		out[1] = 0;
+		return;
+	}
+	float x = nx / sum;
+	float y = ny / sum;
+	if (nz < 0){
+		float foldedX = (1.0f - fabsf(y)) * (x >= 0 ? 1.0f : -1.0f);
+		float foldedY = (1.0f - fabsf(x)) * (y >= 0 ? 1.0f : -1.0f);
+		x = foldedX;
+		y = foldedY;
+	}
+	out[0] = (int16_t) lroundf(glm::clamp(x, -1.0f, 1.0f) * 32767.0f);
+	out[1] = (int16_t) lroundf(glm::clamp(y, -1.0f, 1.0f) * 32767.0f);
+}
+
+/*
+	Describes the vertex and index buffers built by packMesh
+	Every vertex is stride bytes with the attributes interleaved: position (location 0), UV (location 1),
+	optionally an octahedral normal (location 2), and a 16-bit normalized lightmap UV (location 9) if the mesh has a
+	lightmap. Fixed-size fields only, since this is also stored in bake files.
+*/
+struct PackedVertexLayout{
+	uint32_t stride;
+	uint32_t positionFormat;
+	uint32_t positionOffset;
+	uint32_t uvOffset;
+	uint32_t uvNormalized;	// 1 if UVs are 16-bit normalized (all of them were in [0, 1]), 0 if they're half floats
+	uint32_t hasNormals;
+	uint32_t normalOffset;
+	uint32_t hasLightmap;
+	uint32_t lightmapOffset;
+	uint32_t indexType;	// GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+	// For POSITION_UNORM16, position = boundsMin + value * boundsScale. Zero and one for the other formats.
+	float boundsMin[3];
+	float boundsScale[3];
+};
+
+/*
+	One level of detail of a mesh: a range of its index buffer
+	Level 0 is the original mesh. Every level uses the same vertices. Fixed-size, since these go in bake files too.
+*/
+struct MeshLOD{
+	uint32_t firstIndex, numIndices;
+	float error;	// How far (in model units) the simplified surface can be from the original
+	uint32_t padding;
+};
+const int MAX_MESH_LODS = 4;
+
+/*
+	A mesh's vertex and index buffers in their compact GPU format
+	Like MeshData, the bytes either live in the storage vectors or point into a memory-mapped bake file.
+	numIndices counts the indices of every LOD, which come one after another in lods order.
+*/
+struct PackedMesh{
+	PackedVertexLayout layout = {};
+	size_t numIndices = 0;
+	std::vector<MeshLOD> lods;
+	std::vector<unsigned char> vertexStorage, indexStorage;
+	const unsigned char* mappedVertexBytes = nullptr;
+	const unsigned char* mappedIndexBytes = nullptr;
+	size_t numMappedVertexBytes = 0, numMappedIndexBytes = 0;
+
+	const unsigned char* vertexBytes() const{
+		return mappedVertexBytes != nullptr ? mappedVertexBytes : vertexStorage.data();
+	}
+	size_t vertexBytesSize() const{
+		return mappedVertexBytes != nullptr ? numMappedVertexBytes : vertexStorage.size();
+	}
+	const unsigned char* indexBytes() const{
+		return mappedIndexBytes != nullptr ? mappedIndexBytes : indexStorage.data();
+	}
+	size_t indexBytesSize() const{
+		return mappedIndexBytes != nullptr ? numMappedIndexBytes : indexStorage.size();
+	}
+};
+
+/*
+	Builds the compact GPU vertex and index buffers for a mesh
+	Only positions and UVs go in by default, since they're all the mesh shader reads. Positions are stored in
+	positionFormat, UVs as 16-bit normalized values when they're all in [0, 1] (half floats otherwise), and normals
+	(if asked for) as two 16-bit octahedral values. Lightmap UVs are always in [0, 1], so they're 16-bit normalized.
+	Indices are 16-bit when there are few enough vertices.
+	The triangles of any simplified levels (from generateLODs) go in the index buffer after the mesh's own.
+*/
+void packMesh(const MeshData& mesh, PositionFormat positionFormat, bool normals, PackedMesh& packed,
+		const std::vector<std::vector<TriData>>& lodFaces = {}, const std::vector<float>& lodErrors = {}){
+	const VertexData* vertices = mesh.vertexData();
+	size_t numVertices = mesh.vertexCount();
+	PackedVertexLayout& layout = packed.layout;
+	layout = {};
+
+	// Find the bounding box and whether the UVs fit in [0, 1]
+	glm::vec3 boundsMin(FLT_MAX), boundsMax(-FLT_MAX);
+	bool uvInRange = true;
+	for (size_t i = 0; i < numVertices; i++){
+		boundsMin = glm::min(boundsMin, glm::vec3(vertices[i].x, vertices[i].y, vertices[i].z));
+		boundsMax = glm::max(boundsMax, glm::vec3(vertices[i].x, vertices[i].y, vertices[i].z));
+		if (vertices[i].u < 0 || vertices[i].u > 1 || vertices[i].v < 0 || vertices[i].v > 1){
+			uvInRange = false;
+		}
+	}
+	for (int i = 0; i < 3; i++){
+		layout.boundsMin[i] = 0;
+		layout.boundsScale[i] = 1;
+		if (positionFormat == POSITION_UNORM16 && numVertices > 0){
+			layout.boundsMin[i] = boundsMin[i];
+			// Flat meshes have no extent on one axis, and any scale works for that axis
+			layout.boundsScale[i] = boundsMax[i] > boundsMin[i] ? boundsMax[i] - boundsMin[i] : 1;
+		}
+	}
+
+	// Lay out the attributes, keeping each one 4-byte aligned
+	layout.positionFormat = positionFormat;
+	layout.positionOffset = 0;
+	layout.uvOffset = positionFormat == POSITION_FLOAT ? 12 : 8;
+	layout.uvNormalized = uvInRange;
+	layout.hasNormals = normals;
+	layout.normalOffset = normals ? layout.uvOffset + 4 : 0;
+	layout.hasLightmap = !mesh.lightmapUVs.empty();
+	layout.lightmapOffset = layout.hasLightmap ? layout.uvOffset + 4 + (normals ? 4 : 0) : 0;
+	layout.stride = layout.uvOffset + 4 + (normals ? 4 : 0) + (layout.hasLightmap ? 4 : 0);
+
+	packed.vertexStorage.assign(numVertices * layout.stride, 0);
+	for (size_t i = 0; i < numVertices; i++){
+		const VertexData& vd = vertices[i];
+		unsigned char* out = packed.vertexStorage.data() + i * layout.stride;
+		const float position[3] = {vd.x, vd.y, vd.z};
+		if (positionFormat == POSITION_FLOAT){
+			memcpy(out, position, sizeof(position));
+		}
+		else{
+			uint16_t values[3];
+			for (int j = 0; j < 3; j++){
+				if (positionFormat == POSITION_HALF){
+					values[j] = floatToHalf(position[j]);
+				}
+				else{
+					float t = (position[j] - layout.boundsMin[j]) / layout.boundsScale[j];
+					values[j] = (uint16_t) lroundf(glm::clamp(t, 0.0f, 1.0f) * 65535.0f);
+				}
+			}
+			memcpy(out, values, sizeof(values));
+		}
+
+		uint16_t uv[2];
+		if (uvInRange){
+			uv[0] = (uint16_t) lroundf(vd.u * 65535.0f);
+			uv[1] = (uint16_t) lroundf(vd.v * 65535.0f);
+		}
+		else{
+			uv[0] = floatToHalf(vd.u);
+			uv[1] = floatToHalf(vd.v);
+		}
+		memcpy(out + layout.uvOffset, uv, sizeof(uv));
+
+		if (normals){
+			int16_t normal[2];
+			packOctahedralNormal(vd.nx, vd.ny, vd.nz, normal);
+			memcpy(out + layout.normalOffset, normal, sizeof(normal));
+		}
+
+		if (layout.hasLightmap){
+			const glm::vec2& lightmapUV = mesh.lightmapUVs[i];
+			uint16_t values[2];
+			values[0] = (uint16_t) lroundf(glm::clamp(lightmapUV.x, 0.0f, 1.0f) * 65535.0f);
+			values[1] = (uint16_t) lroundf(glm::clamp(lightmapUV.y, 0.0f, 1.0f) * 65535.0f);
+			memcpy(out + layout.lightmapOffset, values, sizeof(values));
+		}
+	}
+
+	// Lay out the levels one after another
+	std::vector<std::pair<const TriData*, size_t>> levels = {{mesh.faceData(), mesh.faceCount()}};
+	for (size_t i = 0; i < lodFaces.size() && levels.size() < MAX_MESH_LODS; i++){
+		levels.push_back({lodFaces[i].data(), lodFaces[i].size()});
+	}
+	packed.lods.clear();
+	packed.numIndices = 0;
+	for (size_t i = 0; i < levels.size(); i++){
+		float error = i > 0 && i - 1 < lodErrors.size() ? lodErrors[i - 1] : 0.0f;
+		packed.lods.push_back({(uint32_t) packed.numIndices, (uint32_t) levels[i].second * 3, error, 0});
+		packed.numIndices += levels[i].second * 3;
+	}
+
+	// 16-bit indices can reach 65536 vertices (primitive restart is never turned on, so 0xffff is a normal index)
+	if (numVertices <= 65536){
+		layout.indexType = GL_UNSIGNED_SHORT;
+		packed.indexStorage.resize(packed.numIndices * sizeof(uint16_t));
+		uint16_t* indices = (uint16_t*) packed.indexStorage.data();
+		for (const std::pair<const TriData*, size_t>& level : levels){
+			const TriData* faces = level.first;
+			for (size_t i = 0; i < level.second; i++){
+				*indices++ = faces[i].v1;
+				*indices++ = faces[i].v2;
+				*indices++ = faces[i].v3;
+			}
+		}
+	}
+	else{
+		layout.indexType = GL_UNSIGNED_INT;
+		packed.indexStorage.clear();
+		for (const std::pair<const TriData*, size_t>& level : levels){
+			packed.indexStorage.insert(packed.indexStorage.end(), (const unsigned char*) level.first, (const unsigned char*) (level.first + level.second));
+		}
+	}
+}
+
+/*
+	A decoded image: width x height BGRA pixels with no row padding, bottom row first like glTexImage2D expects
+	The pixels are either in the pixels vector or, for files that are already stored exactly that way, straight from
+	the memory-mapped file at mappedOffset (see loadImage). Use data() to read them without caring where they are.
+	Move-only, like the MappedFile inside it.
+*/
+struct Image{
+	std::vector<unsigned char> pixels;
+	MappedFile mapping;
+	size_t mappedOffset = 0;
+	unsigned int width = 0, height = 0;
+
+	const unsigned char* data() const{
+		return mapping.data != nullptr ? mapping.data + mappedOffset : pixels.data();
+	}
+	size_t size() const{
+		return (size_t) width * height * 4;
+	}
+	bool empty() const{
+		return width == 0 || height == 0;
+	}
+
+	// Frees the pixels wherever they are, and forgets the size
+	void release(){
+		pixels = std::vector<unsigned char>();
+		mapping.close();
+		mappedOffset = 0;
+		width = height = 0;
+	}
+};
+
+/*
+	How to turn 32-bit BMP pixels with arbitrary red, green, blue and alpha masks into BGRA bytes, for loadImage
+	Channels are kept in BGRA order. A mask of 0 means the file doesn't have that channel, which reads as 0, or 255
+	for alpha. When every mask covers one whole byte (or nothing), converting is just a byte shuffle, which AVX2
+	builds do 8 pixels at a time.
+*/
+struct BitfieldFormat{
+	uint32_t masks[4];
+	int shifts[4], bits[4];
+	bool byteAligned;
+	// Byte shuffle for 4 pixels, plus the bytes to set afterwards (the alpha of files without any)
+	unsigned char shuffle[16], fill[16];
+
+	/*
+		Sets the format up from the file's red, green, blue and alpha masks
+		Returns false if a mask isn't one contiguous run of bits
+	*/
+	bool init(uint32_t red, uint32_t green, uint32_t blue, uint32_t alpha){
+		const uint32_t order[4] = {blue, green, red, alpha};
+		byteAligned = true;
+		for (int c = 0; c < 4; c++){
+			uint32_t mask = order[c];
+			masks[c] = mask;
+			shifts[c] = bits[c] = 0;
+			if (mask != 0){
+				while (((mask >> shifts[c]) & 1) == 0){
+					shifts[c]++;
+				}
+				uint32_t run = mask >> shifts[c];
+				if ((run & (run + 1)) != 0){
+					return false;
+				}
+				while (bits[c] < 32 && (run >> bits[c]) != 0){
+					bits[c]++;
+				}
+			}
+			byteAligned = byteAligned && (mask == 0 || (bits[c] == 8 && shifts[c] % 8 == 0));
+			for (int pixel = 0; pixel < 4; pixel++){
+				shuffle[pixel * 4 + c] = mask != 0 ? pixel * 4 + shifts[c] / 8 : 0x80;
+				fill[pixel * 4 + c] = mask == 0 && c == 3 ? 0xff : 0;
+			}
+		}
+		return true;
+	}
+
+	// Scales a channel value with the given number of bits to 8 bits
+	static unsigned char expand(uint32_t value, int numBits){
+		if (numBits == 8){
+			return value;
+		}
+		if (numBits > 8){
+			return value >> (numBits - 8);
+		}
+		return value * 255 / ((1u << numBits) - 1);
+	}
+
+	void convertRow(const unsigned char* src, unsigned char* dst, unsigned int width) const{
+		unsigned int x = 0;
+#ifdef __AVX2__
+		if (byteAligned){
+			__m256i control = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*) shuffle));
+			__m256i constant = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*) fill));
+			for (; x + 8 <= width; x += 8){
+				__m256i pixels = _mm256_loadu_si256((const __m256i*) (src + x * 4));
+				pixels = _mm256_or_si256(_mm256_shuffle_epi8(pixels, control), constant);
+				_mm256_storeu_si256((__m256i*) (dst + x * 4), pixels);
+			}
+		}
+#endif
+		if (byteAligned){
+			for (; x < width; x++){
+				for (int c = 0; c < 4; c++){
+					dst[x * 4 + c] = shuffle[c] & 0x80 ? fill[c] : src[x * 4 + shuffle[c]];
+				}
+			}
+		}
+		for (; x < width; x++){
+			uint32_t pixel;
+			memcpy(&pixel, src + x * 4, sizeof(pixel));
+			for (int c = 0; c < 4; c++){
+				dst[x * 4 + c] = masks[c] == 0 ? fill[c] : expand((pixel & masks[c]) >> shifts[c], bits[c]);
+			}
+		}
+	}
+};
+
+// Converts a row of 24-bit BGR pixels into BGRA bytes with opaque alpha, 4 pixels per shuffle on AVX2 builds
+void convertBGRRow(const unsigned char* src, unsigned char* dst, unsigned int width){
+	unsigned int x = 0;
+#ifdef __AVX2__
+	const __m128i control = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+	const __m128i alpha = _mm_set1_epi32(0xff000000);
+	// Each load reads 16 bytes for 12 bytes of pixels, so stop while there's still a whole pixel of slack
+	for (; x + 6 <= width; x += 4){
+		__m128i pixels = _mm_loadu_si128((const __m128i*) (src + x * 3));
+		_mm_storeu_si128((__m128i*) (dst + x * 4), _mm_or_si128(_mm_shuffle_epi8(pixels, control), alpha));
+	}
+#endif
+	for (; x < width; x++){
+		dst[x * 4 + 0] = src[x * 3 + 0];
+		dst[x * 4 + 1] = src[x * 3 + 1];
+		dst[x * 4 + 2] = src[x * 3 + 2];
+		dst[x * 4 + 3] = 255;
+	}
+}
+
+/*
+	Decodes RLE8-compressed palette indices into indices (width x height, bottom row first, already zeroed)
+	Pixels the data skips over with end of line and delta codes are left at index 0.
+	Returns false if the data runs out before the end of bitmap code or tries to draw outside the image
+*/
+bool decodeRLE8(const unsigned char* data, size_t size, unsigned int width, unsigned int height, unsigned char* indices){
+	size_t i = 0;
+	unsigned int x = 0, y = 0;
+	while (i + 2 <= size){
+		unsigned char count = data[i], value = data[i + 1];
+		i += 2;
+		if (count > 0){
+			// A run of count copies of value
+			if (y >= height || count > width - x){
+				return false;
+			}
+			memset(indices + (size_t) y * width + x, value, count);
+			x += count;
+		}
+		else if (value == 0){
+			// End of line
+			x = 0;
+			y++;
+		}
+		else if (value == 1){
+			// End of bitmap
+			return true;
+		}
+		else if (value == 2){
+			// Delta: move right and up
+			if (i + 2 > size){
+				return false;
+			}
+			x += data[i];
+			y += data[i + 1];
+			i += 2;
+			if (x > width){
+				return false;
+			}
+		}
+		else{
+			// value literal indices, padded to an even number of bytes
+			if (y >= height || value > width - x || i + value > size){
+				return false;
+			}
+			memcpy(indices + (size_t) y * width + x, data + i, value);
+			x += value;
+			i += (value + 1) & ~1u;
+		}
+	}
+	return false;
+}
+
+/*
+	Reads a BMP file into image, in any of the usual layouts: BITMAPINFOHEADER, V2-V5 headers, 24 bits per pixel,
+	32 bits per pixel (BI_RGB, or BI_BITFIELDS/BI_ALPHABITFIELDS with any masks), or 8 bits per pixel with a palette
+	(uncompressed or RLE8), with rows stored bottom-up or top-down.
+	32bpp bottom-up files with their bytes in B, G, R, A order are already exactly what glTexImage2D gets, so those
+	are only memory-mapped and the pixels are used straight from the mapping. Everything else is converted into
+	image.pixels. Files without an alpha channel come out opaque.
+	verbose is only false for --bench-images, which doesn't want a line printed for every read.
+	Returns 0 if successful, -1 for file IO error, -2 for file format error
+*/
+int loadImage(const std::string& path, Image& image, bool verbose = true){
+	if (verbose){
+		printf("Reading image %s\n", path.data());
+	}
+	image = Image();
+	MappedFile file;
+	if (!file.open(path)){
+		printf("%s could not be opened. Are you in the right directory?\n", path.data());
+		return -1;
+	}
+	auto read16 = [&](size_t offset){
+		uint16_t value;
+		memcpy(&value, file.data + offset, sizeof(value));
+		return value;
+	};
+	auto read32 = [&](size_t offset){
+		uint32_t value;
+		memcpy(&value, file.data + offset, sizeof(value));
+		return value;
+	};
+
+	// 14 bytes of file header and at least the 40 of BITMAPINFOHEADER
+	if (file.size < 54 || file.data[0] != 'B' || file.data[1] != 'M'){
+		printf("%s is not a BMP file\n", path.data());
+		return -2;
+	}
+	uint32_t dataOffset = read32(0x0A);
+	uint32_t headerSize = read32(0x0E);
+	int32_t width = read32(0x12), height = read32(0x16);
+	uint16_t bitsPerPixel = read16(0x1C);
+	uint32_t compression = read32(0x1E);
+	uint32_t paletteSize = read32(0x2E);
+	const uint32_t BI_RGB = 0, BI_RLE8 = 1, BI_BITFIELDS = 3, BI_ALPHABITFIELDS = 6;
+	if (headerSize != 40 && headerSize != 52 && headerSize != 56 && headerSize != 108 && headerSize != 124){
+		printf("%s has an unsupported BMP header (%u bytes)\n", path.data(), headerSize);
+		return -2;
+	}
+	bool bitfields = compression == BI_BITFIELDS || compression == BI_ALPHABITFIELDS;
+	bool supported = (bitsPerPixel == 24 && compression == BI_RGB) || (bitsPerPixel == 32 && (compression == BI_RGB || bitfields))
+		|| (bitsPerPixel == 8 && (compression == BI_RGB || compression == BI_RLE8));
+	if (!supported){
+		printf("%s uses an unsupported BMP format (%d bits per pixel, compression %u)\n", path.data(), bitsPerPixel, compression);
+		return -2;
+	}
+	// Negative heights are top-down, which compressed files can't be
+	bool topDown = height < 0;
+	int64_t rows = topDown ? -(int64_t) height : height;
+	if (width <= 0 || rows == 0 || width > 65536 || rows > 65536 || (topDown && compression == BI_RLE8)){
+		printf("%s has an invalid size (%d x %d)\n", path.data(), width, height);
+		return -2;
+	}
+
+	// Masks come right after the 40 byte header, or are part of the bigger ones. Only those can have an alpha mask.
+	size_t masksEnd = 14 + headerSize;
+	uint32_t masks[4] = {0x00FF0000, 0x0000FF00, 0x000000FF, 0};
+	if (bitfields){
+		bool hasAlpha = headerSize >= 56 || compression == BI_ALPHABITFIELDS;
+		masksEnd = std::max<size_t>(masksEnd, 0x36 + (hasAlpha ? 16 : 12));
+		if (masksEnd > file.size){
+			printf("%s is truncated\n", path.data());
+			return -2;
+		}
+		for (int i = 0; i < (hasAlpha ? 4 : 3); i++){
+			masks[i] = read32(0x36 + i * 4);
+		}
+	}
+	size_t rowBytes = ((size_t) width * bitsPerPixel + 31) / 32 * 4;
+	size_t dataSize = compression == BI_RLE8 ? 1 : rowBytes * rows;
+	if (dataOffset < masksEnd || dataOffset > file.size || dataSize > file.size - dataOffset){
+		printf("%s is truncated\n", path.data());
+		return -2;
+	}
+	// RLE8 data has no fixed size (end of line, delta and end of bitmap codes skip any number of pixels), so a tiny
+	// file can honestly be huge. Those still get capped at what the biggest GL textures hold rather than allocating
+	// gigabytes, and truncated data is caught by decodeRLE8.
+	const uint64_t RLE8_MAX_PIXELS = 16384 * 16384;
+	if (compression == BI_RLE8 && (uint64_t) width * rows > RLE8_MAX_PIXELS){
+		printf("%s has an invalid size (%d x %d) for its RLE8 data\n", path.data(), width, height);
+		return -2;
+	}
+	image.width = width;
+	image.height = rows;
+
+	// The GL layout already, so there's nothing to do but keep the file mapped
+	if (bitsPerPixel == 32 && !topDown && masks[0] == 0x00FF0000 && masks[1] == 0x0000FF00 && masks[2] == 0x000000FF && masks[3] == 0xFF000000){
+		image.mappedOffset = dataOffset;
+		image.mapping = std::move(file);
+		return 0;
+	}
+
+	image.pixels.resize(image.size());
+	auto sourceRow = [&](unsigned int y){
+		return file.data + dataOffset + rowBytes * (topDown ? rows - 1 - y : y);
+	};
+	if (bitsPerPixel == 32){
+		BitfieldFormat format;
+		if (!format.init(masks[0], masks[1], masks[2], masks[3])){
+			printf("%s has invalid colour masks\n", path.data());
+			image = Image();
+			return -2;
+		}
+		for (unsigned int y = 0; y < image.height; y++){
+			format.convertRow(sourceRow(y), image.pixels.data() + (size_t) y * width * 4, width);
+		}
+	}
+	else if (bitsPerPixel == 24){
+		for (unsigned int y = 0; y < image.height; y++){
+			convertBGRRow(sourceRow(y), image.pixels.data() + (size_t) y * width * 4, width);
+		}
+	}
+	else{
+		// Palette entries are B, G, R and an unused byte, and come right after the header (and masks)
+		size_t numColours = paletteSize == 0 ? 256 : std::min<size_t>(paletteSize, 256);
+		if (masksEnd + numColours * 4 > dataOffset){
+			printf("%s is truncated\n", path.data());
+			image = Image();
+			return -2;
+		}
+		uint32_t palette[256];
+		std::fill(palette, palette + 256, 0xFF000000u);
+		for (size_t i = 0; i < numColours; i++){
+			palette[i] = read32(masksEnd + i * 4) | 0xFF000000;
+		}
+		std::vector<unsigned char> decoded;
+		if (compression == BI_RLE8){
+			decoded.assign((size_t) width * rows, 0);
+			if (!decodeRLE8(file.data + dataOffset, file.size - dataOffset, width, rows, decoded.data())){
+				printf("%s has invalid RLE8 data\n", path.data());
+				image = Image();
+				return -2;
+			}
+		}
+		for (unsigned int y = 0; y < image.height; y++){
+			const unsigned char* indices = compression == BI_RLE8 ? decoded.data() + (size_t) y * width : sourceRow(y);
+			unsigned char* dst = image.pixels.data() + (size_t) y * width * 4;
+			for (int x = 0; x < width; x++){
+				memcpy(dst + x * 4, &palette[indices[x]], 4);
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+	Writes a 32bpp BMP with BGRA bytes and bitfield compression, which loadImage reads back
+	pixels are top row first, like the software renderer's framebuffer, so the rows get flipped on the way out since
+	BMP files are stored bottom row first.
+	Returns 0 if successful, -1 if the file couldn't be written
+*/
+int writeBMP(const std::string& path, const unsigned char* pixels, int width, int height){
+	const uint32_t HEADER_SIZE = 14 + 40 + 12;
+	uint32_t imageSize = (uint32_t) width * height * 4;
+	unsigned char header[HEADER_SIZE] = {'B', 'M'};
+	auto put32 = [&](int offset, uint32_t value){
+		memcpy(header + offset, &value, sizeof(value));
+	};
+	put32(0x02, HEADER_SIZE + imageSize);
+	put32(0x0A, HEADER_SIZE);
+	put32(0x0E, 40);
+	put32(0x12, width);
+	put32(0x16, height);
+	put32(0x1A, 1 | (32 << 16));	// 1 plane, 32 bits per pixel
+	put32(0x1E, 3);	// BI_BITFIELDS, with the red, green and blue masks right after this header
+	put32(0x22, imageSize);
+	put32(0x36, 0x00FF0000);
+	put32(0x3A, 0x0000FF00);
+	put32(0x3E, 0x000000FF);
+
+	FILE* file = fopen(path.data(), "wb");
+	if (!file){
+		printf("Couldn't write %s\n", path.data());
+		return -1;
+	}
+	bool ok = fwrite(header, 1, HEADER_SIZE, file) == HEADER_SIZE;
+	for (int y = height - 1; y >= 0 && ok; y--){
+		ok = fwrite(pixels + (size_t) y * width * 4, 1, (size_t) width * 4, file) == (size_t) width * 4;
+	}
+	if (fclose(file) != 0 || !ok){
+		printf("Couldn't write %s\n", path.data());
+		return -1;
+	}
+	return 0;
+}
+
+
+// Axis-aligned bounding box. Starts out empty (min > max) so the first expand() sets it.
+struct AABB{
+	glm::vec3 min, max;
+
+	AABB() : min(FLT_MAX), max(-FLT_MAX){}
+
+	void expand(const glm::vec3& point){
+		min = glm::min(min, point);
+		max = glm::max(max, point);
+	}
+	void expand(const AABB& other){
+		min = glm::min(min, other.min);
+		max = glm::max(max, other.max);
+	}
+	glm::vec3 centre() const{
+		return (min + max) * 0.5f;
+	}
+	bool empty() const{
+		return min.x > max.x;
+	}
+	bool contains(const glm::vec3& point) const{
+		return point.x >= min.x && point.y >= min.y && point.z >= min.z && point.x <= max.x && point.y <= max.y && point.z <= max.z;
+	}
+};
+
+/*
+	A meshlet: a contiguous range of a mesh's triangles with its own bounds, so it can be culled on its own
+	Every triangle's normal is within the normal cone around coneAxis, so none of them can face a camera at camera if
+	dot(centre - camera, coneAxis) >= coneCutoff * length(centre - camera) + radius. Meshlets whose normals are too
+	spread out for that to ever happen, and every meshlet of a two-sided mesh, have a zero coneAxis.
+*/
+struct DrawCluster{
+	GLuint firstTriangle, numTriangles;
+	AABB bounds;
+	glm::vec3 centre;
+	float radius;
+	glm::vec3 coneAxis;
+	float coneCutoff;
+};
+
+// Works out the bounds of the triangles in cluster (and its normal cone if oneSided is set)
+void boundDrawCluster(const MeshData& mesh, bool oneSided, DrawCluster& cluster){
+	const VertexData* vertices = mesh.vertexData();
+	const TriData* faces = mesh.faceData();
+	std::vector<glm::vec3> normals;
+	glm::vec3 normalSum(0.0f);
+	cluster.bounds = AABB();
+	for (size_t t = cluster.firstTriangle; t < cluster.firstTriangle + cluster.numTriangles; t++){
+		glm::vec3 corners[3];
+		GLuint indices[3] = {faces[t].v1, faces[t].v2, faces[t].v3};
+		for (int k = 0; k < 3; k++){
+			corners[k] = glm::vec3(vertices[indices[k]].x, vertices[indices[k]].y, vertices[indices[k]].z);
+			cluster.bounds.expand(corners[k]);
+		}
+		// Zero area triangles can't be seen from either side
+		glm::vec3 normal = glm::cross(corners[1] - corners[0], corners[2] - corners[0]);
+		float length = glm::length(normal);
+		if (length > 0.0f){
+			normals.push_back(normal / length);
+			normalSum += normal / length;
+		}
+	}
+	cluster.centre = cluster.bounds.centre();
+	cluster.radius = 0.0f;
+	for (size_t t = cluster.firstTriangle; t < cluster.firstTriangle + cluster.numTriangles; t++){
+		GLuint indices[3] = {faces[t].v1, faces[t].v2, faces[t].v3};
+		for (GLuint index : indices){
+			cluster.radius = std::max(cluster.radius, glm::length(glm::vec3(vertices[index].x, vertices[index].y, vertices[index].z) - cluster.centre));
+		}
+	}
+
+	// The cone is the average normal, widened to fit the one furthest from it. Once that's nearly 90 degrees away
+	// (the cone is nearly a half space) it could only be culled from right up against it, so it isn't worth it.
+	cluster.coneAxis = glm::vec3(0.0f);
+	cluster.coneCutoff = 1.0f;
+	if (!oneSided || glm::length(normalSum) < 1e-6f){
+		return;
+	}
+	glm::vec3 axis = glm::normalize(normalSum);
+	float minDot = 1.0f;
+	for (const glm::vec3& normal : normals){
+		minDot = std::min(minDot, glm::dot(normal, axis));
+	}
+	if (minDot > 0.1f){
+		cluster.coneAxis = axis;
+		cluster.coneCutoff = sqrt(1.0f - minDot * minDot);
+	}
+}
+
+/*
+	Splits a mesh into meshlets of at most MESHLET_MAX_VERTICES different vertices and MESHLET_MAX_TRIANGLES triangles
+	The triangles are cut into runs in the order they're already in, each ending when the next triangle would go over
+	either limit, so meshes that went through orderMeshlets get the meshlets it built. Other meshes still get fairly
+	tight ones, since optimizeVertexCache leaves neighbouring triangles next to each other.
+*/
+std::vector<DrawCluster> buildDrawClusters(const MeshData& mesh, bool oneSided){
+	const TriData* faces = mesh.faceData();
+	size_t numFaces = mesh.faceCount();
+	MeshletCounter counter(mesh, oneSided);
+	std::vector<DrawCluster> clusters;
+	DrawCluster cluster;
+	cluster.firstTriangle = 0;
+	for (size_t t = 0; t < numFaces; t++){
+		if (!counter.fits(faces[t])){
+			cluster.numTriangles = t - cluster.firstTriangle;
+			boundDrawCluster(mesh, oneSided, cluster);
+			clusters.push_back(cluster);
+			cluster.firstTriangle = t;
+			counter.next();
+		}
+		counter.add(faces[t]);
+	}
+	if (numFaces > cluster.firstTriangle){
+		cluster.numTriangles = numFaces - cluster.firstTriangle;
+		boundDrawCluster(mesh, oneSided, cluster);
+		clusters.push_back(cluster);
+	}
+	return clusters;
+}
+
+/*
+	A range of one mesh's triangles to draw. Culling produces a list of these.
+	While a mesh fades between two LODs, each level's ranges only cover the pixels whose ordered dither threshold is
+	in [ditherMin, ditherMax), so together they cover every pixel exactly once.
+*/
+struct DrawRange{
+	int mesh;
+	GLuint firstTriangle, numTriangles;
+	float ditherMin = 0.0f, ditherMax = 1.0f;
+
+	bool dithered() const{
+		return ditherMin > 0.0f || ditherMax < 1.0f;
+	}
+};
+
+// How a mesh's texture uses alpha, which decides how and when it gets drawn (see classifyTextureAlpha)
+enum AlphaMode{
+	ALPHA_OPAQUE,	// Alpha is always 1: drawn first, front to back, without blending
+	ALPHA_TESTED,	// Alpha is only ever 0 or 1: drawn next, front to back, discarding the 0 pixels
+	ALPHA_BLENDED	// Anything in between: drawn last, back to front, blended and without writing depth
+};
+// Alpha-tested textures discard pixels with less alpha than this
+const float ALPHA_TEST_CUTOFF = 0.5f;
+
+/*
+	Works out the AlphaMode for a 4-byte-per-pixel BGRA image
+	Alpha within ALPHA_TOLERANCE of 0 or 255 counts as exactly that, so slightly noisy alpha channels don't force
+	blending.
+*/
+AlphaMode classifyTextureAlpha(const unsigned char* pixels, size_t numPixels){
+	const unsigned char ALPHA_TOLERANCE = 8;
+	AlphaMode mode = ALPHA_OPAQUE;
+	for (size_t i = 0; i < numPixels; i++){
+		unsigned char alpha = pixels[i * 4 + 3];
+		if (alpha >= 255 - ALPHA_TOLERANCE){
+			continue;
+		}
+		if (alpha > ALPHA_TOLERANCE){
+			return ALPHA_BLENDED;
+		}
+		mode = ALPHA_TESTED;
+	}
+	return mode;
+}
+
+/*
+	How far away a mesh is for sorting draws: from the camera to the nearest point of its box for opaque and
+	alpha-tested meshes (so big meshes the camera is in, like the walls, come first and block the most), and to the
+	centre of its box for blended ones, which only need to be roughly back to front
+*/
+float drawOrderDistance(const AABB& bounds, AlphaMode mode, const glm::vec3& camera){
+	if (mode == ALPHA_BLENDED){
+		return glm::length(bounds.centre() - camera);
+	}
+	return glm::length(camera - glm::clamp(camera, bounds.min, bounds.max));
+}
+
+/*
+	The 6 planes of a view frustum, taken from a projection * view matrix (Gribb and Hartmann's method)
+	Each plane is (normal, distance) with the normal pointing into the frustum.
+*/
+struct Frustum{
+	glm::vec4 planes[6];
+
+	enum Result{
+		OUTSIDE,
+		INTERSECTS,
+		INSIDE
+	};
+
+	Frustum(const glm::mat4& viewProjection){
+		glm::vec4 rows[4];
+		for (int i = 0; i < 4; i++){
+			rows[i] = glm::vec4(viewProjection[0][i], viewProjection[1][i], viewProjection[2][i], viewProjection[3][i]);
+		}
+		planes[0] = rows[3] + rows[0];	// Left
+		planes[1] = rows[3] - rows[0];	// Right
+		planes[2] = rows[3] + rows[1];	// Bottom
+		planes[3] = rows[3] - rows[1];	// Top
+		planes[4] = rows[3] + rows[2];	// Near
+		planes[5] = rows[3] - rows[2];	// Far
+	}
+
+	// Checks the box corner furthest along each plane's normal (and the one furthest against it)
+	Result test(const AABB& box) const{
+		Result result = INSIDE;
+		for (int i = 0; i < 6; i++){
+			const glm::vec4& plane = planes[i];
+			glm::vec3 furthest(plane.x >= 0 ? box.max.x : box.min.x, plane.y >= 0 ? box.max.y : box.min.y, plane.z >= 0 ? box.max.z : box.min.z);
+			if (plane.x * furthest.x + plane.y * furthest.y + plane.z * furthest.z + plane.w < 0){
+				return OUTSIDE;
+			}
+			glm::vec3 nearest(plane.x >= 0 ? box.min.x : box.max.x, plane.y >= 0 ? box.min.y : box.max.y, plane.z >= 0 ? box.min.z : box.max.z);
+			if (plane.x * nearest.x + plane.y * nearest.y + plane.z * nearest.z + plane.w < 0){
+				result = INTERSECTS;
+			}
+		}
+		return result;
+	}
+};
+
+// One level of a texture, ready to pass to glTexImage2D
+struct TextureLevel{
+	const unsigned char* data;
+	unsigned int width, height;
+};
+
+// .lightmap files (from --bake-lightmaps) start with this header, followed by the remap, UV, face and pixel arrays
+const char LIGHTMAP_MAGIC[8] = {'A', 'S', '4', 'L', 'M', 'A', 'P', '\0'};
+const uint32_t LIGHTMAP_VERSION = 1;
+
+struct LightmapHeader{
+	char magic[8];
+	uint32_t version;
+	uint32_t size;	// Width and height in texels
+	uint64_t sourceHash;	// See hashLightmapSource
+	uint32_t optimized;	// Whether optimizeMesh was run before unwrapping, since it renumbers the vertices
+	uint32_t padding;
+	uint64_t numSourceVertices;
+	uint64_t numVertices;
+	uint64_t numFaces;
+	uint64_t stamp;	// Hash of everything after the header, so a bake can tell which lightmap it was made with
+};
+
+/*
+	A mesh's lightmap, pointing into its memory-mapped .lightmap file
+	Charts are cut apart along their edges, so the lit mesh has more vertices than the original: vertex i is a copy of
+	original vertex remap[i] with lightmap coordinates uvs[i], and faces replaces the original faces. pixels is
+	size x size BGRA texels, starting from the v = 0 row like a GL texture, where 128 leaves the texture's colour as it
+	is (see LIGHTMAP_ENCODING_SCALE).
+*/
+struct Lightmap{
+	MappedFile mapping;
+	LightmapHeader header = {};
+	const uint32_t* remap = nullptr;
+	const glm::vec2* uvs = nullptr;
+	const TriData* faces = nullptr;
+	const unsigned char* pixels = nullptr;
+
+	bool loaded() const{
+		return pixels != nullptr;
+	}
+};
+
+// One line of the scene manifest: a mesh, its texture, and where it goes
+struct SceneEntry{
+	std::string PLYPath, texturePath;
+	glm::mat4 transform = glm::mat4(1.0f);
+	// The back of the mesh is never seen, so meshlets facing away from the camera can be skipped (see DrawCluster)
+	bool oneSided = false;
+
+	bool operator==(const SceneEntry& other) const{
+		return PLYPath == other.PLYPath && texturePath == other.texturePath && transform == other.transform && oneSided == other.oneSided;
+	}
+	bool operator!=(const SceneEntry& other) const{
+		return !(*this == other);
+	}
+};
+
+/*
+	Reads a scene manifest
+	Each non-empty line that doesn't start with # is one mesh: its PLY path and BMP path, then any number of
+	"translate x y z", "rotate degrees x y z" (around that axis) and "scale s" or "scale x y z", which are applied to
+	the mesh in the order they're written, and "onesided" anywhere after the paths. Paths can't have spaces in them.
+	Returns 0 if successful, -1 if the file couldn't be opened, -2 if a line is malformed or there are no meshes
+*/
+int loadSceneManifest(std::string path, std::vector<SceneEntry>& entries){
+	std::ifstream file(path);
+	if (!file.is_open()){
+		printf("Couldn't open scene manifest %s\n", path.data());
+		return -1;
+	}
+	entries.clear();
+	std::string line;
+	int lineNumber = 0;
+	while (std::getline(file, line)){
+		lineNumber++;
+		size_t start = line.find_first_not_of(" \t\r");
+		if (start == std::string::npos || line[start] == '#'){
+			continue;
+		}
+		std::istringstream words(line);
+		SceneEntry entry;
+		if (!(words >> entry.PLYPath >> entry.texturePath)){
+			printf("%s line %d: expected \"PLY path BMP path\"\n", path.data(), lineNumber);
+			return -2;
+		}
+		std::vector<glm::mat4> steps;
+		std::string word;
+		while (words >> word){
+			glm::vec3 v;
+			float degrees;
+			if (word == "onesided"){
+				entry.oneSided = true;
+			}
+			else if (word == "translate" && words >> v.x >> v.y >> v.z){
+				steps.push_back(glm::translate(glm::mat4(1.0f), v));
+			}
+			else if (word == "rotate" && words >> degrees >> v.x >> v.y >> v.z && glm::length(v) > 0.0f){
+				steps.push_back(glm::rotate(glm::mat4(1.0f), glm::radians(degrees), v));
+			}
+			else if (word == "scale" && words >> v.x){
+				// One number scales evenly, three scale each axis
+				std::streampos afterX = words.tellg();
+				if (!(words >> v.y >> v.z)){
+					words.clear();
+					words.seekg(afterX);
+					v.y = v.z = v.x;
+				}
+				steps.push_back(glm::scale(glm::mat4(1.0f), v));
+			}
+			else{
+				printf("%s line %d: expected translate, rotate, scale or onesided, got \"%s\"\n", path.data(), lineNumber, word.data());
+				return -2;
+			}
+		}
+		// Written in the order they happen to the mesh, so the first one has to end up on the right
+		for (const glm::mat4& step : steps){
+			entry.transform = step * entry.transform;
+		}
+		entries.push_back(entry);
+	}
+	if (entries.empty()){
+		printf("%s has no meshes\n", path.data());
+		return -2;
+	}
+	return 0;
+}
+
+/*
+	Moves a mesh's vertices (and turns its normals) by a manifest transform
+	A transform that mirrors the mesh turns its triangles inside out, so their winding is flipped back. Mapped meshes
+	get copied out of their mapping first. The identity leaves the mesh (and its mapping) alone.
+*/
+void transformMesh(MeshData& mesh, const glm::mat4& transform){
+	if (transform == glm::mat4(1.0f)){
+		return;
+	}
+	mesh.detach();
+	glm::mat4 normalTransform = glm::transpose(glm::inverse(transform));
+	for (VertexData& vertex : mesh.vertices){
+		glm::vec3 position = glm::vec3(transform * glm::vec4(vertex.x, vertex.y, vertex.z, 1.0f));
+		glm::vec3 normal = glm::vec3(normalTransform * glm::vec4(vertex.nx, vertex.ny, vertex.nz, 0.0f));
+		float length = glm::length(normal);
+		if (length > 0.0f){
+			normal /= length;
+		}
+		vertex.x = position.x;
+		vertex.y = position.y;
+		vertex.z = position.z;
+		vertex.nx = normal.x;
+		vertex.ny = normal.y;
+		vertex.nz = normal.z;
+	}
+	glm::vec3 x = glm::vec3(transform[0]), y = glm::vec3(transform[1]), z = glm::vec3(transform[2]);
+	if (glm::dot(glm::cross(x, y), z) < 0.0f){
+		for (TriData& face : mesh.faces){
+			std::swap(face.v2, face.v3);
+		}
+	}
+}
+
+/*
+	Everything a TexturedMesh needs from its PLY and BMP files, decoded but not uploaded to the GPU yet
+*/
+struct MeshAsset{
+	std::string PLYPath, texturePath;
+	// From the scene manifest, already applied to mesh
+	glm::mat4 transform = glm::mat4(1.0f);
+	// From the scene manifest, for building the mesh's DrawClusters
+	bool oneSided = false;
+	MeshData mesh;
+	// The decoded BMP file. Baked assets leave it empty and use mipLevels instead.
+	Image texture;
+	unsigned int textureWidth = 0, textureHeight = 0;
+	int PLYResult = 0;
+	// Only filled in for baked assets: every mip level of the texture, pointing into mesh.mapping
+	std::vector<TextureLevel> mipLevels;
+	// The vertex and index buffers in the format they're uploaded in
+	PackedMesh packed;
+	AlphaMode alphaMode = ALPHA_OPAQUE;
+	// Baked lighting, if the mesh has an up to date .lightmap file (see openLightmap)
+	Lightmap lightmap;
+};
+
+// Baked asset files start with this header. Every section it points to starts on a BAKE_ALIGNMENT boundary.
+const char BAKE_MAGIC[8] = {'A', 'S', '4', 'B', 'A', 'K', 'E', '\0'};
+const uint32_t BAKE_VERSION = 8;
+const size_t BAKE_ALIGNMENT = 64;
+const int BAKE_MAX_MIP_LEVELS = 16;
+
+struct BakeSection{
+	uint64_t offset;
+	uint64_t size;
+};
+
+struct BakeHeader{
+	char magic[8];
+	uint32_t version;
+	uint32_t numMipLevels;
+	uint32_t optimized;	// Whether optimizeMesh was run before baking
+	uint32_t generatedLODs;	// Whether generateLODs was run before baking
+	uint64_t sourceHash;
+	uint64_t numVertices;
+	uint64_t numFaces;
+	BakeSection vertices;
+	BakeSection faces;
+	PackedVertexLayout packedLayout;
+	uint64_t numPackedIndices;
+	uint32_t numLODs;
+	uint32_t padding;
+	MeshLOD lods[MAX_MESH_LODS];
+	BakeSection packedVertices;
+	BakeSection packedIndices;
+	uint32_t textureWidth;
+	uint32_t textureHeight;
+	BakeSection mipLevels[BAKE_MAX_MIP_LEVELS];
+	uint64_t lightmapStamp;	// The stamp of the lightmap that was applied (see applyLightmap), or 0 if there wasn't one
+	BakeSection lightmapUVs;	// Empty if there's no lightmap
+};
+
+// Baked assets are saved next to the PLY file
+std::string bakePath(const std::string& PLYPath){
+	return PLYPath + ".bake";
+}
+
+/*
+	Adds a manifest transform to a hash
+	The identity adds nothing, so meshes that aren't moved keep the bakes and lightmaps they had before manifests
+*/
+uint64_t hashTransform(const glm::mat4& transform, uint64_t hash){
+	if (transform == glm::mat4(1.0f)){
+		return hash;
+	}
+	return hashBytes((const unsigned char*) &transform[0][0], sizeof(float) * 16, hash);
+}
+
+/*
+	Hashes the contents of a mesh's PLY and BMP files together, along with its transform and the bake format version
+	Returns false if either file can't be read
+*/
+bool hashSourceFiles(const std::string& PLYPath, const std::string& texturePath, const glm::mat4& transform, uint64_t& hash){
+	MappedFile ply, texture;
+	if (!ply.open(PLYPath) || !texture.open(texturePath)){
+		return false;
+	}
+	hash = hashBytes((const unsigned char*) &BAKE_VERSION, sizeof(BAKE_VERSION));
+	hash = hashBytes(ply.data, ply.size, hash);
+	hash = hashBytes(texture.data, texture.size, hash);
+	hash = hashTransform(transform, hash);
+	return true;
+}
+
+// Lightmaps are saved next to the PLY file too
+std::string lightmapPath(const std::string& PLYPath){
+	return PLYPath + ".lightmap";
+}
+
+/*
+	Hashes a mesh's PLY file and transform for matching it up with its lightmap
+	The texture isn't part of it since it doesn't change the charts or the lighting, and neither is BAKE_VERSION, so
+	lightmaps (which take a while to make) survive changes to the bake format. Moving a mesh does change its lighting.
+	Returns false if the file can't be read
+*/
+bool hashLightmapSource(const std::string& PLYPath, const glm::mat4& transform, uint64_t& hash){
+	MappedFile ply;
+	if (!ply.open(PLYPath)){
+		return false;
+	}
+	hash = hashBytes((const unsigned char*) &LIGHTMAP_VERSION, sizeof(LIGHTMAP_VERSION));
+	hash = hashBytes(ply.data, ply.size, hash);
+	hash = hashTransform(transform, hash);
+	return true;
+}
+
+/*
+	Maps a mesh's .lightmap file and checks that it's complete, that every index in it is in range, and that it was
+	made from the current PLY file and transform with the current OPTIMIZE_MESHES setting
+	Returns false, leaving lightmap empty, if LIGHTMAPS is off or there's no usable lightmap
+*/
+bool openLightmap(const std::string& PLYPath, const glm::mat4& transform, Lightmap& lightmap){
+	lightmap = Lightmap();
+	if (!LIGHTMAPS){
+		return false;
+	}
+	std::string path = lightmapPath(PLYPath);
+	MappedFile mapping;
+	if (!mapping.open(path)){
+		return false;
+	}
+
+	LightmapHeader header;
+	bool valid = mapping.size >= sizeof(header);
+	if (valid){
+		memcpy(&header, mapping.data, sizeof(header));
+		valid = memcmp(header.magic, LIGHTMAP_MAGIC, sizeof(LIGHTMAP_MAGIC)) == 0 && header.version == LIGHTMAP_VERSION
+			&& header.size > 0 && header.size <= 16384 && header.numVertices <= mapping.size && header.numFaces <= mapping.size
+			&& mapping.size == sizeof(header) + header.numVertices * (sizeof(uint32_t) + sizeof(glm::vec2))
+				+ header.numFaces * sizeof(TriData) + (uint64_t) header.size * header.size * 4;
+	}
+	if (!valid){
+		printf("Lightmap %s is invalid or from an old version, drawing the mesh unlit\n", path.data());
+		return false;
+	}
+	uint64_t sourceHash;
+	if (header.optimized != OPTIMIZE_MESHES || !hashLightmapSource(PLYPath, transform, sourceHash) || sourceHash != header.sourceHash){
+		printf("Lightmap %s is out of date, drawing the mesh unlit (run --bake-lightmaps again)\n", path.data());
+		return false;
+	}
+
+	const unsigned char* p = mapping.data + sizeof(header);
+	const uint32_t* remap = (const uint32_t*) p;
+	p += header.numVertices * sizeof(uint32_t);
+	const glm::vec2* uvs = (const glm::vec2*) p;
+	p += header.numVertices * sizeof(glm::vec2);
+	const TriData* faces = (const TriData*) p;
+	p += header.numFaces * sizeof(TriData);
+	for (uint64_t i = 0; i < header.numVertices && valid; i++){
+		valid = remap[i] < header.numSourceVertices;
+	}
+	for (uint64_t i = 0; i < header.numFaces && valid; i++){
+		valid = faces[i].v1 < header.numVertices && faces[i].v2 < header.numVertices && faces[i].v3 < header.numVertices;
+	}
+	if (!valid){
+		printf("Lightmap %s is invalid, drawing the mesh unlit\n", path.data());
+		return false;
+	}
+	lightmap.header = header;
+	lightmap.remap = remap;
+	lightmap.uvs = uvs;
+	lightmap.faces = faces;
+	lightmap.pixels = p;
+	lightmap.mapping = std::move(mapping);
+	return true;
+}
+
+/*
+	Cuts a mesh apart along its lightmap's chart edges: its vertices are replaced by the lightmap's copies of them,
+	its faces by the lightmap's faces, and lightmapUVs is filled in. The mesh has to be exactly what the lightmap was
+	made from, so load (and optimize) it the same way first.
+	Returns false, leaving the mesh alone, if the mesh doesn't have the vertex count the lightmap expects
+*/
+bool applyLightmap(MeshData& mesh, const Lightmap& lightmap){
+	if (!lightmap.loaded()){
+		return false;
+	}
+	if (mesh.vertexCount() != lightmap.header.numSourceVertices){
+		printf("Lightmap has %llu source vertices but the mesh has %zu, drawing the mesh unlit\n",
+			(unsigned long long) lightmap.header.numSourceVertices, mesh.vertexCount());
+		return false;
+	}
+	MeshData lit;
+	const VertexData* vertices = mesh.vertexData();
+	lit.vertices.resize(lightmap.header.numVertices);
+	for (size_t i = 0; i < lit.vertices.size(); i++){
+		lit.vertices[i] = vertices[lightmap.remap[i]];
+	}
+	lit.faces.assign(lightmap.faces, lightmap.faces + lightmap.header.numFaces);
+	lit.lightmapUVs.assign(lightmap.uvs, lightmap.uvs + lightmap.header.numVertices);
+	mesh = std::move(lit);
+	return true;
+}
+
+/*
+	Builds the full mip chain for a 4-byte-per-pixel image, each level half the size of the one before it (rounded
+	down, at least 1) down to 1x1, using a 2x2 box filter. levels[0] is a copy of the original image.
+*/
+void buildMipLevels(const unsigned char* data, unsigned int width, unsigned int height, std::vector<std::vector<unsigned char>>& levels, std::vector<glm::ivec2>& sizes){
+	levels.assign(1, std::vector<unsigned char>(data, data + (size_t) width * height * 4));
+	sizes.assign(1, glm::ivec2(width, height));
+	while ((width > 1 || height > 1) && levels.size() < BAKE_MAX_MIP_LEVELS){
+		unsigned int newWidth = std::max(1u, width / 2);
+		unsigned int newHeight = std::max(1u, height / 2);
+		const std::vector<unsigned char>& src = levels.back();
+		std::vector<unsigned char> dst((size_t) newWidth * newHeight * 4);
+		for (unsigned int y = 0; y < newHeight; y++){
+			unsigned int y0 = std::min(y * 2, height - 1), y1 = std::min(y * 2 + 1, height - 1);
+			for (unsigned int x = 0; x < newWidth; x++){
+				unsigned int x0 = std::min(x * 2, width - 1), x1 = std::min(x * 2 + 1, width - 1);
+				for (int c = 0; c < 4; c++){
+					unsigned int sum = src[((size_t) y0 * width + x0) * 4 + c] + src[((size_t) y0 * width + x1) * 4 + c]
+						+ src[((size_t) y1 * width + x0) * 4 + c] + src[((size_t) y1 * width + x1) * 4 + c];
+					dst[((size_t) y * newWidth + x) * 4 + c] = (unsigned char) ((sum + 2) / 4);
+				}
+			}
+		}
+		levels.push_back(std::move(dst));
+		sizes.push_back(glm::ivec2(newWidth, newHeight));
+		width = newWidth;
+		height = newHeight;
+	}
+}
+
+/*
+	Writes the baked version of a mesh: the full vertex and face data, the packed vertex and index buffers and every
+	texture mip level exactly as they get uploaded, plus a hash of the source files (and the mesh's transform) and the
+	stamp of the lightmap (if one was applied) so stale bakes can be detected
+	The file is written to a temporary path and renamed over the old one, so a running program never sees half of it.
+	Returns 0 if successful, -1 for file IO error, -2 for file format error
+*/
+int bakeMeshAsset(const SceneEntry& entry){
+	const std::string& PLYPath = entry.PLYPath;
+	const std::string& texturePath = entry.texturePath;
+	uint64_t sourceHash;
+	if (!hashSourceFiles(PLYPath, texturePath, entry.transform, sourceHash)){
+		printf("Error opening source files for %s\n", PLYPath.data());
+		return -1;
+	}
+
+	MeshData mesh;
+	int result = loadPLY(PLYPath, mesh);
+	if (result != 0){
+		return result;
+	}
+	transformMesh(mesh, entry.transform);
+	if (OPTIMIZE_MESHES){
+		optimizeMesh(mesh, PLYPath);
+	}
+	Lightmap lightmap;
+	bool lit = openLightmap(PLYPath, entry.transform, lightmap) && applyLightmap(mesh, lightmap);
+	if (OPTIMIZE_MESHES){
+		orderMeshlets(mesh, entry.oneSided, PLYPath);
+	}
+	std::vector<std::vector<TriData>> lodFaces;
+	std::vector<float> lodErrors;
+	if (GENERATE_LODS){
+		generateLODs(mesh, PLYPath, lodFaces, lodErrors);
+	}
+	Image texture;
+	result = loadImage(texturePath, texture);
+	if (result != 0){
+		return result;
+	}
+	std::vector<std::vector<unsigned char>> levels;
+	std::vector<glm::ivec2> sizes;
+	buildMipLevels(texture.data(), texture.width, texture.height, levels, sizes);
+	PackedMesh packed;
+	packMesh(mesh, VERTEX_POSITION_FORMAT, VERTEX_NORMALS, packed, lodFaces, lodErrors);
+
+	// Lay out the sections one after another, each starting on an aligned offset
+	BakeHeader header = {};
+	memcpy(header.magic, BAKE_MAGIC, sizeof(BAKE_MAGIC));
+	header.version = BAKE_VERSION;
+	header.sourceHash = sourceHash;
+	header.optimized = OPTIMIZE_MESHES;
+	header.numVertices = mesh.vertexCount();
+	header.numFaces = mesh.faceCount();
+	header.packedLayout = packed.layout;
+	header.numPackedIndices = packed.numIndices;
+	header.generatedLODs = GENERATE_LODS;
+	header.numLODs = packed.lods.size();
+	std::copy(packed.lods.begin(), packed.lods.end(), header.lods);
+	header.textureWidth = texture.width;
+	header.textureHeight = texture.height;
+	header.numMipLevels = levels.size();
+	header.lightmapStamp = lit ? lightmap.header.stamp : 0;
+	uint64_t offset = sizeof(BakeHeader);
+	auto placeSection = [&](BakeSection& section, uint64_t size){
+		offset = (offset + BAKE_ALIGNMENT - 1) / BAKE_ALIGNMENT * BAKE_ALIGNMENT;
+		section.offset = offset;
+		section.size = size;
+		offset += size;
+	};
+	placeSection(header.vertices, sizeof(VertexData) * mesh.vertexCount());
+	placeSection(header.faces, sizeof(TriData) * mesh.faceCount());
+	placeSection(header.packedVertices, packed.vertexBytesSize());
+	placeSection(header.packedIndices, packed.indexBytesSize());
+	for (size_t i = 0; i < levels.size(); i++){
+		placeSection(header.mipLevels[i], levels[i].size());
+	}
+	placeSection(header.lightmapUVs, sizeof(glm::vec2) * mesh.lightmapUVs.size());
+
+	std::string path = bakePath(PLYPath);
+	std::string tempPath = path + ".tmp";
+	FILE* file = fopen(tempPath.data(), "wb");
+	if (!file){
+		printf("Error creating %s\n", tempPath.data());
+		return -1;
+	}
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+	auto writeSection = [&](const BakeSection& section, const void* data){
+		static const unsigned char zeros[BAKE_ALIGNMENT] = {};
+		long padding = (long) section.offset - ftell(file);
+		ok = ok && padding >= 0 && fwrite(zeros, 1, padding, file) == (size_t) padding;
+		ok = ok && fwrite(data, 1, section.size, file) == section.size;
+	};
+	writeSection(header.vertices, mesh.vertexData());
+	writeSection(header.faces, mesh.faceData());
+	writeSection(header.packedVertices, packed.vertexBytes());
+	writeSection(header.packedIndices, packed.indexBytes());
+	for (size_t i = 0; i < levels.size(); i++){
+		writeSection(header.mipLevels[i], levels[i].data());
+	}
+	writeSection(header.lightmapUVs, mesh.lightmapUVs.data());
+	ok = (fclose(file) == 0) && ok;
+	if (!ok || rename(tempPath.data(), path.data()) != 0){
+		printf("Error writing %s\n", path.data());
+		remove(tempPath.data());
+		return -1;
+	}
+	printf("Baked %s (%zu vertices, %zu faces, %zu LODs, %zu mip levels%s)\n", path.data(), mesh.vertexCount(), mesh.faceCount(), packed.lods.size(), levels.size(), lit ? ", lightmapped" : "");
+	return 0;
+}
+
+/*
+	Tries to load a mesh from its baked file instead of the PLY and BMP files
+	Nothing but the lightmap UVs is copied: the vertex, face and texture pointers all point into the memory-mapped
+	bake file.
+	Returns true if the bake exists, is valid, and was made from the current source files
+*/
+bool loadBakedAsset(MeshAsset& asset){
+	std::string path = bakePath(asset.PLYPath);
+	MappedFile mapping;
+	if (!mapping.open(path)){
+		return false;
+	}
+
+	BakeHeader header;
+	if (mapping.size < sizeof(header)){
+		printf("Baked asset %s is invalid, loading the source files\n", path.data());
+		return false;
+	}
+	memcpy(&header, mapping.data, sizeof(header));
+	if (memcmp(header.magic, BAKE_MAGIC, sizeof(BAKE_MAGIC)) != 0 || header.version != BAKE_VERSION
+			|| header.numMipLevels == 0 || header.numMipLevels > BAKE_MAX_MIP_LEVELS){
+		printf("Baked asset %s is invalid or from an old version, loading the source files\n", path.data());
+		return false;
+	}
+	// Make sure every section is aligned and actually inside the file before pointing at any of them
+	auto validSection = [&](const BakeSection& section, uint64_t expectedSize){
+		return section.offset % BAKE_ALIGNMENT == 0 && section.size == expectedSize
+			&& section.offset <= mapping.size && section.size <= mapping.size - section.offset;
+	};
+	const PackedVertexLayout& layout = header.packedLayout;
+	size_t indexSize = layout.indexType == GL_UNSIGNED_SHORT ? sizeof(uint16_t) : sizeof(uint32_t);
+	bool valid = validSection(header.vertices, sizeof(VertexData) * header.numVertices)
+		&& validSection(header.faces, sizeof(TriData) * header.numFaces)
+		&& validSection(header.packedVertices, (uint64_t) layout.stride * header.numVertices)
+		&& validSection(header.packedIndices, indexSize * header.numPackedIndices)
+		&& header.numLODs >= 1 && header.numLODs <= MAX_MESH_LODS
+		&& header.lods[0].firstIndex == 0 && header.lods[0].numIndices == header.numFaces * 3
+		&& validSection(header.lightmapUVs, header.lightmapStamp != 0 ? sizeof(glm::vec2) * header.numVertices : 0)
+		&& (layout.hasLightmap != 0) == (header.lightmapStamp != 0);
+	for (uint32_t i = 0; i < header.numLODs && valid; i++){
+		const MeshLOD& lod = header.lods[i];
+		valid = lod.numIndices % 3 == 0 && lod.firstIndex <= header.numPackedIndices && lod.numIndices <= header.numPackedIndices - lod.firstIndex;
+	}
+	unsigned int width = header.textureWidth, height = header.textureHeight;
+	for (uint32_t i = 0; i < header.numMipLevels && valid; i++){
+		valid = validSection(header.mipLevels[i], (uint64_t) width * height * 4);
+		width = std::max(1u, width / 2);
+		height = std::max(1u, height / 2);
+	}
+	// The faces and packed indices are drawn and traced straight from the mapping, so each one has to be a real vertex
+	const TriData* faces = (const TriData*) (mapping.data + header.faces.offset);
+	for (uint64_t i = 0; i < header.numFaces && valid; i++){
+		valid = faces[i].v1 < header.numVertices && faces[i].v2 < header.numVertices && faces[i].v3 < header.numVertices;
+	}
+	const unsigned char* packedIndices = mapping.data + header.packedIndices.offset;
+	for (uint64_t i = 0; i < header.numPackedIndices && valid; i++){
+		uint32_t index;
+		if (indexSize == sizeof(uint16_t)){
+			uint16_t shortIndex;
+			memcpy(&shortIndex, packedIndices + i * indexSize, sizeof(shortIndex));
+			index = shortIndex;
+		}
+		else{
+			memcpy(&index, packedIndices + i * indexSize, sizeof(index));
+		}
+		valid = index < header.numVertices;
+	}
+	if (!valid){
+		printf("Baked asset %s is invalid, loading the source files\n", path.data());
+		return false;
+	}
+
+	// A bake made with different vertex format or LOD settings is just as stale as one made from old files
+	if (layout.positionFormat != VERTEX_POSITION_FORMAT || layout.hasNormals != VERTEX_NORMALS || header.optimized != OPTIMIZE_MESHES
+			|| header.generatedLODs != GENERATE_LODS){
+		printf("Baked asset %s uses different settings, loading the source files\n", path.data());
+		return false;
+	}
+
+	uint64_t sourceHash;
+	if (!hashSourceFiles(asset.PLYPath, asset.texturePath, asset.transform, sourceHash) || sourceHash != header.sourceHash){
+		printf("Baked asset %s is out of date, loading the source files\n", path.data());
+		return false;
+	}
+
+	// The lightmap changes the vertices, so the bake is also stale if it's been rebaked, turned off or deleted since
+	Lightmap lightmap;
+	uint64_t lightmapStamp = openLightmap(asset.PLYPath, asset.transform, lightmap) ? lightmap.header.stamp : 0;
+	if (lightmapStamp != header.lightmapStamp){
+		printf("Baked asset %s was made with a different lightmap, loading the source files\n", path.data());
+		return false;
+	}
+
+	printf("Reading baked asset %s\n", path.data());
+	MeshData& mesh = asset.mesh;
+	mesh = MeshData();
+	mesh.mappedVertices = (const VertexData*) (mapping.data + header.vertices.offset);
+	mesh.numMappedVertices = header.numVertices;
+	mesh.mappedFaces = (const TriData*) (mapping.data + header.faces.offset);
+	mesh.numMappedFaces = header.numFaces;
+	// The lightmap UVs are the only thing copied, since MeshData keeps them in a vector
+	const glm::vec2* lightmapUVs = (const glm::vec2*) (mapping.data + header.lightmapUVs.offset);
+	mesh.lightmapUVs.assign(lightmapUVs, lightmapUVs + header.lightmapUVs.size / sizeof(glm::vec2));
+	asset.lightmap = std::move(lightmap);
+	asset.packed = PackedMesh();
+	asset.packed.layout = layout;
+	asset.packed.numIndices = header.numPackedIndices;
+	asset.packed.lods.assign(header.lods, header.lods + header.numLODs);
+	asset.packed.mappedVertexBytes = mapping.data + header.packedVertices.offset;
+	asset.packed.numMappedVertexBytes = header.packedVertices.size;
+	asset.packed.mappedIndexBytes = mapping.data + header.packedIndices.offset;
+	asset.packed.numMappedIndexBytes = header.packedIndices.size;
+	asset.textureWidth = header.textureWidth;
+	asset.textureHeight = header.textureHeight;
+	asset.mipLevels.clear();
+	width = header.textureWidth;
+	height = header.textureHeight;
+	for (uint32_t i = 0; i < header.numMipLevels; i++){
+		asset.mipLevels.push_back({mapping.data + header.mipLevels[i].offset, width, height});
+		width = std::max(1u, width / 2);
+		height = std::max(1u, height / 2);
+	}
+	mesh.mapping = std::move(mapping);
+	asset.PLYResult = 0;
+	return true;
+}
+
+/*
+	Reads and decodes the PLY and BMP files for a mesh and moves it by its transform, or reads its baked file if there's
+	an up to date one. This doesn't make any OpenGL calls, so it's safe to run on a thread without a GL context
+	Returns the loadPLY result
+*/
+int loadMeshAsset(MeshAsset& asset){
+	ProfileZone zone("load " + asset.PLYPath);
+	if (loadBakedAsset(asset)){
+		if (!asset.mipLevels.empty()){
+			const TextureLevel& level = asset.mipLevels[0];
+			asset.alphaMode = classifyTextureAlpha(level.data, (size_t) level.width * level.height);
+		}
+		return 0;
+	}
+	if (loadImage(asset.texturePath, asset.texture) == 0){
+		asset.textureWidth = asset.texture.width;
+		asset.textureHeight = asset.texture.height;
+		asset.alphaMode = classifyTextureAlpha(asset.texture.data(), (size_t) asset.textureWidth * asset.textureHeight);
+	}
+	asset.PLYResult = loadPLY(asset.PLYPath, asset.mesh);
+	if (asset.PLYResult == 0){
+		transformMesh(asset.mesh, asset.transform);
+		if (OPTIMIZE_MESHES){
+			optimizeMesh(asset.mesh, asset.PLYPath);
+		}
+		if (openLightmap(asset.PLYPath, asset.transform, asset.lightmap) && !applyLightmap(asset.mesh, asset.lightmap)){
+			asset.lightmap = Lightmap();
+		}
+		if (OPTIMIZE_MESHES){
+			orderMeshlets(asset.mesh, asset.oneSided, asset.PLYPath);
+		}
+		std::vector<std::vector<TriData>> lodFaces;
+		std::vector<float> lodErrors;
+		if (GENERATE_LODS){
+			generateLODs(asset.mesh, asset.PLYPath, lodFaces, lodErrors);
+		}
+		packMesh(asset.mesh, VERTEX_POSITION_FORMAT, VERTEX_NORMALS, asset.packed, lodFaces, lodErrors);
+	}
+	return asset.PLYResult;
+}
+
+/*
+	loadMeshAsset for worker threads, where anything it throws (like bad_alloc for a file claiming to be enormous) would
+	end the whole program
+	The exception is returned instead, for reportMeshAssetException once the workers are joined, and the asset is left
+	empty with a PLYResult of -1, like one whose files didn't load.
+*/
+std::exception_ptr loadMeshAssetCaught(MeshAsset& asset){
+	try{
+		loadMeshAsset(asset);
+		return nullptr;
+	}
+	catch (...){
+		MeshAsset failed;
+		failed.PLYPath = asset.PLYPath;
+		failed.texturePath = asset.texturePath;
+		failed.transform = asset.transform;
+		failed.oneSided = asset.oneSided;
+		failed.PLYResult = -1;
+		asset = std::move(failed);
+		return std::current_exception();
+	}
+}
+
+// Prints what went wrong with the mesh at PLYPath for an exception from loadMeshAssetCaught
+void reportMeshAssetException(const std::string& PLYPath, std::exception_ptr error){
+	try{
+		std::rethrow_exception(error);
+	}
+	catch (const std::exception& e){
+		printf("%s could not be loaded: %s\n", PLYPath.data(), e.what());
+	}
+	catch (...){
+		printf("%s could not be loaded\n", PLYPath.data());
+	}
+}
+
+// Shaders used by every TexturedMesh (shamelessly stolen from class demo code as instructed)
+const std::string MESH_VERTEX_SHADER = "\
+#version 330 core\n\
+// Input vertex data, different for all executions of this shader.\n\
+layout(location = 0) in vec3 vertexPosition;\n\
+layout(location = 1) in vec2 uv;\n\
+layout(location = 9) in vec2 lightmapUV;\n\
+// Output data ; will be interpolated for each fragment.\n\
+out vec2 uv_out;\n\
+out vec2 lightmapUV_out;\n\
+// Values that stay constant for the whole mesh.\n\
+uniform mat4 MVP;\n\
+void main(){ \n\
+	// Output position of the vertex, in clip space : MVP * position\n\
+	gl_Position =  MVP * vec4(vertexPosition,1);\n\
+	// The color will be interpolated to produce the color of each fragment\n\
+	uv_out = uv;\n\
+	lightmapUV_out = lightmapUV;\n\
+}\n";
+
+/*
+	Fragment shader code for fading between LODs: discards the pixel unless its threshold in a 4x4 ordered dither
+	pattern is in [ditherMin, ditherMax). Only goes in the discard shader variants, since discard can turn off early
+	depth testing.
+*/
+const std::string LOD_DITHER_FUNCTION = "\
+const float BAYER[16] = float[16](0, 8, 2, 10, 12, 4, 14, 6, 3, 11, 1, 9, 15, 7, 13, 5);\n\
+void ditherLOD(vec2 range){\n\
+	float threshold = (BAYER[(int(gl_FragCoord.x) & 3) + (int(gl_FragCoord.y) & 3) * 4] + 0.5) / 16.0;\n\
+	if (threshold < range.x || threshold >= range.y) discard;\n\
+}\n";
+
+// Lightmap texels store the light times 128, so 128 leaves the texture as it is and brighter lighting still fits
+const float LIGHTMAP_ENCODING_SCALE = 128.0f;
+const std::string LIGHTMAP_SCALE_GLSL = "(255.0 / " + std::to_string(LIGHTMAP_ENCODING_SCALE) + ")";
+
+const std::string MESH_FRAGMENT_SHADER = "\
+#version 330 core\n\
+in vec2 uv_out; \n\
+in vec2 lightmapUV_out;\n\
+uniform sampler2D tex;\n\
+uniform sampler2D lightmap;\n\
+void main() {\n\
+	gl_FragColor = texture(tex, uv_out);\n\
+	gl_FragColor.rgb *= texture(lightmap, lightmapUV_out).rgb * " + LIGHTMAP_SCALE_GLSL + ";\n\
+}\n";
+
+// MESH_FRAGMENT_SHADER for meshes that are alpha tested or fading between LODs
+const std::string MESH_DISCARD_FRAGMENT_SHADER = "\
+#version 330 core\n\
+in vec2 uv_out; \n\
+in vec2 lightmapUV_out;\n\
+uniform sampler2D tex;\n\
+uniform sampler2D lightmap;\n\
+uniform vec2 ditherRange;\n\
+uniform float alphaCutoff;\n" + LOD_DITHER_FUNCTION + "\
+void main() {\n\
+	ditherLOD(ditherRange);\n\
+	vec4 colour = texture(tex, uv_out);\n\
+	if (colour.a < alphaCutoff) discard;\n\
+	colour.rgb *= texture(lightmap, lightmapUV_out).rgb * " + LIGHTMAP_SCALE_GLSL + ";\n\
+	gl_FragColor = colour;\n\
+}\n";
+
+/*
+	Remembers the GL state that drawing changes, so setting something that's already set doesn't make a GL call
+	Only knows about changes made through it, so call invalidate() after touching any of this state directly
+	(creating buffers, VAOs and textures binds things, for example). Everything starts out unknown.
+	issued and skipped count calls made and avoided since the last resetCounters().
+*/
+class GLStateCache{
+		static const GLuint UNKNOWN = ~0u;
+
+		GLuint program, vertexArray, indirectBuffer;
+		GLenum activeTexture;
+		// Bound textures for the two targets we use, on the two units the shaders use (the texture and the lightmap)
+		static const int TEXTURE_UNITS = 2;
+		GLuint texture2D[TEXTURE_UNITS], texture2DArray[TEXTURE_UNITS];
+		GLuint blend, depthWrite;
+		GLenum blendSource, blendDestination;
+
+		bool changed(GLuint& current, GLuint value){
+			if (current == value){
+				skipped++;
+				return false;
+			}
+			current = value;
+			issued++;
+			return true;
+		}
+
+	public:
+
+		size_t issued = 0, skipped = 0;
+
+		GLStateCache(){
+			invalidate();
+		}
+
+		void invalidate(){
+			program = vertexArray = indirectBuffer = UNKNOWN;
+			activeTexture = UNKNOWN;
+			for (int i = 0; i < TEXTURE_UNITS; i++){
+				texture2D[i] = texture2DArray[i] = UNKNOWN;
+			}
+			blend = depthWrite = UNKNOWN;
+			blendSource = blendDestination = UNKNOWN;
+		}
+
+		void resetCounters(){
+			issued = skipped = 0;
+		}
+
+		void useProgram(GLuint id){
+			if (changed(program, id)){
+				glUseProgram(id);
+			}
+		}
+
+		void bindVertexArray(GLuint id){
+			if (changed(vertexArray, id)){
+				glBindVertexArray(id);
+			}
+		}
+
+		void bindIndirectBuffer(GLuint id){
+			if (changed(indirectBuffer, id)){
+				glBindBuffer(GL_DRAW_INDIRECT_BUFFER, id);
+			}
+		}
+
+		// Unit 0 is the mesh's texture and unit 1 its lightmap
+		void bindTexture(GLenum target, GLuint id, int unit = 0){
+			GLuint& bound = target == GL_TEXTURE_2D_ARRAY ? texture2DArray[unit] : texture2D[unit];
+			if (bound == id){
+				skipped++;
+				return;
+			}
+			if (changed(activeTexture, GL_TEXTURE0 + unit)){
+				glActiveTexture(GL_TEXTURE0 + unit);
+			}
+			changed(bound, id);
+			glBindTexture(target, id);
+		}
+
+		void setBlend(bool enabled){
+			if (changed(blend, enabled)){
+				if (enabled){
+					glEnable(GL_BLEND);
+				}
+				else{
+					glDisable(GL_BLEND);
+				}
+			}
+		}
+
+		// Turning depth writes off also stops glClear from clearing the depth buffer, so turn them back on after
+		void setDepthWrite(bool enabled){
+			if (changed(depthWrite, enabled)){
+				glDepthMask(enabled ? GL_TRUE : GL_FALSE);
+			}
+		}
+
+		void blendFunc(GLenum source, GLenum destination){
+			if (blendSource == source && blendDestination == destination){
+				skipped++;
+				return;
+			}
+			blendSource = source;
+			blendDestination = destination;
+			issued++;
+			glBlendFunc(source, destination);
+		}
+};
+
+GLStateCache glState;
+
+/*
+	Owns one OpenGL object and deletes it when it goes away, so objects can't leak or be deleted twice
+	Move-only: moving hands the object over and leaves the old handle empty (0). Type says how to make and delete the
+	kind of object (see the typedefs below). Deleting also invalidates glState, since GL hands the names of deleted
+	objects out again and the cache would otherwise think a new object was still bound. Like any GL call, handles
+	must be created and destroyed on the GL context's thread while the context exists.
+*/
+template <typename Type>
+class GLHandle{
+		GLuint id = 0;
+
+	public:
+
+		GLHandle(){}
+		GLHandle(const GLHandle&) = delete;
+		GLHandle& operator=(const GLHandle&) = delete;
+		GLHandle(GLHandle&& other) noexcept : id(other.id){
+			other.id = 0;
+		}
+		GLHandle& operator=(GLHandle&& other) noexcept{
+			if (this != &other){
+				reset();
+				id = other.id;
+				other.id = 0;
+			}
+			return *this;
+		}
+		~GLHandle(){
+			reset();
+		}
+
+		// Deletes the current object, if there is one, and makes a new one
+		GLuint create(){
+			reset();
+			id = Type::create();
+			return id;
+		}
+
+		// Takes over an object that was made some other way (like a program from a cached binary)
+		void adopt(GLuint object){
+			reset();
+			id = object;
+		}
+
+		void reset(){
+			if (id != 0){
+				Type::destroy(id);
+				glState.invalidate();
+				id = 0;
+			}
+		}
+
+		GLuint get() const{
+			return id;
+		}
+};
+
+struct GLBufferType{
+	static GLuint create(){
+		GLuint id;
+		glGenBuffers(1, &id);
+		return id;
+	}
+	static void destroy(GLuint id){
+		glDeleteBuffers(1, &id);
+	}
+};
+
+struct GLVertexArrayType{
+	static GLuint create(){
+		GLuint id;
+		glGenVertexArrays(1, &id);
+		return id;
+	}
+	static void destroy(GLuint id){
+		glDeleteVertexArrays(1, &id);
+	}
+};
+
+struct GLTextureType{
+	static GLuint create(){
+		GLuint id;
+		glGenTextures(1, &id);
+		return id;
+	}
+	static void destroy(GLuint id){
+		glDeleteTextures(1, &id);
+	}
+};
+
+struct GLFramebufferType{
+	static GLuint create(){
+		GLuint id;
+		glGenFramebuffers(1, &id);
+		return id;
+	}
+	static void destroy(GLuint id){
+		glDeleteFramebuffers(1, &id);
+	}
+};
+
+struct GLProgramType{
+	static GLuint create(){
+		return glCreateProgram();
+	}
+	static void destroy(GLuint id){
+		glDeleteProgram(id);
+	}
+};
+
+typedef GLHandle<GLBufferType> GLBuffer;
+typedef GLHandle<GLVertexArrayType> GLVertexArray;
+typedef GLHandle<GLTextureType> GLTexture;
+typedef GLHandle<GLFramebufferType> GLFramebuffer;
+typedef GLHandle<GLProgramType> GLProgram;
+
+// Linked program binaries are saved here so later runs can skip compiling
+const std::string SHADER_CACHE_DIR = "./shader_cache";
+
+/*
+	Compiles and links each unique pair of shader sources (or compute shader) once, and hands out the same program ID
+	to everyone who asks for it afterwards. Linked programs are also saved with glGetProgramBinary, keyed by a hash of
+	the sources and the driver's vendor/renderer/version strings, so the next run can load them with glProgramBinary
+	instead.
+	All functions must be called on the GL context's thread.
+*/
+class ShaderProgramRegistry{
+		// Saved program binaries start with this, followed by the binary itself
+		struct CacheHeader{
+			char magic[8];
+			GLenum binaryFormat;
+			GLuint binaryLength;
+		};
+
+		std::unordered_map<uint64_t, GLProgram> programs;
+		// Every active uniform's location in each program, looked up once right after linking
+		std::unordered_map<GLuint, std::unordered_map<std::string, GLint>> uniforms;
+
+		void readUniforms(GLuint programID){
+			std::unordered_map<std::string, GLint>& locations = uniforms[programID];
+			GLint numUniforms = 0, maxLength = 0;
+			glGetProgramiv(programID, GL_ACTIVE_UNIFORMS, &numUniforms);
+			glGetProgramiv(programID, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+			std::vector<char> name(std::max(maxLength, 1));
+			for (GLint i = 0; i < numUniforms; i++){
+				GLsizei length = 0;
+				GLint size = 0;
+				GLenum type = 0;
+				glGetActiveUniform(programID, i, name.size(), &length, &size, &type, name.data());
+				std::string uniformName(name.data(), length);
+				locations[uniformName] = glGetUniformLocation(programID, uniformName.data());
+			}
+		}
+
+		// Prints the info log of a shader or program that failed to compile or link
+		static void printLog(GLuint id, bool isProgram){
+			GLint length = 0;
+			if (isProgram){
+				glGetProgramiv(id, GL_INFO_LOG_LENGTH, &length);
+			}
+			else{
+				glGetShaderiv(id, GL_INFO_LOG_LENGTH, &length);
+			}
+			std::vector<char> log(length + 1, '\0');
+			if (isProgram){
+				glGetProgramInfoLog(id, length, NULL, log.data());
+			}
+			else{
+				glGetShaderInfoLog(id, length, NULL, log.data());
+			}
+			printf("%s\n", log.data());
+		}
+
+		static GLuint compileShader(GLenum type, const std::string& source){
+			GLuint shaderID = glCreateShader(type);
+			char const *sourcePointer = source.c_str();
+			glShaderSource(shaderID, 1, &sourcePointer, NULL);
+			glCompileShader(shaderID);
+			GLint compiled = GL_FALSE;
+			glGetShaderiv(shaderID, GL_COMPILE_STATUS, &compiled);
+			if (!compiled){
+				printf("Error compiling %s shader:\n", type == GL_VERTEX_SHADER ? "vertex" : type == GL_COMPUTE_SHADER ? "compute" : "fragment");
+				printLog(shaderID, false);
+			}
+			return shaderID;
+		}
+
+		// Program binaries only work on the driver that made them, so the driver strings are part of the key
+		static uint64_t programKey(const std::vector<std::pair<GLenum, const std::string*>>& sources){
+			uint64_t key = 0;
+			for (size_t i = 0; i < sources.size(); i++){
+				const std::string& source = *sources[i].second;
+				key = i == 0 ? hashBytes((const unsigned char*) source.data(), source.size() + 1)
+					: hashBytes((const unsigned char*) source.data(), source.size() + 1, key);
+			}
+			GLenum strings[3] = {GL_VENDOR, GL_RENDERER, GL_VERSION};
+			for (GLenum name : strings){
+				const char* value = (const char*) glGetString(name);
+				if (value != nullptr){
+					key = hashBytes((const unsigned char*) value, strlen(value) + 1, key);
+				}
+			}
+			return key;
+		}
+
+		static std::string cachePath(uint64_t key){
+			char name[32];
+			snprintf(name, sizeof(name), "/%016llx.bin", (unsigned long long) key);
+			return SHADER_CACHE_DIR + name;
+		}
+
+		static bool binariesSupported(){
+			GLint numFormats = 0;
+			glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &numFormats);
+			return numFormats > 0;
+		}
+
+		/*
+			Tries to create a program from a cached binary
+			Returns the program ID, or 0 if there's no usable cached binary
+		*/
+		static GLuint loadCachedProgram(uint64_t key){
+			MappedFile file;
+			if (!binariesSupported() || !file.open(cachePath(key))){
+				return 0;
+			}
+			CacheHeader header;
+			if (file.size < sizeof(header)){
+				return 0;
+			}
+			memcpy(&header, file.data, sizeof(header));
+			if (memcmp(header.magic, "AS4PROG", 8) != 0 || header.binaryLength != file.size - sizeof(header)){
+				return 0;
+			}
+			GLuint programID = glCreateProgram();
+			glProgramBinary(programID, header.binaryFormat, file.data + sizeof(header), header.binaryLength);
+			// The driver is allowed to reject binaries (after an update, for example), in which case we just compile
+			GLint linked = GL_FALSE;
+			glGetProgramiv(programID, GL_LINK_STATUS, &linked);
+			if (!linked){
+				glDeleteProgram(programID);
+				return 0;
+			}
+			return programID;
+		}
+
+		static void saveCachedProgram(uint64_t key, GLuint programID){
+			GLint length = 0;
+			glGetProgramiv(programID, GL_PROGRAM_BINARY_LENGTH, &length);
+			if (length <= 0){
+				return;
+			}
+			std::vector<unsigned char> binary(length);
+			CacheHeader header;
+			memcpy(header.magic, "AS4PROG", 8);
+			glGetProgramBinary(programID, length, NULL, &header.binaryFormat, binary.data());
+			header.binaryLength = length;
+
+			std::error_code ec;
+			std::filesystem::create_directories(SHADER_CACHE_DIR, ec);
+			std::string path = cachePath(key);
+			std::string tempPath = path + ".tmp";
+			FILE* file = fopen(tempPath.data(), "wb");
+			if (!file){
+				return;
+			}
+			bool ok = fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(binary.data(), 1, length, file) == (size_t) length;
+			ok = (fclose(file) == 0) && ok;
+			if (!ok || rename(tempPath.data(), path.data()) != 0){
+				remove(tempPath.data());
+			}
+		}
+
+		// Links the shaders in sources (type and source code), or loads them from the cache
+		GLuint getProgram(const std::vector<std::pair<GLenum, const std::string*>>& sources){
+			uint64_t key = programKey(sources);
+			std::unordered_map<uint64_t, GLProgram>::iterator existing = programs.find(key);
+			if (existing != programs.end()){
+				return existing->second.get();
+			}
+
+			GLuint programID = loadCachedProgram(key);
+			if (programID == 0){
+				ProfileZone zone("compile shaders");
+				// Create shaders
+				std::vector<GLuint> shaderIDs;
+				for (const std::pair<GLenum, const std::string*>& source : sources){
+					shaderIDs.push_back(compileShader(source.first, *source.second));
+				}
+
+				programID = glCreateProgram();
+				for (GLuint shaderID : shaderIDs){
+					glAttachShader(programID, shaderID);
+				}
+				if (binariesSupported()){
+					glProgramParameteri(programID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+				}
+				glLinkProgram(programID);
+
+				for (GLuint shaderID : shaderIDs){
+					glDetachShader(programID, shaderID);
+					glDeleteShader(shaderID);
+				}
+
+				GLint linked = GL_FALSE;
+				glGetProgramiv(programID, GL_LINK_STATUS, &linked);
+				if (linked){
+					if (binariesSupported()){
+						saveCachedProgram(key, programID);
+					}
+				}
+				else{
+					printf("Error linking shader program:\n");
+					printLog(programID, true);
+				}
+			}
+			programs[key].adopt(programID);
+			readUniforms(programID);
+			return programID;
+		}
+
+	public:
+
+		/*
+			Returns the program for a vertex/fragment shader pair, creating it the first time each pair is asked for
+			Checks the on-disk cache before compiling anything
+		*/
+		GLuint get(const std::string& vertexSource, const std::string& fragmentSource){
+			return getProgram({{GL_VERTEX_SHADER, &vertexSource}, {GL_FRAGMENT_SHADER, &fragmentSource}});
+		}
+
+		// Same as get, for a compute shader on its own. Needs OpenGL 4.3.
+		GLuint getCompute(const std::string& computeSource){
+			return getProgram({{GL_COMPUTE_SHADER, &computeSource}});
+		}
+
+		// Returns a uniform's location in a program from get(), or -1 if the program doesn't use it
+		GLint uniformLocation(GLuint programID, const std::string& name) const{
+			std::unordered_map<GLuint, std::unordered_map<std::string, GLint>>::const_iterator program = uniforms.find(programID);
+			if (program == uniforms.end()){
+				return -1;
+			}
+			std::unordered_map<std::string, GLint>::const_iterator location = program->second.find(name);
+			return location == program->second.end() ? -1 : location->second;
+		}
+
+		// Deletes every program handed out so far. Must be called before the GL context goes away.
+		void clear(){
+			programs.clear();
+			uniforms.clear();
+		}
+};
+
+ShaderProgramRegistry shaderPrograms;
+
+// Draw calls and triangles submitted since the last reset(), for the window title and --benchmark
+struct FrameCounters{
+	size_t drawCalls = 0, triangles = 0;
+
+	void reset(){
+		drawCalls = triangles = 0;
+	}
+};
+
+FrameCounters frameCounters;
+// One mip level of a texture that finished streaming in (see TextureStreamer::update)
+struct StreamedLevel{
+	GLuint texture;
+	int level;
+};
+
+/*
+	Uploads textures in the background so loading doesn't stop for them
+	Textures are handed over with stream() right after their storage is made. Worker threads build the mip chain (or
+	take it straight from a bake file) and copy the texels into a ring buffer that's persistently mapped
+	(GL_MAP_PERSISTENT_BIT), so nothing has to be mapped or copied on the GL thread. update() runs once a frame on the
+	GL thread and turns whatever the workers have finished into glTexSubImage2D calls from the ring, up to
+	TEXTURE_STREAM_BYTES_PER_FRAME, then puts a fence after them. Ring space is only reused once its fence has
+	passed, and workers wait for space if the ring is full.
+	Levels go smallest first, and each texture's GL_TEXTURE_MIN_LOD is lowered as finer levels arrive, so meshes show
+	up blurry straight away and sharpen over the next few frames.
+	Needs OpenGL 4.4 (glBufferStorage). Check start() and upload textures the normal way if it's false.
+*/
+class TextureStreamer{
+		struct Request{
+			GLuint texture;
+			unsigned int width, height;
+			int levels;
+			// Either the full mip chain (baked assets) or just level 0
+			std::vector<TextureLevel> mipLevels;
+			const unsigned char* pixels;
+		};
+
+		// Space in the ring. Freed in the order it was handed out.
+		struct Region{
+			size_t offset, size;
+			// Frame the upload was issued in, or 0 while a worker still owns it
+			uint64_t frame;
+		};
+
+		// Some rows of one mip level, sitting in the ring waiting for update()
+		struct Upload{
+			GLuint texture;
+			int level;
+			unsigned int y, width, rows;
+			Region* region;
+			bool lastOfLevel;
+		};
+
+		struct FrameFence{
+			uint64_t frame;
+			GLsync fence;
+		};
+
+		static const size_t ALIGNMENT = 256;
+
+		GLBuffer ringBuffer;
+		unsigned char* ring = nullptr;
+		size_t ringSize = 0;
+		int supported = -1;
+
+		std::mutex mutex;
+		std::condition_variable workAvailable, spaceFreed;
+		std::deque<Request> requests;
+		std::deque<Region> regions;
+		std::deque<Upload> uploads;
+		std::vector<std::thread> workers;
+		size_t busyWorkers = 0;
+		bool stopping = false;
+
+		// Only touched on the GL thread
+		std::deque<FrameFence> fences;
+		uint64_t frame = 1, finishedFrame = 0;
+		std::vector<StreamedLevel> completed;
+		std::unordered_map<GLuint, int> finestLevels;
+
+		// Finds room for size bytes, or returns false if there isn't any right now. Caller holds the mutex.
+		bool allocate(size_t size, Region*& region){
+			size_t offset = 0;
+			if (!regions.empty()){
+				size_t oldest = regions.front().offset;
+				size_t end = regions.back().offset + (regions.back().size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+				bool wrapped = regions.back().offset < oldest;
+				if (!wrapped && end + size <= ringSize){
+					offset = end;
+				}
+				else if (!wrapped && size <= oldest){
+					offset = 0;
+				}
+				else if (wrapped && end + size <= oldest){
+					offset = end;
+				}
+				else{
+					return false;
+				}
+			}
+			regions.push_back({offset, size, 0});
+			region = &regions.back();
+			return true;
+		}
+
+		// Copies rows of a level into the ring (waiting for space if it has to) and queues them for upload
+		bool queueLevel(GLuint texture, int level, const unsigned char* data, unsigned int width, unsigned int height){
+			size_t rowBytes = (size_t) width * 4;
+			// Pieces are at most a quarter of the ring so a full ring always drains enough to fit the next one
+			unsigned int rowsPerPiece = std::max<size_t>(1, std::min<size_t>(height, ringSize / 4 / rowBytes));
+			for (unsigned int y = 0; y < height; y += rowsPerPiece){
+				unsigned int rows = std::min(rowsPerPiece, height - y);
+				Region* region;
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					spaceFreed.wait(lock, [&](){
+						return stopping || allocate(rows * rowBytes, region);
+					});
+					if (stopping){
+						return false;
+					}
+				}
+				memcpy(ring + region->offset, data + y * rowBytes, rows * rowBytes);
+				std::lock_guard<std::mutex> lock(mutex);
+				uploads.push_back({texture, level, y, width, rows, region, y + rows == height});
+			}
+			return true;
+		}
+
+		void workerLoop(){
+			while (true){
+				Request request;
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					workAvailable.wait(lock, [&](){
+						return stopping || !requests.empty();
+					});
+					if (stopping){
+						return;
+					}
+					request = std::move(requests.front());
+					requests.pop_front();
+					busyWorkers++;
+				}
+
+				// Textures that weren't baked need their mip chain built first
+				std::vector<std::vector<unsigned char>> builtLevels;
+				std::vector<glm::ivec2> sizes;
+				if (request.mipLevels.empty()){
+					ProfileZone zone("build mip levels");
+					buildMipLevels(request.pixels, request.width, request.height, builtLevels, sizes);
+					for (size_t i = 0; i < builtLevels.size(); i++){
+						request.mipLevels.push_back({builtLevels[i].data(), (unsigned int) sizes[i].x, (unsigned int) sizes[i].y});
+					}
+				}
+				int levels = std::min<int>(request.levels, request.mipLevels.size());
+				for (int level = levels - 1; level >= 0; level--){
+					const TextureLevel& mip = request.mipLevels[level];
+					if (!queueLevel(request.texture, level, mip.data, mip.width, mip.height)){
+						return;
+					}
+				}
+
+				std::lock_guard<std::mutex> lock(mutex);
+				busyWorkers--;
+			}
+		}
+
+		// Frees ring space whose uploads the GPU has finished with. GL thread only.
+		void retire(){
+			while (!fences.empty()){
+				GLenum status = glClientWaitSync(fences.front().fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+				if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED){
+					break;
+				}
+				finishedFrame = fences.front().frame;
+				glDeleteSync(fences.front().fence);
+				fences.pop_front();
+			}
+			std::lock_guard<std::mutex> lock(mutex);
+			bool freed = false;
+			while (!regions.empty() && regions.front().frame != 0 && regions.front().frame <= finishedFrame){
+				regions.pop_front();
+				freed = true;
+			}
+			if (freed){
+				spaceFreed.notify_all();
+			}
+		}
+
+	public:
+
+		~TextureStreamer(){
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+			}
+			workAvailable.notify_all();
+			spaceFreed.notify_all();
+			for (std::thread& worker : workers){
+				worker.join();
+			}
+		}
+
+		/*
+			Creates the ring buffer and worker threads the first time it's called, on the GL thread
+			Returns whether streaming can be used
+		*/
+		bool start(){
+			if (supported >= 0){
+				return supported == 1;
+			}
+			supported = STREAM_TEXTURES && (glewIsSupported("GL_VERSION_4_4") || glewIsSupported("GL_ARB_buffer_storage"));
+			if (!supported){
+				return false;
+			}
+			ringSize = TEXTURE_STREAM_BUFFER_SIZE;
+			GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, ringBuffer.create());
+			glBufferStorage(GL_PIXEL_UNPACK_BUFFER, ringSize, NULL, flags);
+			ring = (unsigned char*) glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, ringSize, flags);
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			if (ring == nullptr){
+				printf("Couldn't map the texture streaming buffer, so textures will be uploaded all at once\n");
+				ringBuffer.reset();
+				supported = 0;
+				return false;
+			}
+			unsigned int numWorkers = std::max(1u, std::min(2u, std::thread::hardware_concurrency()));
+			for (unsigned int i = 0; i < numWorkers; i++){
+				workers.emplace_back(&TextureStreamer::workerLoop, this);
+			}
+			return true;
+		}
+
+		/*
+			Queues every level of a texture to be uploaded
+			The texture needs immutable storage for all its levels already. pixels (level 0, when mipLevels is empty) or
+			the mip level data have to stay valid until the texture has finished streaming.
+		*/
+		void stream(GLuint texture, unsigned int width, unsigned int height, int levels, const std::vector<TextureLevel>& mipLevels, const unsigned char* pixels){
+			// The caller fills in the smallest level with a placeholder, so that much is always there
+			finestLevels[texture] = levels - 1;
+			std::lock_guard<std::mutex> lock(mutex);
+			requests.push_back({texture, width, height, levels, mipLevels, pixels});
+			workAvailable.notify_one();
+		}
+
+		// The finest level of a texture that's been uploaded so far (0 for textures that weren't streamed)
+		int finestLevel(GLuint texture) const{
+			std::unordered_map<GLuint, int>::const_iterator found = finestLevels.find(texture);
+			return found == finestLevels.end() ? 0 : found->second;
+		}
+
+		/*
+			Uploads finished pieces, up to byteBudget bytes (but always at least one piece), on the GL thread
+			Returns the levels that finished this call. Call once a frame.
+		*/
+		const std::vector<StreamedLevel>& update(size_t byteBudget = TEXTURE_STREAM_BYTES_PER_FRAME){
+			completed.clear();
+			if (supported != 1){
+				return completed;
+			}
+			ProfileZone zone("stream textures");
+			retire();
+
+			std::vector<Upload> ready;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				size_t bytes = 0;
+				while (!uploads.empty() && (ready.empty() || bytes + uploads.front().region->size <= byteBudget)){
+					bytes += uploads.front().region->size;
+					ready.push_back(uploads.front());
+					uploads.pop_front();
+				}
+			}
+			if (ready.empty()){
+				return completed;
+			}
+
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, ringBuffer.get());
+			for (const Upload& upload : ready){
+				glState.bindTexture(GL_TEXTURE_2D, upload.texture);
+				glTexSubImage2D(GL_TEXTURE_2D, upload.level, 0, upload.y, upload.width, upload.rows, GL_BGRA, GL_UNSIGNED_BYTE, (void*) (uintptr_t) upload.region->offset);
+				if (upload.lastOfLevel){
+					// Levels arrive smallest first, so everything from here down is there now
+					glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_LOD, upload.level);
+					finestLevels[upload.texture] = upload.level;
+					completed.push_back({upload.texture, upload.level});
+				}
+			}
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			fences.push_back({frame, glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0)});
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				for (const Upload& upload : ready){
+					upload.region->frame = frame;
+				}
+			}
+			frame++;
+			return completed;
+		}
+
+		// Whether anything is still waiting to be built, copied or uploaded
+		bool busy(){
+			std::lock_guard<std::mutex> lock(mutex);
+			return !requests.empty() || !uploads.empty() || busyWorkers > 0;
+		}
+
+		// Uploads everything that's left without a budget, waiting for the workers. For benchmarks and tests.
+		void finish(std::vector<StreamedLevel>& finished){
+			while (busy()){
+				const std::vector<StreamedLevel>& levels = update(SIZE_MAX);
+				finished.insert(finished.end(), levels.begin(), levels.end());
+				glFinish();
+				std::this_thread::yield();
+			}
+		}
+};
+
+TextureStreamer textureStreamer;
+
+// Memory a mesh (or the whole scene) is using, from memoryUsage()
+struct MemoryUsage{
+	size_t cpuBytes = 0;	// On the heap
+	size_t mappedBytes = 0;	// Memory-mapped files (bakes and BMP files used as they are)
+	size_t gpuBytes = 0;	// Buffers and textures
+
+	MemoryUsage& operator+=(const MemoryUsage& other){
+		cpuBytes += other.cpuBytes;
+		mappedBytes += other.mappedBytes;
+		gpuBytes += other.gpuBytes;
+		return *this;
+	}
+};
+
+// Bytes in the first levels mip levels of an RGBA8 texture, layers deep
+size_t textureBytes(unsigned int width, unsigned int height, int levels, size_t layers = 1){
+	size_t bytes = 0;
+	for (int level = 0; level < levels; level++){
+		bytes += (size_t) std::max(1u, width >> level) * std::max(1u, height >> level) * 4 * layers;
+	}
+	return bytes;
+}
+
+// The process's resident set size from /proc/self/statm, or 0 if that can't be read (on anything but Linux)
+size_t residentBytes(){
+	FILE* file = fopen("/proc/self/statm", "r");
+	if (!file){
+		return 0;
+	}
+	unsigned long long totalPages = 0, residentPages = 0;
+	int numRead = fscanf(file, "%llu %llu", &totalPages, &residentPages);
+	fclose(file);
+	return numRead == 2 ? residentPages * sysconf(_SC_PAGESIZE) : 0;
+}
+
+class TexturedMesh {	
+		std::string PLYPath, texturePath;
+		MeshData mesh;
+		GLBuffer vertexVBO, vertexIndicesVBO;
+		GLTexture textureObj, lightmapObj;
+		GLVertexArray meshVAO;
+		// Shared by every mesh and owned by shaderPrograms
+		GLuint programID, discardProgramID;
+		GLint matrixID, discardMatrixID, ditherRangeID, alphaCutoffID;
+		AlphaMode alphaMode;
+		PackedVertexLayout vertexLayout;
+		size_t numIndices, numVertices;
+		// Index ranges of the mesh and its simplified versions. lods[0] is the mesh as loaded.
+		std::vector<MeshLOD> lods;
+		int textureLevels;
+		// Width and height of the lightmap, which is 1 for meshes that don't have one
+		int lightmapSize;
+		// Bounding boxes of the whole mesh and of its clusters, for culling
+		AABB bounds;
+		std::vector<DrawCluster> clusters;
+		// Profiler zone name for drawing this mesh
+		std::string drawZoneName;
+		// Turns the stored (possibly quantized) positions back into model space
+		glm::mat4 positionTransform;
+		
+		// The decoded texture, kept for the streamer (or until releaseCPUData). Baked meshes use the mip levels in
+		// mesh's mapping instead.
+		Image texture;
+		unsigned int textureWidth, textureHeight;
+
+	public:
+		
+		TexturedMesh(std::string ply_path, std::string tex_path){
+			MeshAsset asset;
+			asset.PLYPath = ply_path;
+			asset.texturePath = tex_path;
+			loadMeshAsset(asset);
+			upload(asset);
+		}
+
+		// Takes over an asset that has already been decoded (see loadMeshesParallel), so only the GL work is left
+		TexturedMesh(MeshAsset&& asset){
+			upload(asset);
+		}
+
+	private:
+
+		// Takes over the asset's CPU data, and works out everything about the mesh that doesn't need GL
+		void takeAsset(MeshAsset& asset){
+			drawZoneName = "draw " + asset.PLYPath;
+			PLYPath = asset.PLYPath;
+			texturePath = asset.texturePath;
+			mesh = std::move(asset.mesh);
+			texture = std::move(asset.texture);
+			textureWidth = asset.textureWidth;
+			textureHeight = asset.textureHeight;
+			alphaMode = asset.alphaMode;
+
+			const PackedMesh& packed = asset.packed;
+			vertexLayout = packed.layout;
+			numIndices = packed.numIndices;
+			lods = packed.lods;
+			if (lods.empty()){
+				// The PLY file didn't load, so there's nothing to draw (and no layout, so no stride either)
+				lods.push_back({0, 0, 0.0f, 0});
+			}
+			numVertices = vertexLayout.stride != 0 ? packed.vertexBytesSize() / vertexLayout.stride : 0;
+			clusters = buildDrawClusters(mesh, asset.oneSided);
+			bounds = AABB();
+			for (const DrawCluster& cluster : clusters){
+				bounds.expand(cluster.bounds);
+			}
+			positionTransform = glm::scale(
+				glm::translate(glm::mat4(1.0f), glm::vec3(vertexLayout.boundsMin[0], vertexLayout.boundsMin[1], vertexLayout.boundsMin[2])),
+				glm::vec3(vertexLayout.boundsScale[0], vertexLayout.boundsScale[1], vertexLayout.boundsScale[2])
+			);
+		}
+
+		// Creates all of the GL objects for the mesh from a decoded asset. Must be called on the GL context's thread.
+		void upload(MeshAsset& asset){
+			ProfileZone zone("upload " + asset.PLYPath, true);
+			takeAsset(asset);
+			createGeometry(asset.packed);
+
+			// Get the shader program. Every mesh uses the same sources, so they all share one program.
+			programID = shaderPrograms.get(MESH_VERTEX_SHADER, MESH_FRAGMENT_SHADER);
+			matrixID = shaderPrograms.uniformLocation(programID, "MVP");
+			discardProgramID = shaderPrograms.get(MESH_VERTEX_SHADER, MESH_DISCARD_FRAGMENT_SHADER);
+			discardMatrixID = shaderPrograms.uniformLocation(discardProgramID, "MVP");
+			ditherRangeID = shaderPrograms.uniformLocation(discardProgramID, "ditherRange");
+			alphaCutoffID = shaderPrograms.uniformLocation(discardProgramID, "alphaCutoff");
+			// Samplers start out on unit 0, which is the texture's, so point the lightmap at unit 1
+			for (GLuint program : {programID, discardProgramID}){
+				glUseProgram(program);
+				glUniform1i(shaderPrograms.uniformLocation(program, "lightmap"), 1);
+			}
+
+			createTexture(asset);
+			createLightmap(asset.lightmap);
+			glState.invalidate();
+		}
+
+		// Makes a new VAO and vertex and index buffers for packed
+		void createGeometry(const PackedMesh& packed){
+			glBindVertexArray(meshVAO.create());
+
+			// Vertices: one interleaved buffer in the compact format from packMesh
+			glBindBuffer(GL_ARRAY_BUFFER, vertexVBO.create());
+			glBufferData(GL_ARRAY_BUFFER, packed.vertexBytesSize(), packed.vertexBytes(), GL_STATIC_DRAW);
+
+			// Positions
+			GLenum positionType = GL_FLOAT;
+			if (vertexLayout.positionFormat == POSITION_HALF){
+				positionType = GL_HALF_FLOAT;
+			}
+			else if (vertexLayout.positionFormat == POSITION_UNORM16){
+				positionType = GL_UNSIGNED_SHORT;
+			}
+			glEnableVertexAttribArray(0);
+			glVertexAttribPointer(
+				0,
+				3,
+				positionType,
+				vertexLayout.positionFormat == POSITION_UNORM16 ? GL_TRUE : GL_FALSE,
+				vertexLayout.stride,
+				(void*) (uintptr_t) vertexLayout.positionOffset
+			);
+
+			// Texture coordinates
+			glEnableVertexAttribArray(1);
+			glVertexAttribPointer(
+				1,
+				2,
+				vertexLayout.uvNormalized ? GL_UNSIGNED_SHORT : GL_HALF_FLOAT,
+				vertexLayout.uvNormalized ? GL_TRUE : GL_FALSE,
+				vertexLayout.stride,
+				(void*) (uintptr_t) vertexLayout.uvOffset
+			);
+
+			// Normals, if the shader wants them
+			if (vertexLayout.hasNormals){
+				glEnableVertexAttribArray(2);
+				glVertexAttribPointer(
+					2,
+					2,
+					GL_SHORT,
+					GL_TRUE,
+					vertexLayout.stride,
+					(void*) (uintptr_t) vertexLayout.normalOffset
+				);
+			}
+
+			// Lightmap coordinates. Without them the attribute reads as (0, 0), which is fine for the 1x1 lightmap.
+			if (vertexLayout.hasLightmap){
+				glEnableVertexAttribArray(9);
+				glVertexAttribPointer(
+					9,
+					2,
+					GL_UNSIGNED_SHORT,
+					GL_TRUE,
+					vertexLayout.stride,
+					(void*) (uintptr_t) vertexLayout.lightmapOffset
+				);
+			}
+
+			// Face vertex indices
+			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, vertexIndicesVBO.create());
+			glBufferData(GL_ELEMENT_ARRAY_BUFFER, packed.indexBytesSize(), packed.indexBytes(), GL_STATIC_DRAW);
+
+			glBindVertexArray(0);
+		}
+
+		// Makes a new texture object for the asset's texture, streaming its levels in if the streamer is running
+		void createTexture(const MeshAsset& asset){
+			glBindTexture(GL_TEXTURE_2D, textureObj.create());
+			bool hasPixels = !texture.empty() || !asset.mipLevels.empty();
+			if (hasPixels && textureStreamer.start()){
+				// Make room for every level now but leave filling them to the streamer. Until the first real level
+				// arrives, the smallest level is a grey placeholder and nothing finer gets sampled.
+				textureLevels = textureLevelCount(asset);
+				glTexStorage2D(GL_TEXTURE_2D, textureLevels, GL_RGBA8, textureWidth, textureHeight);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, textureLevels - 1);
+				glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_LOD, textureLevels - 1);
+				const unsigned char PLACEHOLDER[4] = {128, 128, 128, 255};
+				glTexSubImage2D(GL_TEXTURE_2D, textureLevels - 1, 0, 0, 1, 1, GL_BGRA, GL_UNSIGNED_BYTE, PLACEHOLDER);
+				textureStreamer.stream(textureObj.get(), textureWidth, textureHeight, textureLevels, asset.mipLevels, texture.data());
+			}
+			else if (!asset.mipLevels.empty()){
+				// Baked assets already have every mip level, straight from the mapped file
+				for (size_t i = 0; i < asset.mipLevels.size(); i++){
+					glTexImage2D(
+						GL_TEXTURE_2D,
+						i,
+						GL_RGBA8,
+						asset.mipLevels[i].width,
+						asset.mipLevels[i].height,
+						0,
+						GL_BGRA,
+						GL_UNSIGNED_BYTE,
+						asset.mipLevels[i].data
+					);
+				}
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, asset.mipLevels.size() - 1);
+				textureLevels = asset.mipLevels.size();
+			}
+			else{
+				glTexImage2D(
+					GL_TEXTURE_2D,
+					0,
+					GL_RGBA8,
+					textureWidth,
+					textureHeight,
+					0,
+					GL_BGRA,
+					GL_UNSIGNED_BYTE,
+					texture.data()
+				);
+				glGenerateMipmap(GL_TEXTURE_2D);
+				textureLevels = 1;
+				for (unsigned int size = std::max(textureWidth, textureHeight); size > 1; size /= 2){
+					textureLevels++;
+				}
+			}
+		}
+
+		/*
+			Makes a new lightmap texture
+			The lightmap is smooth, so it only gets one level. Meshes without one get a single texel that leaves the
+			texture alone, so every mesh can use the same shaders.
+		*/
+		void createLightmap(const Lightmap& lightmap){
+			const unsigned char UNLIT[4] = {128, 128, 128, 255};
+			lightmapSize = lightmap.loaded() ? lightmap.header.size : 1;
+			glBindTexture(GL_TEXTURE_2D, lightmapObj.create());
+			glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, lightmapSize, lightmapSize);
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, lightmapSize, lightmapSize, GL_BGRA, GL_UNSIGNED_BYTE,
+				lightmap.loaded() ? lightmap.pixels : UNLIT);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+			glBindTexture(GL_TEXTURE_2D, 0);
+		}
+
+		// Whether two layouts put the same attributes in the same places, so one VAO works for both
+		static bool sameVertexFormat(const PackedVertexLayout& a, const PackedVertexLayout& b){
+			return a.stride == b.stride && a.positionFormat == b.positionFormat && a.positionOffset == b.positionOffset
+				&& a.uvOffset == b.uvOffset && a.uvNormalized == b.uvNormalized && a.hasNormals == b.hasNormals
+				&& a.normalOffset == b.normalOffset && a.hasLightmap == b.hasLightmap && a.lightmapOffset == b.lightmapOffset
+				&& a.indexType == b.indexType;
+		}
+
+		// How many mip levels createTexture gives an asset's texture
+		static int textureLevelCount(const MeshAsset& asset){
+			if (!asset.mipLevels.empty()){
+				return std::min<int>(asset.mipLevels.size(), BAKE_MAX_MIP_LEVELS);
+			}
+			int levels = 1;
+			for (unsigned int size = std::max(asset.textureWidth, asset.textureHeight); size > 1; size /= 2){
+				levels++;
+			}
+			return std::min(levels, BAKE_MAX_MIP_LEVELS);
+		}
+
+	public:
+
+		/*
+			Replaces the mesh with a newly decoded version of its files, for hot reloading
+			Buffers and textures that are still the same size (and vertex format) are refilled in place with
+			glBufferSubData and glTexSubImage2D, so their objects stay the same. Anything else gets new objects, like
+			upload() makes. Don't call it while the streamer is busy, since it could still be filling the old texture.
+			Returns true if every object was kept, so renderers that copied them (BatchedScene) can copy the new
+			contents into the same places
+		*/
+		bool reload(MeshAsset& asset){
+			ProfileZone zone("reload " + asset.PLYPath, true);
+			PackedVertexLayout oldLayout = vertexLayout;
+			size_t oldVertexBytes = numVertices * vertexLayout.stride, oldIndices = numIndices;
+			unsigned int oldWidth = textureWidth, oldHeight = textureHeight;
+			takeAsset(asset);
+
+			const PackedMesh& packed = asset.packed;
+			bool sameGeometry = sameVertexFormat(oldLayout, vertexLayout) && packed.vertexBytesSize() == oldVertexBytes
+				&& numIndices == oldIndices;
+			if (sameGeometry){
+				glBindBuffer(GL_COPY_WRITE_BUFFER, vertexVBO.get());
+				glBufferSubData(GL_COPY_WRITE_BUFFER, 0, packed.vertexBytesSize(), packed.vertexBytes());
+				glBindBuffer(GL_COPY_WRITE_BUFFER, vertexIndicesVBO.get());
+				glBufferSubData(GL_COPY_WRITE_BUFFER, 0, packed.indexBytesSize(), packed.indexBytes());
+				glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+			}
+			else{
+				createGeometry(packed);
+			}
+
+			bool hasPixels = !texture.empty() || !asset.mipLevels.empty();
+			bool sameTexture = hasPixels && textureWidth == oldWidth && textureHeight == oldHeight
+				&& textureLevelCount(asset) == textureLevels;
+			if (sameTexture){
+				glBindTexture(GL_TEXTURE_2D, textureObj.get());
+				if (!asset.mipLevels.empty()){
+					for (int i = 0; i < textureLevels; i++){
+						const TextureLevel& level = asset.mipLevels[i];
+						glTexSubImage2D(GL_TEXTURE_2D, i, 0, 0, level.width, level.height, GL_BGRA, GL_UNSIGNED_BYTE, level.data);
+					}
+				}
+				else if (textureStreamer.start()){
+					// The streamer builds the levels with buildMipLevels, so do the same to get the same texture
+					std::vector<std::vector<unsigned char>> levels;
+					std::vector<glm::ivec2> sizes;
+					buildMipLevels(texture.data(), textureWidth, textureHeight, levels, sizes);
+					for (int i = 0; i < textureLevels && i < (int) levels.size(); i++){
+						glTexSubImage2D(GL_TEXTURE_2D, i, 0, 0, sizes[i].x, sizes[i].y, GL_BGRA, GL_UNSIGNED_BYTE, levels[i].data());
+					}
+				}
+				else{
+					glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, textureWidth, textureHeight, GL_BGRA, GL_UNSIGNED_BYTE, texture.data());
+					glGenerateMipmap(GL_TEXTURE_2D);
+				}
+				glBindTexture(GL_TEXTURE_2D, 0);
+			}
+			else{
+				createTexture(asset);
+			}
+
+			int newLightmapSize = asset.lightmap.loaded() ? asset.lightmap.header.size : 1;
+			bool sameLightmap = newLightmapSize == lightmapSize;
+			if (sameLightmap){
+				const unsigned char UNLIT[4] = {128, 128, 128, 255};
+				glBindTexture(GL_TEXTURE_2D, lightmapObj.get());
+				glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, lightmapSize, lightmapSize, GL_BGRA, GL_UNSIGNED_BYTE,
+					asset.lightmap.loaded() ? asset.lightmap.pixels : UNLIT);
+				glBindTexture(GL_TEXTURE_2D, 0);
+			}
+			else{
+				createLightmap(asset.lightmap);
+			}
+			glState.invalidate();
+			return sameGeometry && sameTexture && sameLightmap;
+		}
+
+	private:
+
+		/*
+			Sets up the texture and lightmap, blending, depth writes, shader and VAO for drawing
+			Goes through glState, so anything the previous draw already set up isn't set again. Nothing gets unbound
+			afterwards for the same reason. Only blended meshes get blending, and they don't write depth. Alpha-tested
+			meshes and a range other than [0, 1) pick the discard program (see DrawRange).
+		*/
+		void bindForDraw(const glm::mat4& mvp, float ditherMin = 0.0f, float ditherMax = 1.0f){
+			bool dithered = ditherMin > 0.0f || ditherMax < 1.0f;
+			bool discards = usesDiscard(dithered);
+			bool blended = alphaMode == ALPHA_BLENDED;
+			glState.bindTexture(GL_TEXTURE_2D, textureObj.get());
+			glState.bindTexture(GL_TEXTURE_2D, lightmapObj.get(), 1);
+			glState.setBlend(blended);
+			glState.blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+			glState.setDepthWrite(!blended);
+			glState.useProgram(discards ? discardProgramID : programID);
+			glState.bindVertexArray(meshVAO.get());
+
+			// The MVP matrix is different for every mesh since it includes positionTransform
+			glm::mat4 meshMVP = mvp * positionTransform;
+			glUniformMatrix4fv(discards ? discardMatrixID : matrixID, 1, GL_FALSE, &meshMVP[0][0]);
+			if (discards){
+				glUniform2f(ditherRangeID, ditherMin, ditherMax);
+				glUniform1f(alphaCutoffID, alphaMode == ALPHA_TESTED ? ALPHA_TEST_CUTOFF : 0.0f);
+			}
+		}
+
+		bool usesDiscard(bool dithered) const{
+			return dithered || alphaMode == ALPHA_TESTED;
+		}
+
+	public:
+
+		void draw(glm::mat4 mvp){			
+			ProfileZone zone(drawZoneName, true);
+			bindForDraw(mvp);
+			glDrawElements(
+				GL_TRIANGLES,
+				lods[0].numIndices,
+				vertexLayout.indexType,
+				(void*) 0
+			);
+			frameCounters.drawCalls++;
+			frameCounters.triangles += lods[0].numIndices / 3;
+		}
+
+		/*
+			Draws only some ranges of the mesh's triangles (like the clusters that survived culling, or a LOD), in one
+			call. The ranges must all have the same dither range.
+		*/
+		void drawRanges(glm::mat4 mvp, const DrawRange* ranges, size_t numRanges){
+			size_t indexSize = vertexLayout.indexType == GL_UNSIGNED_SHORT ? sizeof(uint16_t) : sizeof(uint32_t);
+			std::vector<GLsizei> counts(numRanges);
+			std::vector<const void*> offsets(numRanges);
+			for (size_t i = 0; i < numRanges; i++){
+				counts[i] = ranges[i].numTriangles * 3;
+				offsets[i] = (const void*) (uintptr_t) (ranges[i].firstTriangle * 3 * indexSize);
+				frameCounters.triangles += ranges[i].numTriangles;
+			}
+			ProfileZone zone(drawZoneName, true);
+			bindForDraw(mvp, ranges[0].ditherMin, ranges[0].ditherMax);
+			glMultiDrawElements(GL_TRIANGLES, counts.data(), vertexLayout.indexType, offsets.data(), numRanges);
+			frameCounters.drawCalls++;
+		}
+
+		/*
+			Frees the CPU copies of the vertices, faces and texels, and the files mapped for them, for GPU_RESIDENT
+			Only call this once the texture has finished streaming in, since the streamer reads the texels.
+			getMeshData() is empty afterwards.
+		*/
+		void releaseCPUData(){
+			mesh = MeshData();
+			texture.release();
+		}
+
+		/*
+			How much memory the mesh is using: its CPU copies (heap and mapped), and its buffers and textures on the GPU,
+			counting every mip level. Renderers that copy the buffers and textures (BatchedScene) count their copies
+			themselves.
+		*/
+		MemoryUsage memoryUsage() const{
+			MemoryUsage usage;
+			usage.cpuBytes = mesh.vertices.capacity() * sizeof(VertexData) + mesh.faces.capacity() * sizeof(TriData)
+				+ mesh.lightmapUVs.capacity() * sizeof(glm::vec2) + texture.pixels.capacity() + clusters.capacity() * sizeof(DrawCluster);
+			usage.mappedBytes = mesh.mapping.size + texture.mapping.size;
+			size_t indexSize = vertexLayout.indexType == GL_UNSIGNED_SHORT ? sizeof(uint16_t) : sizeof(uint32_t);
+			usage.gpuBytes = numVertices * vertexLayout.stride + numIndices * indexSize
+				+ textureBytes(textureWidth, textureHeight, textureLevels) + textureBytes(lightmapSize, lightmapSize, 1);
+			return usage;
+		}
+
+		const std::string& getPLYPath() const { return PLYPath; }
+		const AABB& getBounds() const { return bounds; }
+		const std::vector<DrawCluster>& getClusters() const { return clusters; }
+		// The vertices and faces as loaded, for CPU work like ray queries (see TriangleBVH). Empty after releaseCPUData().
+		const MeshData& getMeshData() const { return mesh; }
+
+		// GL objects and sizes, for renderers that draw meshes without calling draw() (see BatchedScene)
+		GLuint getVertexBuffer() const { return vertexVBO.get(); }
+		GLuint getIndexBuffer() const { return vertexIndicesVBO.get(); }
+		GLuint getTexture() const { return textureObj.get(); }
+		GLuint getLightmap() const { return lightmapObj.get(); }
+		int getLightmapSize() const { return lightmapSize; }
+		GLuint getProgram(bool dithered = false) const { return usesDiscard(dithered) ? discardProgramID : programID; }
+		GLuint getVertexArray() const { return meshVAO.get(); }
+		const PackedVertexLayout& getVertexLayout() const { return vertexLayout; }
+		// Indices of every LOD together, which is how big the index buffer is
+		size_t getIndexCount() const { return numIndices; }
+		const std::vector<MeshLOD>& getLODs() const { return lods; }
+		size_t getVertexCount() const { return numVertices; }
+		unsigned int getTextureWidth() const { return textureWidth; }
+		unsigned int getTextureHeight() const { return textureHeight; }
+		int getTextureLevels() const { return textureLevels; }
+		AlphaMode getAlphaMode() const { return alphaMode; }
+};
+
+/*
+	Collects the draws for a frame and issues them sorted by a 64-bit key, so meshes that share a program are drawn
+	back to back and glState can skip setting them again, opaque meshes go front to back so the depth test throws
+	away as much as possible, and blended meshes go last and back to front so they blend over the right things
+	Key layout, most significant first: 4 bits of pass (the mesh's AlphaMode, so opaque, then alpha-tested, then
+	blended), then for the first two passes 16 bits each of program, distance and texture, and for the blended pass
+	16 bits of inverted distance before program and texture. Last come 12 bits of submission order so equal keys keep
+	the order they were added in. Every mesh has its own VAO, so the texture stands in for that too. IDs past 16 bits
+	only make the sort less effective, never wrong.
+*/
+class RenderQueue{
+		struct Item{
+			uint64_t key;
+			TexturedMesh* mesh;
+			// Empty range list means the whole mesh
+			const DrawRange* ranges;
+			size_t numRanges;
+		};
+
+		std::vector<Item> items;
+
+	public:
+
+		// Distances are clamped to this for the key, which is plenty for one room
+		static constexpr float SORT_DISTANCE_RANGE = 100.0f;
+
+		static uint64_t sortKey(unsigned int pass, GLuint program, GLuint texture, float distance, size_t order){
+			uint64_t depth = (uint64_t) (glm::clamp(distance / SORT_DISTANCE_RANGE, 0.0f, 1.0f) * 0xFFFF);
+			uint64_t key = ((uint64_t) (pass & 0xF) << 60) | (uint64_t) (std::min(order, (size_t) 0xFFF));
+			if (pass == ALPHA_BLENDED){
+				return key
+					| ((0xFFFF - depth) << 44)
+					| ((uint64_t) (program & 0xFFFF) << 28)
+					| ((uint64_t) (texture & 0xFFFF) << 12);
+			}
+			return key
+				| ((uint64_t) (program & 0xFFFF) << 44)
+				| (depth << 28)
+				| ((uint64_t) (texture & 0xFFFF) << 12);
+		}
+
+		/*
+			Adds a whole mesh, or only some ranges of it. The ranges have to stay alive until flush().
+			distance is how far the mesh is from the camera (see drawOrderDistance).
+		*/
+		void push(TexturedMesh& mesh, float distance, const DrawRange* ranges = nullptr, size_t numRanges = 0){
+			bool dithered = numRanges > 0 && ranges[0].dithered();
+			uint64_t key = sortKey(mesh.getAlphaMode(), mesh.getProgram(dithered), mesh.getTexture(), distance, items.size());
+			items.push_back({key, &mesh, ranges, numRanges});
+		}
+
+		// Draws everything in key order and empties the queue
+		void flush(const glm::mat4& mvp){
+			std::sort(items.begin(), items.end(), [](const Item& a, const Item& b){
+				return a.key < b.key;
+			});
+			for (const Item& item : items){
+				if (item.numRanges > 0){
+					item.mesh->drawRanges(mvp, item.ranges, item.numRanges);
+				}
+				else{
+					item.mesh->draw(mvp);
+				}
+			}
+			glState.setDepthWrite(true);
+			items.clear();
+		}
+};
+
+// Counters from the last SceneBVH::cull (and OcclusionCuller::filter)
+struct CullStats{
+	// BVH nodes looked at, meshes/clusters skipped, and meshes/clusters that will be drawn
+	size_t nodesVisited, culled, drawn;
+	// Meshes in the frustum that were left out because they're hidden
+	size_t occluded;
+	// Clusters in the frustum that were left out because they face away from the camera
+	size_t backfacing;
+};
+
+/*
+	Bounding volume hierarchy over every mesh in the scene, for view frustum and normal cone culling
+	The leaves hold clusters (see DrawCluster), so a big mesh that's only partly on screen only has its visible
+	clusters drawn. Nodes are split at the median of their longest axis until they have LEAF_SIZE items or fewer.
+	Each node covers a contiguous range of the item list, and of the leaves' groups of items.
+	The meshes must not move after the BVH is built.
+*/
+class SceneBVH{
+		struct Item{
+			int mesh;
+			DrawCluster cluster;
+		};
+
+		/*
+			The items of one leaf, stored as separate arrays of each value so all 8 can be tested at once
+			Lanes past numItems are left zeroed and never used.
+		*/
+		struct alignas(32) ItemGroup{
+			float minX[8], minY[8], minZ[8], maxX[8], maxY[8], maxZ[8];
+			float centreX[8], centreY[8], centreZ[8], radius[8];
+			float axisX[8], axisY[8], axisZ[8], cutoff[8];
+			size_t firstItem, numItems;
+		};
+
+		struct Node{
+			AABB bounds;
+			// Children are only used by inner nodes. Items and groups are used by both, since inner nodes cover all
+			// their children's.
+			int left, right;
+			size_t firstItem, numItems;
+			size_t firstGroup, numGroups;
+		};
+
+		// A leaf is one ItemGroup
+		static const size_t LEAF_SIZE = 8;
+
+		std::vector<Item> items;
+		std::vector<ItemGroup> groups;
+		std::vector<Node> nodes;
+
+		int build(size_t first, size_t count){
+			Node node;
+			node.firstItem = first;
+			node.numItems = count;
+			node.left = node.right = -1;
+			node.firstGroup = groups.size();
+			AABB centres;
+			for (size_t i = first; i < first + count; i++){
+				node.bounds.expand(items[i].cluster.bounds);
+				centres.expand(items[i].cluster.bounds.centre());
+			}
+			int index = nodes.size();
+			nodes.push_back(node);
+			if (count <= LEAF_SIZE){
+				addGroup(first, count);
+				nodes[index].numGroups = 1;
+				return index;
+			}
+
+			glm::vec3 extent = centres.max - centres.min;
+			int axis = 0;
+			if (extent.y > extent[axis]){
+				axis = 1;
+			}
+			if (extent.z > extent[axis]){
+				axis = 2;
+			}
+			size_t half = count / 2;
+			std::nth_element(items.begin() + first, items.begin() + first + half, items.begin() + first + count,
+				[axis](const Item& a, const Item& b){
+					return a.cluster.bounds.centre()[axis] < b.cluster.bounds.centre()[axis];
+				});
+			int left = build(first, half);
+			int right = build(first + half, count - half);
+			nodes[index].left = left;
+			nodes[index].right = right;
+			nodes[index].numGroups = groups.size() - nodes[index].firstGroup;
+			return index;
+		}
+
+		void addGroup(size_t first, size_t count){
+			ItemGroup group = {};
+			group.firstItem = first;
+			group.numItems = count;
+			for (size_t i = 0; i < count; i++){
+				const DrawCluster& cluster = items[first + i].cluster;
+				group.minX[i] = cluster.bounds.min.x;
+				group.minY[i] = cluster.bounds.min.y;
+				group.minZ[i] = cluster.bounds.min.z;
+				group.maxX[i] = cluster.bounds.max.x;
+				group.maxY[i] = cluster.bounds.max.y;
+				group.maxZ[i] = cluster.bounds.max.z;
+				group.centreX[i] = cluster.centre.x;
+				group.centreY[i] = cluster.centre.y;
+				group.centreZ[i] = cluster.centre.z;
+				group.radius[i] = cluster.radius;
+				group.axisX[i] = cluster.coneAxis.x;
+				group.axisY[i] = cluster.coneAxis.y;
+				group.axisZ[i] = cluster.coneAxis.z;
+				group.cutoff[i] = cluster.coneCutoff;
+			}
+			groups.push_back(group);
+		}
+
+		/*
+			Tests every item in a group against the frustum (unless the group's node is already known to be inside
+			it) and against its normal cone (with CONE_CULLING)
+			inFrustum gets a bit set for each item that's at least partly in the frustum, and visible a bit for each
+			of those that doesn't face away from the camera.
+		*/
+		static void testGroup(const ItemGroup& group, const Frustum& frustum, bool testFrustum, const glm::vec3& camera,
+				unsigned int& inFrustum, unsigned int& visible){
+			unsigned int used = (1u << group.numItems) - 1;
+			inFrustum = used;
+			visible = used;
+#ifdef __AVX2__
+			if (testFrustum){
+				// Outside if the box corner furthest along any plane's normal is still behind it
+				__m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+				for (const glm::vec4& plane : frustum.planes){
+					__m256 x = _mm256_load_ps(plane.x >= 0 ? group.maxX : group.minX);
+					__m256 y = _mm256_load_ps(plane.y >= 0 ? group.maxY : group.minY);
+					__m256 z = _mm256_load_ps(plane.z >= 0 ? group.maxZ : group.minZ);
+					__m256 distance = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(plane.x)), _mm256_mul_ps(y, _mm256_set1_ps(plane.y))),
+						_mm256_add_ps(_mm256_mul_ps(z, _mm256_set1_ps(plane.z)), _mm256_set1_ps(plane.w)));
+					inside = _mm256_and_ps(inside, _mm256_cmp_ps(distance, _mm256_setzero_ps(), _CMP_GE_OQ));
+				}
+				inFrustum &= _mm256_movemask_ps(inside);
+				visible = inFrustum;
+			}
+			if (CONE_CULLING){
+				__m256 x = _mm256_sub_ps(_mm256_load_ps(group.centreX), _mm256_set1_ps(camera.x));
+				__m256 y = _mm256_sub_ps(_mm256_load_ps(group.centreY), _mm256_set1_ps(camera.y));
+				__m256 z = _mm256_sub_ps(_mm256_load_ps(group.centreZ), _mm256_set1_ps(camera.z));
+				__m256 distance = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y)), _mm256_mul_ps(z, z)));
+				__m256 along = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, _mm256_load_ps(group.axisX)), _mm256_mul_ps(y, _mm256_load_ps(group.axisY))),
+					_mm256_mul_ps(z, _mm256_load_ps(group.axisZ)));
+				__m256 limit = _mm256_add_ps(_mm256_mul_ps(_mm256_load_ps(group.cutoff), distance), _mm256_load_ps(group.radius));
+				visible &= ~_mm256_movemask_ps(_mm256_cmp_ps(along, limit, _CMP_GE_OQ));
+			}
+#else
+			for (size_t i = 0; i < group.numItems; i++){
+				if (testFrustum){
+					for (const glm::vec4& plane : frustum.planes){
+						float x = plane.x >= 0 ? group.maxX[i] : group.minX[i];
+						float y = plane.y >= 0 ? group.maxY[i] : group.minY[i];
+						float z = plane.z >= 0 ? group.maxZ[i] : group.minZ[i];
+						if (plane.x * x + plane.y * y + plane.z * z + plane.w < 0){
+							inFrustum &= ~(1u << i);
+							visible &= ~(1u << i);
+							break;
+						}
+					}
+				}
+				if (CONE_CULLING){
+					glm::vec3 offset = glm::vec3(group.centreX[i], group.centreY[i], group.centreZ[i]) - camera;
+					glm::vec3 axis(group.axisX[i], group.axisY[i], group.axisZ[i]);
+					if (glm::dot(offset, axis) >= group.cutoff[i] * glm::length(offset) + group.radius[i]){
+						visible &= ~(1u << i);
+					}
+				}
+			}
+#endif
+		}
+
+	public:
+
+		// With onlyBlended, the other meshes are left out (for GPUCuller, which draws those itself)
+		SceneBVH(const std::vector<TexturedMesh>& meshes, bool onlyBlended = false){
+			for (size_t i = 0; i < meshes.size(); i++){
+				if (onlyBlended && meshes[i].getAlphaMode() != ALPHA_BLENDED){
+					continue;
+				}
+				// Cluster bounds are in the mesh's own coordinates, which is also world space here
+				for (const DrawCluster& cluster : meshes[i].getClusters()){
+					items.push_back({(int) i, cluster});
+				}
+			}
+			if (!items.empty()){
+				build(0, items.size());
+			}
+		}
+
+		/*
+			Finds every cluster that might be visible from camera with the given projection * view matrix
+			Nodes are only tested against the frustum. Once a node is inside it, or is a leaf, its groups of items are
+			tested 8 at a time (see testGroup). Fills ranges in draw order (by mesh, then by position in the index
+			buffer) with neighbouring clusters joined into one range. Returns the counters for this call.
+		*/
+		CullStats cull(const glm::mat4& viewProjection, const glm::vec3& camera, std::vector<DrawRange>& ranges) const{
+			CullStats stats = {0, 0, 0, 0, 0};
+			ranges.clear();
+			if (nodes.empty()){
+				return stats;
+			}
+			Frustum frustum(viewProjection);
+			std::vector<DrawRange> visible;
+
+			int stack[64];
+			int stackSize = 0;
+			stack[stackSize++] = 0;
+			while (stackSize > 0){
+				const Node& node = nodes[stack[--stackSize]];
+				stats.nodesVisited++;
+				Frustum::Result result = frustum.test(node.bounds);
+				if (result == Frustum::OUTSIDE){
+					stats.culled += node.numItems;
+				}
+				else if (result == Frustum::INSIDE || node.left < 0){
+					for (size_t g = node.firstGroup; g < node.firstGroup + node.numGroups; g++){
+						const ItemGroup& group = groups[g];
+						unsigned int inFrustum, visibleItems;
+						testGroup(group, frustum, result != Frustum::INSIDE, camera, inFrustum, visibleItems);
+						stats.culled += group.numItems - __builtin_popcount(inFrustum);
+						stats.backfacing += __builtin_popcount(inFrustum & ~visibleItems);
+						for (; visibleItems != 0; visibleItems &= visibleItems - 1){
+							const Item& item = items[group.firstItem + __builtin_ctz(visibleItems)];
+							visible.push_back({item.mesh, item.cluster.firstTriangle, item.cluster.numTriangles});
+						}
+					}
+				}
+				else{
+					stack[stackSize++] = node.right;
+					stack[stackSize++] = node.left;
+				}
+			}
+			stats.drawn = visible.size();
+
+			// Put the ranges back in draw order and join up the ones that touch
+			std::sort(visible.begin(), visible.end(), [](const DrawRange& a, const DrawRange& b){
+				return std::tie(a.mesh, a.firstTriangle) < std::tie(b.mesh, b.firstTriangle);
+			});
+			for (const DrawRange& range : visible){
+				if (!ranges.empty() && ranges.back().mesh == range.mesh
+						&& ranges.back().firstTriangle + ranges.back().numTriangles == range.firstTriangle){
+					ranges.back().numTriangles += range.numTriangles;
+				}
+				else{
+					ranges.push_back(range);
+				}
+			}
+			return stats;
+		}
+};
+
+// Shaders for BatchedScene. Per-draw values come in as instanced attributes (one "instance" per draw, picked by
+// the draw's baseInstance), which avoids needing gl_DrawID.
+const std::string BATCH_VERTEX_SHADER = "\
+#version 400 core\n\
+layout(location = 0) in vec3 vertexPosition;\n\
+layout(location = 1) in vec2 uv;\n\
+// Per draw: undoes position quantization, picks the texture array layer, and the finest mip level loaded so far\n\
+layout(location = 3) in vec3 boundsMin;\n\
+layout(location = 4) in vec3 boundsScale;\n\
+layout(location = 5) in float layer;\n\
+layout(location = 6) in float minLevel;\n\
+// Per draw: which pixels to draw while fading between LODs, and the alpha test cutoff (only read by\n\
+// BATCH_DISCARD_FRAGMENT_SHADER)\n\
+layout(location = 7) in vec2 ditherRange;\n\
+layout(location = 8) in float alphaCutoff;\n\
+layout(location = 9) in vec2 lightmapUV;\n\
+out vec2 uv_out;\n\
+out vec2 lightmapUV_out;\n\
+flat out float layer_out;\n\
+flat out float minLevel_out;\n\
+flat out vec2 ditherRange_out;\n\
+flat out float alphaCutoff_out;\n\
+uniform mat4 MVP;\n\
+void main(){ \n\
+	gl_Position =  MVP * vec4(boundsMin + vertexPosition * boundsScale, 1);\n\
+	uv_out = uv;\n\
+	lightmapUV_out = lightmapUV;\n\
+	layer_out = layer;\n\
+	minLevel_out = minLevel;\n\
+	ditherRange_out = ditherRange;\n\
+	alphaCutoff_out = alphaCutoff;\n\
+}\n";
+
+// Layers can't have their own GL_TEXTURE_MIN_LOD, so the shader clamps the mip level itself for streamed textures
+const std::string BATCH_FRAGMENT_SHADER = "\
+#version 400 core\n\
+in vec2 uv_out; \n\
+in vec2 lightmapUV_out;\n\
+flat in float layer_out;\n\
+flat in float minLevel_out;\n\
+out vec4 colour;\n\
+uniform sampler2DArray tex;\n\
+uniform sampler2DArray lightmaps;\n\
+void main() {\n\
+	float level = max(textureQueryLod(tex, uv_out).y, minLevel_out);\n\
+	colour = textureLod(tex, vec3(uv_out, layer_out), level);\n\
+	colour.rgb *= texture(lightmaps, vec3(lightmapUV_out, layer_out)).rgb * " + LIGHTMAP_SCALE_GLSL + ";\n\
+}\n";
+
+// BATCH_FRAGMENT_SHADER for draws that are alpha tested or fading between LODs
+const std::string BATCH_DISCARD_FRAGMENT_SHADER = "\
+#version 400 core\n\
+in vec2 uv_out; \n\
+in vec2 lightmapUV_out;\n\
+flat in float layer_out;\n\
+flat in float minLevel_out;\n\
+flat in vec2 ditherRange_out;\n\
+flat in float alphaCutoff_out;\n\
+out vec4 colour;\n\
+uniform sampler2DArray tex;\n\
+uniform sampler2DArray lightmaps;\n" + LOD_DITHER_FUNCTION + "\
+void main() {\n\
+	ditherLOD(ditherRange_out);\n\
+	float level = max(textureQueryLod(tex, uv_out).y, minLevel_out);\n\
+	colour = textureLod(tex, vec3(uv_out, layer_out), level);\n\
+	if (colour.a < alphaCutoff_out) discard;\n\
+	colour.rgb *= texture(lightmaps, vec3(lightmapUV_out, layer_out)).rgb * " + LIGHTMAP_SCALE_GLSL + ";\n\
+}\n";
+
+/*
+	Draws a whole list of meshes with one glMultiDrawElementsIndirect call per batch instead of one draw per mesh
+	Meshes are grouped into batches that can share everything: same vertex format and index type, and same texture
+	and lightmap sizes. Each batch gets one vertex buffer and one index buffer holding all of its meshes back to back, two
+	GL_TEXTURE_2D_ARRAYs (textures and lightmaps) with a layer per mesh, and an indirect buffer that gets the frame's
+	draw commands. Everything
+	is copied GPU-side from the meshes' own buffers and textures (glCopyBufferSubData/glCopyImageSubData). The
+	per-draw values of every batch share one buffer.
+	The number of GL calls per frame depends on how many batches and alpha passes there are, not how many meshes.
+	Needs OpenGL 4.3. Check isSupported() and fall back to TexturedMesh::draw if it's false.
+*/
+class BatchedScene{
+	public:
+
+		// Matches the layout glMultiDrawElementsIndirect reads
+		struct DrawElementsIndirectCommand{
+			GLuint count;
+			GLuint instanceCount;
+			GLuint firstIndex;
+			GLint baseVertex;
+			GLuint baseInstance;
+		};
+
+		/*
+			Per-draw values read by the vertex shader as instanced attributes
+			Each mesh has DRAW_DATA_SLOTS of these in a row, which only differ in ditherRange: one for drawing it
+			normally, one for the LOD it's fading to and one for the LOD it's fading from (see setFade). Every batch
+			reads them from the same buffer, so a draw's baseInstance picks its mesh's slots no matter which batch it's in.
+		*/
+		struct DrawData{
+			float boundsMin[3];
+			float boundsScale[3];
+			float layer;
+			float minLevel;
+			float ditherRange[2];
+			float alphaCutoff;
+		};
+		static const int DRAW_DATA_SLOTS = 3;
+
+		// Where each mesh ended up, so a DrawRange can be turned into a draw command, plus what it takes to sort it
+		struct MeshLocation{
+			size_t batch;
+			GLuint firstIndex;
+			GLint baseVertex;
+			// The mesh's layer in the batch's texture arrays, and its first DrawData slot
+			GLuint drawIndex, firstSlot;
+			AlphaMode alphaMode;
+			AABB bounds;
+			// How much room the mesh has in the batch's buffers
+			size_t numVertices, numIndices;
+		};
+
+		// Commands in a row in some indirect buffer that are drawn with one call
+		struct Run{
+			size_t batch;
+			AlphaMode pass;
+			bool discards;
+			size_t first, count;
+		};
+
+	private:
+
+		// Meshes can only share a batch if all of these match
+		struct BatchKey{
+			uint32_t stride, positionFormat, uvNormalized, indexType, hasLightmap;
+			unsigned int textureWidth, textureHeight;
+			int textureLevels, lightmapSize;
+			bool operator<(const BatchKey& other) const{
+				return std::tie(stride, positionFormat, uvNormalized, indexType, hasLightmap, textureWidth, textureHeight, textureLevels, lightmapSize)
+					< std::tie(other.stride, other.positionFormat, other.uvNormalized, other.indexType, other.hasLightmap, other.textureWidth,
+						other.textureHeight, other.textureLevels, other.lightmapSize);
+			}
+			bool operator==(const BatchKey& other) const{
+				return !(*this < other) && !(other < *this);
+			}
+		};
+
+		struct Batch{
+			BatchKey key;
+			GLVertexArray VAO;
+			GLBuffer vertexBuffer, indexBuffer;
+			GLTexture textureArray, lightmapArray;
+			// Rewritten every frame with just the visible ranges
+			GLBuffer indirectBuffer;
+			size_t indirectCapacity;
+			GLenum indexType;
+			std::string zoneName;
+			unsigned int textureWidth, textureHeight;
+		};
+
+		// A draw command waiting to be sorted into its pass
+		struct QueuedCommand{
+			AlphaMode pass;
+			float distance;
+			size_t batch;
+			bool discards;
+			DrawElementsIndirectCommand command;
+		};
+
+		std::vector<Batch> batches;
+		std::vector<MeshLocation> locations;
+		// Every mesh's DrawData slots, in the order of locations' firstSlot. The CPU copy is only kept while building.
+		GLBuffer drawDataBuffer;
+		std::vector<DrawData> drawData;
+		// Mesh texture -> mesh number, for copying streamed texture levels into the right layer
+		std::unordered_map<GLuint, int> textureMeshes;
+		// The frame's commands, sorted, then split up per batch and into runs (see draw)
+		std::vector<QueuedCommand> queued;
+		std::vector<std::vector<DrawElementsIndirectCommand>> batchCommands;
+		std::vector<Run> runs;
+		// Per mesh: the fade its dithered DrawData slots were last set up for
+		std::vector<float> fades;
+		GLuint programID = 0, discardProgramID = 0;
+		GLint matrixID = -1, discardMatrixID = -1;
+		bool supported = false;
+		// Size of every batch's buffers and texture arrays together
+		size_t gpuBytes = 0;
+
+		static BatchKey batchKey(const TexturedMesh& mesh){
+			const PackedVertexLayout& layout = mesh.getVertexLayout();
+			return {layout.stride, layout.positionFormat, layout.uvNormalized, layout.indexType, layout.hasLightmap,
+				mesh.getTextureWidth(), mesh.getTextureHeight(), mesh.getTextureLevels(), mesh.getLightmapSize()};
+		}
+
+		void buildBatch(const BatchKey& key, const std::vector<TexturedMesh>& allMeshes, const std::vector<int>& meshIndices){
+			std::vector<const TexturedMesh*> meshes;
+			for (int index : meshIndices){
+				meshes.push_back(&allMeshes[index]);
+			}
+			Batch batch;
+			batch.key = key;
+			batch.indexType = key.indexType;
+			size_t indexSize = key.indexType == GL_UNSIGNED_SHORT ? sizeof(uint16_t) : sizeof(uint32_t);
+
+			// Work out where every mesh goes in the shared buffers, and its draw command
+			std::vector<DrawElementsIndirectCommand> commands;
+			size_t totalVertices = 0, totalIndices = 0;
+			for (size_t i = 0; i < meshes.size(); i++){
+				const PackedVertexLayout& layout = meshes[i]->getVertexLayout();
+				DrawElementsIndirectCommand command;
+				command.count = meshes[i]->getLODs()[0].numIndices;
+				command.instanceCount = 1;
+				command.firstIndex = totalIndices;
+				command.baseVertex = totalVertices;
+				command.baseInstance = drawData.size();
+				commands.push_back(command);
+				locations[meshIndices[i]] = {batches.size(), command.firstIndex, command.baseVertex, (GLuint) i, command.baseInstance,
+					meshes[i]->getAlphaMode(), meshes[i]->getBounds(), meshes[i]->getVertexCount(), meshes[i]->getIndexCount()};
+
+				DrawData data;
+				for (int j = 0; j < 3; j++){
+					data.boundsMin[j] = layout.boundsMin[j];
+					data.boundsScale[j] = layout.boundsScale[j];
+				}
+				data.layer = i;
+				data.minLevel = textureStreamer.finestLevel(meshes[i]->getTexture());
+				data.ditherRange[0] = 0.0f;
+				data.ditherRange[1] = 1.0f;
+				data.alphaCutoff = meshes[i]->getAlphaMode() == ALPHA_TESTED ? ALPHA_TEST_CUTOFF : 0.0f;
+				for (int slot = 0; slot < DRAW_DATA_SLOTS; slot++){
+					drawData.push_back(data);
+				}
+				textureMeshes[meshes[i]->getTexture()] = meshIndices[i];
+
+				totalVertices += meshes[i]->getVertexCount();
+				totalIndices += meshes[i]->getIndexCount();
+			}
+
+			// Copy the geometry into the shared buffers
+			glBindBuffer(GL_COPY_WRITE_BUFFER, batch.vertexBuffer.create());
+			glBufferData(GL_COPY_WRITE_BUFFER, totalVertices * key.stride, NULL, GL_STATIC_DRAW);
+			for (size_t i = 0; i < meshes.size(); i++){
+				glBindBuffer(GL_COPY_READ_BUFFER, meshes[i]->getVertexBuffer());
+				glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, (GLintptr) commands[i].baseVertex * key.stride, meshes[i]->getVertexCount() * key.stride);
+			}
+			glBindBuffer(GL_COPY_WRITE_BUFFER, batch.indexBuffer.create());
+			glBufferData(GL_COPY_WRITE_BUFFER, totalIndices * indexSize, NULL, GL_STATIC_DRAW);
+			for (size_t i = 0; i < meshes.size(); i++){
+				glBindBuffer(GL_COPY_READ_BUFFER, meshes[i]->getIndexBuffer());
+				glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, (GLintptr) commands[i].firstIndex * indexSize, meshes[i]->getIndexCount() * indexSize);
+			}
+			glBindBuffer(GL_COPY_READ_BUFFER, 0);
+			glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+			batch.indirectCapacity = commands.size();
+			glBindBuffer(GL_DRAW_INDIRECT_BUFFER, batch.indirectBuffer.create());
+			glBufferData(GL_DRAW_INDIRECT_BUFFER, sizeof(DrawElementsIndirectCommand) * commands.size(), NULL, GL_DYNAMIC_DRAW);
+			glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+
+			// Same vertex format as TexturedMesh. The per-draw attributes are added once every batch is built (see
+			// bindDrawData).
+			glBindVertexArray(batch.VAO.create());
+			glBindBuffer(GL_ARRAY_BUFFER, batch.vertexBuffer.get());
+			GLenum positionType = GL_FLOAT;
+			if (key.positionFormat == POSITION_HALF){
+				positionType = GL_HALF_FLOAT;
+			}
+			else if (key.positionFormat == POSITION_UNORM16){
+				positionType = GL_UNSIGNED_SHORT;
+			}
+			const PackedVertexLayout& layout = meshes[0]->getVertexLayout();
+			glEnableVertexAttribArray(0);
+			glVertexAttribPointer(0, 3, positionType, key.positionFormat == POSITION_UNORM16 ? GL_TRUE : GL_FALSE, key.stride, (void*) (uintptr_t) layout.positionOffset);
+			glEnableVertexAttribArray(1);
+			glVertexAttribPointer(1, 2, key.uvNormalized ? GL_UNSIGNED_SHORT : GL_HALF_FLOAT, key.uvNormalized ? GL_TRUE : GL_FALSE, key.stride, (void*) (uintptr_t) layout.uvOffset);
+			if (key.hasLightmap){
+				glEnableVertexAttribArray(9);
+				glVertexAttribPointer(9, 2, GL_UNSIGNED_SHORT, GL_TRUE, key.stride, (void*) (uintptr_t) layout.lightmapOffset);
+			}
+
+			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, batch.indexBuffer.get());
+			glBindVertexArray(0);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+			// Copy every mip level of every mesh's texture into its own layer
+			glBindTexture(GL_TEXTURE_2D_ARRAY, batch.textureArray.create());
+			glTexStorage3D(GL_TEXTURE_2D_ARRAY, key.textureLevels, GL_RGBA8, key.textureWidth, key.textureHeight, meshes.size());
+			glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			for (size_t i = 0; i < meshes.size(); i++){
+				unsigned int width = key.textureWidth, height = key.textureHeight;
+				for (int level = 0; level < key.textureLevels; level++){
+					glCopyImageSubData(meshes[i]->getTexture(), GL_TEXTURE_2D, level, 0, 0, 0,
+						batch.textureArray.get(), GL_TEXTURE_2D_ARRAY, level, 0, 0, i, width, height, 1);
+					width = std::max(1u, width / 2);
+					height = std::max(1u, height / 2);
+				}
+			}
+
+			// And every lightmap into its own layer of the lightmap array
+			glBindTexture(GL_TEXTURE_2D_ARRAY, batch.lightmapArray.create());
+			glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, GL_RGBA8, key.lightmapSize, key.lightmapSize, meshes.size());
+			glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+			for (size_t i = 0; i < meshes.size(); i++){
+				glCopyImageSubData(meshes[i]->getLightmap(), GL_TEXTURE_2D, 0, 0, 0, 0,
+					batch.lightmapArray.get(), GL_TEXTURE_2D_ARRAY, 0, 0, 0, i, key.lightmapSize, key.lightmapSize, 1);
+			}
+			glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+			gpuBytes += totalVertices * key.stride + totalIndices * indexSize + sizeof(DrawElementsIndirectCommand) * commands.size()
+				+ textureBytes(key.textureWidth, key.textureHeight, key.textureLevels, meshes.size())
+				+ textureBytes(key.lightmapSize, key.lightmapSize, 1, meshes.size());
+			batch.zoneName = "draw batch " + std::to_string(batches.size());
+			batch.textureWidth = key.textureWidth;
+			batch.textureHeight = key.textureHeight;
+			batches.push_back(std::move(batch));
+		}
+
+		// Points a batch's per-draw attributes at drawDataBuffer
+		void bindDrawData(Batch& batch){
+			glBindVertexArray(batch.VAO.get());
+			glBindBuffer(GL_ARRAY_BUFFER, drawDataBuffer.get());
+			glEnableVertexAttribArray(3);
+			glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(DrawData), (void*) offsetof(DrawData, boundsMin));
+			glVertexAttribDivisor(3, 1);
+			glEnableVertexAttribArray(4);
+			glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, sizeof(DrawData), (void*) offsetof(DrawData, boundsScale));
+			glVertexAttribDivisor(4, 1);
+			glEnableVertexAttribArray(5);
+			glVertexAttribPointer(5, 1, GL_FLOAT, GL_FALSE, sizeof(DrawData), (void*) offsetof(DrawData, layer));
+			glVertexAttribDivisor(5, 1);
+			glEnableVertexAttribArray(6);
+			glVertexAttribPointer(6, 1, GL_FLOAT, GL_FALSE, sizeof(DrawData), (void*) offsetof(DrawData, minLevel));
+			glVertexAttribDivisor(6, 1);
+			glEnableVertexAttribArray(7);
+			glVertexAttribPointer(7, 2, GL_FLOAT, GL_FALSE, sizeof(DrawData), (void*) offsetof(DrawData, ditherRange));
+			glVertexAttribDivisor(7, 1);
+			glEnableVertexAttribArray(8);
+			glVertexAttribPointer(8, 1, GL_FLOAT, GL_FALSE, sizeof(DrawData), (void*) offsetof(DrawData, alphaCutoff));
+			glVertexAttribDivisor(8, 1);
+			glBindVertexArray(0);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+		}
+
+	public:
+
+		BatchedScene(const std::vector<TexturedMesh>& meshes){
+			supported = glewIsSupported("GL_VERSION_4_3");
+			if (!supported){
+				printf("OpenGL 4.3 isn't available, so meshes will be drawn one at a time\n");
+				return;
+			}
+			programID = shaderPrograms.get(BATCH_VERTEX_SHADER, BATCH_FRAGMENT_SHADER);
+			matrixID = shaderPrograms.uniformLocation(programID, "MVP");
+			discardProgramID = shaderPrograms.get(BATCH_VERTEX_SHADER, BATCH_DISCARD_FRAGMENT_SHADER);
+			discardMatrixID = shaderPrograms.uniformLocation(discardProgramID, "MVP");
+			for (GLuint program : {programID, discardProgramID}){
+				glUseProgram(program);
+				glUniform1i(shaderPrograms.uniformLocation(program, "lightmaps"), 1);
+			}
+
+			// Group the meshes, keeping them in their original order within each group. Texture arrays can only have
+			// so many layers, so big groups are split up.
+			GLint maxLayers = 256;
+			glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxLayers);
+			locations.resize(meshes.size());
+			std::map<BatchKey, std::vector<int>> groups;
+			std::vector<BatchKey> order;
+			for (size_t i = 0; i < meshes.size(); i++){
+				BatchKey key = batchKey(meshes[i]);
+				std::vector<int>& group = groups[key];
+				if (group.empty()){
+					order.push_back(key);
+				}
+				group.push_back(i);
+				if (group.size() == (size_t) maxLayers){
+					buildBatch(key, meshes, group);
+					group.clear();
+				}
+			}
+			for (const BatchKey& key : order){
+				if (!groups[key].empty()){
+					buildBatch(key, meshes, groups[key]);
+					groups[key].clear();
+				}
+			}
+			glBindBuffer(GL_ARRAY_BUFFER, drawDataBuffer.create());
+			glBufferData(GL_ARRAY_BUFFER, sizeof(DrawData) * drawData.size(), drawData.data(), GL_DYNAMIC_DRAW);
+			gpuBytes += sizeof(DrawData) * drawData.size();
+			drawData = std::vector<DrawData>();
+			for (Batch& batch : batches){
+				bindDrawData(batch);
+			}
+			batchCommands.resize(batches.size());
+			fades.assign(meshes.size(), -1.0f);
+			printf("Batched %zu meshes into %zu draw calls\n", meshes.size(), batches.size());
+			// Building the batches bound things behind glState's back
+			glState.invalidate();
+		}
+
+		bool isSupported() const{
+			return supported;
+		}
+
+		size_t getGPUBytes() const{
+			return gpuBytes;
+		}
+
+		const MeshLocation& getLocation(int mesh) const{
+			return locations[mesh];
+		}
+
+		// Holds every mesh's DrawData slots
+		GLuint getDrawDataBuffer() const{
+			return drawDataBuffer.get();
+		}
+
+		/*
+			Copies a mesh that TexturedMesh::reload refilled in place over its old copy in its batch
+			Returns false, changing nothing, if it doesn't fit there any more (it has a different number of vertices or
+			indices, or a different vertex format or texture size), in which case the batches need building again
+		*/
+		bool updateMesh(int index, const TexturedMesh& mesh){
+			MeshLocation& location = locations[index];
+			Batch& batch = batches[location.batch];
+			const BatchKey& key = batch.key;
+			if (!(batchKey(mesh) == key) || mesh.getVertexCount() != location.numVertices || mesh.getIndexCount() != location.numIndices){
+				return false;
+			}
+			size_t indexSize = key.indexType == GL_UNSIGNED_SHORT ? sizeof(uint16_t) : sizeof(uint32_t);
+			glBindBuffer(GL_COPY_READ_BUFFER, mesh.getVertexBuffer());
+			glBindBuffer(GL_COPY_WRITE_BUFFER, batch.vertexBuffer.get());
+			glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, (GLintptr) location.baseVertex * key.stride, location.numVertices * key.stride);
+			glBindBuffer(GL_COPY_READ_BUFFER, mesh.getIndexBuffer());
+			glBindBuffer(GL_COPY_WRITE_BUFFER, batch.indexBuffer.get());
+			glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, (GLintptr) location.firstIndex * indexSize, location.numIndices * indexSize);
+			glBindBuffer(GL_COPY_READ_BUFFER, 0);
+			glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+			unsigned int width = key.textureWidth, height = key.textureHeight;
+			for (int level = 0; level < key.textureLevels; level++){
+				glCopyImageSubData(mesh.getTexture(), GL_TEXTURE_2D, level, 0, 0, 0,
+					batch.textureArray.get(), GL_TEXTURE_2D_ARRAY, level, 0, 0, location.drawIndex, width, height, 1);
+				width = std::max(1u, width / 2);
+				height = std::max(1u, height / 2);
+			}
+			glCopyImageSubData(mesh.getLightmap(), GL_TEXTURE_2D, 0, 0, 0, 0,
+				batch.lightmapArray.get(), GL_TEXTURE_2D_ARRAY, 0, 0, 0, location.drawIndex, key.lightmapSize, key.lightmapSize, 1);
+
+			// The quantization bounds move with the vertices, and the alpha mode can change with the texture. The
+			// dither ranges stay as they are.
+			const PackedVertexLayout& layout = mesh.getVertexLayout();
+			float bounds[6] = {layout.boundsMin[0], layout.boundsMin[1], layout.boundsMin[2],
+				layout.boundsScale[0], layout.boundsScale[1], layout.boundsScale[2]};
+			float minLevel = textureStreamer.finestLevel(mesh.getTexture());
+			float alphaCutoff = mesh.getAlphaMode() == ALPHA_TESTED ? ALPHA_TEST_CUTOFF : 0.0f;
+			glBindBuffer(GL_ARRAY_BUFFER, drawDataBuffer.get());
+			for (int slot = 0; slot < DRAW_DATA_SLOTS; slot++){
+				size_t offset = sizeof(DrawData) * (location.firstSlot + slot);
+				glBufferSubData(GL_ARRAY_BUFFER, offset + offsetof(DrawData, boundsMin), sizeof(bounds), bounds);
+				glBufferSubData(GL_ARRAY_BUFFER, offset + offsetof(DrawData, minLevel), sizeof(float), &minLevel);
+				glBufferSubData(GL_ARRAY_BUFFER, offset + offsetof(DrawData, alphaCutoff), sizeof(float), &alphaCutoff);
+			}
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+			location.alphaMode = mesh.getAlphaMode();
+			location.bounds = mesh.getBounds();
+			glState.invalidate();
+			return true;
+		}
+
+		/*
+			Copies texture levels that finished streaming (from TextureStreamer::update) into the texture arrays
+			The arrays were copied from the meshes' textures when the batches were built, so any level that arrives
+			after that needs copying again. Each layer's finest usable level is raised to match.
+		*/
+		void texturesStreamed(const std::vector<StreamedLevel>& levels){
+			for (const StreamedLevel& streamed : levels){
+				std::unordered_map<GLuint, int>::const_iterator mesh = textureMeshes.find(streamed.texture);
+				if (mesh == textureMeshes.end()){
+					continue;
+				}
+				const MeshLocation& location = locations[mesh->second];
+				const Batch& batch = batches[location.batch];
+				unsigned int width = std::max(1u, batch.textureWidth >> streamed.level);
+				unsigned int height = std::max(1u, batch.textureHeight >> streamed.level);
+				glCopyImageSubData(streamed.texture, GL_TEXTURE_2D, streamed.level, 0, 0, 0,
+					batch.textureArray.get(), GL_TEXTURE_2D_ARRAY, streamed.level, 0, 0, location.drawIndex, width, height, 1);
+				float minLevel = streamed.level;
+				glBindBuffer(GL_ARRAY_BUFFER, drawDataBuffer.get());
+				for (int slot = 0; slot < DRAW_DATA_SLOTS; slot++){
+					size_t offset = sizeof(DrawData) * (location.firstSlot + slot) + offsetof(DrawData, minLevel);
+					glBufferSubData(GL_ARRAY_BUFFER, offset, sizeof(float), &minLevel);
+				}
+				glBindBuffer(GL_ARRAY_BUFFER, 0);
+			}
+		}
+
+	private:
+
+		// Sets up the state for drawing a run: blending, program, the batch's textures and its VAO
+		void bindRun(const Run& run){
+			const Batch& batch = batches[run.batch];
+			glState.setBlend(run.pass == ALPHA_BLENDED);
+			glState.setDepthWrite(run.pass != ALPHA_BLENDED);
+			glState.useProgram(run.discards ? discardProgramID : programID);
+			glState.bindTexture(GL_TEXTURE_2D_ARRAY, batch.textureArray.get());
+			glState.bindTexture(GL_TEXTURE_2D_ARRAY, batch.lightmapArray.get(), 1);
+			glState.bindVertexArray(batch.VAO.get());
+		}
+
+		// Points a mesh's dithered DrawData slots at [0, fade) for the LOD it's fading to and [fade, 1) for the old one
+		void setFade(int mesh, float fade){
+			if (fades[mesh] == fade){
+				return;
+			}
+			fades[mesh] = fade;
+			const MeshLocation& location = locations[mesh];
+			const float ranges[2][2] = {{0.0f, fade}, {fade, 1.0f}};
+			glBindBuffer(GL_ARRAY_BUFFER, drawDataBuffer.get());
+			for (int i = 0; i < 2; i++){
+				size_t offset = sizeof(DrawData) * (location.firstSlot + 1 + i) + offsetof(DrawData, ditherRange);
+				glBufferSubData(GL_ARRAY_BUFFER, offset, sizeof(ranges[i]), ranges[i]);
+			}
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+		}
+
+	public:
+
+		/*
+			Draws the given ranges (from SceneBVH::cull and the LOD selection) with as few calls as sorting allows
+			Commands are sorted by pass (the mesh's AlphaMode), then for opaque and alpha-tested meshes by batch,
+			program and distance front to back, and for blended ones back to front first. Each run of commands that
+			share a batch, pass and program in that order is one call. Alpha-tested ranges and ranges fading between
+			LODs need the discard program. camera is the camera's position, for the distances.
+		*/
+		void draw(glm::mat4 mvp, const std::vector<DrawRange>& ranges, const glm::vec3& camera){
+			queued.clear();
+			bool anyDiscards = false;
+			for (const DrawRange& range : ranges){
+				const MeshLocation& location = locations[range.mesh];
+				QueuedCommand entry;
+				entry.pass = location.alphaMode;
+				entry.distance = drawOrderDistance(location.bounds, location.alphaMode, camera);
+				entry.batch = location.batch;
+				entry.discards = range.dithered() || location.alphaMode == ALPHA_TESTED;
+				DrawElementsIndirectCommand& command = entry.command;
+				command.count = range.numTriangles * 3;
+				command.instanceCount = 1;
+				command.firstIndex = location.firstIndex + range.firstTriangle * 3;
+				command.baseVertex = location.baseVertex;
+				command.baseInstance = location.firstSlot;
+				if (range.dithered()){
+					// The new LOD covers [0, fade) and the old one [fade, 1)
+					bool fadingIn = range.ditherMin == 0.0f;
+					setFade(range.mesh, fadingIn ? range.ditherMax : range.ditherMin);
+					command.baseInstance += fadingIn ? 1 : 2;
+				}
+				anyDiscards = anyDiscards || entry.discards;
+				queued.push_back(entry);
+				frameCounters.triangles += range.numTriangles;
+			}
+			// Stable, so a mesh's ranges stay in order
+			std::stable_sort(queued.begin(), queued.end(), [](const QueuedCommand& a, const QueuedCommand& b){
+				if (a.pass != b.pass){
+					return a.pass < b.pass;
+				}
+				if (a.pass == ALPHA_BLENDED && a.distance != b.distance){
+					return a.distance > b.distance;
+				}
+				if (a.batch != b.batch){
+					return a.batch < b.batch;
+				}
+				if (a.discards != b.discards){
+					return a.discards < b.discards;
+				}
+				return a.distance < b.distance;
+			});
+
+			// Split the sorted commands up by batch, remembering where each run starts in its batch's list
+			for (size_t i = 0; i < batches.size(); i++){
+				batchCommands[i].clear();
+			}
+			runs.clear();
+			for (const QueuedCommand& entry : queued){
+				if (runs.empty() || runs.back().batch != entry.batch || runs.back().pass != entry.pass
+						|| runs.back().discards != entry.discards){
+					runs.push_back({entry.batch, entry.pass, entry.discards, batchCommands[entry.batch].size(), 0});
+				}
+				batchCommands[entry.batch].push_back(entry.command);
+				runs.back().count++;
+			}
+			for (size_t i = 0; i < batches.size(); i++){
+				if (batchCommands[i].empty()){
+					continue;
+				}
+				Batch& batch = batches[i];
+				glState.bindIndirectBuffer(batch.indirectBuffer.get());
+				// A mesh that's partly visible can need several commands, so the buffer may have to grow
+				GLsizeiptr size = sizeof(DrawElementsIndirectCommand) * batchCommands[i].size();
+				if (batchCommands[i].size() > batch.indirectCapacity){
+					glBufferData(GL_DRAW_INDIRECT_BUFFER, size, batchCommands[i].data(), GL_DYNAMIC_DRAW);
+					gpuBytes += sizeof(DrawElementsIndirectCommand) * (batchCommands[i].size() - batch.indirectCapacity);
+					batch.indirectCapacity = batchCommands[i].size();
+				}
+				else{
+					glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, size, batchCommands[i].data());
+				}
+			}
+
+			if (anyDiscards){
+				glState.useProgram(discardProgramID);
+				glUniformMatrix4fv(discardMatrixID, 1, GL_FALSE, &mvp[0][0]);
+			}
+			glState.useProgram(programID);
+			glUniformMatrix4fv(matrixID, 1, GL_FALSE, &mvp[0][0]);
+			glState.blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+			for (const Run& run : runs){
+				const Batch& batch = batches[run.batch];
+				ProfileZone zone(batch.zoneName, true);
+				bindRun(run);
+				glState.bindIndirectBuffer(batch.indirectBuffer.get());
+				const void* offset = (const void*) (sizeof(DrawElementsIndirectCommand) * run.first);
+				glMultiDrawElementsIndirect(GL_TRIANGLES, batch.indexType, offset, run.count, 0);
+				frameCounters.drawCalls++;
+			}
+			glState.setDepthWrite(true);
+		}
+
+		/*
+			Draws runs of commands that the GPU wrote into commandBuffer itself (see GPUCuller)
+			countBuffer holds a GLuint per run saying how many of its commands to draw, and each run's count is only
+			the most it can have. Runs are drawn in the order they're given, so they should already be sorted by pass.
+			Needs GL_ARB_indirect_parameters.
+		*/
+		void drawIndirectCount(const glm::mat4& mvp, GLuint commandBuffer, GLuint countBuffer, const std::vector<Run>& indirectRuns){
+			glState.useProgram(discardProgramID);
+			glUniformMatrix4fv(discardMatrixID, 1, GL_FALSE, &mvp[0][0]);
+			glState.useProgram(programID);
+			glUniformMatrix4fv(matrixID, 1, GL_FALSE, &mvp[0][0]);
+			glState.blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+			glState.bindIndirectBuffer(commandBuffer);
+			glBindBuffer(GL_PARAMETER_BUFFER_ARB, countBuffer);
+			for (size_t i = 0; i < indirectRuns.size(); i++){
+				const Run& run = indirectRuns[i];
+				if (run.count == 0){
+					continue;
+				}
+				const Batch& batch = batches[run.batch];
+				ProfileZone zone(batch.zoneName, true);
+				bindRun(run);
+				const void* offset = (const void*) (sizeof(DrawElementsIndirectCommand) * run.first);
+				glMultiDrawElementsIndirectCountARB(GL_TRIANGLES, batch.indexType, offset, (GLintptr) (sizeof(GLuint) * i), run.count, 0);
+				frameCounters.drawCalls++;
+			}
+			glBindBuffer(GL_PARAMETER_BUFFER_ARB, 0);
+			glState.setDepthWrite(true);
+		}
+};
+
+
+/*
+	Loads every mesh in a scene manifest into meshes, in the same order as the manifest
+	Worker threads read and decode the files in parallel (one per core, up to one per file). The calling thread,
+	which must own the GL context, only creates buffers and textures, and does so for each asset as soon as it's
+	decoded rather than waiting for all of them.
+*/
+void loadMeshesParallel(const std::vector<SceneEntry>& entries, std::vector<TexturedMesh>& meshes){
+	size_t numFiles = entries.size();
+	std::vector<MeshAsset> assets(numFiles);
+	for (size_t i = 0; i < numFiles; i++){
+		assets[i].PLYPath = entries[i].PLYPath;
+		assets[i].texturePath = entries[i].texturePath;
+		assets[i].transform = entries[i].transform;
+		assets[i].oneSided = entries[i].oneSided;
+	}
+
+	// Workers grab the next file index from nextAsset and report finished ones through the decoded queue
+	std::atomic<size_t> nextAsset(0);
+	std::mutex queueMutex;
+	std::condition_variable queueCondition;
+	std::vector<size_t> decoded;
+	// Anything a worker throws, by file, to be reported once they've all finished
+	std::vector<std::exception_ptr> errors(numFiles);
+
+	size_t numThreads = std::max(1u, std::thread::hardware_concurrency());
+	numThreads = std::min(numThreads, numFiles);
+	std::vector<std::thread> workers;
+	for (size_t t = 0; t < numThreads; t++){
+		workers.emplace_back([&](){
+			size_t i;
+			while ((i = nextAsset++) < numFiles){
+				errors[i] = loadMeshAssetCaught(assets[i]);
+				std::lock_guard<std::mutex> lock(queueMutex);
+				decoded.push_back(i);
+				queueCondition.notify_one();
+			}
+		});
+	}
+
+	// Upload each asset as it arrives. They can finish in any order, so keep them in slots until they're all done.
+	std::vector<std::unique_ptr<TexturedMesh>> slots(numFiles);
+	for (size_t uploaded = 0; uploaded < numFiles; uploaded++){
+		size_t i;
+		{
+			std::unique_lock<std::mutex> lock(queueMutex);
+			queueCondition.wait(lock, [&](){ return !decoded.empty(); });
+			i = decoded.back();
+			decoded.pop_back();
+		}
+		slots[i].reset(new TexturedMesh(std::move(assets[i])));
+	}
+	for (std::thread& worker : workers){
+		worker.join();
+	}
+	// Those meshes are already in as empty ones, the same as if their files just didn't load
+	for (size_t i = 0; i < numFiles; i++){
+		if (errors[i]){
+			reportMeshAssetException(entries[i].PLYPath, errors[i]);
+		}
+	}
+
+	meshes.reserve(meshes.size() + numFiles);
+	for (size_t i = 0; i < numFiles; i++){
+		meshes.push_back(std::move(*slots[i]));
+	}
+}
+
+
+/*
+	Times the ASCII PLY body parsers against each other on every PLY file in ./assets
+	Each file is read into memory once, then both parsers are run over the same bytes so only parsing is timed.
+	Returns 0 if successful, -1 if the assets couldn't be read, -2 if the parsers disagree
+*/
+int benchmarkPLYParsers(int iterations){
+	std::vector<std::string> paths;
+	std::error_code ec;
+	for (const std::filesystem::directory_entry& entry : std::filesystem::directory_iterator("./assets", ec)){
+		if (entry.path().extension() == ".ply"){
+			paths.push_back(entry.path().string());
+		}
+	}
+	std::sort(paths.begin(), paths.end());
+	if (ec || paths.empty()){
+		printf("No PLY files found in ./assets\n");
+		return -1;
+	}
+
+	printf("%-28s %10s %12s %12s %8s\n", "file", "bytes", "stream (ms)", "buffer (ms)", "speedup");
+	double totalOld = 0, totalNew = 0;
+	for (const std::string& path : paths){
+		// Use loadPLY once to get the element counts, then find where the body starts
+		MeshData header;
+		if (loadPLY(path, header) != 0){
+			return -1;
+		}
+		std::ifstream file(path, std::ios::binary);
+		std::string contents((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+		size_t bodyStart = contents.find("end_header\n");
+		if (bodyStart == std::string::npos){
+			printf("%s is not an ASCII PLY file, skipping\n", path.data());
+			continue;
+		}
+		bodyStart += strlen("end_header\n");
+		int numVertices = header.vertexCount();
+		int numFaces = header.faceCount();
+
+		std::vector<VertexData> oldVertices, newVertices;
+		std::vector<TriData> oldFaces, newFaces;
+		double oldSeconds = 0, newSeconds = 0;
+		for (int i = 0; i < iterations; i++){
+			oldVertices.clear();
+			oldFaces.clear();
+			std::istringstream stream(contents.substr(bodyStart));
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			parseASCIIPLYBodyReference(stream, numVertices, numFaces, oldVertices, oldFaces);
+			oldSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+			newVertices.clear();
+			newFaces.clear();
+			start = std::chrono::steady_clock::now();
+			parseASCIIPLYBody(contents.data() + bodyStart, contents.data() + contents.size(), numVertices, numFaces, newVertices, newFaces);
+			newSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		}
+
+		// Both parsers have to produce exactly the same mesh for the comparison to mean anything
+		if (oldVertices.size() != newVertices.size() || oldFaces.size() != newFaces.size()
+				|| memcmp(oldVertices.data(), newVertices.data(), sizeof(VertexData) * oldVertices.size()) != 0
+				|| memcmp(oldFaces.data(), newFaces.data(), sizeof(TriData) * oldFaces.size()) != 0){
+			printf("%s: parsers produced different results\n", path.data());
+			return -2;
+		}
+
+		double oldMs = oldSeconds * 1000.0 / iterations;
+		double newMs = newSeconds * 1000.0 / iterations;
+		totalOld += oldMs;
+		totalNew += newMs;
+		printf("%-28s %10zu %12.3f %12.3f %7.1fx\n", path.data(), contents.size(), oldMs, newMs, oldMs / newMs);
+	}
+	printf("%-28s %10s %12.3f %12.3f %7.1fx\n", "total", "", totalOld, totalNew, totalOld / totalNew);
+	return 0;
+}
+
+// One of the BMP layouts benchmarkImages writes out to time loadImage on
+struct BenchmarkBMPFormat{
+	const char* name;
+	uint16_t bitsPerPixel;
+	uint32_t compression;
+	uint32_t masks[4];
+	bool topDown;
+};
+
+/*
+	Writes pixels (BGRA bytes, bottom row first, like an Image) to path in the given layout, for benchmarkImages
+	8bpp formats take palette indices instead, one byte per pixel, with the colours in palette. RLE8 rows use a
+	literal run for anything that doesn't repeat, and a normal run for everything else.
+	Returns 0 if successful, -1 if the file couldn't be written
+*/
+int writeBenchmarkBMP(const std::string& path, const BenchmarkBMPFormat& format, const unsigned char* pixels, const uint32_t* palette,
+		int width, int height){
+	const uint32_t BI_RLE8 = 1;
+	bool bitfields = format.compression == 3 || format.compression == 6;
+	size_t rowBytes = ((size_t) width * format.bitsPerPixel + 31) / 32 * 4;
+	std::vector<unsigned char> data;
+	if (format.compression == BI_RLE8){
+		for (int y = 0; y < height; y++){
+			const unsigned char* row = pixels + (size_t) y * width;
+			int x = 0;
+			while (x < width){
+				int run = 1;
+				while (x + run < width && run < 255 && row[x + run] == row[x]){
+					run++;
+				}
+				int literal = 0;
+				while (run == 1 && x + literal < width && literal < 255 && (x + literal + 1 >= width || row[x + literal + 1] != row[x + literal])){
+					literal++;
+				}
+				// Literal runs need at least 3 pixels, since 1 and 2 mean end of bitmap and delta
+				if (literal >= 3){
+					data.push_back(0);
+					data.push_back(literal);
+					data.insert(data.end(), row + x, row + x + literal);
+					if (literal & 1){
+						data.push_back(0);
+					}
+					x += literal;
+				}
+				else{
+					data.push_back(run);
+					data.push_back(row[x]);
+					x += run;
+				}
+			}
+			data.push_back(0);
+			data.push_back(y == height - 1 ? 1 : 0);
+		}
+	}
+	else{
+		data.resize(rowBytes * height);
+		for (int y = 0; y < height; y++){
+			unsigned char* dst = data.data() + rowBytes * (format.topDown ? height - 1 - y : y);
+			for (int x = 0; x < width; x++){
+				uint32_t colour;
+				if (format.bitsPerPixel == 8){
+					dst[x] = pixels[(size_t) y * width + x];
+					continue;
+				}
+				memcpy(&colour, pixels + ((size_t) y * width + x) * 4, 4);
+				if (format.bitsPerPixel == 24){
+					memcpy(dst + x * 3, &colour, 3);
+					continue;
+				}
+				// Each BGRA byte goes wherever its mask says (only whole-byte masks are used here)
+				uint32_t packed = 0;
+				for (int c = 0; c < 4; c++){
+					uint32_t mask = format.masks[c == 3 ? 3 : 2 - c];
+					if (mask != 0){
+						packed |= ((colour >> (c * 8)) & 0xFF) << __builtin_ctz(mask);
+					}
+				}
+				memcpy(dst + x * 4, &packed, 4);
+			}
+		}
+	}
+
+	size_t maskBytes = bitfields ? 16 : 0;
+	size_t paletteBytes = format.bitsPerPixel == 8 ? 256 * 4 : 0;
+	uint32_t dataOffset = 14 + 40 + maskBytes + paletteBytes;
+	std::vector<unsigned char> header(dataOffset, 0);
+	auto put32 = [&](size_t offset, uint32_t value){
+		memcpy(header.data() + offset, &value, sizeof(value));
+	};
+	header[0] = 'B';
+	header[1] = 'M';
+	put32(0x02, dataOffset + data.size());
+	put32(0x0A, dataOffset);
+	put32(0x0E, 40);
+	put32(0x12, width);
+	put32(0x16, format.topDown ? -height : height);
+	put32(0x1A, 1 | (format.bitsPerPixel << 16));
+	put32(0x1E, format.compression);
+	put32(0x22, data.size());
+	if (bitfields){
+		for (int i = 0; i < 4; i++){
+			put32(0x36 + i * 4, format.masks[i]);
+		}
+	}
+	if (paletteBytes != 0){
+		put32(0x2E, 256);
+		for (int i = 0; i < 256; i++){
+			put32(14 + 40 + maskBytes + i * 4, palette[i] & 0x00FFFFFF);
+		}
+	}
+
+	FILE* file = fopen(path.data(), "wb");
+	if (!file){
+		printf("Couldn't write %s\n", path.data());
+		return -1;
+	}
+	bool ok = fwrite(header.data(), 1, header.size(), file) == header.size() && fwrite(data.data(), 1, data.size(), file) == data.size();
+	if (fclose(file) != 0 || !ok){
+		printf("Couldn't write %s\n", path.data());
+		return -1;
+	}
+	return 0;
+}
+
+/*
+	Times loadImage against memcpy: mapping the same file and copying its bytes (over and over, for files with fewer
+	than 4 bytes per pixel) into a new buffer the size of the decoded image. Both open, map and allocate every time
+	and write the same number of bytes, so the difference is just the decoding.
+	With no directory, it writes the same 1024x1024 picture out in every layout loadImage handles into a temporary
+	directory, checks each one decodes back to exactly the pixels it was written from, and times them. Otherwise it
+	times every BMP file in directory. Files that are already in the GL layout are only mapped by loadImage (marked
+	"mapped"), so they come out faster than the copy, which is why every asset in ./assets does.
+	Returns 0 if successful, -1 if the files couldn't be read or written, -2 if one of them isn't a valid image or
+	doesn't decode to the right pixels
+*/
+int benchmarkImages(int iterations, const std::string& directory){
+	std::vector<std::string> paths;
+	std::vector<std::string> labels;
+	std::error_code ec;
+	std::filesystem::path generated;
+	if (directory.empty()){
+		const BenchmarkBMPFormat FORMATS[] = {
+			{"32bpp BGRA", 32, 6, {0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000}, false},
+			{"32bpp BGRA top-down", 32, 6, {0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000}, true},
+			{"32bpp RGBA bitfields", 32, 6, {0x000000FF, 0x0000FF00, 0x00FF0000, 0xFF000000}, false},
+			{"32bpp BI_RGB", 32, 0, {0x00FF0000, 0x0000FF00, 0x000000FF, 0}, false},
+			{"24bpp", 24, 0, {0, 0, 0, 0}, false},
+			{"8bpp palette", 8, 0, {0, 0, 0, 0}, false},
+			{"8bpp RLE8", 8, 1, {0, 0, 0, 0}, false},
+		};
+		const int SIZE = 1024;
+		generated = std::filesystem::temp_directory_path(ec) / ("as4_bench_images_" + std::to_string(getpid()));
+		if (ec || !std::filesystem::create_directories(generated, ec)){
+			printf("Couldn't create a temporary directory for the test images\n");
+			return -1;
+		}
+
+		// Stripes 8 pixels wide that RLE8 can compress, with noise in the left quarter for its literal runs
+		std::mt19937 random(1);
+		uint32_t palette[256];
+		for (uint32_t& colour : palette){
+			colour = random();
+		}
+		std::vector<unsigned char> indices((size_t) SIZE * SIZE);
+		std::vector<unsigned char> pixels(indices.size() * 4);
+		for (int y = 0; y < SIZE; y++){
+			for (int x = 0; x < SIZE; x++){
+				size_t i = (size_t) y * SIZE + x;
+				indices[i] = x < SIZE / 4 ? random() & 0xFF : (x / 8 + y * 3) & 0xFF;
+				memcpy(pixels.data() + i * 4, &palette[indices[i]], 4);
+			}
+		}
+
+		int result = 0;
+		for (const BenchmarkBMPFormat& format : FORMATS){
+			std::string path = (generated / (std::to_string(paths.size()) + ".bmp")).string();
+			result = writeBenchmarkBMP(path, format, format.bitsPerPixel == 8 ? indices.data() : pixels.data(), palette, SIZE, SIZE);
+			if (result != 0){
+				break;
+			}
+			Image image;
+			result = loadImage(path, image, false);
+			if (result != 0){
+				break;
+			}
+			// Only formats with an alpha mask keep the alpha, everything else comes out opaque
+			bool mismatch = image.width != SIZE || image.height != SIZE;
+			uint32_t alpha = format.masks[3] != 0 ? 0 : 0xFF000000;
+			for (size_t i = 0; i < indices.size() && !mismatch; i++){
+				uint32_t expected, actual;
+				memcpy(&expected, pixels.data() + i * 4, 4);
+				memcpy(&actual, image.data() + i * 4, 4);
+				mismatch = actual != (expected | alpha);
+			}
+			if (mismatch){
+				printf("%s: loadImage didn't give back the pixels it was written from\n", format.name);
+				result = -2;
+				break;
+			}
+			paths.push_back(path);
+			labels.push_back(format.name);
+		}
+		if (result != 0){
+			std::filesystem::remove_all(generated, ec);
+			return result;
+		}
+		printf("All %zu formats decode to the pixels they were written from\n\n", paths.size());
+	}
+	else{
+		for (const std::filesystem::directory_entry& entry : std::filesystem::directory_iterator(directory, ec)){
+			if (entry.path().extension() == ".bmp"){
+				paths.push_back(entry.path().string());
+			}
+		}
+		std::sort(paths.begin(), paths.end());
+		if (ec || paths.empty()){
+			printf("No BMP files found in %s\n", directory.data());
+			return -1;
+		}
+		labels = paths;
+	}
+
+	printf("%-28s %12s %10s %12s %12s %8s\n", "file", "size", "bytes", "memcpy (ms)", "decode (ms)", "speed");
+	double totalCopy = 0, totalDecode = 0;
+	int result = 0;
+	for (size_t f = 0; f < paths.size() && result == 0; f++){
+		const std::string& path = paths[f];
+		Image image;
+		result = loadImage(path, image, false);
+		if (result != 0){
+			break;
+		}
+		size_t fileSize = std::filesystem::file_size(path, ec);
+
+		double copySeconds = 0, decodeSeconds = 0;
+		for (int i = 0; i < iterations; i++){
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			{
+				MappedFile file;
+				if (!file.open(path)){
+					printf("%s could not be opened\n", path.data());
+					result = -1;
+					break;
+				}
+				std::vector<unsigned char> copy(image.size());
+				for (size_t offset = 0; offset < copy.size(); offset += file.size){
+					memcpy(copy.data() + offset, file.data, std::min(file.size, copy.size() - offset));
+				}
+			}
+			copySeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+			start = std::chrono::steady_clock::now();
+			{
+				Image decoded;
+				loadImage(path, decoded, false);
+			}
+			decodeSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		}
+		if (result != 0){
+			break;
+		}
+
+		double copyMs = copySeconds * 1000.0 / iterations;
+		double decodeMs = decodeSeconds * 1000.0 / iterations;
+		totalCopy += copyMs;
+		totalDecode += decodeMs;
+		char size[32];
+		snprintf(size, sizeof(size), "%ux%u", image.width, image.height);
+		printf("%-28s %12s %10zu %12.4f %12.4f %7.0f%%%s\n", labels[f].data(), size, fileSize, copyMs, decodeMs, copyMs / decodeMs * 100.0,
+			image.mapping.data != nullptr ? " mapped" : "");
+	}
+	if (!generated.empty()){
+		std::filesystem::remove_all(generated, ec);
+	}
+	if (result == 0){
+		printf("%-28s %12s %10s %12.4f %12.4f %7.0f%%\n", "total", "", "", totalCopy, totalDecode, totalCopy / totalDecode * 100.0);
+	}
+	return result;
+}
+
+
+// Shaders for ProfilerOverlay. Positions are in window pixels from the top left.
+const std::string OVERLAY_VERTEX_SHADER = "\
+#version 330 core\n\
+layout(location = 0) in vec2 position;\n\
+layout(location = 1) in vec4 colour;\n\
+out vec4 colour_out;\n\
+uniform vec2 screenSize;\n\
+void main(){\n\
+	gl_Position = vec4(position.x / screenSize.x * 2.0 - 1.0, 1.0 - position.y / screenSize.y * 2.0, 0.0, 1.0);\n\
+	colour_out = colour;\n\
+}\n";
+
+const std::string OVERLAY_FRAGMENT_SHADER = "\
+#version 330 core\n\
+in vec4 colour_out;\n\
+out vec4 colour;\n\
+void main(){\n\
+	colour = colour_out;\n\
+}\n";
+
+/*
+	Draws the profiler's per-zone averages over the top of the scene as text
+	Uses a tiny built-in 3x5 pixel font (upper case letters, digits and a bit of punctuation; lower case is drawn as
+	upper case and anything else as a space) where every lit font pixel is a small square. The text only gets rebuilt
+	when update() is called.
+*/
+class ProfilerOverlay{
+		struct Vertex{
+			float x, y;
+			float colour[4];
+		};
+
+		// Each glyph is 5 rows of 3 pixels, top row first, 1 for lit
+		struct Glyph{
+			char character;
+			const char* pixels;
+		};
+
+		static const Glyph* findGlyph(char c){
+			static const Glyph GLYPHS[] = {
+				{'A', "010101111101101"}, {'B', "110101110101110"}, {'C', "011100100100011"}, {'D', "110101101101110"},
+				{'E', "111100110100111"}, {'F', "111100110100100"}, {'G', "011100101101011"}, {'H', "101101111101101"},
+				{'I', "111010010010111"}, {'J', "001001001101010"}, {'K', "101101110101101"}, {'L', "100100100100111"},
+				{'M', "101111111101101"}, {'N', "110101101101101"}, {'O', "010101101101010"}, {'P', "110101110100100"},
+				{'Q', "010101101110011"}, {'R', "110101110101101"}, {'S', "011100010001110"}, {'T', "111010010010010"},
+				{'U', "101101101101111"}, {'V', "101101101101010"}, {'W', "101101111111101"}, {'X', "101101010101101"},
+				{'Y', "101101010010010"}, {'Z', "111001010100111"},
+				{'0', "111101101101111"}, {'1', "010110010010111"}, {'2', "110001010100111"}, {'3', "110001010001110"},
+				{'4', "101101111001001"}, {'5', "111100110001110"}, {'6', "011100111101111"}, {'7', "111001010010010"},
+				{'8', "111101111101111"}, {'9', "111101111001110"},
+				{'.', "000000000000010"}, {':', "000010000010000"}, {'-', "000000111000000"}, {'_', "000000000000111"},
+				{'/', "001001010100100"}, {'(', "010100100100010"}, {')', "010001001001010"}, {'%', "101001010100101"}
+			};
+			char upper = (c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c;
+			for (const Glyph& glyph : GLYPHS){
+				if (glyph.character == upper){
+					return &glyph;
+				}
+			}
+			return nullptr;
+		}
+
+		static const int PIXEL_SIZE = 2;
+		static const int CHARACTER_WIDTH = 4 * PIXEL_SIZE;
+		static const int LINE_HEIGHT = 7 * PIXEL_SIZE;
+
+		GLVertexArray VAO;
+		GLBuffer vertexBuffer;
+		GLuint programID = 0;
+		GLint screenSizeID = -1;
+		std::vector<Vertex> vertices;
+
+		void addRectangle(float x, float y, float width, float height, const float colour[4]){
+			float cornerX[4] = {x, x + width, x + width, x};
+			float cornerY[4] = {y, y, y + height, y + height};
+			int order[6] = {0, 1, 2, 0, 2, 3};
+			for (int index : order){
+				Vertex vertex;
+				vertex.x = cornerX[index];
+				vertex.y = cornerY[index];
+				memcpy(vertex.colour, colour, sizeof(vertex.colour));
+				vertices.push_back(vertex);
+			}
+		}
+
+		void addText(const std::string& text, float x, float y, const float colour[4]){
+			for (char c : text){
+				const Glyph* glyph = findGlyph(c);
+				for (int pixel = 0; glyph != nullptr && pixel < 15; pixel++){
+					if (glyph->pixels[pixel] == '1'){
+						addRectangle(x + (pixel % 3) * PIXEL_SIZE, y + (pixel / 3) * PIXEL_SIZE, PIXEL_SIZE, PIXEL_SIZE, colour);
+					}
+				}
+				x += CHARACTER_WIDTH;
+			}
+		}
+
+	public:
+
+		ProfilerOverlay(){
+			programID = shaderPrograms.get(OVERLAY_VERTEX_SHADER, OVERLAY_FRAGMENT_SHADER);
+			screenSizeID = shaderPrograms.uniformLocation(programID, "screenSize");
+			glBindVertexArray(VAO.create());
+			glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer.create());
+			glEnableVertexAttribArray(0);
+			glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*) offsetof(Vertex, x));
+			glEnableVertexAttribArray(1);
+			glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*) offsetof(Vertex, colour));
+			glBindVertexArray(0);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+			glState.invalidate();
+		}
+
+		// Rebuilds the text from the profiler's current averages, one line per zone
+		void update(){
+			const float BACKGROUND[4] = {0.0f, 0.0f, 0.0f, 0.6f};
+			const float CPU_COLOUR[4] = {1.0f, 1.0f, 1.0f, 1.0f};
+			const float GPU_COLOUR[4] = {0.5f, 1.0f, 0.5f, 1.0f};
+			std::vector<std::pair<std::string, double>> averages = profiler.averages();
+			vertices.clear();
+			std::vector<std::string> lines;
+			size_t longest = 0;
+			for (const std::pair<std::string, double>& average : averages){
+				// Paths make zone names long, and only the file name matters here
+				std::string name = average.first;
+				size_t slash = name.find_last_of('/');
+				if (slash != std::string::npos){
+					size_t space = name.find_last_of(' ', slash);
+					name = name.substr(0, space == std::string::npos ? 0 : space + 1) + name.substr(slash + 1);
+				}
+				char line[96];
+				snprintf(line, sizeof(line), "%-28.28s %8.3f MS", name.data(), average.second);
+				lines.push_back(line);
+				longest = std::max(longest, lines.back().size());
+			}
+			addRectangle(0, 0, (longest + 2) * CHARACTER_WIDTH, (lines.size() + 1) * LINE_HEIGHT, BACKGROUND);
+			for (size_t i = 0; i < lines.size(); i++){
+				bool gpu = averages[i].first.compare(0, 4, "gpu ") == 0;
+				addText(lines[i], CHARACTER_WIDTH, PIXEL_SIZE * 4 + i * LINE_HEIGHT, gpu ? GPU_COLOUR : CPU_COLOUR);
+			}
+			glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer.get());
+			glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), vertices.data(), GL_DYNAMIC_DRAW);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+		}
+
+		// Draws on top of whatever's there, ignoring depth
+		void draw(){
+			if (vertices.empty()){
+				return;
+			}
+			glDisable(GL_DEPTH_TEST);
+			glState.setBlend(true);
+			glState.blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+			glState.useProgram(programID);
+			glUniform2f(screenSizeID, SCREEN_WIDTH, SCREEN_HEIGHT);
+			glState.bindVertexArray(VAO.get());
+			glDrawArrays(GL_TRIANGLES, 0, vertices.size());
+			glEnable(GL_DEPTH_TEST);
+		}
+};
+
+// Shaders for DynamicResolution: one triangle covering the window, with its UVs going 0 to 1 across the window
+const std::string UPSCALE_VERTEX_SHADER = "\
+#version 330 core\n\
+out vec2 UV;\n\
+void main(){\n\
+	UV = vec2(gl_VertexID & 1, gl_VertexID >> 1) * 2.0;\n\
+	gl_Position = vec4(UV * 2.0 - 1.0, 0.0, 1.0);\n\
+}\n";
+
+/*
+	Samples the drawn corner of the offscreen target bilinearly, clamped half a texel inside it so nothing outside
+	bleeds in. The four diagonal taps half a texel out are a blur of the centre, which sharpening pushes away from.
+	Edge smoothing is the simple form of FXAA: those taps give the direction across the edge, and the colour is
+	blurred along the edge instead, unless that takes in something brighter or darker than the neighbourhood.
+*/
+const std::string UPSCALE_FRAGMENT_SHADER = "\
+#version 330 core\n\
+in vec2 UV;\n\
+out vec4 colour;\n\
+uniform sampler2D source;\n\
+uniform vec2 regionScale;\n\
+uniform vec2 texelSize;\n\
+uniform float sharpness;\n\
+uniform bool smoothEdges;\n\
+vec3 tap(vec2 position){\n\
+	return texture(source, clamp(position, texelSize * 0.5, regionScale - texelSize * 0.5)).rgb;\n\
+}\n\
+float luma(vec3 rgb){\n\
+	return dot(rgb, vec3(0.299, 0.587, 0.114));\n\
+}\n\
+void main(){\n\
+	vec2 position = UV * regionScale;\n\
+	vec3 centre = tap(position);\n\
+	vec3 northWest = tap(position + vec2(-0.5, 0.5) * texelSize);\n\
+	vec3 northEast = tap(position + vec2(0.5, 0.5) * texelSize);\n\
+	vec3 southWest = tap(position + vec2(-0.5, -0.5) * texelSize);\n\
+	vec3 southEast = tap(position + vec2(0.5, -0.5) * texelSize);\n\
+	if (smoothEdges){\n\
+		float lumaNW = luma(northWest), lumaNE = luma(northEast), lumaSW = luma(southWest), lumaSE = luma(southEast);\n\
+		float lumaCentre = luma(centre);\n\
+		float lumaMin = min(lumaCentre, min(min(lumaNW, lumaNE), min(lumaSW, lumaSE)));\n\
+		float lumaMax = max(lumaCentre, max(max(lumaNW, lumaNE), max(lumaSW, lumaSE)));\n\
+		if (lumaMax - lumaMin > max(0.05, lumaMax * 0.125)){\n\
+			vec2 direction = vec2(-((lumaNW + lumaNE) - (lumaSW + lumaSE)), (lumaNW + lumaSW) - (lumaNE + lumaSE));\n\
+			float reduce = max((lumaNW + lumaNE + lumaSW + lumaSE) * 0.03125, 1.0 / 128.0);\n\
+			direction = clamp(direction / (min(abs(direction.x), abs(direction.y)) + reduce), -8.0, 8.0) * texelSize;\n\
+			vec3 near = 0.5 * (tap(position - direction / 6.0) + tap(position + direction / 6.0));\n\
+			vec3 far = 0.5 * near + 0.25 * (tap(position - direction * 0.5) + tap(position + direction * 0.5));\n\
+			float lumaFar = luma(far);\n\
+			colour = vec4(lumaFar < lumaMin || lumaFar > lumaMax ? near : far, 1.0);\n\
+			return;\n\
+		}\n\
+	}\n\
+	vec3 blurred = 0.25 * (northWest + northEast + southWest + southEast);\n\
+	colour = vec4(max(centre + (centre - blurred) * sharpness, 0.0), 1.0);\n\
+}\n";
+
+/*
+	Draws the scene offscreen at whatever resolution keeps the GPU inside FRAME_TIME_BUDGET_MS, then scales it up to
+	the window
+	The target is made at the window's size once and the scene only draws into its bottom left corner, so the
+	resolution can change every frame without reallocating anything. How long the GPU took for a frame comes from
+	timestamp queries that are read a few frames later, once they're done, so nothing waits on the GPU. The time goes
+	roughly with the number of pixels, so the scale that would have fit the budget is worked out from that and the
+	scale moves a quarter of the way there, in steps of 1/32 so it isn't changing by a pixel every frame. Under load
+	MSAA goes first (the upscale smooths edges instead) and only comes back once full resolution has been well inside
+	the budget for a while.
+	Needs OpenGL 4.3 for the multisampled target. Check isSupported() and draw straight to a multisampled window if
+	it's false.
+*/
+class DynamicResolution{
+		// Timestamps around one frame's drawing, and what it was drawn with
+		struct FrameQuery{
+			GLuint begin = 0, end = 0;
+			float scale = 1.0f;
+			bool multisampled = false;
+			bool pending = false;
+		};
+
+		static const int QUERY_FRAMES = 4;
+		static const int MSAA_SAMPLES = 4;
+		// Aim this far under the budget, and leave the scale alone when the time is within DEAD_BAND of that
+		static constexpr float TARGET_FRACTION = 0.9f;
+		static constexpr float DEAD_BAND = 0.1f;
+		static constexpr float SCALE_STEP = 1.0f / 32.0f;
+		// MSAA comes back after this many frames in a row at full resolution that took less than this much of the budget
+		static const int MSAA_RESTORE_FRAMES = 60;
+		static constexpr float MSAA_RESTORE_FRACTION = 0.5f;
+
+		int width, height;
+		GLTexture multisampledColour, multisampledDepth, colour, depth;
+		GLFramebuffer multisampledFramebuffer, framebuffer;
+		GLVertexArray VAO;
+		GLuint programID = 0;
+		GLint regionScaleID = -1, texelSizeID = -1, sharpnessID = -1, smoothEdgesID = -1;
+		FrameQuery queries[QUERY_FRAMES];
+		int currentQuery = 0;
+		bool timing = false;
+		float scale = 1.0f;
+		bool multisampled = true;
+		int framesUnderBudget = 0;
+		float lastMilliseconds = 0.0f;
+		int regionWidth = 0, regionHeight = 0;
+
+		void attach(GLuint framebufferID, GLenum target, GLuint colourID, GLuint depthID){
+			glBindFramebuffer(GL_FRAMEBUFFER, framebufferID);
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, target, colourID, 0);
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, target, depthID, 0);
+			if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE){
+				printf("Dynamic resolution framebuffer is incomplete\n");
+			}
+			glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		}
+
+		// Moves the scale and MSAA towards what would have fit the budget, given how long a frame drawn with them took
+		void update(float milliseconds, float drawnScale, bool drawnMultisampled){
+			lastMilliseconds = milliseconds;
+			// Frames drawn before MSAA was last switched don't say anything about how it's doing now
+			if (drawnMultisampled != multisampled){
+				return;
+			}
+			if (multisampled && milliseconds > FRAME_TIME_BUDGET_MS){
+				multisampled = false;
+				framesUnderBudget = 0;
+				return;
+			}
+			float target = FRAME_TIME_BUDGET_MS * TARGET_FRACTION;
+			if (fabs(milliseconds - target) > FRAME_TIME_BUDGET_MS * DEAD_BAND){
+				float targetScale = drawnScale * sqrt(target / milliseconds);
+				float newScale = round((scale + (targetScale - scale) * 0.25f) / SCALE_STEP) * SCALE_STEP;
+				if (newScale == scale && fabs(targetScale - scale) >= SCALE_STEP){
+					newScale += targetScale > scale ? SCALE_STEP : -SCALE_STEP;
+				}
+				scale = glm::clamp(newScale, MIN_RESOLUTION_SCALE, 1.0f);
+			}
+			if (!multisampled && scale == 1.0f && milliseconds < FRAME_TIME_BUDGET_MS * MSAA_RESTORE_FRACTION){
+				framesUnderBudget++;
+				if (framesUnderBudget >= MSAA_RESTORE_FRAMES){
+					multisampled = true;
+					framesUnderBudget = 0;
+				}
+			}
+			else{
+				framesUnderBudget = 0;
+			}
+		}
+
+		// Reads every finished query, oldest first, without waiting for the ones that aren't
+		void readQueries(){
+			for (int i = 0; i < QUERY_FRAMES; i++){
+				FrameQuery& query = queries[(currentQuery + i) % QUERY_FRAMES];
+				if (!query.pending){
+					continue;
+				}
+				GLint available = 0;
+				glGetQueryObjectiv(query.end, GL_QUERY_RESULT_AVAILABLE, &available);
+				if (!available){
+					break;
+				}
+				GLuint64 begin = 0, end = 0;
+				glGetQueryObjectui64v(query.begin, GL_QUERY_RESULT, &begin);
+				glGetQueryObjectui64v(query.end, GL_QUERY_RESULT, &end);
+				query.pending = false;
+				update((end - begin) / 1000000.0f, query.scale, query.multisampled);
+			}
+		}
+
+	public:
+
+		static bool isSupported(){
+			return glewIsSupported("GL_VERSION_4_3");
+		}
+
+		DynamicResolution(int width, int height) : width(width), height(height){
+			glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, multisampledColour.create());
+			glTexStorage2DMultisample(GL_TEXTURE_2D_MULTISAMPLE, MSAA_SAMPLES, GL_RGBA8, width, height, GL_TRUE);
+			glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, multisampledDepth.create());
+			glTexStorage2DMultisample(GL_TEXTURE_2D_MULTISAMPLE, MSAA_SAMPLES, GL_DEPTH_COMPONENT24, width, height, GL_TRUE);
+			glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, 0);
+			glBindTexture(GL_TEXTURE_2D, colour.create());
+			glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, width, height);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+			glBindTexture(GL_TEXTURE_2D, depth.create());
+			glTexStorage2D(GL_TEXTURE_2D, 1, GL_DEPTH_COMPONENT24, width, height);
+			glBindTexture(GL_TEXTURE_2D, 0);
+			attach(multisampledFramebuffer.create(), GL_TEXTURE_2D_MULTISAMPLE, multisampledColour.get(), multisampledDepth.get());
+			attach(framebuffer.create(), GL_TEXTURE_2D, colour.get(), depth.get());
+
+			for (FrameQuery& query : queries){
+				glGenQueries(1, &query.begin);
+				glGenQueries(1, &query.end);
+			}
+			VAO.create();
+			programID = shaderPrograms.get(UPSCALE_VERTEX_SHADER, UPSCALE_FRAGMENT_SHADER);
+			regionScaleID = shaderPrograms.uniformLocation(programID, "regionScale");
+			texelSizeID = shaderPrograms.uniformLocation(programID, "texelSize");
+			sharpnessID = shaderPrograms.uniformLocation(programID, "sharpness");
+			smoothEdgesID = shaderPrograms.uniformLocation(programID, "smoothEdges");
+			glState.invalidate();
+		}
+
+		~DynamicResolution(){
+			for (FrameQuery& query : queries){
+				glDeleteQueries(1, &query.begin);
+				glDeleteQueries(1, &query.end);
+			}
+		}
+
+		DynamicResolution(const DynamicResolution&) = delete;
+		DynamicResolution& operator=(const DynamicResolution&) = delete;
+
+		// Picks this frame's resolution and points drawing at the offscreen target. The scene is drawn after this.
+		void begin(){
+			readQueries();
+			regionWidth = std::max(1, int(round(width * scale)));
+			regionHeight = std::max(1, int(round(height * scale)));
+			glBindFramebuffer(GL_FRAMEBUFFER, multisampled ? multisampledFramebuffer.get() : framebuffer.get());
+			glViewport(0, 0, regionWidth, regionHeight);
+			// glClear ignores the viewport, so this keeps it to the part being drawn
+			glScissor(0, 0, regionWidth, regionHeight);
+			glEnable(GL_SCISSOR_TEST);
+			// If every query is still waiting on the GPU, this frame just goes untimed
+			FrameQuery& query = queries[currentQuery];
+			timing = !query.pending;
+			if (timing){
+				query.scale = scale;
+				query.multisampled = multisampled;
+				glQueryCounter(query.begin, GL_TIMESTAMP);
+			}
+		}
+
+		// Resolves what was drawn since begin() and scales it up to fill the window
+		void end(){
+			glDisable(GL_SCISSOR_TEST);
+			if (multisampled){
+				glBindFramebuffer(GL_READ_FRAMEBUFFER, multisampledFramebuffer.get());
+				glBindFramebuffer(GL_DRAW_FRAMEBUFFER, framebuffer.get());
+				glBlitFramebuffer(0, 0, regionWidth, regionHeight, 0, 0, regionWidth, regionHeight, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+			}
+			glBindFramebuffer(GL_FRAMEBUFFER, 0);
+			glViewport(0, 0, width, height);
+
+			glDisable(GL_DEPTH_TEST);
+			glState.setBlend(false);
+			glState.useProgram(programID);
+			glUniform2f(regionScaleID, float(regionWidth) / width, float(regionHeight) / height);
+			glUniform2f(texelSizeID, 1.0f / width, 1.0f / height);
+			// Nothing needs sharpening at full resolution
+			glUniform1f(sharpnessID, regionWidth == width && regionHeight == height ? 0.0f : UPSCALE_SHARPNESS);
+			glUniform1i(smoothEdgesID, !multisampled);
+			glState.bindTexture(GL_TEXTURE_2D, colour.get());
+			glState.bindVertexArray(VAO.get());
+			glDrawArrays(GL_TRIANGLES, 0, 3);
+			glEnable(GL_DEPTH_TEST);
+
+			if (timing){
+				glQueryCounter(queries[currentQuery].end, GL_TIMESTAMP);
+				queries[currentQuery].pending = true;
+				currentQuery = (currentQuery + 1) % QUERY_FRAMES;
+			}
+		}
+
+		// Fraction of the window's width and height the scene is being drawn at
+		float getScale() const{
+			return scale;
+		}
+
+		bool isMultisampled() const{
+			return multisampled;
+		}
+
+		// How long the GPU took for the newest frame that's been timed
+		float getMilliseconds() const{
+			return lastMilliseconds;
+		}
+
+		size_t getGPUBytes() const{
+			return (size_t) width * height * (4 + 4) * (MSAA_SAMPLES + 1);
+		}
+};
+
+
+// Shaders for OcclusionCuller: a unit cube stretched over a bounding box. Only depth testing matters, so no colour.
+const std::string OCCLUSION_VERTEX_SHADER = "\
+#version 330 core\n\
+layout(location = 0) in vec3 corner;\n\
+uniform mat4 MVP;\n\
+uniform vec3 boundsMin;\n\
+uniform vec3 boundsMax;\n\
+void main(){\n\
+	gl_Position = MVP * vec4(mix(boundsMin, boundsMax, corner), 1);\n\
+}\n";
+
+const std::string OCCLUSION_FRAGMENT_SHADER = "\
+#version 330 core\n\
+void main(){\n\
+}\n";
+
+/*
+	Leaves out meshes that are hidden behind other meshes, using occlusion queries on their bounding boxes
+	After the scene is drawn, test() draws the box of every mesh that was in the frustum against the finished depth
+	buffer (with colour and depth writes off) inside an occlusion query. Results are only read once the GPU says
+	they're ready, so nothing ever waits on it, and filter() uses the latest ones to drop hidden meshes before the
+	next frame is drawn. A mesh that comes out from behind something can show up a frame or two late because of that.
+	Meshes that just came into the frustum, or whose box the camera is inside, always count as visible.
+*/
+class OcclusionCuller{
+		struct MeshState{
+			GLuint query = 0;
+			bool pending = false;	// A query was issued and its result hasn't been read yet
+			bool stale = false;	// The pending query is from before the mesh last left the frustum
+			bool visible = true;
+			bool inFrustum = false;
+			bool test = false;	// Gets its box tested after this frame is drawn
+		};
+
+		// Boxes are grown a bit so flat meshes have some thickness, and so a mesh's own depth doesn't hide its box
+		static constexpr float BOX_MARGIN = 0.05f;
+
+		std::vector<MeshState> states;
+		std::vector<AABB> boxes;
+		GLVertexArray VAO;
+		GLBuffer vertexBuffer, indexBuffer;
+		GLuint programID = 0;
+		GLint matrixID = -1, boundsMinID = -1, boundsMaxID = -1;
+		GLenum queryTarget = GL_ANY_SAMPLES_PASSED;
+
+	public:
+
+		OcclusionCuller(const std::vector<TexturedMesh>& meshes){
+			states.resize(meshes.size());
+			for (size_t i = 0; i < meshes.size(); i++){
+				glGenQueries(1, &states[i].query);
+				AABB box = meshes[i].getBounds();
+				box.min -= glm::vec3(BOX_MARGIN);
+				box.max += glm::vec3(BOX_MARGIN);
+				boxes.push_back(box);
+			}
+			// The conservative version can answer sooner, but it's only in 4.3
+			if (glewIsSupported("GL_VERSION_4_3")){
+				queryTarget = GL_ANY_SAMPLES_PASSED_CONSERVATIVE;
+			}
+
+			programID = shaderPrograms.get(OCCLUSION_VERTEX_SHADER, OCCLUSION_FRAGMENT_SHADER);
+			matrixID = shaderPrograms.uniformLocation(programID, "MVP");
+			boundsMinID = shaderPrograms.uniformLocation(programID, "boundsMin");
+			boundsMaxID = shaderPrograms.uniformLocation(programID, "boundsMax");
+
+			const float CORNERS[8][3] = {{0, 0, 0}, {1, 0, 0}, {0, 1, 0}, {1, 1, 0}, {0, 0, 1}, {1, 0, 1}, {0, 1, 1}, {1, 1, 1}};
+			const GLubyte INDICES[36] = {
+				0, 2, 1, 1, 2, 3,	// -z
+				4, 5, 6, 5, 7, 6,	// +z
+				0, 1, 4, 1, 5, 4,	// -y
+				2, 6, 3, 3, 6, 7,	// +y
+				0, 4, 2, 2, 4, 6,	// -x
+				1, 3, 5, 3, 7, 5	// +x
+			};
+			glBindVertexArray(VAO.create());
+			glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer.create());
+			glBufferData(GL_ARRAY_BUFFER, sizeof(CORNERS), CORNERS, GL_STATIC_DRAW);
+			glEnableVertexAttribArray(0);
+			glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void*) 0);
+			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer.create());
+			glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(INDICES), INDICES, GL_STATIC_DRAW);
 			glBindVertexArray(0);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+			glState.invalidate();
+		}
+
+		~OcclusionCuller(){
+			for (MeshState& state : states){
+				glDeleteQueries(1, &state.query);
+			}
+		}
+
+		/*
+			Reads any query results that are ready, then removes the ranges of every mesh that was hidden last time it
+			was tested. ranges are the ones that survived frustum culling, sorted by mesh.
+			Returns the number of meshes removed
+		*/
+		size_t filter(std::vector<DrawRange>& ranges, const glm::vec3& camera){
+			for (MeshState& state : states){
+				if (!state.pending){
+					continue;
+				}
+				GLuint available = 0;
+				glGetQueryObjectuiv(state.query, GL_QUERY_RESULT_AVAILABLE, &available);
+				if (available){
+					GLuint samples = 0;
+					glGetQueryObjectuiv(state.query, GL_QUERY_RESULT, &samples);
+					if (!state.stale){
+						state.visible = samples != 0;
+					}
+					state.pending = false;
+					state.stale = false;
+				}
+			}
+
+			std::vector<bool> inFrustum(states.size(), false);
+			for (const DrawRange& range : ranges){
+				inFrustum[range.mesh] = true;
+			}
+			size_t occluded = 0;
+			for (size_t i = 0; i < states.size(); i++){
+				MeshState& state = states[i];
+				bool cameraInside = boxes[i].contains(camera);
+				if (inFrustum[i] && (!state.inFrustum || cameraInside)){
+					// Whatever was known about it is out of date
+					state.visible = true;
+					state.stale = state.pending;
+				}
+				state.inFrustum = inFrustum[i];
+				state.test = inFrustum[i] && !cameraInside;
+				if (inFrustum[i] && !state.visible){
+					occluded++;
+				}
+			}
+			ranges.erase(std::remove_if(ranges.begin(), ranges.end(), [this](const DrawRange& range){
+				return !states[range.mesh].visible;
+			}), ranges.end());
+			return occluded;
+		}
+
+		// Tests the boxes picked by the last filter() against the depth buffer. Call after drawing the scene.
+		void test(const glm::mat4& viewProjection){
+			glState.useProgram(programID);
+			glState.bindVertexArray(VAO.get());
+			glUniformMatrix4fv(matrixID, 1, GL_FALSE, &viewProjection[0][0]);
+			glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+			glState.setDepthWrite(false);
+			glDepthFunc(GL_LEQUAL);
+			for (size_t i = 0; i < states.size(); i++){
+				MeshState& state = states[i];
+				// Meshes with a result still on the way keep using the last one
+				if (!state.test || state.pending){
+					continue;
+				}
+				glUniform3f(boundsMinID, boxes[i].min.x, boxes[i].min.y, boxes[i].min.z);
+				glUniform3f(boundsMaxID, boxes[i].max.x, boxes[i].max.y, boxes[i].max.z);
+				glBeginQuery(queryTarget, state.query);
+				glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_BYTE, (void*) 0);
+				glEndQuery(queryTarget);
+				state.pending = true;
+				frameCounters.drawCalls++;
+			}
+			glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+			glState.setDepthWrite(true);
+			glDepthFunc(GL_LESS);
+		}
+};
+
+
+/*
+	Builds one level of a DepthPyramid: every texel gets the furthest depth of the 2x2 texels under it in the level
+	before, or for level 0 in the depth buffer (the furthest of their samples, if it's multisampled). Levels are half
+	the size of the one before, rounded down, so the last texel of an odd-sized row or column takes in three instead.
+*/
+const std::string DEPTH_PYRAMID_SHADER = "\
+#version 430 core\n\
+layout(local_size_x = 8, local_size_y = 8) in;\n\
+layout(r32f, binding = 0) writeonly uniform image2D destination;\n\
+uniform sampler2D source;\n\
+uniform sampler2DMS multisampledSource;\n\
+// Level 0 reads the copy of the depth buffer (from multisampledSource if samples > 0), the others the level before\n\
+uniform bool fromDepth;\n\
+uniform int samples;\n\
+uniform int sourceLevel;\n\
+uniform ivec2 sourceSize, destinationSize;\n\
+float fetch(ivec2 texel){\n\
+	if (!fromDepth) return texelFetch(source, texel, sourceLevel).r;\n\
+	if (samples == 0) return texelFetch(source, texel, 0).r;\n\
+	float depth = 0.0;\n\
+	for (int i = 0; i < samples; i++) depth = max(depth, texelFetch(multisampledSource, texel, i).r);\n\
+	return depth;\n\
+}\n\
+void main(){\n\
+	ivec2 coord = ivec2(gl_GlobalInvocationID.xy);\n\
+	if (any(greaterThanEqual(coord, destinationSize))) return;\n\
+	ivec2 last = ivec2(coord.x == destinationSize.x - 1 && (sourceSize.x & 1) != 0 ? 2 : 1,\n\
+		coord.y == destinationSize.y - 1 && (sourceSize.y & 1) != 0 ? 2 : 1);\n\
+	float depth = 0.0;\n\
+	for (int y = 0; y <= last.y; y++){\n\
+		for (int x = 0; x <= last.x; x++){\n\
+			depth = max(depth, fetch(min(coord * 2 + ivec2(x, y), sourceSize - 1)));\n\
+		}\n\
+	}\n\
+	imageStore(destination, coord, vec4(depth));\n\
+}\n";
+
+/*
+	A mip chain of the furthest depth over each texel's area, built from the depth buffer partway through a frame, so
+	GPUCuller can test boxes against it in a compute shader
+	The depth buffer is copied with glBlitFramebuffer first, since the default framebuffer can't be read by a shader.
+	Level 0 is half its size, and each level covers 2x2 texels of the one before (see DEPTH_PYRAMID_SHADER), like the
+	mip levels after the first would. A box whose nearest point is further away than the furthest depth in the level
+	where it covers about 2x2 texels is hidden by what was drawn before the pyramid was built. The textures are only
+	made again when the viewport gets bigger than them or the depth buffer's format changes.
+*/
+class DepthPyramid{
+		// A texture the depth buffer gets blitted into, which has to match its format and sample count
+		struct DepthCopy{
+			GLTexture texture;
+			GLFramebuffer framebuffer;
+			int width = 0, height = 0, samples = 0;
+			GLenum format = GL_NONE;
+		};
+
+		// One copy for single-sampled depth buffers and one for multisampled, so switching MSAA on and off (see
+		// DynamicResolution) doesn't make either of them again
+		DepthCopy copies[2];
+		GLTexture pyramid;
+		// The size of the viewport it was last built from, and how big the pyramid actually is. Everything is only made
+		// bigger, so a viewport that shrinks and grows again doesn't reallocate anything.
+		int width = 0, height = 0, levels = 0, samples = 0;
+		int capacityWidth = 0, capacityHeight = 0, capacityLevels = 0;
+		GLuint programID = 0;
+		GLint fromDepthID = -1, samplesID = -1, sourceLevelID = -1, sourceSizeID = -1, destinationSizeID = -1;
+		bool valid = false;
+
+		/*
+			The format of the depth buffer being drawn to, which the copy has to match exactly for glBlitFramebuffer
+			Returns GL_NONE if there isn't one
+		*/
+		static GLenum framebufferDepthFormat(){
+			GLint framebuffer = 0;
+			glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &framebuffer);
+			GLenum depthAttachment = framebuffer == 0 ? GL_DEPTH : GL_DEPTH_ATTACHMENT;
+			GLenum stencilAttachment = framebuffer == 0 ? GL_STENCIL : GL_STENCIL_ATTACHMENT;
+			GLint depthType = GL_NONE, stencilType = GL_NONE, depthBits = 0, stencilBits = 0, componentType = GL_NONE;
+			glGetFramebufferAttachmentParameteriv(GL_DRAW_FRAMEBUFFER, depthAttachment, GL_FRAMEBUFFER_ATTACHMENT_OBJECT_TYPE, &depthType);
+			if (depthType == GL_NONE){
+				return GL_NONE;
+			}
+			glGetFramebufferAttachmentParameteriv(GL_DRAW_FRAMEBUFFER, depthAttachment, GL_FRAMEBUFFER_ATTACHMENT_DEPTH_SIZE, &depthBits);
+			glGetFramebufferAttachmentParameteriv(GL_DRAW_FRAMEBUFFER, depthAttachment, GL_FRAMEBUFFER_ATTACHMENT_COMPONENT_TYPE, &componentType);
+			glGetFramebufferAttachmentParameteriv(GL_DRAW_FRAMEBUFFER, stencilAttachment, GL_FRAMEBUFFER_ATTACHMENT_OBJECT_TYPE, &stencilType);
+			if (stencilType != GL_NONE){
+				glGetFramebufferAttachmentParameteriv(GL_DRAW_FRAMEBUFFER, stencilAttachment, GL_FRAMEBUFFER_ATTACHMENT_STENCIL_SIZE, &stencilBits);
+			}
+			if (depthBits == 0){
+				return GL_NONE;
+			}
+			if (componentType == GL_FLOAT){
+				return stencilBits > 0 ? GL_DEPTH32F_STENCIL8 : GL_DEPTH_COMPONENT32F;
+			}
+			if (stencilBits > 0){
+				return GL_DEPTH24_STENCIL8;
+			}
+			return depthBits <= 16 ? GL_DEPTH_COMPONENT16 : depthBits <= 24 ? GL_DEPTH_COMPONENT24 : GL_DEPTH_COMPONENT32;
+		}
+
+		static int levelCount(int width, int height){
+			int levels = 1;
+			while ((std::max(width, height) >> (levels + 1)) > 0){
+				levels++;
+			}
+			return levels;
+		}
+
+		void resizeCopy(DepthCopy& copy, int newWidth, int newHeight, int newSamples, GLenum format){
+			copy.width = newWidth;
+			copy.height = newHeight;
+			copy.samples = newSamples;
+			copy.format = format;
+			GLenum target = newSamples > 0 ? GL_TEXTURE_2D_MULTISAMPLE : GL_TEXTURE_2D;
+			glBindTexture(target, copy.texture.create());
+			if (newSamples > 0){
+				glTexStorage2DMultisample(target, newSamples, format, newWidth, newHeight, GL_TRUE);
+			}
+			else{
+				glTexStorage2D(target, 1, format, newWidth, newHeight);
+				glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+				glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+			}
+			glBindTexture(target, 0);
+			bool stencil = format == GL_DEPTH24_STENCIL8 || format == GL_DEPTH32F_STENCIL8;
+			GLint drawFramebuffer = 0;
+			glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &drawFramebuffer);
+			glBindFramebuffer(GL_DRAW_FRAMEBUFFER, copy.framebuffer.create());
+			glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, stencil ? GL_DEPTH_STENCIL_ATTACHMENT : GL_DEPTH_ATTACHMENT, target, copy.texture.get(), 0);
+			glDrawBuffer(GL_NONE);
+			glBindFramebuffer(GL_DRAW_FRAMEBUFFER, drawFramebuffer);
+			glState.invalidate();
+		}
+
+		void resizePyramid(int newWidth, int newHeight){
+			capacityWidth = newWidth;
+			capacityHeight = newHeight;
+			capacityLevels = levelCount(capacityWidth, capacityHeight);
+			glBindTexture(GL_TEXTURE_2D, pyramid.create());
+			glTexStorage2D(GL_TEXTURE_2D, capacityLevels, GL_R32F, std::max(1, capacityWidth >> 1), std::max(1, capacityHeight >> 1));
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+			glBindTexture(GL_TEXTURE_2D, 0);
+			glState.invalidate();
+		}
+
+	public:
+
+		// The size of a level of the pyramid. The depth buffer it's built from would be level -1.
+		int levelWidth(int level) const{
+			return std::max(1, width >> (level + 1));
+		}
+		int levelHeight(int level) const{
+			return std::max(1, height >> (level + 1));
+		}
+
+		DepthPyramid(){
+			programID = shaderPrograms.getCompute(DEPTH_PYRAMID_SHADER);
+			fromDepthID = shaderPrograms.uniformLocation(programID, "fromDepth");
+			samplesID = shaderPrograms.uniformLocation(programID, "samples");
+			sourceLevelID = shaderPrograms.uniformLocation(programID, "sourceLevel");
+			sourceSizeID = shaderPrograms.uniformLocation(programID, "sourceSize");
+			destinationSizeID = shaderPrograms.uniformLocation(programID, "destinationSize");
+			glUseProgram(programID);
+			glUniform1i(shaderPrograms.uniformLocation(programID, "multisampledSource"), 1);
+			glState.invalidate();
+		}
+
+		// Builds the pyramid from the depth buffer of the framebuffer being drawn to, within the current viewport
+		void build(){
+			GLint viewport[4], drawFramebuffer = 0, readFramebuffer = 0, framebufferSamples = 0;
+			glGetIntegerv(GL_VIEWPORT, viewport);
+			glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &drawFramebuffer);
+			glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &readFramebuffer);
+			glGetIntegerv(GL_SAMPLES, &framebufferSamples);
+			GLenum format = framebufferDepthFormat();
+			valid = format != GL_NONE && viewport[2] > 0 && viewport[3] > 0;
+			if (!valid){
+				return;
+			}
+			DepthCopy& copy = copies[framebufferSamples > 0 ? 1 : 0];
+			if (viewport[2] > copy.width || viewport[3] > copy.height || framebufferSamples != copy.samples || format != copy.format){
+				resizeCopy(copy, std::max(viewport[2], copy.width), std::max(viewport[3], copy.height), framebufferSamples, format);
+			}
+			if (viewport[2] > capacityWidth || viewport[3] > capacityHeight){
+				resizePyramid(std::max(viewport[2], capacityWidth), std::max(viewport[3], capacityHeight));
+			}
+			samples = framebufferSamples;
+			width = viewport[2];
+			height = viewport[3];
+			levels = levelCount(width, height);
+
+			glBindFramebuffer(GL_READ_FRAMEBUFFER, drawFramebuffer);
+			glBindFramebuffer(GL_DRAW_FRAMEBUFFER, copy.framebuffer.get());
+			glBlitFramebuffer(viewport[0], viewport[1], viewport[0] + width, viewport[1] + height, 0, 0, width, height, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+			glBindFramebuffer(GL_DRAW_FRAMEBUFFER, drawFramebuffer);
+			glBindFramebuffer(GL_READ_FRAMEBUFFER, readFramebuffer);
+
+			glUseProgram(programID);
+			glActiveTexture(GL_TEXTURE0);
+			for (int level = 0; level < levels; level++){
+				glBindImageTexture(0, pyramid.get(), level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+				glUniform1i(fromDepthID, level == 0);
+				glUniform1i(samplesID, samples);
+				glUniform1i(sourceLevelID, level - 1);
+				glUniform2i(sourceSizeID, level == 0 ? width : levelWidth(level - 1), level == 0 ? height : levelHeight(level - 1));
+				glUniform2i(destinationSizeID, levelWidth(level), levelHeight(level));
+				if (level == 0 && samples > 0){
+					glActiveTexture(GL_TEXTURE1);
+					glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, copy.texture.get());
+					glActiveTexture(GL_TEXTURE0);
+				}
+				else{
+					glBindTexture(GL_TEXTURE_2D, level == 0 ? copy.texture.get() : pyramid.get());
+				}
+				glDispatchCompute((levelWidth(level) + 7) / 8, (levelHeight(level) + 7) / 8, 1);
+				glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+			}
+			glBindImageTexture(0, 0, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+			glState.invalidate();
+		}
+
+		// Whether build() has made a pyramid that can be tested against
+		bool isValid() const{
+			return valid;
+		}
+
+		GLuint getTexture() const{
+			return pyramid.get();
+		}
+
+		int getWidth() const{
+			return width;
+		}
+
+		int getHeight() const{
+			return height;
+		}
+
+		int getLevels() const{
+			return levels;
+		}
+
+		size_t getGPUBytes() const{
+			size_t bytes = textureBytes(std::max(1, capacityWidth >> 1), std::max(1, capacityHeight >> 1), capacityLevels);
+			for (const DepthCopy& copy : copies){
+				size_t depthBytes = (copy.format == GL_DEPTH_COMPONENT16 ? 2 : copy.format == GL_DEPTH32F_STENCIL8 ? 8 : 4) * std::max(copy.samples, 1);
+				bytes += (size_t) copy.width * copy.height * depthBytes;
+			}
+			return bytes;
+		}
+};
+
+// The layout of GPUCuller's records and LOD states, shared by its shaders
+const std::string GPU_CULL_STRUCTS = "\
+struct DrawRecord{\n\
+	vec4 boundsMin, boundsMax;\n\
+	// Centre and radius, then normal cone axis and cutoff (see DrawCluster)\n\
+	vec4 sphere, cone;\n\
+	// Index count, first index, base vertex, and the mesh's first DrawData slot\n\
+	uvec4 draw;\n\
+	// Mesh, LOD level, and its AlphaMode\n\
+	uvec4 info;\n\
+};\n\
+struct LODState{\n\
+	int level, previousLevel;\n\
+	float fade, padding;\n\
+};\n";
+
+/*
+	Picks every mesh's LOD like Scene::selectLODs, one invocation per mesh, and points its dithered DrawData slots at
+	the fade (like BatchedScene::setFade). Meshes without any levels are left alone, since Scene picks theirs.
+*/
+const std::string GPU_LOD_SHADER = "\
+#version 430 core\n\
+layout(local_size_x = 64) in;\n" + GPU_CULL_STRUCTS + "\
+struct MeshInfo{\n\
+	vec4 boundsMin, boundsMax;\n\
+	// Every LOD level's error\n\
+	vec4 errors;\n\
+	// Number of LOD levels, first DrawData slot\n\
+	uvec4 info;\n\
+};\n\
+layout(std430, binding = 0) readonly buffer Meshes{ MeshInfo meshes[]; };\n\
+layout(std430, binding = 1) buffer LODStates{ LODState states[]; };\n\
+layout(std430, binding = 2) buffer DrawData{ float drawData[]; };\n\
+const uint DRAW_DATA_FLOATS = " + std::to_string(sizeof(BatchedScene::DrawData) / sizeof(float)) + "u;\n\
+const uint DITHER_RANGE = " + std::to_string(offsetof(BatchedScene::DrawData, ditherRange) / sizeof(float)) + "u;\n\
+uniform uint numMeshes;\n\
+uniform vec3 camera;\n\
+uniform float pixelsPerUnit, pixelError;\n\
+// How much the fade moves this frame, and where it starts when the level changes\n\
+uniform float fadeStep, startFade;\n\
+void main(){\n\
+	uint i = gl_GlobalInvocationID.x;\n\
+	if (i >= numMeshes) return;\n\
+	MeshInfo mesh = meshes[i];\n\
+	if (mesh.info.x == 0u) return;\n\
+	LODState state = states[i];\n\
+	state.fade = min(1.0, state.fade + fadeStep);\n\
+	float distance = length(camera - clamp(camera, mesh.boundsMin.xyz, mesh.boundsMax.xyz));\n\
+	int level = 0;\n\
+	while (level + 1 < int(mesh.info.x) && mesh.errors[level + 1] * pixelsPerUnit <= pixelError * distance) level++;\n\
+	if (level != state.level){\n\
+		state.previousLevel = state.level;\n\
+		state.level = level;\n\
+		state.fade = startFade;\n\
+	}\n\
+	states[i] = state;\n\
+	// The new level covers [0, fade) and the old one [fade, 1)\n\
+	uint fadingIn = (mesh.info.y + 1u) * DRAW_DATA_FLOATS + DITHER_RANGE + 1u;\n\
+	uint fadingOut = (mesh.info.y + 2u) * DRAW_DATA_FLOATS + DITHER_RANGE;\n\
+	if (drawData[fadingIn] != state.fade){\n\
+		drawData[fadingIn] = state.fade;\n\
+		drawData[fadingOut] = state.fade;\n\
+	}\n\
+}\n";
+
+/*
+	Decides whether each of GPUCuller's records gets drawn in this pass, one invocation per record
+	Records of LOD levels that aren't being drawn are skipped. The rest are tested against the frustum and their normal
+	cone (like SceneBVH). With occlusion culling the frame is drawn in two passes: the first draws what was visible
+	last frame without testing it any further, and the second tests everything against a depth pyramid of the first
+	pass, draws what wasn't drawn yet and remembers what was visible for the next frame. visibility gets 0 for records
+	that aren't drawn in this pass, or 1 + the DrawData slot they're drawn with, plus 4 if they need the discard
+	program.
+*/
+const std::string GPU_CULL_SHADER = "\
+#version 430 core\n\
+layout(local_size_x = 64) in;\n" + GPU_CULL_STRUCTS + "\
+layout(std430, binding = 0) readonly buffer Records{ DrawRecord records[]; };\n\
+layout(std430, binding = 1) readonly buffer LODStates{ LODState states[]; };\n\
+layout(std430, binding = 2) buffer Visibility{ uint visibility[]; };\n\
+// Culled, backfacing, occluded, drawn, triangles\n\
+layout(std430, binding = 3) buffer Counters{ uint counters[]; };\n\
+// Whether each record was visible at the end of the last frame\n\
+layout(std430, binding = 7) buffer History{ uint history[]; };\n\
+const uint ALPHA_OPAQUE = " + std::to_string(ALPHA_OPAQUE) + "u;\n\
+uniform uint numRecords;\n\
+// 0 or 1, and whether there are two of them (only with occlusion culling)\n\
+uniform uint pass;\n\
+uniform bool twoPasses;\n\
+uniform bool frustumCulling, coneCulling, occlusionCulling;\n\
+uniform vec4 planes[6];\n\
+uniform vec3 camera;\n\
+uniform sampler2D depthPyramid;\n\
+// The size of the depth buffer the pyramid was built from, which is twice the size of its level 0\n\
+uniform ivec2 depthSize;\n\
+uniform int pyramidLevels;\n\
+uniform mat4 viewProjection;\n\
+uniform float boxMargin;\n\
+bool outsideFrustum(vec3 boxMin, vec3 boxMax){\n\
+	for (int i = 0; i < 6; i++){\n\
+		vec3 furthest = mix(boxMin, boxMax, greaterThanEqual(planes[i].xyz, vec3(0.0)));\n\
+		if (dot(planes[i].xyz, furthest) + planes[i].w < 0.0) return true;\n\
+	}\n\
+	return false;\n\
+}\n\
+bool hidden(vec3 boxMin, vec3 boxMax){\n\
+	boxMin -= boxMargin;\n\
+	boxMax += boxMargin;\n\
+	vec2 size = vec2(depthSize);\n\
+	vec2 rectMin = size, rectMax = vec2(0.0);\n\
+	float nearest = 1.0;\n\
+	for (int i = 0; i < 8; i++){\n\
+		vec4 clip = viewProjection * vec4(mix(boxMin, boxMax, vec3(i & 1, (i >> 1) & 1, (i >> 2) & 1)), 1.0);\n\
+		if (clip.w <= 0.0) return false;\n\
+		vec3 ndc = clip.xyz / clip.w;\n\
+		vec2 pixel = (ndc.xy * 0.5 + 0.5) * size;\n\
+		rectMin = min(rectMin, pixel);\n\
+		rectMax = max(rectMax, pixel);\n\
+		nearest = min(nearest, ndc.z * 0.5 + 0.5);\n\
+	}\n\
+	rectMin = max(rectMin, vec2(0.0));\n\
+	rectMax = min(rectMax, size - 1.0);\n\
+	if (any(greaterThan(rectMin, rectMax))) return false;\n\
+	// The level where the box covers at most 2x2 texels, each 2^(level + 1) pixels across\n\
+	vec2 extent = rectMax - rectMin;\n\
+	int level = clamp(int(ceil(log2(max(max(extent.x, extent.y), 1.0)))) - 1, 0, pyramidLevels - 1);\n\
+	ivec2 levelSize = max(depthSize >> (level + 1), ivec2(1));\n\
+	ivec2 low = min(ivec2(rectMin) >> (level + 1), levelSize - 1);\n\
+	ivec2 high = min(ivec2(rectMax) >> (level + 1), levelSize - 1);\n\
+	float furthest = max(max(texelFetch(depthPyramid, low, level).r, texelFetch(depthPyramid, ivec2(high.x, low.y), level).r),\n\
+		max(texelFetch(depthPyramid, ivec2(low.x, high.y), level).r, texelFetch(depthPyramid, high, level).r));\n\
+	return nearest > furthest;\n\
+}\n\
+void main(){\n\
+	uint i = gl_GlobalInvocationID.x;\n\
+	if (i >= numRecords) return;\n\
+	DrawRecord record = records[i];\n\
+	LODState state = states[record.info.x];\n\
+	int level = int(record.info.y);\n\
+	uint slot;\n\
+	if (level == state.level && state.fade > 0.0){\n\
+		slot = state.fade >= 1.0 ? 0u : 1u;\n\
+	}\n\
+	else if (level == state.previousLevel && state.fade < 1.0){\n\
+		slot = state.fade > 0.0 ? 2u : 0u;\n\
+	}\n\
+	else{\n\
+		visibility[i] = 0u;\n\
+		history[i] = 0u;\n\
+		return;\n\
+	}\n\
+	if (twoPasses && pass == 0u && history[i] == 0u){\n\
+		visibility[i] = 0u;\n\
+		return;\n\
+	}\n\
+	// Only the last pass counts what's left out, so nothing is counted twice\n\
+	bool lastPass = !twoPasses || pass == 1u;\n\
+	bool drawnBefore = pass == 1u && visibility[i] != 0u;\n\
+	vec3 offset = record.sphere.xyz - camera;\n\
+	bool visible = false;\n\
+	if (frustumCulling && outsideFrustum(record.boundsMin.xyz, record.boundsMax.xyz)){\n\
+		if (lastPass) atomicAdd(counters[0], 1u);\n\
+	}\n\
+	else if (coneCulling && dot(offset, record.cone.xyz) >= record.cone.w * length(offset) + record.sphere.w){\n\
+		if (lastPass) atomicAdd(counters[1], 1u);\n\
+	}\n\
+	else if (pass == 1u && occlusionCulling && hidden(record.boundsMin.xyz, record.boundsMax.xyz)){\n\
+		if (!drawnBefore) atomicAdd(counters[2], 1u);\n\
+	}\n\
+	else{\n\
+		visible = true;\n\
+	}\n\
+	if (lastPass) history[i] = visible ? 1u : 0u;\n\
+	if (visible && !drawnBefore){\n\
+		visibility[i] = 1u + slot + (slot != 0u || record.info.z != ALPHA_OPAQUE ? 4u : 0u);\n\
+		atomicAdd(counters[3], 1u);\n\
+		atomicAdd(counters[4], record.draw.x / 3u);\n\
+	}\n\
+	else{\n\
+		visibility[i] = 0u;\n\
+	}\n\
+}\n";
+
+/*
+	Turns the visible records of each of GPUCuller's groups into draw commands, one work group per group
+	The group's commands without the discard program go at firstCommand and the ones with it numRecords after that,
+	both in record order, which a prefix sum over each 256 records at a time works out. How many of each there are goes
+	in counts, two per group.
+*/
+const std::string GPU_COMPACT_SHADER = "\
+#version 430 core\n\
+layout(local_size_x = 256) in;\n" + GPU_CULL_STRUCTS + "\
+struct DrawGroup{\n\
+	uint firstRecord, numRecords, firstCommand, padding;\n\
+};\n\
+layout(std430, binding = 0) readonly buffer Records{ DrawRecord records[]; };\n\
+layout(std430, binding = 2) readonly buffer Visibility{ uint visibility[]; };\n\
+layout(std430, binding = 4) readonly buffer Groups{ DrawGroup groups[]; };\n\
+layout(std430, binding = 5) writeonly buffer Commands{ uint commands[]; };\n\
+layout(std430, binding = 6) writeonly buffer Counts{ uint counts[]; };\n\
+shared uint sums[256];\n\
+void main(){\n\
+	DrawGroup group = groups[gl_WorkGroupID.x];\n\
+	uint local = gl_LocalInvocationID.x;\n\
+	uint normalCount = 0u, discardCount = 0u;\n\
+	for (uint first = 0u; first < group.numRecords; first += 256u){\n\
+		uint i = first + local;\n\
+		uint visible = i < group.numRecords ? visibility[group.firstRecord + i] : 0u;\n\
+		// Both counts are summed at once: commands without discard in the low 16 bits and with it above\n\
+		uint flag = visible == 0u ? 0u : (visible & 4u) != 0u ? 0x10000u : 1u;\n\
+		sums[local] = flag;\n\
+		barrier();\n\
+		for (uint step = 1u; step < 256u; step *= 2u){\n\
+			uint add = local >= step ? sums[local - step] : 0u;\n\
+			barrier();\n\
+			sums[local] += add;\n\
+			barrier();\n\
+		}\n\
+		if (visible != 0u){\n\
+			uint before = sums[local] - flag;\n\
+			uint command = (visible & 4u) != 0u ? group.firstCommand + group.numRecords + discardCount + (before >> 16)\n\
+				: group.firstCommand + normalCount + (before & 0xFFFFu);\n\
+			uvec4 draw = records[group.firstRecord + i].draw;\n\
+			commands[command * 5u] = draw.x;\n\
+			commands[command * 5u + 1u] = 1u;\n\
+			commands[command * 5u + 2u] = draw.y;\n\
+			commands[command * 5u + 3u] = draw.z;\n\
+			commands[command * 5u + 4u] = draw.w + (visible & 3u) - 1u;\n\
+		}\n\
+		uint total = sums[255];\n\
+		normalCount += total & 0xFFFFu;\n\
+		discardCount += total >> 16;\n\
+		barrier();\n\
+	}\n\
+	if (local == 0u){\n\
+		counts[gl_WorkGroupID.x * 2u] = normalCount;\n\
+		counts[gl_WorkGroupID.x * 2u + 1u] = discardCount;\n\
+	}\n\
+}\n";
+
+/*
+	Culls the scene, picks LODs and writes the draw commands on the GPU, so the CPU's work each frame doesn't depend on
+	how many meshes or meshlets there are
+	Every meshlet of every mesh, and every simplified LOD level of it, is a record in a shader storage buffer. Records
+	are grouped by pass and batch, the order BatchedScene::draw sorts its commands into. Each frame GPU_LOD_SHADER
+	picks the meshes' LODs, GPU_CULL_SHADER tests the records of those levels against the frustum and their normal
+	cones, and GPU_COMPACT_SHADER packs what's left into draw commands and counts. Then every group is drawn with
+	glMultiDrawElementsIndirectCountARB (twice for opaque meshes, with and without the discard program).
+	With OCCLUSION_CULLING that's done twice: first for what was visible last frame, then, after building a
+	DepthPyramid from that, for everything else that isn't hidden behind it. Nothing pops in when the camera turns
+	quickly, since the second pass only trusts this frame's depth. Blended meshes are left out altogether, so Scene
+	can still sort them back to front on the CPU.
+	The counters come back a few frames late, once a fence says they're ready, so nothing waits on the GPU.
+	Needs OpenGL 4.3 and GL_ARB_indirect_parameters (check isSupported()) and the BatchedScene it was built for, and has
+	to be built again along with it.
+*/
+class GPUCuller{
+		// These match the structs in GPU_CULL_STRUCTS, GPU_LOD_SHADER and GPU_COMPACT_SHADER
+		struct DrawRecord{
+			float boundsMin[4], boundsMax[4];
+			float sphere[4], cone[4];
+			GLuint count, firstIndex;
+			GLint baseVertex;
+			GLuint firstSlot;
+			GLuint mesh, level, alphaMode, padding;
+		};
+		struct MeshInfo{
+			float boundsMin[4], boundsMax[4];
+			float errors[4];
+			GLuint numLevels, firstSlot, padding[2];
+		};
+		struct LODState{
+			GLint level, previousLevel;
+			float fade, padding;
+		};
+		struct DrawGroup{
+			GLuint firstRecord, numRecords, firstCommand, padding;
+		};
+
+		// What GPU_CULL_SHADER counts, in order
+		enum Counter{
+			COUNTER_CULLED,
+			COUNTER_BACKFACING,
+			COUNTER_OCCLUDED,
+			COUNTER_DRAWN,
+			COUNTER_TRIANGLES,
+			NUM_COUNTERS
+		};
+		// Each frame's counters go in the next of these, so one can be read while others are still being written
+		static const int COUNTER_FRAMES = 3;
+		// Boxes are grown this much for the depth pyramid test, so a meshlet's own depth can't hide it
+		static constexpr float OCCLUSION_MARGIN = 0.01f;
+
+		GLBuffer recordBuffer, meshBuffer, stateBuffer, visibilityBuffer, historyBuffer, groupBuffer;
+		// One set per pass, so the second pass doesn't overwrite commands the first is still drawing from
+		GLBuffer commandBuffers[2], countBuffers[2];
+		GLBuffer counterBuffers[COUNTER_FRAMES];
+		GLsync counterFences[COUNTER_FRAMES] = {};
+		size_t frame = 0;
+		// Two per group, in the order they're drawn: without the discard program, then with it
+		std::vector<BatchedScene::Run> runs;
+		size_t numRecords = 0, numMeshes = 0, numGroups = 0;
+		GLuint lodProgramID = 0, cullProgramID = 0, compactProgramID = 0;
+		DepthPyramid depthPyramid;
+		// From the newest frame whose counters have come back
+		CullStats stats = {0, 0, 0, 0, 0};
+		size_t triangles = 0;
+		size_t gpuBytes = 0;
+
+		template <typename T>
+		void createBuffer(GLBuffer& buffer, const std::vector<T>& data){
+			glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer.create());
+			glBufferData(GL_SHADER_STORAGE_BUFFER, std::max<size_t>(sizeof(T) * data.size(), sizeof(T)), data.data(), GL_STATIC_DRAW);
+			gpuBytes += sizeof(T) * data.size();
+		}
+
+		static DrawRecord makeRecord(const AABB& bounds, const glm::vec3& centre, float radius, const glm::vec3& coneAxis, float coneCutoff){
+			DrawRecord record = {};
+			for (int i = 0; i < 3; i++){
+				record.boundsMin[i] = bounds.min[i];
+				record.boundsMax[i] = bounds.max[i];
+				record.sphere[i] = centre[i];
+				record.cone[i] = coneAxis[i];
+			}
+			record.sphere[3] = radius;
+			record.cone[3] = coneCutoff;
+			return record;
+		}
+
+		// Reads the counters of every frame the GPU has finished since last time, keeping the newest
+		void readCounters(){
+			for (int i = 0; i < COUNTER_FRAMES; i++){
+				size_t slot = (frame + i) % COUNTER_FRAMES;
+				if (counterFences[slot] == 0){
+					continue;
+				}
+				GLenum status = glClientWaitSync(counterFences[slot], GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+				if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED){
+					continue;
+				}
+				glDeleteSync(counterFences[slot]);
+				counterFences[slot] = 0;
+				GLuint counters[NUM_COUNTERS];
+				glBindBuffer(GL_SHADER_STORAGE_BUFFER, counterBuffers[slot].get());
+				glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(counters), counters);
+				stats.culled = counters[COUNTER_CULLED];
+				stats.backfacing = counters[COUNTER_BACKFACING];
+				stats.occluded = counters[COUNTER_OCCLUDED];
+				stats.drawn = counters[COUNTER_DRAWN];
+				triangles = counters[COUNTER_TRIANGLES];
+			}
+		}
+
+		// Culls the records for one pass (see GPU_CULL_SHADER), then writes and draws its commands
+		void drawPass(int pass, bool twoPasses, const glm::mat4& viewProjection, BatchedScene& batchedScene){
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, commandBuffers[pass].get());
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, countBuffers[pass].get());
+			bool occlusion = pass == 1 && depthPyramid.isValid();
+			glState.useProgram(cullProgramID);
+			glUniform1ui(shaderPrograms.uniformLocation(cullProgramID, "pass"), pass);
+			glUniform1i(shaderPrograms.uniformLocation(cullProgramID, "twoPasses"), twoPasses);
+			glUniform1i(shaderPrograms.uniformLocation(cullProgramID, "occlusionCulling"), occlusion);
+			if (occlusion){
+				glState.bindTexture(GL_TEXTURE_2D, depthPyramid.getTexture());
+				glUniform2i(shaderPrograms.uniformLocation(cullProgramID, "depthSize"), depthPyramid.getWidth(), depthPyramid.getHeight());
+				glUniform1i(shaderPrograms.uniformLocation(cullProgramID, "pyramidLevels"), depthPyramid.getLevels());
+			}
+			glDispatchCompute((numRecords + 63) / 64, 1, 1);
+			glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+			glState.useProgram(compactProgramID);
+			glDispatchCompute(numGroups, 1, 1);
+			// The commands, counts and dither ranges are all read by the draws, and the visibility by the next pass
+			glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+			batchedScene.drawIndirectCount(viewProjection, commandBuffers[pass].get(), countBuffers[pass].get(), runs);
+		}
+
+	public:
+
+		static bool isSupported(){
+			return glewIsSupported("GL_VERSION_4_3") && glewIsSupported("GL_ARB_indirect_parameters");
+		}
+
+		GPUCuller(const std::vector<TexturedMesh>& meshes, const BatchedScene& batchedScene){
+			lodProgramID = shaderPrograms.getCompute(GPU_LOD_SHADER);
+			cullProgramID = shaderPrograms.getCompute(GPU_CULL_SHADER);
+			compactProgramID = shaderPrograms.getCompute(GPU_COMPACT_SHADER);
+
+			// Group the meshes by pass, then batch, keeping them in order within each group
+			std::map<std::pair<int, size_t>, std::vector<int>> groupMeshes;
+			for (size_t i = 0; i < meshes.size(); i++){
+				if (meshes[i].getAlphaMode() == ALPHA_BLENDED){
+					continue;
+				}
+				groupMeshes[{meshes[i].getAlphaMode(), batchedScene.getLocation(i).batch}].push_back(i);
+			}
+			std::vector<DrawRecord> records;
+			std::vector<DrawGroup> groups;
+			for (const std::pair<const std::pair<int, size_t>, std::vector<int>>& entry : groupMeshes){
+				DrawGroup group = {(GLuint) records.size(), 0, (GLuint) records.size() * 2, 0};
+				for (int mesh : entry.second){
+					const BatchedScene::MeshLocation& location = batchedScene.getLocation(mesh);
+					AlphaMode alphaMode = meshes[mesh].getAlphaMode();
+					// The original mesh is culled a meshlet at a time, and simplified levels whole
+					for (const DrawCluster& cluster : meshes[mesh].getClusters()){
+						DrawRecord record = makeRecord(cluster.bounds, cluster.centre, cluster.radius, cluster.coneAxis, cluster.coneCutoff);
+						record.count = cluster.numTriangles * 3;
+						record.firstIndex = location.firstIndex + cluster.firstTriangle * 3;
+						record.baseVertex = location.baseVertex;
+						record.firstSlot = location.firstSlot;
+						record.mesh = mesh;
+						record.level = 0;
+						record.alphaMode = alphaMode;
+						records.push_back(record);
+					}
+					const std::vector<MeshLOD>& lods = meshes[mesh].getLODs();
+					const AABB& bounds = meshes[mesh].getBounds();
+					for (size_t level = 1; level < lods.size(); level++){
+						DrawRecord record = makeRecord(bounds, bounds.centre(), 0.0f, glm::vec3(0.0f), 1.0f);
+						record.count = lods[level].numIndices;
+						record.firstIndex = location.firstIndex + lods[level].firstIndex;
+						record.baseVertex = location.baseVertex;
+						record.firstSlot = location.firstSlot;
+						record.mesh = mesh;
+						record.level = level;
+						record.alphaMode = alphaMode;
+						records.push_back(record);
+					}
+				}
+				group.numRecords = records.size() - group.firstRecord;
+				groups.push_back(group);
+				// Alpha-tested meshes always need the discard program
+				AlphaMode pass = (AlphaMode) entry.first.first;
+				size_t batch = entry.first.second;
+				runs.push_back({batch, pass, false, group.firstCommand, pass == ALPHA_TESTED ? 0 : group.numRecords});
+				runs.push_back({batch, pass, true, group.firstCommand + group.numRecords, group.numRecords});
+			}
+			numRecords = records.size();
+			numGroups = groups.size();
+			numMeshes = meshes.size();
+
+			std::vector<MeshInfo> meshInfo(meshes.size());
+			for (size_t i = 0; i < meshes.size(); i++){
+				const AABB& bounds = meshes[i].getBounds();
+				const std::vector<MeshLOD>& lods = meshes[i].getLODs();
+				MeshInfo& info = meshInfo[i];
+				info = {};
+				for (int j = 0; j < 3; j++){
+					info.boundsMin[j] = bounds.min[j];
+					info.boundsMax[j] = bounds.max[j];
+				}
+				// No levels means GPU_LOD_SHADER skips it
+				info.numLevels = meshes[i].getAlphaMode() == ALPHA_BLENDED ? 0 : std::min<size_t>(lods.size(), 4);
+				for (GLuint level = 0; level < info.numLevels; level++){
+					info.errors[level] = lods[level].error;
+				}
+				info.firstSlot = batchedScene.getLocation(i).firstSlot;
+			}
+
+			createBuffer(recordBuffer, records);
+			createBuffer(meshBuffer, meshInfo);
+			createBuffer(stateBuffer, std::vector<LODState>(meshes.size(), {0, 0, 1.0f, 0.0f}));
+			createBuffer(visibilityBuffer, std::vector<GLuint>(numRecords, 0));
+			// Nothing was visible last frame, so the first frame is all drawn in the second pass
+			createBuffer(historyBuffer, std::vector<GLuint>(numRecords, 0));
+			createBuffer(groupBuffer, groups);
+			for (int pass = 0; pass < 2; pass++){
+				createBuffer(commandBuffers[pass], std::vector<BatchedScene::DrawElementsIndirectCommand>(numRecords * 2));
+				createBuffer(countBuffers[pass], std::vector<GLuint>(numGroups * 2, 0));
+			}
+			for (GLBuffer& buffer : counterBuffers){
+				createBuffer(buffer, std::vector<GLuint>(NUM_COUNTERS, 0));
+			}
+			glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+			printf("GPU culling %zu records in %zu groups\n", numRecords, numGroups);
+		}
+
+		~GPUCuller(){
+			for (GLsync fence : counterFences){
+				if (fence != 0){
+					glDeleteSync(fence);
+				}
+			}
+		}
+
+		/*
+			Culls and draws the scene through batchedScene, as seen with viewProjection from camera. seconds is how long
+			it's been since the last frame, for LOD fading.
+			Returns the counters from the newest frame the GPU has finished, which is usually a frame or two ago
+		*/
+		CullStats draw(const glm::mat4& viewProjection, const glm::vec3& camera, float seconds, BatchedScene& batchedScene){
+			readCounters();
+			if (numRecords == 0){
+				return stats;
+			}
+			size_t slot = frame % COUNTER_FRAMES;
+			GLuint buffers[] = {recordBuffer.get(), stateBuffer.get(), visibilityBuffer.get(), counterBuffers[slot].get(),
+				groupBuffer.get(), commandBuffers[0].get(), countBuffers[0].get(), historyBuffer.get()};
+			for (GLuint binding = 0; binding < sizeof(buffers) / sizeof(buffers[0]); binding++){
+				glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding, buffers[binding]);
+			}
+
+			// LODs first, since the culling needs to know which levels are drawn
+			float pixelsPerUnit = SCREEN_HEIGHT / (2.0f * tan(glm::radians(FOV) / 2.0f));
+			glState.useProgram(lodProgramID);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, meshBuffer.get());
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, batchedScene.getDrawDataBuffer());
+			glUniform1ui(shaderPrograms.uniformLocation(lodProgramID, "numMeshes"), numMeshes);
+			glUniform3fv(shaderPrograms.uniformLocation(lodProgramID, "camera"), 1, &camera[0]);
+			glUniform1f(shaderPrograms.uniformLocation(lodProgramID, "pixelsPerUnit"), pixelsPerUnit);
+			glUniform1f(shaderPrograms.uniformLocation(lodProgramID, "pixelError"), LOD_PIXEL_ERROR);
+			glUniform1f(shaderPrograms.uniformLocation(lodProgramID, "fadeStep"), LOD_FADE_SECONDS > 0 ? seconds / LOD_FADE_SECONDS : 1.0f);
+			glUniform1f(shaderPrograms.uniformLocation(lodProgramID, "startFade"), LOD_FADE_SECONDS > 0 ? 0.0f : 1.0f);
+			glDispatchCompute((numMeshes + 63) / 64, 1, 1);
+			glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, recordBuffer.get());
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, visibilityBuffer.get());
+
+			glBindBuffer(GL_SHADER_STORAGE_BUFFER, counterBuffers[slot].get());
+			glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
+			glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+			Frustum frustum(viewProjection);
+			glState.useProgram(cullProgramID);
+			glUniform1ui(shaderPrograms.uniformLocation(cullProgramID, "numRecords"), numRecords);
+			glUniform1i(shaderPrograms.uniformLocation(cullProgramID, "frustumCulling"), FRUSTUM_CULLING);
+			glUniform1i(shaderPrograms.uniformLocation(cullProgramID, "coneCulling"), CONE_CULLING);
+			glUniform4fv(shaderPrograms.uniformLocation(cullProgramID, "planes[0]"), 6, &frustum.planes[0][0]);
+			glUniform3fv(shaderPrograms.uniformLocation(cullProgramID, "camera"), 1, &camera[0]);
+			glUniformMatrix4fv(shaderPrograms.uniformLocation(cullProgramID, "viewProjection"), 1, GL_FALSE, &viewProjection[0][0]);
+			glUniform1f(shaderPrograms.uniformLocation(cullProgramID, "boxMargin"), OCCLUSION_MARGIN);
+
+			drawPass(0, OCCLUSION_CULLING, viewProjection, batchedScene);
+			if (OCCLUSION_CULLING){
+				{
+					ProfileZone zone("depth pyramid", true);
+					depthPyramid.build();
+				}
+				drawPass(1, true, viewProjection, batchedScene);
+			}
+
+			if (counterFences[slot] != 0){
+				// Never came back, so just skip that frame's counters
+				glDeleteSync(counterFences[slot]);
+			}
+			counterFences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			frame++;
+			frameCounters.triangles += triangles;
+			return stats;
+		}
+
+		size_t getGPUBytes() const{
+			return gpuBytes + depthPyramid.getGPUBytes();
+		}
+};
+
+
+/*
+	Watches the scene manifest and every file it lists with inotify, for hot reloading
+	The directories the files are in get watched rather than the files themselves, since a lot of editors save by
+	writing a new file and renaming it over the old one, which a watch on the old file would never see. Only files that
+	were closed after writing (IN_CLOSE_WRITE) or renamed into place (IN_MOVED_TO) count, so half-written files are
+	never reported. poll() never blocks, so it can be called every frame.
+*/
+class SceneWatcher{
+		// Files have to be left alone this long before poll() reports them, so a save that writes several times (or
+		// several files saved together) only reloads once
+		static constexpr std::chrono::milliseconds SETTLE_TIME{200};
+
+		int fd = -1;
+		// Watch descriptor -> directory
+		std::unordered_map<int, std::string> directories;
+		std::set<std::string> watchedDirectories;
+		// Normalized paths of the files that matter, and the ones that changed since poll() last reported anything
+		std::set<std::string> files, pending;
+		std::chrono::steady_clock::time_point lastChange;
+
+	public:
+
+		SceneWatcher(){
+			fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+			if (fd < 0){
+				printf("Couldn't start watching files, so nothing will be hot reloaded\n");
+			}
+		}
+
+		~SceneWatcher(){
+			if (fd >= 0){
+				close(fd);
+			}
+		}
+
+		SceneWatcher(const SceneWatcher&) = delete;
+		SceneWatcher& operator=(const SceneWatcher&) = delete;
+
+		// Paths from the manifest and from inotify are compared in this form, so "./assets/a.bmp" matches "assets/a.bmp"
+		static std::string normalize(const std::string& path){
+			return std::filesystem::path(path).lexically_normal().string();
+		}
+
+		// Starts watching the manifest and every file in entries, on top of whatever is already being watched
+		void watch(const std::string& manifestPath, const std::vector<SceneEntry>& entries){
+			if (fd < 0){
+				return;
+			}
+			std::vector<std::string> paths = {manifestPath};
+			for (const SceneEntry& entry : entries){
+				paths.push_back(entry.PLYPath);
+				paths.push_back(entry.texturePath);
+			}
+			for (const std::string& path : paths){
+				std::string file = normalize(path);
+				files.insert(file);
+				std::string directory = std::filesystem::path(file).parent_path().string();
+				if (directory.empty()){
+					directory = ".";
+				}
+				if (!watchedDirectories.insert(directory).second){
+					continue;
+				}
+				int descriptor = inotify_add_watch(fd, directory.data(), IN_CLOSE_WRITE | IN_MOVED_TO);
+				if (descriptor < 0){
+					printf("Couldn't watch %s for changes\n", directory.data());
+					continue;
+				}
+				directories[descriptor] = directory;
+			}
+		}
+
+		/*
+			Reads whatever events have come in, and once the watched files have settled down, adds the normalized paths
+			of the ones that changed to changed
+			Returns true if it added any
+		*/
+		bool poll(std::set<std::string>& changed){
+			if (fd < 0){
+				return false;
+			}
+			alignas(inotify_event) char buffer[4096];
+			ssize_t length;
+			while ((length = read(fd, buffer, sizeof(buffer))) > 0){
+				for (char* p = buffer; p < buffer + length; ){
+					const inotify_event* event = (const inotify_event*) p;
+					p += sizeof(inotify_event) + event->len;
+					std::unordered_map<int, std::string>::const_iterator directory = directories.find(event->wd);
+					if (directory == directories.end() || event->len == 0){
+						continue;
+					}
+					std::string path = normalize(directory->second + "/" + event->name);
+					if (files.count(path) != 0){
+						pending.insert(path);
+						lastChange = std::chrono::steady_clock::now();
+					}
+				}
+			}
+			if (pending.empty() || std::chrono::steady_clock::now() - lastChange < SETTLE_TIME){
+				return false;
+			}
+			changed.insert(pending.begin(), pending.end());
+			pending.clear();
+			return true;
+		}
+};
+
+
+/*
+	Everything needed to draw the room: the meshes plus whatever batching and culling is turned on
+	Needs a current GL context. Used by both the window and --benchmark so they draw exactly the same way.
+*/
+class Scene{
+		// Which LOD a mesh is drawn at. While fade < 1, it's dithering over from previousLevel.
+		struct LODState{
+			int level = 0, previousLevel = 0;
+			float fade = 1.0f;
+		};
+
+		// The manifest lines the meshes were loaded from, in the same order
+		std::vector<SceneEntry> entries;
+		std::vector<TexturedMesh> meshes;
+		std::unique_ptr<BatchedScene> batchedScene;
+		std::unique_ptr<SceneBVH> sceneBVH;
+		std::unique_ptr<OcclusionCuller> occlusionCuller;
+		std::unique_ptr<GPUCuller> gpuCuller;
+		std::vector<DrawRange> visibleRanges, lodRanges;
+		std::vector<LODState> lodStates;
+		std::chrono::steady_clock::time_point lastDraw;
+		RenderQueue renderQueue;
+		// Whether GPU_RESIDENT has freed the meshes' CPU copies yet
+		bool cpuDataReleased = false;
+
+		/*
+			Builds the culling structures for the meshes: a GPUCuller if GPU_CULLING is on and it can run, otherwise the
+			SceneBVH and OcclusionCuller. GPUCuller leaves the blended meshes to a SceneBVH of their own, so they can
+			still be sorted back to front on the CPU.
+		*/
+		void buildCulling(){
+			gpuCuller.reset();
+			sceneBVH.reset();
+			occlusionCuller.reset();
+			if (GPU_CULLING){
+				if (batchedScene && batchedScene->isSupported() && GPUCuller::isSupported()){
+					gpuCuller.reset(new GPUCuller(meshes, *batchedScene));
+					sceneBVH.reset(new SceneBVH(meshes, true));
+					return;
+				}
+				printf("GPU culling needs batched draws, OpenGL 4.3 and GL_ARB_indirect_parameters, culling on the CPU instead\n");
+			}
+			if (FRUSTUM_CULLING){
+				sceneBVH.reset(new SceneBVH(meshes));
+			}
+			if (OCCLUSION_CULLING){
+				occlusionCuller.reset(new OcclusionCuller(meshes));
+			}
+		}
+
+		/*
+			Picks a LOD for every mesh in visibleRanges and replaces its ranges with that LOD's
+			A level's error (in model units) is projected to pixels at the distance of the nearest point of the mesh's
+			bounding box, and the coarsest level under LOD_PIXEL_ERROR wins. Simplified levels are drawn whole, since
+			they're only picked for meshes that are far away (and so usually all on screen) anyway. When a mesh changes
+			level, both levels are drawn dithered for LOD_FADE_SECONDS.
+		*/
+		void selectLODs(const glm::vec3& camera, float seconds){
+			float pixelsPerUnit = SCREEN_HEIGHT / (2.0f * tan(glm::radians(FOV) / 2.0f));
+			for (LODState& state : lodStates){
+				state.fade = std::min(1.0f, state.fade + (LOD_FADE_SECONDS > 0 ? seconds / LOD_FADE_SECONDS : 1.0f));
+			}
+
+			lodRanges.clear();
+			for (size_t first = 0, last; first < visibleRanges.size(); first = last){
+				int mesh = visibleRanges[first].mesh;
+				for (last = first + 1; last < visibleRanges.size() && visibleRanges[last].mesh == mesh; last++);
+				const std::vector<MeshLOD>& lods = meshes[mesh].getLODs();
+				const AABB& bounds = meshes[mesh].getBounds();
+				float distance = glm::length(camera - glm::clamp(camera, bounds.min, bounds.max));
+				int level = 0;
+				while (level + 1 < (int) lods.size() && lods[level + 1].error * pixelsPerUnit <= LOD_PIXEL_ERROR * distance){
+					level++;
+				}
+
+				LODState& state = lodStates[mesh];
+				if (level != state.level){
+					state.previousLevel = state.level;
+					state.level = level;
+					state.fade = LOD_FADE_SECONDS > 0 ? 0.0f : 1.0f;
+				}
+				auto addLevel = [&](int lodLevel, float ditherMin, float ditherMax){
+					if (lodLevel == 0){
+						// The original mesh keeps its culled clusters
+						for (size_t i = first; i < last; i++){
+							DrawRange range = visibleRanges[i];
+							range.ditherMin = ditherMin;
+							range.ditherMax = ditherMax;
+							lodRanges.push_back(range);
+						}
+					}
+					else{
+						const MeshLOD& lod = lods[lodLevel];
+						lodRanges.push_back({mesh, lod.firstIndex / 3, lod.numIndices / 3, ditherMin, ditherMax});
+					}
+				};
+				if (state.fade >= 1.0f){
+					addLevel(state.level, 0.0f, 1.0f);
+				}
+				else if (state.fade > 0.0f){
+					addLevel(state.level, 0.0f, state.fade);
+					addLevel(state.previousLevel, state.fade, 1.0f);
+				}
+				else{
+					addLevel(state.previousLevel, 0.0f, 1.0f);
+				}
+			}
+			visibleRanges.swap(lodRanges);
+		}
+
+	public:
+
+		// Counters from the last draw()
+		CullStats cullStats = {0, 0, 0, 0, 0};
+
+		Scene(const std::vector<SceneEntry>& sceneEntries) : entries(sceneEntries){
+			ProfileZone zone("load scene");
+			// Load data from files
+			// The files are decoded in parallel, but the meshes still end up in the order of the manifest
+			loadMeshesParallel(entries, meshes);
+
+			// Pack everything into as few draw calls as possible
+			if (BATCH_DRAWS){
+				batchedScene.reset(new BatchedScene(meshes));
+			}
+
+			// Culling data only depends on the meshes, which never move, so it's only built again when they're reloaded
+			buildCulling();
+			lodStates.resize(meshes.size());
+			lastDraw = std::chrono::steady_clock::now();
+			printMemoryUsage("after loading");
+
+			// Enable depth testing
+			glEnable(GL_DEPTH_TEST);
+			glDepthFunc(GL_LESS);
+			glClearColor(0,0,0,1);
+		}
+
+		const std::vector<TexturedMesh>& getMeshes() const{
+			return meshes;
+		}
+
+		const std::vector<SceneEntry>& getEntries() const{
+			return entries;
+		}
+
+		/*
+			Brings the scene up to date with a (possibly edited) manifest and the files that changed on disk (normalized
+			paths, from SceneWatcher), reloading only the meshes that need it: new lines, lines that changed, and lines
+			whose PLY or BMP file changed. Lines are matched up with meshes by position.
+			Changed meshes are decoded in parallel, then refilled in place (see TexturedMesh::reload) and copied over
+			their old spot in their batch. If one doesn't fit any more, or meshes were added or removed, the batches
+			are built again. The culling structures are cheap, so they're always rebuilt. A mesh whose files fail to
+			load keeps its old version. Don't call it while textureStreamer is busy.
+			Returns true if anything was reloaded
+		*/
+		bool reload(const std::vector<SceneEntry>& newEntries, const std::set<std::string>& changedFiles){
+			ProfileZone zone("reload scene");
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			std::vector<size_t> changed;
+			for (size_t i = 0; i < newEntries.size(); i++){
+				const SceneEntry& entry = newEntries[i];
+				if (i >= entries.size() || entry != entries[i] || changedFiles.count(SceneWatcher::normalize(entry.PLYPath)) != 0
+						|| changedFiles.count(SceneWatcher::normalize(entry.texturePath)) != 0){
+					changed.push_back(i);
+				}
+			}
+			if (changed.empty() && newEntries.size() == entries.size()){
+				return false;
+			}
+
+			// Decode on worker threads like loadMeshesParallel does, but there's usually only one, so just wait for them
+			std::vector<MeshAsset> assets(changed.size());
+			std::vector<std::exception_ptr> errors(changed.size());
+			std::atomic<size_t> nextAsset(0);
+			std::vector<std::thread> workers;
+			size_t numThreads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), changed.size());
+			for (size_t t = 0; t < numThreads; t++){
+				workers.emplace_back([&](){
+					size_t j;
+					while ((j = nextAsset++) < changed.size()){
+						const SceneEntry& entry = newEntries[changed[j]];
+						assets[j].PLYPath = entry.PLYPath;
+						assets[j].texturePath = entry.texturePath;
+						assets[j].transform = entry.transform;
+						assets[j].oneSided = entry.oneSided;
+						errors[j] = loadMeshAssetCaught(assets[j]);
+					}
+				});
+			}
+			for (std::thread& worker : workers){
+				worker.join();
+			}
+			for (size_t j = 0; j < changed.size(); j++){
+				if (errors[j]){
+					reportMeshAssetException(assets[j].PLYPath, errors[j]);
+				}
+			}
+
+			std::vector<SceneEntry> loadedEntries = newEntries;
+			bool resized = newEntries.size() != entries.size();
+			bool rebuildBatches = resized;
+			bool batched = batchedScene && batchedScene->isSupported();
+			size_t reloaded = 0;
+			lodStates.resize(newEntries.size());
+			for (size_t j = 0; j < changed.size(); j++){
+				size_t i = changed[j];
+				MeshAsset& asset = assets[j];
+				if (i >= meshes.size()){
+					// New meshes go in even if they're broken, same as when the scene is first loaded
+					meshes.emplace_back(std::move(asset));
+					reloaded++;
+					continue;
+				}
+				if (asset.PLYResult != 0 || (asset.texture.empty() && asset.mipLevels.empty())){
+					printf("Couldn't reload %s, keeping the old version\n", asset.PLYPath.data());
+					loadedEntries[i] = entries[i];
+					continue;
+				}
+				bool kept = meshes[i].reload(asset);
+				if (batched && !rebuildBatches){
+					rebuildBatches = !kept || !batchedScene->updateMesh(i, meshes[i]);
+				}
+				// Its LODs may be different now
+				lodStates[i] = LODState();
+				reloaded++;
+			}
+			if (meshes.size() > newEntries.size()){
+				meshes.erase(meshes.begin() + newEntries.size(), meshes.end());
+			}
+			entries = loadedEntries;
+
+			if (batched && rebuildBatches){
+				batchedScene.reset(new BatchedScene(meshes));
+			}
+			buildCulling();
+			// Reloaded meshes have CPU copies again
+			cpuDataReleased = false;
+			double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			printf("Reloaded %zu of %zu meshes in %.1f ms (%s)\n", reloaded, meshes.size(), milliseconds,
+				!batched ? "not batched" : rebuildBatches ? "rebuilt the batches" : "updated the batches in place");
+			return reloaded > 0 || resized;
+		}
+
+		// Every mesh's memory use added up, plus the batches' copies of their buffers and textures
+		MemoryUsage memoryUsage() const{
+			MemoryUsage usage;
+			for (const TexturedMesh& mesh : meshes){
+				usage += mesh.memoryUsage();
+			}
+			if (batchedScene && batchedScene->isSupported()){
+				usage.gpuBytes += batchedScene->getGPUBytes();
+			}
+			if (gpuCuller){
+				usage.gpuBytes += gpuCuller->getGPUBytes();
+			}
+			return usage;
+		}
+
+		// Prints every mesh's memory use, then the totals and the process's resident set size
+		void printMemoryUsage(const char* when) const{
+			const double KB = 1024.0, MB = 1024.0 * 1024.0;
+			printf("Memory %s:\n", when);
+			for (const TexturedMesh& mesh : meshes){
+				MemoryUsage usage = mesh.memoryUsage();
+				printf("  %s: %.1f KB CPU, %.1f KB mapped, %.1f KB GPU\n", mesh.getPLYPath().data(), usage.cpuBytes / KB,
+					usage.mappedBytes / KB, usage.gpuBytes / KB);
+			}
+			MemoryUsage total = memoryUsage();
+			printf("  Total: %.2f MB CPU, %.2f MB mapped, %.2f MB GPU (%.2f MB of it batched copies), %.2f MB resident\n",
+				total.cpuBytes / MB, total.mappedBytes / MB, total.gpuBytes / MB,
+				batchedScene && batchedScene->isSupported() ? batchedScene->getGPUBytes() / MB : 0.0, residentBytes() / MB);
+		}
+
+		// Waits for every texture to finish streaming in, so benchmarks don't measure the blurry start
+		void finishStreaming(){
+			std::vector<StreamedLevel> streamed;
+			textureStreamer.finish(streamed);
+			if (batchedScene && batchedScene->isSupported()){
+				batchedScene->texturesStreamed(streamed);
+			}
+		}
+
+		// Clears the screen and draws every mesh, skipping anything outside the view
+		void draw(const glm::mat4& projection, const glm::mat4& view){
+			ProfileZone zone("draw scene", true);
+			const std::vector<StreamedLevel>& streamed = textureStreamer.update();
+			if (batchedScene && batchedScene->isSupported()){
+				batchedScene->texturesStreamed(streamed);
+			}
+			// Once the streamer has read the last of the texels, the GPU has everything and the CPU copies can go
+			if (GPU_RESIDENT && !cpuDataReleased && !textureStreamer.busy()){
+				for (TexturedMesh& mesh : meshes){
+					mesh.releaseCPUData();
+				}
+				cpuDataReleased = true;
+				printMemoryUsage("after freeing the CPU copies");
+			}
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			glState.resetCounters();
+			frameCounters.reset();
+
+			glm::mat4 model = glm::mat4(1.0f);
+			glm::mat4 mvp = projection * view * model;
+			std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+			float seconds = std::chrono::duration<float>(now - lastDraw).count();
+			lastDraw = now;
+			glm::vec3 camera = glm::vec3(glm::inverse(view)[3]);
+
+			// Culling, LODs and the draw commands all happen on the GPU, and its counters come back a few frames late.
+			// Blended meshes come after, culled and sorted on the CPU.
+			if (gpuCuller){
+				{
+					ProfileZone cullZone("GPU culling", true);
+					cullStats = gpuCuller->draw(projection * view, camera, seconds, *batchedScene);
+				}
+				CullStats blendedStats = sceneBVH->cull(projection * view, camera, visibleRanges);
+				cullStats.culled += blendedStats.culled;
+				cullStats.backfacing += blendedStats.backfacing;
+				cullStats.drawn += blendedStats.drawn;
+				if (GENERATE_LODS){
+					selectLODs(camera, seconds);
+				}
+				batchedScene->draw(mvp, visibleRanges, camera);
+				return;
+			}
+
+			// Even with nothing to cull, everything goes through the ranges so it can be sorted by pass and distance
+			if (sceneBVH){
+				ProfileZone cullZone("cull");
+				cullStats = sceneBVH->cull(projection * view, camera, visibleRanges);
+			}
+			else{
+				visibleRanges.clear();
+				for (size_t i = 0; i < meshes.size(); i++){
+					visibleRanges.push_back({(int) i, 0, meshes[i].getLODs()[0].numIndices / 3});
+				}
+			}
+			if (occlusionCuller){
+				cullStats.occluded = occlusionCuller->filter(visibleRanges, camera);
+			}
+			if (GENERATE_LODS){
+				ProfileZone lodZone("select LODs");
+				selectLODs(camera, seconds);
+			}
+			if (batchedScene && batchedScene->isSupported()){
+				batchedScene->draw(mvp, visibleRanges, camera);
+			}
+			else{
+				// Ranges are sorted by mesh, so each mesh's ranges (for each of its LODs) are next to each other
+				for (size_t first = 0, last; first < visibleRanges.size(); first = last){
+					const DrawRange& range = visibleRanges[first];
+					for (last = first + 1; last < visibleRanges.size() && visibleRanges[last].mesh == range.mesh
+						&& visibleRanges[last].ditherMin == range.ditherMin; last++);
+					TexturedMesh& mesh = meshes[range.mesh];
+					float distance = drawOrderDistance(mesh.getBounds(), mesh.getAlphaMode(), camera);
+					renderQueue.push(mesh, distance, &visibleRanges[first], last - first);
+				}
+				renderQueue.flush(mvp);
+			}
+			// Blended meshes don't write depth, so only opaque and alpha-tested ones can hide anything from the queries
+			if (occlusionCuller){
+				ProfileZone occlusionZone("occlusion queries", true);
+				occlusionCuller->test(projection * view);
+			}
+		}
+};
+
+/*
+	A fixed set of worker threads that run batches of numbered tasks (the software renderer's tiles)
+	Every worker has its own queue with an even share of the tasks. It works through its own queue from the back, and
+	once that's empty it steals from the front of the others, so a worker that got the cheap tasks (tiles of empty
+	wall, say) helps with the busy ones instead of sitting idle. The thread that calls run() works too, as worker 0.
+	The threads stay around between batches so a frame doesn't pay for starting them.
+*/
+class WorkStealingPool{
+		struct TaskQueue{
+			std::mutex mutex;
+			std::deque<int> tasks;
+		};
+
+		std::vector<std::thread> threads;
+		std::vector<std::unique_ptr<TaskQueue>> queues;
+		std::mutex mutex;
+		std::condition_variable startCondition, doneCondition;
+		const std::function<void(int)>* job = nullptr;
+		// Bumped for every run() so the workers know there's a new batch
+		uint64_t generation = 0;
+		size_t workersDone = 0;
+		bool stopping = false;
+
+		bool takeTask(size_t worker, int& task){
+			{
+				TaskQueue& own = *queues[worker];
+				std::lock_guard<std::mutex> lock(own.mutex);
+				if (!own.tasks.empty()){
+					task = own.tasks.back();
+					own.tasks.pop_back();
+					return true;
+				}
+			}
+			for (size_t i = 1; i < queues.size(); i++){
+				TaskQueue& victim = *queues[(worker + i) % queues.size()];
+				std::lock_guard<std::mutex> lock(victim.mutex);
+				if (!victim.tasks.empty()){
+					task = victim.tasks.front();
+					victim.tasks.pop_front();
+					return true;
+				}
+			}
+			return false;
+		}
+
+		void work(size_t worker){
+			int task;
+			while (takeTask(worker, task)){
+				(*job)(task);
+			}
+		}
+
+		void workerLoop(size_t worker){
+			uint64_t seen = 0;
+			while (true){
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					startCondition.wait(lock, [&](){ return stopping || generation != seen; });
+					if (stopping){
+						return;
+					}
+					seen = generation;
+				}
+				work(worker);
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					workersDone++;
+				}
+				doneCondition.notify_one();
+			}
+		}
+
+	public:
+
+		WorkStealingPool(size_t numThreads = std::thread::hardware_concurrency()){
+			numThreads = std::max<size_t>(1, numThreads);
+			for (size_t i = 0; i < numThreads; i++){
+				queues.emplace_back(new TaskQueue());
+			}
+			for (size_t i = 1; i < numThreads; i++){
+				threads.emplace_back(&WorkStealingPool::workerLoop, this, i);
+			}
+		}
+
+		~WorkStealingPool(){
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+			}
+			startCondition.notify_all();
+			for (std::thread& thread : threads){
+				thread.join();
+			}
+		}
+
+		WorkStealingPool(const WorkStealingPool&) = delete;
+		WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+		size_t size() const{
+			return queues.size();
+		}
+
+		// Runs task(0) to task(numTasks - 1) spread over every worker, and returns once they've all finished
+		void run(int numTasks, const std::function<void(int)>& task){
+			size_t numQueues = queues.size();
+			for (size_t i = 0; i < numQueues; i++){
+				std::lock_guard<std::mutex> lock(queues[i]->mutex);
+				int first = (int) (numTasks * i / numQueues), last = (int) (numTasks * (i + 1) / numQueues);
+				for (int t = first; t < last; t++){
+					queues[i]->tasks.push_back(t);
+				}
+			}
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				job = &task;
+				workersDone = 0;
+				generation++;
+			}
+			startCondition.notify_all();
+			work(0);
+			std::unique_lock<std::mutex> lock(mutex);
+			doneCondition.wait(lock, [&](){ return workersDone == threads.size(); });
+			job = nullptr;
+		}
+};
+
+// A mesh's texture for the software renderer: every mip level, as 4-byte BGRA pixels like the BMP files
+struct SoftwareTexture{
+	// Levels built by buildMipLevels. Baked assets point straight into their mapped file instead.
+	std::vector<std::vector<unsigned char>> ownedLevels;
+	std::vector<TextureLevel> levels;
+
+	// Bilinear sample of one mip level, wrapping like GL_REPEAT. Writes 4 BGRA values between 0 and 255.
+	void sample(float u, float v, int level, float* bgra) const{
+		if (levels.empty()){
+			bgra[0] = bgra[1] = bgra[2] = 128.0f;
+			bgra[3] = 255.0f;
+			return;
+		}
+		const TextureLevel& mip = levels[level];
+		int width = mip.width, height = mip.height;
+		float x = u * width - 0.5f, y = v * height - 0.5f;
+		float floorX = floorf(x), floorY = floorf(y);
+		float fx = x - floorX, fy = y - floorY;
+		// Most samples are already inside the texture, so only pay for the modulo when they aren't
+		auto wrap = [](int i, int size){
+			if ((unsigned int) i < (unsigned int) size){
+				return i;
+			}
+			i %= size;
+			return i < 0 ? i + size : i;
+		};
+		int x0 = wrap((int) floorX, width), y0 = wrap((int) floorY, height);
+		int x1 = x0 + 1 == width ? 0 : x0 + 1, y1 = y0 + 1 == height ? 0 : y0 + 1;
+		const unsigned char* row0 = mip.data + (size_t) y0 * width * 4;
+		const unsigned char* row1 = mip.data + (size_t) y1 * width * 4;
+		for (int c = 0; c < 4; c++){
+			float top = row0[x0 * 4 + c] + (row0[x1 * 4 + c] - row0[x0 * 4 + c]) * fx;
+			float bottom = row1[x0 * 4 + c] + (row1[x1 * 4 + c] - row1[x0 * 4 + c]) * fx;
+			bgra[c] = top + (bottom - top) * fy;
+		}
+	}
+};
+
+/*
+	Draws the scene entirely on the CPU into a framebuffer that can be saved (saveBMP) or shown in the window (blit),
+	for machines without a GPU, and as a reference to check the GL path against
+	It loads the same PLY and BMP files (through loadMeshAsset, so bakes work too) and follows the same rules as
+	Scene: a GL_LESS depth test, opaque and alpha-tested meshes front to back, alpha-tested texels under
+	ALPHA_TEST_CUTOFF thrown away, and blended meshes last, back to front, without writing depth. A frame goes:
+	1. Meshes outside the view frustum are skipped. The rest have their vertices transformed to clip space, their
+	   triangles clipped against the near plane, and each triangle set up as three edge functions plus screen-space
+	   planes for depth, 1/w, and the texture and lightmap coordinates over w.
+	2. Each triangle is binned into every SOFTWARE_TILE_SIZE tile its bounding box overlaps, except tiles that are
+	   completely outside one of its edges.
+	3. The tiles are spread over a WorkStealingPool. Each tile draws its triangles in order, 8 pixels of a row at a
+	   time: the edge functions and the depth test run on all 8 at once (with AVX2 if it's compiled with -mavx2,
+	   otherwise one at a time), then each pixel that passed gets perspective-correct UVs, a bilinear sample from
+	   the nearest mip level, and one from the lightmap if the mesh has one.
+	Tiles never share pixels, so they write straight into the framebuffer without locking. There's no multisampling.
+*/
+class SoftwareRenderer{
+		struct Mesh{
+			MeshAsset asset;
+			SoftwareTexture texture;
+			// One level pointing at asset.lightmap's pixels, or no levels if the mesh doesn't have a lightmap
+			SoftwareTexture lightmap;
+			AABB bounds;
+		};
+
+		/*
+			A triangle ready to rasterize, in pixels with y going down. Edge i is the one across from vertex i, and is
+			edgeA * x + edgeB * y + edgeC, which is positive inside. Every plane is {change per pixel in x, change per
+			pixel in y, value at pixel (0, 0)}.
+		*/
+		struct Triangle{
+			float edgeA[3], edgeB[3], edgeC[3];
+			// Whether pixels exactly on each edge count, picked so that a pixel on an edge two triangles share is only
+			// drawn by one of them
+			bool edgeInclusive[3];
+			float depth[3], invW[3], uOverW[3], vOverW[3], lightmapUOverW[3], lightmapVOverW[3];
+			int minX, minY, maxX, maxY;
+			const Mesh* mesh;
+		};
+
+		// A vertex in clip space with its texture and lightmap coordinates, for near plane clipping
+		struct ClipVertex{
+			glm::vec4 position;
+			float u, v, lightmapU, lightmapV;
+		};
+
+		std::vector<Mesh> meshes;
+		std::vector<Triangle> triangles;
+		// Triangle indices overlapping each tile, in drawing order
+		std::vector<std::vector<uint32_t>> bins;
+		std::vector<glm::vec4> clipPositions;
+		// BGRA, top row first
+		std::vector<unsigned char> colour;
+		// Window-space depth (0 to 1) per pixel
+		std::vector<float> depthBuffer;
+		int width, height, tilesX, tilesY;
+		WorkStealingPool pool;
+		// GL objects for blit(), made the first time it's called
+		GLTexture blitTexture;
+		GLFramebuffer blitFramebuffer;
+
+		// Adds up in the same order as the AVX2 code in coverage(), so both builds draw exactly the same pixels
+		static float evaluate(const float* plane, float x, float y){
+			return plane[0] * x + (plane[1] * y + plane[2]);
+		}
+
+		// Screen-space setup for one triangle (see Triangle). Degenerate triangles and ones that don't cover any
+		// pixel centre's bounding box are dropped.
+		void addTriangle(const ClipVertex* vertices, const Mesh& mesh){
+			float x[3], y[3], depth[3], invW[3], uOverW[3], vOverW[3], lightmapUOverW[3], lightmapVOverW[3];
+			for (int i = 0; i < 3; i++){
+				const glm::vec4& position = vertices[i].position;
+				invW[i] = 1.0f / position.w;
+				x[i] = (position.x * invW[i] * 0.5f + 0.5f) * width;
+				y[i] = (0.5f - position.y * invW[i] * 0.5f) * height;
+				depth[i] = position.z * invW[i] * 0.5f + 0.5f;
+				uOverW[i] = vertices[i].u * invW[i];
+				vOverW[i] = vertices[i].v * invW[i];
+				lightmapUOverW[i] = vertices[i].lightmapU * invW[i];
+				lightmapVOverW[i] = vertices[i].lightmapV * invW[i];
+			}
+			float area = (x[1] - x[0]) * (y[2] - y[0]) - (y[1] - y[0]) * (x[2] - x[0]);
+			if (!(fabsf(area) > 0.0f) || !std::isfinite(area)){
+				return;
+			}
+			// Nothing gets backface culled (the GL path doesn't either), so flip clockwise triangles around
+			if (area < 0.0f){
+				std::swap(x[1], x[2]);
+				std::swap(y[1], y[2]);
+				std::swap(depth[1], depth[2]);
+				std::swap(invW[1], invW[2]);
+				std::swap(uOverW[1], uOverW[2]);
+				std::swap(vOverW[1], vOverW[2]);
+				std::swap(lightmapUOverW[1], lightmapUOverW[2]);
+				std::swap(lightmapVOverW[1], lightmapVOverW[2]);
+				area = -area;
+			}
+
+			Triangle triangle;
+			triangle.minX = std::max(0, (int) floorf(std::min({x[0], x[1], x[2]})));
+			triangle.minY = std::max(0, (int) floorf(std::min({y[0], y[1], y[2]})));
+			triangle.maxX = std::min(width - 1, (int) ceilf(std::max({x[0], x[1], x[2]})));
+			triangle.maxY = std::min(height - 1, (int) ceilf(std::max({y[0], y[1], y[2]})));
+			if (triangle.minX > triangle.maxX || triangle.minY > triangle.maxY){
+				return;
+			}
+			for (int i = 0; i < 3; i++){
+				int a = (i + 1) % 3, b = (i + 2) % 3;
+				triangle.edgeA[i] = y[a] - y[b];
+				triangle.edgeB[i] = x[b] - x[a];
+				triangle.edgeC[i] = -(triangle.edgeA[i] * x[a] + triangle.edgeB[i] * y[a]);
+				triangle.edgeInclusive[i] = triangle.edgeA[i] > 0.0f || (triangle.edgeA[i] == 0.0f && triangle.edgeB[i] > 0.0f);
+			}
+			// Each attribute is the sum of its vertex values weighted by the edge functions, divided by the area
+			auto setPlane = [&](float* plane, const float* values){
+				plane[0] = plane[1] = plane[2] = 0.0f;
+				for (int i = 0; i < 3; i++){
+					plane[0] += triangle.edgeA[i] * values[i] / area;
+					plane[1] += triangle.edgeB[i] * values[i] / area;
+					plane[2] += triangle.edgeC[i] * values[i] / area;
+				}
+			};
+			setPlane(triangle.depth, depth);
+			setPlane(triangle.invW, invW);
+			setPlane(triangle.uOverW, uOverW);
+			setPlane(triangle.vOverW, vOverW);
+			setPlane(triangle.lightmapUOverW, lightmapUOverW);
+			setPlane(triangle.lightmapVOverW, lightmapVOverW);
+			triangle.mesh = &mesh;
+			triangles.push_back(triangle);
+		}
+
+		// Transforms a mesh and sets up its triangles, clipping the ones that cross the near plane
+		void setupMesh(const Mesh& mesh, const glm::mat4& viewProjection){
+			const MeshData& data = mesh.asset.mesh;
+			const VertexData* vertices = data.vertexData();
+			size_t numVertices = data.vertexCount();
+			clipPositions.resize(numVertices);
+			for (size_t i = 0; i < numVertices; i++){
+				clipPositions[i] = viewProjection * glm::vec4(vertices[i].x, vertices[i].y, vertices[i].z, 1.0f);
+			}
+
+			const TriData* faces = data.faceData();
+			bool hasLightmap = !data.lightmapUVs.empty();
+			for (size_t f = 0; f < data.faceCount(); f++){
+				const GLuint indices[3] = {faces[f].v1, faces[f].v2, faces[f].v3};
+				ClipVertex corners[3];
+				// Bit i of each mask is set if the triangle is all on the outside of that plane
+				int allOutside = 0x3F, behindNear = 0;
+				for (int i = 0; i < 3; i++){
+					const glm::vec4& p = clipPositions[indices[i]];
+					glm::vec2 lightmapUV = hasLightmap ? data.lightmapUVs[indices[i]] : glm::vec2(0.0f);
+					corners[i] = {p, vertices[indices[i]].u, vertices[indices[i]].v, lightmapUV.x, lightmapUV.y};
+					int outside = (p.x < -p.w) | (p.x > p.w) << 1 | (p.y < -p.w) << 2 | (p.y > p.w) << 3 | (p.z > p.w) << 4 | (p.z < -p.w) << 5;
+					allOutside &= outside;
+					behindNear += p.z < -p.w;
+				}
+				if (allOutside != 0){
+					continue;
+				}
+				if (behindNear == 0){
+					addTriangle(corners, mesh);
+					continue;
+				}
+				// Cut off the part behind the near plane (z < -w), which leaves a triangle or a quad
+				ClipVertex polygon[4];
+				int numCorners = 0;
+				for (int i = 0; i < 3; i++){
+					const ClipVertex& current = corners[i];
+					const ClipVertex& next = corners[(i + 1) % 3];
+					float currentDistance = current.position.z + current.position.w;
+					float nextDistance = next.position.z + next.position.w;
+					if (currentDistance >= 0.0f){
+						polygon[numCorners++] = current;
+					}
+					if ((currentDistance >= 0.0f) != (nextDistance >= 0.0f)){
+						float t = currentDistance / (currentDistance - nextDistance);
+						polygon[numCorners++] = {
+							current.position + (next.position - current.position) * t,
+							current.u + (next.u - current.u) * t,
+							current.v + (next.v - current.v) * t,
+							current.lightmapU + (next.lightmapU - current.lightmapU) * t,
+							current.lightmapV + (next.lightmapV - current.lightmapV) * t
+						};
+					}
+				}
+				for (int i = 2; i < numCorners; i++){
+					ClipVertex fan[3] = {polygon[0], polygon[i - 1], polygon[i]};
+					addTriangle(fan, mesh);
+				}
+			}
+		}
+
+		/*
+			Which of the 8 pixels starting at (x, y) are inside the triangle and closer than what's already there, as a
+			bit mask. Only the first numPixels are looked at. py is the row's pixel centre.
+		*/
+		unsigned int coverage(const Triangle& triangle, int x, float py, int numPixels, const float* depthRow) const{
+#ifdef __AVX2__
+			const __m256 offsets = _mm256_setr_ps(0.5f, 1.5f, 2.5f, 3.5f, 4.5f, 5.5f, 6.5f, 7.5f);
+			__m256 px = _mm256_add_ps(_mm256_set1_ps((float) x), offsets);
+			__m256 zero = _mm256_setzero_ps();
+			__m256i lanes = _mm256_cmpgt_epi32(_mm256_set1_epi32(numPixels), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+			__m256 inside = _mm256_castsi256_ps(lanes);
+			for (int i = 0; i < 3; i++){
+				__m256 value = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(triangle.edgeA[i]), px),
+					_mm256_set1_ps(triangle.edgeB[i] * py + triangle.edgeC[i]));
+				__m256 test = triangle.edgeInclusive[i] ? _mm256_cmp_ps(value, zero, _CMP_GE_OQ) : _mm256_cmp_ps(value, zero, _CMP_GT_OQ);
+				inside = _mm256_and_ps(inside, test);
+			}
+			if (_mm256_movemask_ps(inside) == 0){
+				return 0;
+			}
+			__m256 depth = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(triangle.depth[0]), px),
+				_mm256_set1_ps(triangle.depth[1] * py + triangle.depth[2]));
+			__m256 stored = _mm256_maskload_ps(depthRow + x, lanes);
+			inside = _mm256_and_ps(inside, _mm256_cmp_ps(depth, stored, _CMP_LT_OQ));
+			inside = _mm256_and_ps(inside, _mm256_cmp_ps(depth, _mm256_set1_ps(1.0f), _CMP_LE_OQ));
+			return _mm256_movemask_ps(inside);
+#else
+			unsigned int mask = 0;
+			for (int lane = 0; lane < numPixels; lane++){
+				float px = x + lane + 0.5f;
+				bool inside = true;
+				for (int i = 0; i < 3 && inside; i++){
+					float value = triangle.edgeA[i] * px + (triangle.edgeB[i] * py + triangle.edgeC[i]);
+					inside = triangle.edgeInclusive[i] ? value >= 0.0f : value > 0.0f;
+				}
+				float depth = evaluate(triangle.depth, px, py);
+				if (inside && depth < depthRow[x + lane] && depth <= 1.0f){
+					mask |= 1u << lane;
+				}
+			}
+			return mask;
+#endif
+		}
+
+		/*
+			Mip level for the pixel at (px, py), from how far the UVs move per pixel (the quotient rule on u/w and v/w
+			over 1/w), rounded to the nearest level. GPUs work this out per 2x2 quad; here it's once per 8 pixels.
+		*/
+		int mipLevel(const Triangle& triangle, float px, float py) const{
+			const SoftwareTexture& texture = triangle.mesh->texture;
+			if (texture.levels.size() <= 1){
+				return 0;
+			}
+			float w = 1.0f / evaluate(triangle.invW, px, py);
+			float u = evaluate(triangle.uOverW, px, py) * w, v = evaluate(triangle.vOverW, px, py) * w;
+			float texWidth = texture.levels[0].width, texHeight = texture.levels[0].height;
+			float dudx = (triangle.uOverW[0] - u * triangle.invW[0]) * w * texWidth;
+			float dvdx = (triangle.vOverW[0] - v * triangle.invW[0]) * w * texHeight;
+			float dudy = (triangle.uOverW[1] - u * triangle.invW[1]) * w * texWidth;
+			float dvdy = (triangle.vOverW[1] - v * triangle.invW[1]) * w * texHeight;
+			float rho = std::max(dudx * dudx + dvdx * dvdx, dudy * dudy + dvdy * dvdy);
+			float lod = 0.5f * log2f(std::max(rho, 1e-8f));
+			return std::min((int) (texture.levels.size() - 1), std::max(0, (int) (lod + 0.5f)));
+		}
+
+		// Textures and writes one pixel that passed the coverage and depth tests
+		void shade(const Triangle& triangle, int x, int y, int level){
+			float px = x + 0.5f, py = y + 0.5f;
+			float w = 1.0f / evaluate(triangle.invW, px, py);
+			float u = evaluate(triangle.uOverW, px, py) * w, v = evaluate(triangle.vOverW, px, py) * w;
+			float texel[4];
+			triangle.mesh->texture.sample(u, v, level, texel);
+
+			AlphaMode alphaMode = triangle.mesh->asset.alphaMode;
+			if (alphaMode == ALPHA_TESTED && texel[3] < ALPHA_TEST_CUTOFF * 255.0f){
+				return;
+			}
+			const SoftwareTexture& lightmap = triangle.mesh->lightmap;
+			if (!lightmap.levels.empty()){
+				float light[4];
+				lightmap.sample(evaluate(triangle.lightmapUOverW, px, py) * w, evaluate(triangle.lightmapVOverW, px, py) * w, 0, light);
+				for (int c = 0; c < 3; c++){
+					texel[c] = std::min(255.0f, texel[c] * light[c] / LIGHTMAP_ENCODING_SCALE);
+				}
+			}
+			size_t pixel = (size_t) y * width + x;
+			unsigned char* destination = &colour[pixel * 4];
+			if (alphaMode == ALPHA_BLENDED){
+				float alpha = texel[3] / 255.0f;
+				for (int c = 0; c < 3; c++){
+					destination[c] = (unsigned char) (texel[c] * alpha + destination[c] * (1.0f - alpha) + 0.5f);
+				}
+				return;
+			}
+			for (int c = 0; c < 3; c++){
+				destination[c] = (unsigned char) (texel[c] + 0.5f);
+			}
+			destination[3] = 255;
+			depthBuffer[pixel] = evaluate(triangle.depth, px, py);
+		}
+
+		// Clears one tile and draws every triangle binned into it
+		void drawTile(int tile){
+			int x0 = (tile % tilesX) * SOFTWARE_TILE_SIZE, y0 = (tile / tilesX) * SOFTWARE_TILE_SIZE;
+			int x1 = std::min(x0 + SOFTWARE_TILE_SIZE, width), y1 = std::min(y0 + SOFTWARE_TILE_SIZE, height);
+			for (int y = y0; y < y1; y++){
+				for (int x = x0; x < x1; x++){
+					size_t pixel = (size_t) y * width + x;
+					colour[pixel * 4] = colour[pixel * 4 + 1] = colour[pixel * 4 + 2] = 0;
+					colour[pixel * 4 + 3] = 255;
+					depthBuffer[pixel] = 1.0f;
+				}
+			}
+			for (uint32_t index : bins[tile]){
+				const Triangle& triangle = triangles[index];
+				int minX = std::max(triangle.minX, x0), maxX = std::min(triangle.maxX, x1 - 1);
+				int minY = std::max(triangle.minY, y0), maxY = std::min(triangle.maxY, y1 - 1);
+				for (int y = minY; y <= maxY; y++){
+					const float* depthRow = &depthBuffer[(size_t) y * width];
+					for (int x = minX; x <= maxX; x += 8){
+						unsigned int mask = coverage(triangle, x, y + 0.5f, std::min(8, maxX - x + 1), depthRow);
+						if (mask == 0){
+							continue;
+						}
+						int level = mipLevel(triangle, x + 4.0f, y + 0.5f);
+						while (mask != 0){
+							int lane = __builtin_ctz(mask);
+							mask &= mask - 1;
+							shade(triangle, x + lane, y, level);
+						}
+					}
+				}
+			}
+		}
+
+	public:
+
+		// Loads every mesh in a scene manifest, decoding them in parallel on the renderer's own threads
+		SoftwareRenderer(const std::vector<SceneEntry>& entries, int frameWidth, int frameHeight)
+				: width(frameWidth), height(frameHeight){
+			ProfileZone zone("load software scene");
+			meshes.resize(entries.size());
+			pool.run(entries.size(), [&](int i){
+				Mesh& mesh = meshes[i];
+				mesh.asset.PLYPath = entries[i].PLYPath;
+				mesh.asset.texturePath = entries[i].texturePath;
+				mesh.asset.transform = entries[i].transform;
+				loadMeshAsset(mesh.asset);
+				MeshAsset& asset = mesh.asset;
+				if (!asset.mipLevels.empty()){
+					mesh.texture.levels = asset.mipLevels;
+				}
+				else if (!asset.texture.empty()){
+					std::vector<glm::ivec2> sizes;
+					buildMipLevels(asset.texture.data(), asset.textureWidth, asset.textureHeight, mesh.texture.ownedLevels, sizes);
+					for (size_t level = 0; level < sizes.size(); level++){
+						mesh.texture.levels.push_back({mesh.texture.ownedLevels[level].data(), (unsigned int) sizes[level].x, (unsigned int) sizes[level].y});
+					}
+					asset.texture.release();
+				}
+				if (asset.lightmap.loaded()){
+					unsigned int size = asset.lightmap.header.size;
+					mesh.lightmap.levels.push_back({asset.lightmap.pixels, size, size});
+				}
+				const VertexData* vertices = asset.mesh.vertexData();
+				for (size_t v = 0; v < asset.mesh.vertexCount(); v++){
+					mesh.bounds.expand(glm::vec3(vertices[v].x, vertices[v].y, vertices[v].z));
+				}
+			});
+			tilesX = (width + SOFTWARE_TILE_SIZE - 1) / SOFTWARE_TILE_SIZE;
+			tilesY = (height + SOFTWARE_TILE_SIZE - 1) / SOFTWARE_TILE_SIZE;
+			bins.resize(tilesX * tilesY);
+			colour.resize((size_t) width * height * 4);
+			depthBuffer.resize((size_t) width * height);
+			printf("Software renderer: %zu threads, %dx%d tiles, %s\n", pool.size(), tilesX, tilesY, simdName());
+		}
+
+		static const char* simdName(){
+#ifdef __AVX2__
+			return "AVX2";
+#else
+			return "no SIMD";
+#endif
+		}
+
+		size_t threadCount() const{
+			return pool.size();
+		}
+
+		size_t meshCount() const{
+			return meshes.size();
+		}
+
+		const MeshData& getMeshData(size_t mesh) const{
+			return meshes[mesh].asset.mesh;
+		}
+
+		// Draws a frame into the framebuffer. Counts its triangles in frameCounters like Scene::draw does.
+		void render(const glm::mat4& projection, const glm::mat4& view){
+			ProfileZone zone("software render");
+			frameCounters.reset();
+			glm::mat4 viewProjection = projection * view;
+			glm::vec3 camera = glm::vec3(glm::inverse(view)[3]);
+			Frustum frustum(viewProjection);
+
+			// Same order as RenderQueue: opaque, then alpha-tested, front to back, then blended back to front
+			std::vector<std::tuple<int, float, int>> order;
+			for (size_t i = 0; i < meshes.size(); i++){
+				const Mesh& mesh = meshes[i];
+				if (mesh.asset.PLYResult != 0 || frustum.test(mesh.bounds) == Frustum::OUTSIDE){
+					continue;
+				}
+				AlphaMode mode = mesh.asset.alphaMode;
+				float distance = drawOrderDistance(mesh.bounds, mode, camera);
+				order.push_back(std::make_tuple((int) mode, mode == ALPHA_BLENDED ? -distance : distance, (int) i));
+			}
+			std::sort(order.begin(), order.end());
+
+			{
+				ProfileZone setupZone("software setup");
+				triangles.clear();
+				for (const std::tuple<int, float, int>& entry : order){
+					setupMesh(meshes[std::get<2>(entry)], viewProjection);
+				}
+			}
+			{
+				ProfileZone binZone("software binning");
+				for (std::vector<uint32_t>& bin : bins){
+					bin.clear();
+				}
+				for (uint32_t index = 0; index < triangles.size(); index++){
+					const Triangle& triangle = triangles[index];
+					for (int tileY = triangle.minY / SOFTWARE_TILE_SIZE; tileY <= triangle.maxY / SOFTWARE_TILE_SIZE; tileY++){
+						for (int tileX = triangle.minX / SOFTWARE_TILE_SIZE; tileX <= triangle.maxX / SOFTWARE_TILE_SIZE; tileX++){
+							// Skip the tile if its pixel centre furthest along some edge's normal is still outside it
+							float left = tileX * SOFTWARE_TILE_SIZE + 0.5f, top = tileY * SOFTWARE_TILE_SIZE + 0.5f;
+							float right = std::min((tileX + 1) * SOFTWARE_TILE_SIZE, width) - 0.5f;
+							float bottom = std::min((tileY + 1) * SOFTWARE_TILE_SIZE, height) - 0.5f;
+							bool overlaps = true;
+							for (int i = 0; i < 3 && overlaps; i++){
+								float x = triangle.edgeA[i] > 0.0f ? right : left;
+								float y = triangle.edgeB[i] > 0.0f ? bottom : top;
+								overlaps = triangle.edgeA[i] * x + triangle.edgeB[i] * y + triangle.edgeC[i] >= 0.0f;
+							}
+							if (overlaps){
+								bins[tileY * tilesX + tileX].push_back(index);
+							}
+						}
+					}
+				}
+			}
+			{
+				ProfileZone rasterZone("software raster");
+				pool.run(tilesX * tilesY, [&](int tile){
+					drawTile(tile);
+				});
+			}
+			frameCounters.triangles += triangles.size();
+		}
+
+		// BGRA pixels of the last frame, top row first
+		const unsigned char* pixels() const{
+			return colour.data();
+		}
+
+		int saveBMP(const std::string& path) const{
+			return writeBMP(path, colour.data(), width, height);
+		}
+
+		/*
+			Copies the last frame onto the current GL framebuffer (the window), through a texture and
+			glBlitFramebuffer. Needs a current GL context.
+		*/
+		void blit(){
+			if (blitFramebuffer.get() == 0){
+				glBindTexture(GL_TEXTURE_2D, blitTexture.create());
+				glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, width, height);
+				glBindFramebuffer(GL_READ_FRAMEBUFFER, blitFramebuffer.create());
+				glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, blitTexture.get(), 0);
+				glState.invalidate();
+			}
+			glState.bindTexture(GL_TEXTURE_2D, blitTexture.get());
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_BGRA, GL_UNSIGNED_BYTE, colour.data());
+			glBindFramebuffer(GL_READ_FRAMEBUFFER, blitFramebuffer.get());
+			glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+			// The framebuffer's top row is first, but GL's first row is the bottom one, so flip it on the way
+			glBlitFramebuffer(0, 0, width, height, 0, height, width, 0, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+			glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+		}
+};
+
+/*
+	Bounding volume hierarchy over every triangle in the scene, for ray queries: the lightmap baker's shadow and
+	ambient occlusion rays, camera collision and picking in the window, and --bench-rays.
+	It's built as a binary tree first, with each node split wherever the surface area heuristic says rays will be
+	cheapest to trace: the cost of a split is each side's box area (how likely a ray is to go into it) times its
+	number of triangles. Triangle centres are sorted into BINS bins along each axis and only the boundaries between
+	bins are tried, so finding a split is one pass over the node's triangles. The top of the tree is built on the
+	calling thread, binning the biggest nodes on every worker of the pool, and once the nodes are small enough the
+	subtrees under them are built in parallel.
+	Then the binary tree is collapsed into nodes with up to 8 children each, by repeatedly opening up the child with
+	the biggest box. Their boxes are stored as separate arrays of each coordinate, so with -mavx2 a ray is tested
+	against all 8 at once. Triangles are kept as a corner and two edges, which is what the Moller-Trumbore test wants.
+*/
+class TriangleBVH{
+		static const int BINS = 16;
+		static const uint32_t MAX_LEAF_SIZE = 8;
+		// Below this many triangles nodes are binned on one thread
+		static const size_t PARALLEL_BINNING_SIZE = 65536;
+		// Past this depth nodes are split in half instead of with the heuristic, which bounds how deep the tree gets
+		// even for meshes where it keeps splitting off one triangle at a time
+		static const int MAX_SAH_DEPTH = 64;
+		// Enough for every child of every node on the deepest possible path
+		static const int STACK_SIZE = 7 * (MAX_SAH_DEPTH + 32) + 1;
+
+		struct Triangle{
+			glm::vec3 corner, edge1, edge2;
+		};
+
+		// The mesh number and face that were passed to addTriangle, so hits can say what they hit
+		struct TriangleID{
+			uint32_t mesh, face;
+		};
+
+		// A triangle while the tree is being built
+		struct BuildRef{
+			AABB bounds;
+			glm::vec3 centre;
+			uint32_t triangle;
+		};
+
+		// A node of the binary tree, which only exists while building
+		struct BuildNode{
+			AABB bounds;
+			// Inner nodes only use the children, and leaves only the triangles
+			int left, right;
+			uint32_t firstTriangle, numTriangles;
+		};
+
+		// A node that's built on its own (into nodes) once the top of the tree is done, and then copied in at index
+		struct Subtree{
+			int index, depth;
+			size_t first, count;
+			std::vector<BuildNode> nodes;
+		};
+
+		// Triangle counts and bounds for every bin along every axis
+		struct Bins{
+			AABB bounds[3][BINS];
+			uint32_t counts[3][BINS];
+		};
+
+		/*
+			child[i] >= 0 is another node, and child[i] < 0 is a leaf with count[i] triangles starting at ~child[i]
+			Only the first numChildren are used. The rest have empty boxes.
+		*/
+		struct alignas(32) Node{
+			float minX[8], minY[8], minZ[8], maxX[8], maxY[8], maxZ[8];
+			int32_t child[8];
+			uint8_t count[8];
+			int numChildren;
+		};
+
+		std::vector<Triangle> triangles;
+		std::vector<TriangleID> ids;
+		std::vector<Node> nodes;
+
+		static float surfaceArea(const AABB& box){
+			if (box.empty()){
+				return 0.0f;
+			}
+			glm::vec3 size = box.max - box.min;
+			return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
+		}
+
+		static int binOf(const glm::vec3& centre, const AABB& centres, const glm::vec3& scale, int axis){
+			int bin = (int) ((centre[axis] - centres.min[axis]) * scale[axis]);
+			return std::min(std::max(bin, 0), BINS - 1);
+		}
+
+		/*
+			Calls work(first, count, chunk) for pieces of a range of refs, spread over the pool if the range is big
+			enough to be worth it and there is one. Returns the number of chunks.
+		*/
+		static int forChunks(size_t first, size_t count, WorkStealingPool* pool, const std::function<void(size_t, size_t, int)>& work){
+			if (pool == nullptr || pool->size() == 1 || count < PARALLEL_BINNING_SIZE){
+				work(first, count, 0);
+				return 1;
+			}
+			int numChunks = pool->size() * 4;
+			pool->run(numChunks, [&](int chunk){
+				size_t chunkFirst = first + count * chunk / numChunks, chunkLast = first + count * (chunk + 1) / numChunks;
+				work(chunkFirst, chunkLast - chunkFirst, chunk);
+			});
+			return numChunks;
+		}
+
+		/*
+			Finds the cheapest split of refs[first, first + count) with the surface area heuristic and partitions them
+			so the first half of them go on the left. Also works out the bounds of the whole range. Returns false
+			without moving anything if there's no way to split them or it's cheaper to leave them as a leaf.
+		*/
+		bool findSplit(std::vector<BuildRef>& refs, size_t first, size_t count, WorkStealingPool* pool, AABB& bounds, size_t& half) const{
+			AABB centres;
+			std::vector<AABB> chunkBounds(pool != nullptr ? pool->size() * 4 : 1), chunkCentres(chunkBounds.size());
+			int numChunks = forChunks(first, count, pool, [&](size_t chunkFirst, size_t chunkCount, int chunk){
+				for (size_t i = chunkFirst; i < chunkFirst + chunkCount; i++){
+					chunkBounds[chunk].expand(refs[i].bounds);
+					chunkCentres[chunk].expand(refs[i].centre);
+				}
+			});
+			for (int chunk = 0; chunk < numChunks; chunk++){
+				bounds.expand(chunkBounds[chunk]);
+				centres.expand(chunkCentres[chunk]);
+			}
+			if (count <= 1){
+				return false;
+			}
+
+			glm::vec3 extent = centres.max - centres.min;
+			glm::vec3 scale;
+			for (int axis = 0; axis < 3; axis++){
+				scale[axis] = extent[axis] > 0.0f ? BINS / extent[axis] : 0.0f;
+			}
+			std::vector<Bins> chunkBins(chunkBounds.size());
+			forChunks(first, count, pool, [&](size_t chunkFirst, size_t chunkCount, int chunk){
+				Bins& bins = chunkBins[chunk];
+				memset(bins.counts, 0, sizeof(bins.counts));
+				for (size_t i = chunkFirst; i < chunkFirst + chunkCount; i++){
+					for (int axis = 0; axis < 3; axis++){
+						int bin = binOf(refs[i].centre, centres, scale, axis);
+						bins.bounds[axis][bin].expand(refs[i].bounds);
+						bins.counts[axis][bin]++;
+					}
+				}
+			});
+			Bins& bins = chunkBins[0];
+			for (int chunk = 1; chunk < numChunks; chunk++){
+				for (int axis = 0; axis < 3; axis++){
+					for (int bin = 0; bin < BINS; bin++){
+						bins.bounds[axis][bin].expand(chunkBins[chunk].bounds[axis][bin]);
+						bins.counts[axis][bin] += chunkBins[chunk].counts[axis][bin];
+					}
+				}
+			}
+
+			// Sweep from the right to get the cost of everything after each boundary, then from the left
+			float bestCost = FLT_MAX;
+			int splitAxis = -1, splitBin = 0;
+			for (int axis = 0; axis < 3; axis++){
+				if (extent[axis] <= 0.0f){
+					continue;
+				}
+				float rightCost[BINS];
+				AABB right;
+				uint32_t rightCount = 0;
+				for (int bin = BINS - 1; bin > 0; bin--){
+					right.expand(bins.bounds[axis][bin]);
+					rightCount += bins.counts[axis][bin];
+					rightCost[bin] = surfaceArea(right) * rightCount;
+				}
+				AABB left;
+				uint32_t leftCount = 0;
+				for (int bin = 1; bin < BINS; bin++){
+					left.expand(bins.bounds[axis][bin - 1]);
+					leftCount += bins.counts[axis][bin - 1];
+					float cost = surfaceArea(left) * leftCount + rightCost[bin];
+					if (leftCount > 0 && leftCount < count && cost < bestCost){
+						bestCost = cost;
+						splitAxis = axis;
+						splitBin = bin;
+					}
+				}
+			}
+			// A split costs a box test (counted as much as a triangle test) plus the triangles a ray is expected to hit
+			float area = surfaceArea(bounds);
+			float splitCost = area > 0.0f ? 1.0f + bestCost / area : FLT_MAX;
+			if (splitAxis == -1 || (count <= MAX_LEAF_SIZE && count <= splitCost)){
+				return false;
+			}
+			// Partition on the same bins the counts came from, so neither side can end up empty
+			half = std::partition(refs.begin() + first, refs.begin() + first + count, [&](const BuildRef& ref){
+				return binOf(ref.centre, centres, scale, splitAxis) < splitBin;
+			}) - (refs.begin() + first);
+			return true;
+		}
+
+		/*
+			Builds the binary tree over refs[first, first + count) into buildNodes and returns the root's index
+			With subtrees, the top of the tree is built and any node small enough to be its own task (subtreeSize) is
+			left empty and added to the list instead.
+		*/
+		int build(std::vector<BuildRef>& refs, size_t first, size_t count, int depth, std::vector<BuildNode>& buildNodes,
+				WorkStealingPool* pool, std::vector<Subtree>* subtrees, size_t subtreeSize) const{
+			int index = buildNodes.size();
+			buildNodes.push_back({AABB(), -1, -1, (uint32_t) first, 0});
+			if (subtrees != nullptr && count <= subtreeSize){
+				subtrees->push_back({index, depth, first, count, {}});
+				return index;
+			}
+
+			// Anything that can't be split with the heuristic (like a pile of triangles with the same centre) and is too
+			// big for a leaf just gets cut in half
+			AABB bounds;
+			size_t half = count / 2;
+			bool split = false;
+			if (depth < MAX_SAH_DEPTH){
+				split = findSplit(refs, first, count, pool, bounds, half);
+			}
+			else{
+				for (size_t i = first; i < first + count; i++){
+					bounds.expand(refs[i].bounds);
+				}
+			}
+			buildNodes[index].bounds = bounds;
+			if (!split && count <= MAX_LEAF_SIZE){
+				buildNodes[index].numTriangles = count;
+				return index;
+			}
+			int left = build(refs, first, half, depth + 1, buildNodes, pool, subtrees, subtreeSize);
+			int right = build(refs, first + half, count - half, depth + 1, buildNodes, pool, subtrees, subtreeSize);
+			buildNodes[index].left = left;
+			buildNodes[index].right = right;
+			return index;
+		}
+
+		// Turns the binary tree under buildNodes[index] into 8-wide nodes and returns the index of the first one
+		int collapse(const std::vector<BuildNode>& buildNodes, int index){
+			int children[8];
+			int numChildren = 0;
+			if (buildNodes[index].numTriangles > 0){
+				children[numChildren++] = index;
+			}
+			else{
+				children[numChildren++] = buildNodes[index].left;
+				children[numChildren++] = buildNodes[index].right;
+			}
+			while (numChildren < 8){
+				int open = -1;
+				float openArea = -1.0f;
+				for (int i = 0; i < numChildren; i++){
+					const BuildNode& child = buildNodes[children[i]];
+					if (child.numTriangles == 0 && surfaceArea(child.bounds) > openArea){
+						open = i;
+						openArea = surfaceArea(child.bounds);
+					}
+				}
+				if (open == -1){
+					break;
+				}
+				const BuildNode& opened = buildNodes[children[open]];
+				children[open] = opened.left;
+				children[numChildren++] = opened.right;
+			}
+
+			int wideIndex = nodes.size();
+			nodes.emplace_back();
+			Node node;
+			memset(&node, 0, sizeof(node));
+			node.numChildren = numChildren;
+			for (int i = 0; i < numChildren; i++){
+				const BuildNode& child = buildNodes[children[i]];
+				node.minX[i] = child.bounds.min.x;
+				node.minY[i] = child.bounds.min.y;
+				node.minZ[i] = child.bounds.min.z;
+				node.maxX[i] = child.bounds.max.x;
+				node.maxY[i] = child.bounds.max.y;
+				node.maxZ[i] = child.bounds.max.z;
+				if (child.numTriangles > 0){
+					node.child[i] = ~(int32_t) child.firstTriangle;
+					node.count[i] = child.numTriangles;
+				}
+				else{
+					node.child[i] = collapse(buildNodes, children[i]);
+				}
+			}
+			nodes[wideIndex] = node;
+			return wideIndex;
+		}
+
+		/*
+			1 / a direction component for the slab test, with 0 nudged to a tiny number of the same sign
+			A real 0 gives an infinite inverse, and a ray starting exactly on a box's plane then gets 0 * infinity = NaN
+			for that side, which misses boxes it's inside (like walking straight along a wall that starts at z = 0).
+		*/
+		static float slabInverse(float direction){
+			return 1.0f / (fabsf(direction) > 1e-20f ? direction : copysignf(1e-20f, direction));
+		}
+
+		// Moller-Trumbore. u and v say how far towards the second and third corners the hit is.
+		static bool intersectTriangle(const Triangle& triangle, const glm::vec3& origin, const glm::vec3& direction, float maxDistance,
+				float& distance, float& u, float& v){
+			glm::vec3 p = glm::cross(direction, triangle.edge2);
+			float inverse = 1.0f / glm::dot(p, triangle.edge1);
+			glm::vec3 toOrigin = origin - triangle.corner;
+			u = glm::dot(p, toOrigin) * inverse;
+			glm::vec3 q = glm::cross(toOrigin, triangle.edge1);
+			v = glm::dot(q, direction) * inverse;
+			distance = glm::dot(q, triangle.edge2) * inverse;
+			// A determinant of 0 (the ray is parallel to the triangle) makes everything infinite or NaN, which fails these
+			return u >= 0.0f && v >= 0.0f && u + v <= 1.0f && distance > 0.0f && distance < maxDistance;
+		}
+
+		/*
+			Walks the tree for one ray. Children are visited nearest box first, and skipped once they start further
+			away than the closest hit so far. With anyHit it stops at the first hit instead.
+			Returns the index of the triangle hit (in triangles) or -1, with maxDistance lowered to the hit.
+		*/
+		template<bool anyHit>
+		int64_t trace(const glm::vec3& origin, const glm::vec3& direction, float& maxDistance, float& hitU, float& hitV) const{
+			struct Entry{
+				int32_t child;
+				uint32_t count;
+				float distance;
+			};
+			int64_t hit = -1;
+			if (nodes.empty()){
+				return hit;
+			}
+			Entry stack[STACK_SIZE];
+			int stackSize = 0;
+			stack[stackSize++] = {0, 0, 0.0f};
+			glm::vec3 inverse(slabInverse(direction.x), slabInverse(direction.y), slabInverse(direction.z));
+#ifdef __AVX2__
+			__m256 originX = _mm256_set1_ps(origin.x), originY = _mm256_set1_ps(origin.y), originZ = _mm256_set1_ps(origin.z);
+			__m256 inverseX = _mm256_set1_ps(inverse.x), inverseY = _mm256_set1_ps(inverse.y), inverseZ = _mm256_set1_ps(inverse.z);
+#endif
+			while (stackSize > 0){
+				Entry entry = stack[--stackSize];
+				if (entry.distance > maxDistance){
+					continue;
+				}
+				if (entry.child < 0){
+					for (uint32_t i = ~entry.child; i < ~entry.child + entry.count; i++){
+						float distance, u, v;
+						if (intersectTriangle(triangles[i], origin, direction, maxDistance, distance, u, v)){
+							hit = i;
+							maxDistance = distance;
+							hitU = u;
+							hitV = v;
+							if (anyHit){
+								return hit;
+							}
+						}
+					}
+					continue;
+				}
+
+				// Slab test: the ray is inside a box between the largest entry and the smallest exit distance
+				const Node& node = nodes[entry.child];
+				alignas(32) float entryDistance[8];
+				unsigned int enter = 0;
+#ifdef __AVX2__
+				__m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.minX), originX), inverseX);
+				__m256 t2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.maxX), originX), inverseX);
+				__m256 boxEntry = _mm256_max_ps(_mm256_setzero_ps(), _mm256_min_ps(t1, t2));
+				__m256 boxExit = _mm256_min_ps(_mm256_set1_ps(maxDistance), _mm256_max_ps(t1, t2));
+				t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.minY), originY), inverseY);
+				t2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.maxY), originY), inverseY);
+				boxEntry = _mm256_max_ps(boxEntry, _mm256_min_ps(t1, t2));
+				boxExit = _mm256_min_ps(boxExit, _mm256_max_ps(t1, t2));
+				t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.minZ), originZ), inverseZ);
+				t2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.maxZ), originZ), inverseZ);
+				boxEntry = _mm256_max_ps(boxEntry, _mm256_min_ps(t1, t2));
+				boxExit = _mm256_min_ps(boxExit, _mm256_max_ps(t1, t2));
+				_mm256_store_ps(entryDistance, boxEntry);
+				enter = _mm256_movemask_ps(_mm256_cmp_ps(boxEntry, boxExit, _CMP_LE_OQ)) & ((1u << node.numChildren) - 1);
+#else
+				const float* minimum[3] = {node.minX, node.minY, node.minZ};
+				const float* maximum[3] = {node.maxX, node.maxY, node.maxZ};
+				for (int i = 0; i < node.numChildren; i++){
+					float near = 0.0f, far = maxDistance;
+					for (int axis = 0; axis < 3; axis++){
+						float t1 = (minimum[axis][i] - origin[axis]) * inverse[axis], t2 = (maximum[axis][i] - origin[axis]) * inverse[axis];
+						near = std::max(near, std::min(t1, t2));
+						far = std::min(far, std::max(t1, t2));
+					}
+					entryDistance[i] = near;
+					if (near <= far){
+						enter |= 1u << i;
+					}
+				}
+#endif
+				// Push the furthest first so the nearest comes off the stack first
+				int first = stackSize;
+				for (; enter != 0; enter &= enter - 1){
+					int i = __builtin_ctz(enter);
+					Entry child = {node.child[i], node.count[i], entryDistance[i]};
+					int j = stackSize++;
+					for (; j > first && stack[j - 1].distance < child.distance; j--){
+						stack[j] = stack[j - 1];
+					}
+					stack[j] = child;
+				}
+			}
+			return hit;
+		}
+
+	public:
+
+		// What a ray hit: the mesh and face passed to addTriangle, how far along the ray, where on the triangle (how
+		// far towards its second and third corners) and the triangle's normal, facing back towards the ray
+		struct Hit{
+			float distance;
+			uint32_t mesh, face;
+			float u, v;
+			glm::vec3 normal;
+		};
+
+		// 8 rays, one per lane. Directions don't need to be normalized: maxDistance is in multiples of them.
+		struct RayPacket{
+			float originX[8], originY[8], originZ[8];
+			float directionX[8], directionY[8], directionZ[8];
+			float maxDistance[8];
+		};
+
+		void addTriangle(const glm::vec3& a, const glm::vec3& b, const glm::vec3& c, uint32_t mesh = 0, uint32_t face = 0){
+			triangles.push_back({a, b - a, c - a});
+			ids.push_back({mesh, face});
+		}
+
+		// Adds every face of a mesh, numbered meshIndex
+		void addMesh(const MeshData& mesh, uint32_t meshIndex){
+			const VertexData* vertices = mesh.vertexData();
+			const TriData* faces = mesh.faceData();
+			for (size_t f = 0; f < mesh.faceCount(); f++){
+				const VertexData& a = vertices[faces[f].v1];
+				const VertexData& b = vertices[faces[f].v2];
+				const VertexData& c = vertices[faces[f].v3];
+				addTriangle(glm::vec3(a.x, a.y, a.z), glm::vec3(b.x, b.y, b.z), glm::vec3(c.x, c.y, c.z), meshIndex, f);
+			}
+		}
+
+		// Builds the tree over every triangle added so far, using every worker in pool. Triangles can't be added after this.
+		void build(WorkStealingPool& pool){
+			ProfileZone zone("build triangle BVH");
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			nodes.clear();
+			if (triangles.empty()){
+				return;
+			}
+			std::vector<BuildRef> refs(triangles.size());
+			forChunks(0, refs.size(), &pool, [&](size_t first, size_t count, int /*chunk*/){
+				for (size_t i = first; i < first + count; i++){
+					const Triangle& triangle = triangles[i];
+					refs[i].bounds = AABB();
+					refs[i].bounds.expand(triangle.corner);
+					refs[i].bounds.expand(triangle.corner + triangle.edge1);
+					refs[i].bounds.expand(triangle.corner + triangle.edge2);
+					refs[i].centre = refs[i].bounds.centre();
+					refs[i].triangle = i;
+				}
+			});
+
+			// The top of the tree, until there are about 8 pieces per worker
+			std::vector<BuildNode> buildNodes;
+			std::vector<Subtree> subtrees;
+			size_t subtreeSize = std::max<size_t>(MAX_LEAF_SIZE, refs.size() / (pool.size() * 8));
+			build(refs, 0, refs.size(), 0, buildNodes, &pool, &subtrees, subtreeSize);
+			pool.run(subtrees.size(), [&](int i){
+				Subtree& subtree = subtrees[i];
+				build(refs, subtree.first, subtree.count, subtree.depth, subtree.nodes, nullptr, nullptr, 0);
+			});
+			// Each subtree's root replaces its placeholder, and the rest of its nodes go on the end
+			for (Subtree& subtree : subtrees){
+				int base = buildNodes.size() - 1;
+				auto remap = [&](int child){
+					return child == 0 ? subtree.index : base + child;
+				};
+				for (BuildNode& node : subtree.nodes){
+					if (node.numTriangles == 0){
+						node.left = remap(node.left);
+						node.right = remap(node.right);
+					}
+				}
+				buildNodes[subtree.index] = subtree.nodes[0];
+				buildNodes.insert(buildNodes.end(), subtree.nodes.begin() + 1, subtree.nodes.end());
+			}
+			collapse(buildNodes, 0);
+
+			std::vector<Triangle> orderedTriangles(triangles.size());
+			std::vector<TriangleID> orderedIDs(ids.size());
+			for (size_t i = 0; i < refs.size(); i++){
+				orderedTriangles[i] = triangles[refs[i].triangle];
+				orderedIDs[i] = ids[refs[i].triangle];
+			}
+			triangles = std::move(orderedTriangles);
+			ids = std::move(orderedIDs);
+			double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			printf("Built triangle BVH: %zu triangles, %zu nodes in %.1f ms (%zu threads)\n", triangles.size(), nodes.size(), milliseconds, pool.size());
+		}
+
+		size_t size() const{
+			return triangles.size();
+		}
+
+		/*
+			Finds the nearest triangle the ray hits between its origin and maxDistance (both ways up count)
+			direction doesn't need to be normalized, and distances are in multiples of it. Returns false if it misses.
+		*/
+		bool closestHit(const glm::vec3& origin, const glm::vec3& direction, float maxDistance, Hit& hit) const{
+			int64_t triangle = trace<false>(origin, direction, maxDistance, hit.u, hit.v);
+			if (triangle < 0){
+				return false;
+			}
+			hit.distance = maxDistance;
+			hit.mesh = ids[triangle].mesh;
+			hit.face = ids[triangle].face;
+			hit.normal = glm::normalize(glm::cross(triangles[triangle].edge1, triangles[triangle].edge2));
+			if (glm::dot(hit.normal, direction) > 0.0f){
+				hit.normal = -hit.normal;
+			}
+			return true;
+		}
+
+		// Whether the ray hits anything between its origin and maxDistance, which is cheaper than finding the closest
+		bool occluded(const glm::vec3& origin, const glm::vec3& direction, float maxDistance) const{
+			float u, v;
+			return trace<true>(origin, direction, maxDistance, u, v) >= 0;
+		}
+
+		/*
+			Which of the rays in active (bit i for lane i) hit any triangle between their origin and maxDistance
+			With -mavx2 the 8 rays walk the tree together: a child is entered if any ray in the packet hits its box, and
+			each box and triangle is tested against all 8 at once. Rays that start at the same point or next to each
+			other mostly visit the same nodes, so the packet costs little more than one ray. Every ray stops at the
+			first thing it hits and the whole packet stops once they all have. Without AVX2 they're traced one at a time.
+		*/
+		unsigned int occluded8(const RayPacket& rays, unsigned int active) const{
+			unsigned int hits = 0;
+			if (nodes.empty() || active == 0){
+				return 0;
+			}
+#ifdef __AVX2__
+			int stack[STACK_SIZE];
+			int stackSize = 0;
+			stack[stackSize++] = 0;
+			__m256 originX = _mm256_loadu_ps(rays.originX), originY = _mm256_loadu_ps(rays.originY), originZ = _mm256_loadu_ps(rays.originZ);
+			__m256 directionX = _mm256_loadu_ps(rays.directionX), directionY = _mm256_loadu_ps(rays.directionY);
+			__m256 directionZ = _mm256_loadu_ps(rays.directionZ), maxDistance = _mm256_loadu_ps(rays.maxDistance);
+			__m256 one = _mm256_set1_ps(1.0f), zero = _mm256_setzero_ps();
+			float inverseDirection[3][8];
+			for (int lane = 0; lane < 8; lane++){
+				inverseDirection[0][lane] = slabInverse(rays.directionX[lane]);
+				inverseDirection[1][lane] = slabInverse(rays.directionY[lane]);
+				inverseDirection[2][lane] = slabInverse(rays.directionZ[lane]);
+			}
+			__m256 inverseX = _mm256_loadu_ps(inverseDirection[0]), inverseY = _mm256_loadu_ps(inverseDirection[1]);
+			__m256 inverseZ = _mm256_loadu_ps(inverseDirection[2]);
+			auto cross = [](__m256 ax, __m256 ay, __m256 az, __m256 bx, __m256 by, __m256 bz, __m256* out){
+				out[0] = _mm256_sub_ps(_mm256_mul_ps(ay, bz), _mm256_mul_ps(az, by));
+				out[1] = _mm256_sub_ps(_mm256_mul_ps(az, bx), _mm256_mul_ps(ax, bz));
+				out[2] = _mm256_sub_ps(_mm256_mul_ps(ax, by), _mm256_mul_ps(ay, bx));
+			};
+			auto dot = [](const __m256* a, __m256 bx, __m256 by, __m256 bz){
+				return _mm256_add_ps(_mm256_mul_ps(a[0], bx), _mm256_add_ps(_mm256_mul_ps(a[1], by), _mm256_mul_ps(a[2], bz)));
+			};
+			while (stackSize > 0){
+				const Node& node = nodes[stack[--stackSize]];
+				for (int c = 0; c < node.numChildren; c++){
+					// Slab test: the ray is inside the box between the largest entry and the smallest exit distance
+					__m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node.minX[c]), originX), inverseX);
+					__m256 t2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node.maxX[c]), originX), inverseX);
+					__m256 entry = _mm256_max_ps(zero, _mm256_min_ps(t1, t2));
+					__m256 exit = _mm256_min_ps(maxDistance, _mm256_max_ps(t1, t2));
+					t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node.minY[c]), originY), inverseY);
+					t2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node.maxY[c]), originY), inverseY);
+					entry = _mm256_max_ps(entry, _mm256_min_ps(t1, t2));
+					exit = _mm256_min_ps(exit, _mm256_max_ps(t1, t2));
+					t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node.minZ[c]), originZ), inverseZ);
+					t2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node.maxZ[c]), originZ), inverseZ);
+					entry = _mm256_max_ps(entry, _mm256_min_ps(t1, t2));
+					exit = _mm256_min_ps(exit, _mm256_max_ps(t1, t2));
+					unsigned int enter = _mm256_movemask_ps(_mm256_cmp_ps(entry, exit, _CMP_LE_OQ)) & active;
+					if (enter == 0){
+						continue;
+					}
+					if (node.child[c] >= 0){
+						stack[stackSize++] = node.child[c];
+						continue;
+					}
+					uint32_t firstTriangle = ~node.child[c];
+					for (uint32_t i = firstTriangle; i < firstTriangle + node.count[c]; i++){
+						const Triangle& triangle = triangles[i];
+						__m256 edge1[3] = {_mm256_set1_ps(triangle.edge1.x), _mm256_set1_ps(triangle.edge1.y), _mm256_set1_ps(triangle.edge1.z)};
+						__m256 edge2X = _mm256_set1_ps(triangle.edge2.x), edge2Y = _mm256_set1_ps(triangle.edge2.y), edge2Z = _mm256_set1_ps(triangle.edge2.z);
+						__m256 p[3], q[3];
+						cross(directionX, directionY, directionZ, edge2X, edge2Y, edge2Z, p);
+						__m256 determinant = dot(p, edge1[0], edge1[1], edge1[2]);
+						__m256 inverse = _mm256_div_ps(one, determinant);
+						__m256 toOriginX = _mm256_sub_ps(originX, _mm256_set1_ps(triangle.corner.x));
+						__m256 toOriginY = _mm256_sub_ps(originY, _mm256_set1_ps(triangle.corner.y));
+						__m256 toOriginZ = _mm256_sub_ps(originZ, _mm256_set1_ps(triangle.corner.z));
+						__m256 u = _mm256_mul_ps(dot(p, toOriginX, toOriginY, toOriginZ), inverse);
+						cross(toOriginX, toOriginY, toOriginZ, edge1[0], edge1[1], edge1[2], q);
+						__m256 v = _mm256_mul_ps(dot(q, directionX, directionY, directionZ), inverse);
+						__m256 t = _mm256_mul_ps(dot(q, edge2X, edge2Y, edge2Z), inverse);
+						// Same as intersectTriangle: a determinant of 0 makes everything infinite or NaN, which fails these
+						__m256 hit = _mm256_and_ps(_mm256_cmp_ps(u, zero, _CMP_GE_OQ), _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+						hit = _mm256_and_ps(hit, _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ));
+						hit = _mm256_and_ps(hit, _mm256_cmp_ps(t, zero, _CMP_GT_OQ));
+						hit = _mm256_and_ps(hit, _mm256_cmp_ps(t, maxDistance, _CMP_LT_OQ));
+						hits |= _mm256_movemask_ps(hit) & active;
+					}
+					active &= ~hits;
+					if (active == 0){
+						return hits;
+					}
+				}
+			}
+#else
+			for (int lane = 0; lane < 8; lane++){
+				if (active >> lane & 1){
+					glm::vec3 origin(rays.originX[lane], rays.originY[lane], rays.originZ[lane]);
+					glm::vec3 direction(rays.directionX[lane], rays.directionY[lane], rays.directionZ[lane]);
+					if (occluded(origin, direction, rays.maxDistance[lane])){
+						hits |= 1u << lane;
+					}
+				}
+			}
+#endif
+			return hits;
+		}
+};
+
+/*
+	Unwraps a mesh for its lightmap: splits it into charts, lays them out in a size x size texture without any
+	overlapping, and cuts the mesh apart along the chart edges so every vertex has a single lightmap position
+	A chart grows from its first triangle across shared edges (compared by position, since vertices are split on
+	texture seams) to every triangle facing within 30 degrees of that first one, and is flattened by projecting it onto
+	the plane facing the same way. Charts are shelf packed tallest first with LIGHTMAP_PADDING empty texels around
+	each, at the highest texel density that fits. Faces stay in their original order, so the vertex cache order
+	from optimizeMesh survives, and new vertices are numbered in the order the faces first use them.
+	Outputs the source vertex of each new vertex, the new vertices' lightmap UVs and the new faces. Returns the number
+	of charts, or 0 if there are too many to fit.
+*/
+size_t buildLightmapCharts(const MeshData& mesh, int size, std::vector<uint32_t>& remap, std::vector<glm::vec2>& uvs, std::vector<TriData>& faces){
+	const float CHART_COS_ANGLE = cosf(glm::radians(30.0f));
+	const VertexData* vertices = mesh.vertexData();
+	const TriData* sourceFaces = mesh.faceData();
+	size_t numVertices = mesh.vertexCount(), numFaces = mesh.faceCount();
+	auto position = [&](GLuint v){
+		return glm::vec3(vertices[v].x, vertices[v].y, vertices[v].z);
+	};
+
+	// Same position IDs and edge keys as simplifyMesh
+	std::map<std::tuple<float, float, float>, GLuint> positions;
+	std::vector<GLuint> positionID(numVertices);
+	for (size_t v = 0; v < numVertices; v++){
+		positionID[v] = positions.emplace(std::make_tuple(vertices[v].x, vertices[v].y, vertices[v].z), (GLuint) positions.size()).first->second;
+	}
+	auto edgeKey = [&](GLuint a, GLuint b){
+		uint64_t pa = positionID[a], pb = positionID[b];
+		return pa < pb ? (pa << 32) | pb : (pb << 32) | pa;
+	};
+	std::unordered_map<uint64_t, std::vector<uint32_t>> edgeFaces;
+	std::vector<glm::vec3> normals(numFaces);
+	for (uint32_t f = 0; f < numFaces; f++){
+		const GLuint corners[3] = {sourceFaces[f].v1, sourceFaces[f].v2, sourceFaces[f].v3};
+		for (int i = 0; i < 3; i++){
+			edgeFaces[edgeKey(corners[i], corners[(i + 1) % 3])].push_back(f);
+		}
+		glm::vec3 normal = glm::cross(position(corners[1]) - position(corners[0]), position(corners[2]) - position(corners[0]));
+		float length = glm::length(normal);
+		normals[f] = length > 0.0f ? normal / length : glm::vec3(0.0f);
+	}
+
+	// Grow the charts. Degenerate triangles have no direction, so they join whichever chart reaches them first.
+	struct Chart{
+		glm::vec3 tangent, bitangent;
+		glm::vec2 min, max;
+		int x, y;
+	};
+	std::vector<Chart> charts;
+	std::vector<int> chartOf(numFaces, -1);
+	std::vector<uint32_t> queue;
+	for (uint32_t seed = 0; seed < numFaces; seed++){
+		if (chartOf[seed] != -1){
+			continue;
+		}
+		int chart = charts.size();
+		glm::vec3 normal = glm::length(normals[seed]) > 0.0f ? normals[seed] : glm::vec3(0.0f, 1.0f, 0.0f);
+		chartOf[seed] = chart;
+		queue.assign(1, seed);
+		while (!queue.empty()){
+			uint32_t f = queue.back();
+			queue.pop_back();
+			const GLuint corners[3] = {sourceFaces[f].v1, sourceFaces[f].v2, sourceFaces[f].v3};
+			for (int i = 0; i < 3; i++){
+				for (uint32_t neighbour : edgeFaces[edgeKey(corners[i], corners[(i + 1) % 3])]){
+					if (chartOf[neighbour] == -1 && (glm::dot(normals[neighbour], normal) >= CHART_COS_ANGLE || glm::length(normals[neighbour]) == 0.0f)){
+						chartOf[neighbour] = chart;
+						queue.push_back(neighbour);
+					}
+				}
+			}
+		}
+		Chart newChart;
+		glm::vec3 up = fabsf(normal.y) < 0.99f ? glm::vec3(0.0f, 1.0f, 0.0f) : glm::vec3(1.0f, 0.0f, 0.0f);
+		newChart.tangent = glm::normalize(glm::cross(up, normal));
+		newChart.bitangent = glm::cross(normal, newChart.tangent);
+		newChart.min = glm::vec2(FLT_MAX);
+		newChart.max = glm::vec2(-FLT_MAX);
+		charts.push_back(newChart);
+	}
+	auto project = [&](const Chart& chart, GLuint v){
+		glm::vec3 p = position(v);
+		return glm::vec2(glm::dot(p, chart.tangent), glm::dot(p, chart.bitangent));
+	};
+	for (uint32_t f = 0; f < numFaces; f++){
+		Chart& chart = charts[chartOf[f]];
+		for (GLuint v : {sourceFaces[f].v1, sourceFaces[f].v2, sourceFaces[f].v3}){
+			chart.min = glm::min(chart.min, project(chart, v));
+			chart.max = glm::max(chart.max, project(chart, v));
+		}
+	}
+
+	// Places every chart at density texels per unit, returning false if they don't all fit
+	std::vector<int> order(charts.size());
+	for (size_t i = 0; i < order.size(); i++){
+		order[i] = i;
+	}
+	auto pack = [&](float density){
+		auto rectSize = [&](const Chart& chart){
+			return glm::ivec2(ceilf((chart.max.x - chart.min.x) * density), ceilf((chart.max.y - chart.min.y) * density)) + 2 * LIGHTMAP_PADDING;
+		};
+		std::sort(order.begin(), order.end(), [&](int a, int b){
+			return rectSize(charts[a]).y > rectSize(charts[b]).y;
+		});
+		int x = 0, y = 0, shelfHeight = 0;
+		for (int index : order){
+			glm::ivec2 rect = rectSize(charts[index]);
+			if (x + rect.x > size){
+				x = 0;
+				y += shelfHeight;
+				shelfHeight = 0;
+			}
+			if (x + rect.x > size || y + rect.y > size){
+				return false;
+			}
+			charts[index].x = x;
+			charts[index].y = y;
+			x += rect.x;
+			shelfHeight = std::max(shelfHeight, rect.y);
+		}
+		return true;
+	};
+
+	// Start from a density that would fill about 70% of the texture, step up or down until there's a density that
+	// fits and one that doesn't, then binary search between them
+	float area = 0.0f;
+	for (const Chart& chart : charts){
+		area += (chart.max.x - chart.min.x) * (chart.max.y - chart.min.y);
+	}
+	float fits = sqrtf(0.7f * size * size / std::max(area, 1e-12f)), overflows = fits;
+	if (pack(fits)){
+		// Charts with no area fit at any density, so give up growing eventually
+		for (int attempts = 0; attempts < 100 && pack(overflows); attempts++){
+			fits = overflows;
+			overflows *= 1.25f;
+		}
+	}
+	else{
+		// Even zero-sized charts take up their padding, so too many charts can't fit at any density
+		for (int attempts = 0; !pack(fits); attempts++){
+			if (attempts == 100){
+				printf("%zu charts don't fit in a %dx%d lightmap\n", charts.size(), size, size);
+				return 0;
+			}
+			overflows = fits;
+			fits *= 0.8f;
+		}
+	}
+	for (int i = 0; i < 8; i++){
+		float middle = (fits + overflows) * 0.5f;
+		if (pack(middle)){
+			fits = middle;
+		}
+		else{
+			overflows = middle;
+		}
+	}
+	float density = fits;
+	pack(density);
+
+	// Make a vertex for every (chart, original vertex) pair the faces use
+	std::unordered_map<uint64_t, GLuint> newVertices;
+	remap.clear();
+	uvs.clear();
+	faces.resize(numFaces);
+	for (uint32_t f = 0; f < numFaces; f++){
+		const Chart& chart = charts[chartOf[f]];
+		const GLuint corners[3] = {sourceFaces[f].v1, sourceFaces[f].v2, sourceFaces[f].v3};
+		GLuint newCorners[3];
+		for (int i = 0; i < 3; i++){
+			uint64_t key = (uint64_t) chartOf[f] << 32 | corners[i];
+			std::pair<std::unordered_map<uint64_t, GLuint>::iterator, bool> inserted = newVertices.emplace(key, (GLuint) remap.size());
+			if (inserted.second){
+				glm::vec2 texel = glm::vec2(chart.x + LIGHTMAP_PADDING, chart.y + LIGHTMAP_PADDING) + (project(chart, corners[i]) - chart.min) * density;
+				remap.push_back(corners[i]);
+				uvs.push_back(texel / (float) size);
+			}
+			newCorners[i] = inserted.first->second;
+		}
+		faces[f] = {newCorners[0], newCorners[1], newCorners[2]};
+	}
+	return charts.size();
+}
+
+/*
+	Writes a .lightmap file (see Lightmap) for a mesh, to a temporary path that's renamed over the old one like bakes
+	Returns 0 if successful, -1 if the file couldn't be written
+*/
+int writeLightmap(const std::string& PLYPath, uint64_t sourceHash, size_t numSourceVertices, int size, const std::vector<uint32_t>& remap,
+		const std::vector<glm::vec2>& uvs, const std::vector<TriData>& faces, const std::vector<unsigned char>& pixels){
+	LightmapHeader header = {};
+	memcpy(header.magic, LIGHTMAP_MAGIC, sizeof(LIGHTMAP_MAGIC));
+	header.version = LIGHTMAP_VERSION;
+	header.size = size;
+	header.sourceHash = sourceHash;
+	header.optimized = OPTIMIZE_MESHES;
+	header.numSourceVertices = numSourceVertices;
+	header.numVertices = remap.size();
+	header.numFaces = faces.size();
+	header.stamp = hashBytes((const unsigned char*) remap.data(), remap.size() * sizeof(uint32_t));
+	header.stamp = hashBytes((const unsigned char*) uvs.data(), uvs.size() * sizeof(glm::vec2), header.stamp);
+	header.stamp = hashBytes((const unsigned char*) faces.data(), faces.size() * sizeof(TriData), header.stamp);
+	header.stamp = hashBytes(pixels.data(), pixels.size(), header.stamp);
+
+	std::string path = lightmapPath(PLYPath);
+	std::string tempPath = path + ".tmp";
+	FILE* file = fopen(tempPath.data(), "wb");
+	if (!file){
+		printf("Error creating %s\n", tempPath.data());
+		return -1;
+	}
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+		&& fwrite(remap.data(), sizeof(uint32_t), remap.size(), file) == remap.size()
+		&& fwrite(uvs.data(), sizeof(glm::vec2), uvs.size(), file) == uvs.size()
+		&& fwrite(faces.data(), sizeof(TriData), faces.size(), file) == faces.size()
+		&& fwrite(pixels.data(), 1, pixels.size(), file) == pixels.size();
+	ok = (fclose(file) == 0) && ok;
+	if (!ok || rename(tempPath.data(), path.data()) != 0){
+		printf("Error writing %s\n", path.data());
+		remove(tempPath.data());
+		return -1;
+	}
+	return 0;
+}
+
+/*
+	--bake-lightmaps: works out the lighting of every texel of every mesh's lightmap and saves them as .lightmap files
+	1. Each mesh is loaded (and optimized) the same way loadMeshAsset does it, and unwrapped (buildLightmapCharts).
+	2. Every triangle of every mesh goes into one TriangleBVH.
+	3. Each mesh's triangles are rasterized into its lightmap, which gives every texel they cover a position and a
+	   normal (interpolated from the PLY normals).
+	4. The texels are lit in blocks spread over a WorkStealingPool: LIGHTMAP_LIGHT_COLOUR times n.l if nothing is in
+	   the way of LIGHTMAP_LIGHT_POSITION, plus LIGHTMAP_AMBIENT times the fraction of LIGHTMAP_AO_RAYS cosine-weighted
+	   rays that don't hit anything within LIGHTMAP_AO_DISTANCE. Shadow rays go 8 neighbouring texels to a packet and
+	   ambient occlusion rays 8 from the same texel, so the rays in a packet stay close together.
+	5. Empty texels next to covered ones take the average of their covered neighbours, LIGHTMAP_PADDING times over,
+	   so filtering at the edge of a chart doesn't pull in black.
+	The ray tracing doesn't know about alpha testing, so cut-out texels (like the gaps in the curtains) still cast
+	shadows. Baked assets made before a lightmap changes are stale, so run --bake again afterwards if you use them.
+	Returns 0 if successful, -1 for file IO errors, -2 for file format errors
+*/
+int bakeLightmaps(const std::vector<SceneEntry>& entries){
+	struct MeshLightmap{
+		MeshData mesh;
+		uint64_t sourceHash;
+		int result;
+		std::vector<uint32_t> remap;
+		std::vector<glm::vec2> uvs;
+		std::vector<TriData> faces;
+		// Per texel: whether a triangle covers it, and its light
+		std::vector<unsigned char> covered;
+		std::vector<glm::vec3> light;
+	};
+	// A covered texel waiting to be lit
+	struct Texel{
+		glm::vec3 position, normal;
+		uint32_t mesh, index;
+	};
+	const int size = LIGHTMAP_SIZE;
+	// Rays start this far off the surface so they don't hit the triangle they start on
+	const float RAY_OFFSET = 1e-3f;
+	const size_t TEXELS_PER_TASK = 64;
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	WorkStealingPool pool;
+	std::vector<MeshLightmap> meshes(entries.size());
+	pool.run(entries.size(), [&](int i){
+		MeshLightmap& lightmap = meshes[i];
+		lightmap.result = loadPLY(entries[i].PLYPath, lightmap.mesh);
+		if (lightmap.result != 0 || !hashLightmapSource(entries[i].PLYPath, entries[i].transform, lightmap.sourceHash)){
+			lightmap.result = lightmap.result != 0 ? lightmap.result : -1;
+			return;
+		}
+		transformMesh(lightmap.mesh, entries[i].transform);
+		if (OPTIMIZE_MESHES){
+			optimizeMesh(lightmap.mesh, entries[i].PLYPath);
+		}
+		size_t numCharts = buildLightmapCharts(lightmap.mesh, size, lightmap.remap, lightmap.uvs, lightmap.faces);
+		if (numCharts == 0){
+			lightmap.result = -2;
+			return;
+		}
+		printf("Unwrapped %s into %zu charts (%zu -> %zu vertices)\n", entries[i].PLYPath.data(), numCharts, lightmap.mesh.vertexCount(), lightmap.remap.size());
+	});
 
-			// Create shader program
-			// Create shaders (shamelessly stolen from class demo code as instructed)
-			GLuint VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
-			GLuint FragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
-			std::string VertexShaderCode = "\
-			#version 330 core\n\
-			// Input vertex data, different for all executions of this shader.\n\
-			layout(location = 0) in vec3 vertexPosition;\n\
-			layout(location = 1) in vec2 uv;\n\
-			// Output data ; will be interpolated for each fragment.\n\
-			out vec2 uv_out;\n\
-			// Values that stay constant for the whole mesh.\n\
-			uniform mat4 MVP;\n\
-			void main(){ \n\
-				// Output position of the vertex, in clip space : MVP * position\n\
-				gl_Position =  MVP * vec4(vertexPosition,1);\n\
-				// The color will be interpolated to produce the color of each fragment\n\
-				uv_out = uv;\n\
-			}\n";
-
-			// Read the Fragment Shader code from the file
-			std::string FragmentShaderCode = "\
-			#version 330 core\n\
-			in vec2 uv_out; \n\
-			uniform sampler2D tex;\n\
-			void main() {\n\
-				gl_FragColor = texture(tex, uv_out);\n\
-			}\n";
-			char const *VertexSourcePointer = VertexShaderCode.c_str();
-			glShaderSource(VertexShaderID, 1, &VertexSourcePointer, NULL);
-			glCompileShader(VertexShaderID);
-
-			// Compile Fragment Shader
-			char const *FragmentSourcePointer = FragmentShaderCode.c_str();
-			glShaderSource(FragmentShaderID, 1, &FragmentSourcePointer, NULL);
-			glCompileShader(FragmentShaderID);
-
-			programID = glCreateProgram();
-			glAttachShader(programID, VertexShaderID);
-			glAttachShader(programID, FragmentShaderID);
-			glLinkProgram(programID);
-
-			glDetachShader(programID, VertexShaderID);
-			glDetachShader(programID, FragmentShaderID);
-
-			glDeleteShader(VertexShaderID);
-			glDeleteShader(FragmentShaderID);
-
-			// Create texture object
-			glGenTextures(1, &textureObj);
-			glBindTexture(GL_TEXTURE_2D, textureObj);
-			glTexImage2D(
-				GL_TEXTURE_2D,
-				0,
-				GL_RGBA,
-				textureWidth,
-				textureHeight,
-				0,
-				GL_BGRA,
-				GL_UNSIGNED_BYTE,
-				textureData
-			);
-			glGenerateMipmap(GL_TEXTURE_2D);
-			glBindTexture(GL_TEXTURE_2D, 0);
+	TriangleBVH bvh;
+	for (uint32_t m = 0; m < meshes.size(); m++){
+		if (meshes[m].result == 0){
+			bvh.addMesh(meshes[m].mesh, m);
 		}
-		void draw(glm::mat4 mvp){			
+	}
+	bvh.build(pool);
 
-			// Set active texture unit
-			glActiveTexture(GL_TEXTURE0);
-			glEnable(GL_TEXTURE_2D);
-			glBindTexture(GL_TEXTURE_2D, textureObj);
-			
-			// Enable blending
-			glEnable(GL_BLEND);
-			glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-
-			// Get location of uniform MVP matrix
-			GLuint matrixID = glGetUniformLocation(programID, "MVP");
-			
-			// Set shader program and uniform MVP matrix
-			glUseProgram(programID);
-			glUniformMatrix4fv(matrixID, 1, GL_FALSE, &mvp[0][0]);
-			
-			glBindVertexArray(meshVAO);
+	// Find the position and normal under the centre of every texel a triangle covers
+	std::vector<Texel> texels;
+	for (uint32_t m = 0; m < meshes.size(); m++){
+		MeshLightmap& lightmap = meshes[m];
+		if (lightmap.result != 0){
+			continue;
+		}
+		lightmap.covered.assign((size_t) size * size, 0);
+		lightmap.light.assign((size_t) size * size, glm::vec3(0.0f));
+		std::vector<Texel> meshTexels((size_t) size * size);
+		const VertexData* vertices = lightmap.mesh.vertexData();
+		for (const TriData& face : lightmap.faces){
+			const GLuint corners[3] = {face.v1, face.v2, face.v3};
+			glm::vec2 texel[3];
+			glm::vec3 positions[3], normals[3];
+			for (int i = 0; i < 3; i++){
+				const VertexData& vd = vertices[lightmap.remap[corners[i]]];
+				texel[i] = lightmap.uvs[corners[i]] * (float) size;
+				positions[i] = glm::vec3(vd.x, vd.y, vd.z);
+				normals[i] = glm::vec3(vd.nx, vd.ny, vd.nz);
+			}
+			float area = (texel[1].x - texel[0].x) * (texel[2].y - texel[0].y) - (texel[1].y - texel[0].y) * (texel[2].x - texel[0].x);
+			if (area == 0.0f){
+				continue;
+			}
+			glm::vec3 faceNormal = glm::cross(positions[1] - positions[0], positions[2] - positions[0]);
+			int minX = std::max(0, (int) floorf(std::min({texel[0].x, texel[1].x, texel[2].x})));
+			int minY = std::max(0, (int) floorf(std::min({texel[0].y, texel[1].y, texel[2].y})));
+			int maxX = std::min(size - 1, (int) ceilf(std::max({texel[0].x, texel[1].x, texel[2].x})));
+			int maxY = std::min(size - 1, (int) ceilf(std::max({texel[0].y, texel[1].y, texel[2].y})));
+			for (int y = minY; y <= maxY; y++){
+				for (int x = minX; x <= maxX; x++){
+					glm::vec2 centre(x + 0.5f, y + 0.5f);
+					float weights[3];
+					for (int i = 0; i < 3; i++){
+						const glm::vec2& a = texel[(i + 1) % 3];
+						const glm::vec2& b = texel[(i + 2) % 3];
+						weights[i] = ((b.x - a.x) * (centre.y - a.y) - (b.y - a.y) * (centre.x - a.x)) / area;
+					}
+					// A little slack so texels exactly on an edge between two triangles aren't missed by both
+					if (weights[0] < -1e-4f || weights[1] < -1e-4f || weights[2] < -1e-4f){
+						continue;
+					}
+					glm::vec3 normal = normals[0] * weights[0] + normals[1] * weights[1] + normals[2] * weights[2];
+					if (glm::length(normal) == 0.0f){
+						normal = faceNormal;
+					}
+					size_t index = (size_t) y * size + x;
+					lightmap.covered[index] = 1;
+					meshTexels[index] = {positions[0] * weights[0] + positions[1] * weights[1] + positions[2] * weights[2],
+						glm::normalize(normal), m, (uint32_t) index};
+				}
+			}
+		}
+		for (size_t i = 0; i < meshTexels.size(); i++){
+			if (lightmap.covered[i]){
+				texels.push_back(meshTexels[i]);
+			}
+		}
+	}
 
-			glDrawElements(
-				GL_TRIANGLES,
-				faces.size() * 3,
-				GL_UNSIGNED_INT,
-				(void*) 0
-			);
-			glBindVertexArray(0);
-			glUseProgram(0);
-			glBindTexture(GL_TEXTURE_2D, 0);
+	// Fixed cosine-weighted directions around +z (Hammersley points), turned by a different amount for every texel
+	std::vector<glm::vec2> aoSamples(LIGHTMAP_AO_RAYS);
+	for (int i = 0; i < LIGHTMAP_AO_RAYS; i++){
+		uint32_t bits = i;
+		bits = (bits << 16) | (bits >> 16);
+		bits = ((bits & 0x55555555u) << 1) | ((bits & 0xAAAAAAAAu) >> 1);
+		bits = ((bits & 0x33333333u) << 2) | ((bits & 0xCCCCCCCCu) >> 2);
+		bits = ((bits & 0x0F0F0F0Fu) << 4) | ((bits & 0xF0F0F0F0u) >> 4);
+		bits = ((bits & 0x00FF00FFu) << 8) | ((bits & 0xFF00FF00u) >> 8);
+		aoSamples[i] = glm::vec2((i + 0.5f) / LIGHTMAP_AO_RAYS, bits * 2.3283064365386963e-10f);
+	}
+	std::atomic<uint64_t> numRays(0);
+	size_t numTasks = (texels.size() + TEXELS_PER_TASK - 1) / TEXELS_PER_TASK;
+	pool.run(numTasks, [&](int task){
+		size_t first = task * TEXELS_PER_TASK, last = std::min(texels.size(), first + TEXELS_PER_TASK);
+		uint64_t rays = 0;
+		TriangleBVH::RayPacket packet;
+		auto setRay = [&](int lane, const glm::vec3& origin, const glm::vec3& direction, float maxDistance){
+			packet.originX[lane] = origin.x;
+			packet.originY[lane] = origin.y;
+			packet.originZ[lane] = origin.z;
+			packet.directionX[lane] = direction.x;
+			packet.directionY[lane] = direction.y;
+			packet.directionZ[lane] = direction.z;
+			packet.maxDistance[lane] = maxDistance;
+		};
+
+		// Shadows, 8 texels at a time
+		for (size_t i = first; i < last; i += 8){
+			unsigned int active = 0;
+			float facing[8];
+			for (int lane = 0; lane < 8 && i + lane < last; lane++){
+				const Texel& texel = texels[i + lane];
+				glm::vec3 origin = texel.position + texel.normal * RAY_OFFSET;
+				glm::vec3 toLight = LIGHTMAP_LIGHT_POSITION - origin;
+				float distance = glm::length(toLight);
+				facing[lane] = distance > 0.0f ? glm::dot(texel.normal, toLight / distance) : 0.0f;
+				setRay(lane, origin, toLight / std::max(distance, 1e-12f), distance);
+				if (facing[lane] > 0.0f){
+					active |= 1u << lane;
+				}
+			}
+			unsigned int shadowed = bvh.occluded8(packet, active);
+			rays += __builtin_popcount(active);
+			for (int lane = 0; lane < 8 && i + lane < last; lane++){
+				if ((active & ~shadowed) >> lane & 1){
+					const Texel& texel = texels[i + lane];
+					meshes[texel.mesh].light[texel.index] += LIGHTMAP_LIGHT_COLOUR * facing[lane];
+				}
+			}
+		}
+
+		// Ambient occlusion, 8 rays at a time from each texel
+		for (size_t i = first; i < last; i++){
+			const Texel& texel = texels[i];
+			glm::vec3 up = fabsf(texel.normal.y) < 0.99f ? glm::vec3(0.0f, 1.0f, 0.0f) : glm::vec3(1.0f, 0.0f, 0.0f);
+			glm::vec3 tangent = glm::normalize(glm::cross(up, texel.normal));
+			glm::vec3 bitangent = glm::cross(texel.normal, tangent);
+			glm::vec3 origin = texel.position + texel.normal * RAY_OFFSET;
+			uint32_t hash = (uint32_t) i * 2654435761u;
+			hash ^= hash >> 15;
+			hash *= 2246822519u;
+			float turnU = (hash & 0xffff) / 65536.0f, turnV = (hash >> 16) / 65536.0f;
+			int open = 0;
+			for (int ray = 0; ray < LIGHTMAP_AO_RAYS; ray += 8){
+				unsigned int active = 0;
+				for (int lane = 0; lane < 8 && ray + lane < LIGHTMAP_AO_RAYS; lane++){
+					glm::vec2 sample = glm::fract(aoSamples[ray + lane] + glm::vec2(turnU, turnV));
+					float radius = sqrtf(sample.x), angle = 2.0f * (float) M_PI * sample.y;
+					glm::vec3 direction = tangent * (radius * cosf(angle)) + bitangent * (radius * sinf(angle))
+						+ texel.normal * sqrtf(std::max(0.0f, 1.0f - sample.x));
+					setRay(lane, origin, direction, LIGHTMAP_AO_DISTANCE);
+					active |= 1u << lane;
+				}
+				open += __builtin_popcount(active & ~bvh.occluded8(packet, active));
+				rays += __builtin_popcount(active);
+			}
+			meshes[texel.mesh].light[texel.index] += LIGHTMAP_AMBIENT * ((float) open / LIGHTMAP_AO_RAYS);
+		}
+		numRays += rays;
+	});
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	printf("Lit %zu texels with %llu rays against %zu triangles in %.2f s (%.2f million rays/s, %zu threads, %s)\n", texels.size(),
+		(unsigned long long) numRays.load(), bvh.size(), seconds, numRays.load() / seconds / 1e6, pool.size(), SoftwareRenderer::simdName());
+
+	int result = 0;
+	for (size_t m = 0; m < meshes.size(); m++){
+		MeshLightmap& lightmap = meshes[m];
+		if (lightmap.result != 0){
+			result = lightmap.result;
+			continue;
+		}
+		// Grow the covered texels outwards into the padding
+		for (int pass = 0; pass < LIGHTMAP_PADDING; pass++){
+			std::vector<unsigned char> covered = lightmap.covered;
+			for (int y = 0; y < size; y++){
+				for (int x = 0; x < size; x++){
+					size_t index = (size_t) y * size + x;
+					if (lightmap.covered[index]){
+						continue;
+					}
+					glm::vec3 sum(0.0f);
+					int count = 0;
+					for (int dy = -1; dy <= 1; dy++){
+						for (int dx = -1; dx <= 1; dx++){
+							int nx = x + dx, ny = y + dy;
+							if (nx >= 0 && ny >= 0 && nx < size && ny < size && lightmap.covered[(size_t) ny * size + nx]){
+								sum += lightmap.light[(size_t) ny * size + nx];
+								count++;
+							}
+						}
+					}
+					if (count > 0){
+						lightmap.light[index] = sum / (float) count;
+						covered[index] = 1;
+					}
+				}
+			}
+			lightmap.covered = std::move(covered);
+		}
+		// Anything still empty is never sampled, so it's left at the value that doesn't change the texture
+		std::vector<unsigned char> pixels((size_t) size * size * 4);
+		for (size_t i = 0; i < lightmap.light.size(); i++){
+			glm::vec3 light = lightmap.covered[i] ? lightmap.light[i] : glm::vec3(1.0f);
+			for (int c = 0; c < 3; c++){
+				pixels[i * 4 + 2 - c] = (unsigned char) lroundf(glm::clamp(light[c] * LIGHTMAP_ENCODING_SCALE, 0.0f, 255.0f));
+			}
+			pixels[i * 4 + 3] = 255;
+		}
+		if (writeLightmap(entries[m].PLYPath, lightmap.sourceHash, lightmap.mesh.vertexCount(), size, lightmap.remap, lightmap.uvs,
+				lightmap.faces, pixels) != 0){
+			result = -1;
+			continue;
+		}
+		printf("Wrote %s\n", lightmapPath(entries[m].PLYPath).data());
+	}
+	return result;
+}
+
+// Same projection for the window and --benchmark
+glm::mat4 cameraProjection(){
+	return glm::perspective(glm::radians(FOV), SCREEN_WIDTH / SCREEN_HEIGHT, 0.001f, 1000.0f);
+}
+
+// View matrix for a camera at position looking along yaw (in degrees) on the horizontal plane
+glm::mat4 cameraView(const glm::vec3& position, float yaw){
+	glm::vec3 direction = {cos(glm::radians(yaw)), 0.0f, sin(glm::radians(yaw))};
+	glm::vec3 up = {0.0f, 1.0f, 0.0f};
+	return glm::lookAt(position, position + direction, up);
+}
+
+/*
+	The ray through a point on the screen, in normalized device coordinates (-1 to 1, y going up)
+	It starts on the near plane and has a normalized direction, and length is how far it is to the far plane.
+*/
+void cameraRay(const glm::mat4& viewProjection, const glm::vec2& point, glm::vec3& origin, glm::vec3& direction, float& length){
+	glm::mat4 inverse = glm::inverse(viewProjection);
+	glm::vec4 nearPoint = inverse * glm::vec4(point, -1.0f, 1.0f);
+	glm::vec4 farPoint = inverse * glm::vec4(point, 1.0f, 1.0f);
+	origin = glm::vec3(nearPoint) / nearPoint.w;
+	direction = glm::vec3(farPoint) / farPoint.w - origin;
+	length = glm::length(direction);
+	direction /= length;
+}
+
+/*
+	Moves a camera at position by movement, stopping CAMERA_RADIUS short of the first triangle in the way
+	Whatever movement is left after hitting something slides along it (the part going into the triangle is taken
+	out), so walking into a wall at an angle moves along the wall instead of stopping dead. That can run into
+	something else, so it goes around a few times. The camera only moves horizontally, so sliding along a sloped
+	surface (like the edge of the table) doesn't move it up or down either. Only the line the camera moves along is
+	checked, so it can still get closer than CAMERA_RADIUS to things beside it.
+	Returns the new position.
+*/
+glm::vec3 moveCamera(const TriangleBVH& bvh, glm::vec3 position, glm::vec3 movement){
+	for (int i = 0; i < 3; i++){
+		float length = glm::length(movement);
+		if (length < 1e-6f){
+			break;
+		}
+		glm::vec3 direction = movement / length;
+		TriangleBVH::Hit hit;
+		if (!bvh.closestHit(position, direction, length + CAMERA_RADIUS, hit)){
+			position += movement;
+			break;
+		}
+		float travel = std::max(0.0f, hit.distance - CAMERA_RADIUS);
+		position += direction * travel;
+		glm::vec3 normal(hit.normal.x, 0.0f, hit.normal.z);
+		if (glm::length(normal) < 1e-6f){
+			break;
+		}
+		normal = glm::normalize(normal);
+		movement = direction * (length - travel);
+		movement -= normal * glm::dot(movement, normal);
+	}
+	return position;
+}
+
+/*
+	Hands the latest value from one writer thread to one reader thread without either of them ever waiting
+	There are three copies: the writer fills one, the reader looks at another, and the third sits in the middle
+	holding the newest finished value. Publishing swaps the writer's copy with the middle one and marks it fresh;
+	the reader swaps its copy with the middle one only if something fresh is there, so it always sees a whole value
+	and never the one being written. Values the reader didn't get to in time are just skipped.
+*/
+template <typename T>
+class TripleBuffer{
+		// Set in middle when it holds a value the reader hasn't taken yet
+		static const int FRESH = 4;
+
+		T slots[3];
+		int writeIndex = 0;
+		std::atomic<int> middle{1};
+		int readIndex = 2;
+
+	public:
+
+		// The copy to fill in before calling publish. Only the writer thread can touch it.
+		T& writing(){
+			return slots[writeIndex];
+		}
+
+		// Makes what was written the newest value
+		void publish(){
+			writeIndex = middle.exchange(writeIndex | FRESH, std::memory_order_acq_rel) & ~FRESH;
+		}
 
+		/*
+			Takes the newest published value if there's one the reader doesn't have yet
+			Returns true if reading() changed.
+		*/
+		bool update(){
+			if ((middle.load(std::memory_order_relaxed) & FRESH) == 0){
+				return false;
+			}
+			readIndex = middle.exchange(readIndex, std::memory_order_acq_rel) & ~FRESH;
+			return true;
+		}
+
+		// The value update last took. Only the reader thread can touch it.
+		const T& reading() const{
+			return slots[readIndex];
 		}
 };
 
+// Where the camera is at one simulation tick
+struct CameraState{
+	glm::vec3 position = {0.0f, 0.5f, 0.0f};
+	float yaw = 0.0f;
+};
+
+/*
+	Everything the render thread needs from the simulation, published through a TripleBuffer after every tick
+	Ticks happen SIMULATION_RATE times a second no matter how long frames take to draw, so the camera is drawn part
+	way between the last two ticks depending on how long ago the last one was (see interpolateCamera). That puts it
+	one tick behind the input, but moving smoothly instead of jumping once per tick.
+*/
+struct SimulationSnapshot{
+	CameraState previous;
+	CameraState current;
+	// When the tick that produced current was due
+	std::chrono::steady_clock::time_point time;
+	bool showOverlay = false;
+};
+
+// The camera amount (0 to 1) of the way from previous to current
+CameraState interpolateCamera(const SimulationSnapshot& snapshot, float amount){
+	CameraState camera;
+	camera.position = glm::mix(snapshot.previous.position, snapshot.current.position, amount);
+	camera.yaw = glm::mix(snapshot.previous.yaw, snapshot.current.yaw, amount);
+	return camera;
+}
+
+/*
+	Every triangle in the scene, for camera collision and picking, with the PLY file each mesh came from
+	The render thread builds a new one whenever the scene is reloaded and the simulation thread swaps it in at its
+	next tick, so one is never changed while the other is using it.
+*/
+struct CollisionWorld{
+	TriangleBVH bvh;
+	std::vector<std::string> names;
+};
+
+
+// One point on a camera path
+struct CameraKeyframe{
+	glm::vec3 position;
+	float yaw;
+};
+
+/*
+	Reads a camera path file
+	Each non-empty line that doesn't start with # is one keyframe: "x y z yaw", with yaw in degrees like the arrow
+	keys use. Returns 0 if successful, -1 if the file couldn't be opened, -2 if a line is malformed or there are no
+	keyframes
+*/
+int loadCameraPath(std::string path, std::vector<CameraKeyframe>& keyframes){
+	std::ifstream file(path);
+	if (!file.is_open()){
+		printf("Couldn't open camera path %s\n", path.data());
+		return -1;
+	}
+	std::string line;
+	int lineNumber = 0;
+	while (std::getline(file, line)){
+		lineNumber++;
+		size_t start = line.find_first_not_of(" \t\r");
+		if (start == std::string::npos || line[start] == '#'){
+			continue;
+		}
+		CameraKeyframe keyframe;
+		if (sscanf(line.data(), "%f %f %f %f", &keyframe.position.x, &keyframe.position.y, &keyframe.position.z, &keyframe.yaw) != 4){
+			printf("%s line %d: expected \"x y z yaw\"\n", path.data(), lineNumber);
+			return -2;
+		}
+		keyframes.push_back(keyframe);
+	}
+	if (keyframes.empty()){
+		printf("%s has no keyframes\n", path.data());
+		return -2;
+	}
+	return 0;
+}
+
+// Position along a camera path, where t goes from 0 (first keyframe) to 1 (last keyframe) at an even pace
+CameraKeyframe sampleCameraPath(const std::vector<CameraKeyframe>& keyframes, float t){
+	if (keyframes.size() == 1){
+		return keyframes[0];
+	}
+	float position = glm::clamp(t, 0.0f, 1.0f) * (keyframes.size() - 1);
+	size_t index = std::min((size_t) position, keyframes.size() - 2);
+	float blend = position - index;
+	const CameraKeyframe& a = keyframes[index];
+	const CameraKeyframe& b = keyframes[index + 1];
+	CameraKeyframe result;
+	result.position = a.position + (b.position - a.position) * blend;
+	result.yaw = a.yaw + (b.yaw - a.yaw) * blend;
+	return result;
+}
+
+
+/*
+	Creates an OpenGL context with no window, using EGL
+	Tries Mesa's surfaceless platform first (works on llvmpipe with no display or GPU at all), then the default
+	display. Nothing is drawn to a surface, so the caller has to render into a framebuffer object.
+	Returns true if a context was made current
+*/
+bool createHeadlessContext(){
+	EGLDisplay display = EGL_NO_DISPLAY;
+	PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+	if (getPlatformDisplay != NULL){
+		display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+	}
+	EGLint major, minor;
+	if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor)){
+		display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+		if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor)){
+			printf("Failed to initialize EGL\n");
+			return false;
+		}
+	}
+
+	EGLint configAttributes[] = {EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE};
+	EGLConfig config;
+	EGLint numConfigs = 0;
+	if (!eglChooseConfig(display, configAttributes, &config, 1, &numConfigs) || numConfigs == 0 || !eglBindAPI(EGL_OPENGL_API)){
+		printf("No EGL config supports desktop OpenGL\n");
+		return false;
+	}
+	// Compatibility profile, same as the GLFW window gets by default
+	EGLint contextAttributes[] = {
+		EGL_CONTEXT_MAJOR_VERSION, 4,
+		EGL_CONTEXT_MINOR_VERSION, 5,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_COMPATIBILITY_PROFILE_BIT,
+		EGL_NONE
+	};
+	EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttributes);
+	if (context == EGL_NO_CONTEXT){
+		// Older drivers might not have 4.5, so take whatever version they give
+		context = eglCreateContext(display, config, EGL_NO_CONTEXT, NULL);
+	}
+	if (context == EGL_NO_CONTEXT || !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)){
+		printf("Failed to create an EGL context\n");
+		return false;
+	}
+	return true;
+}
+
+// Value at fraction p (0 to 1) of a sorted list, using the nearest rank
+double percentile(const std::vector<double>& sorted, double p){
+	size_t rank = (size_t) ceil(p * sorted.size());
+	return sorted[std::min(std::max(rank, (size_t) 1), sorted.size()) - 1];
+}
+
+/*
+	Renders the scene offscreen along a camera path and writes timing statistics as JSON
+	Frames are spread evenly along the path. Each frame is timed from the start of drawing until glFinish returns, so
+	the GPU's time counts too. A few warm-up frames go first and aren't counted. Renders into a framebuffer object the
+	same size as the window, with the same 4x multisampling. With software set, it uses SoftwareRenderer instead and
+	never touches OpenGL, so it works on machines without a GPU. entries is the scene manifest to draw.
+	Returns 0 if successful, -1 if the path, context or output file didn't work, -2 if the path file is malformed
+*/
+int runBenchmark(std::string pathFile, int numFrames, std::string outputPath, bool software, const std::vector<SceneEntry>& entries){
+	std::vector<CameraKeyframe> keyframes;
+	int result = loadCameraPath(pathFile, keyframes);
+	if (result != 0){
+		return result;
+	}
+	std::unique_ptr<Scene> scene;
+	std::unique_ptr<SoftwareRenderer> softwareRenderer;
+	std::string rendererName;
+	if (software){
+		softwareRenderer.reset(new SoftwareRenderer(entries, SCREEN_WIDTH, SCREEN_HEIGHT));
+		rendererName = "software, " + std::to_string(softwareRenderer->threadCount()) + " threads, " + SoftwareRenderer::simdName();
+		printf("Benchmarking on %s\n", rendererName.data());
+	}
+	else{
+		if (!createHeadlessContext()){
+			return -1;
+		}
+		// GLEW looks for GLX as well, which isn't there without a display, but the GL functions still get loaded
+		glewExperimental = true;
+		GLenum glewResult = glewInit();
+		if (glewResult != GLEW_OK && glewResult != GLEW_ERROR_NO_GLX_DISPLAY){
+			printf("Failed to initialize GLEW\n");
+			return -1;
+		}
+		const char* renderer = (const char*) glGetString(GL_RENDERER);
+		rendererName = renderer ? renderer : "unknown";
+		printf("Benchmarking on %s\n", rendererName.data());
+
+		GLuint framebuffer, renderbuffers[2];
+		glGenFramebuffers(1, &framebuffer);
+		glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+		glGenRenderbuffers(2, renderbuffers);
+		glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[0]);
+		glRenderbufferStorageMultisample(GL_RENDERBUFFER, 4, GL_RGBA8, SCREEN_WIDTH, SCREEN_HEIGHT);
+		glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[1]);
+		glRenderbufferStorageMultisample(GL_RENDERBUFFER, 4, GL_DEPTH_COMPONENT24, SCREEN_WIDTH, SCREEN_HEIGHT);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbuffers[0]);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, renderbuffers[1]);
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE){
+			printf("Failed to create the offscreen framebuffer\n");
+			return -1;
+		}
+		glViewport(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT);
+
+		scene.reset(new Scene(entries));
+		scene->finishStreaming();
+	}
+	glm::mat4 projection = cameraProjection();
+
+	const int WARMUP_FRAMES = 5;
+	std::vector<double> frameTimes;
+	size_t totalDrawCalls = 0, totalTriangles = 0, maxDrawCalls = 0, maxTriangles = 0;
+	for (int frame = -WARMUP_FRAMES; frame < numFrames; frame++){
+		float t = numFrames > 1 ? std::max(frame, 0) / (float) (numFrames - 1) : 0.0f;
+		CameraKeyframe camera = sampleCameraPath(keyframes, t);
+
+		profiler.beginFrame();
+		ProfileZone zone("frame");
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		if (softwareRenderer){
+			softwareRenderer->render(projection, cameraView(camera.position, camera.yaw));
+		}
+		else{
+			scene->draw(projection, cameraView(camera.position, camera.yaw));
+			glFinish();
+		}
+		double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+		if (frame >= 0){
+			frameTimes.push_back(milliseconds);
+			totalDrawCalls += frameCounters.drawCalls;
+			totalTriangles += frameCounters.triangles;
+			maxDrawCalls = std::max(maxDrawCalls, frameCounters.drawCalls);
+			maxTriangles = std::max(maxTriangles, frameCounters.triangles);
+		}
+	}
+
+	std::vector<double> sorted = frameTimes;
+	std::sort(sorted.begin(), sorted.end());
+	double totalTime = 0;
+	for (double time : frameTimes){
+		totalTime += time;
+	}
+
+	FILE* output = fopen(outputPath.data(), "w");
+	if (!output){
+		printf("Couldn't write %s\n", outputPath.data());
+		return -1;
+	}
+	// The renderer string comes from the driver, so keep only characters that are safe in a JSON string
+	for (char& c : rendererName){
+		if (c == '"' || c == '\\' || (unsigned char) c < 0x20){
+			c = ' ';
+		}
+	}
+	fprintf(output, "{\n");
+	fprintf(output, "\t\"renderer\": \"%s\",\n", rendererName.data());
+	fprintf(output, "\t\"width\": %d,\n\t\"height\": %d,\n", (int) SCREEN_WIDTH, (int) SCREEN_HEIGHT);
+	fprintf(output, "\t\"frames\": %d,\n", numFrames);
+	fprintf(output, "\t\"frame_ms\": {\"mean\": %.4f, \"p50\": %.4f, \"p95\": %.4f, \"p99\": %.4f, \"min\": %.4f, \"max\": %.4f},\n",
+		totalTime / numFrames, percentile(sorted, 0.50), percentile(sorted, 0.95), percentile(sorted, 0.99), sorted.front(), sorted.back());
+	fprintf(output, "\t\"draw_calls\": {\"mean\": %.2f, \"max\": %zu},\n", totalDrawCalls / (double) numFrames, maxDrawCalls);
+	fprintf(output, "\t\"triangles\": {\"mean\": %.2f, \"max\": %zu}%s\n", totalTriangles / (double) numFrames, maxTriangles, scene ? "," : "");
+	if (scene){
+		MemoryUsage memory = scene->memoryUsage();
+		fprintf(output, "\t\"memory_bytes\": {\"cpu\": %zu, \"mapped\": %zu, \"gpu\": %zu, \"resident\": %zu}\n",
+			memory.cpuBytes, memory.mappedBytes, memory.gpuBytes, residentBytes());
+	}
+	fprintf(output, "}\n");
+	fclose(output);
+
+	printf("%d frames: p50 %.3f ms, p95 %.3f ms, p99 %.3f ms, %.1f draw calls and %.0f triangles per frame\n",
+		numFrames, percentile(sorted, 0.50), percentile(sorted, 0.95), percentile(sorted, 0.99),
+		totalDrawCalls / (double) numFrames, totalTriangles / (double) numFrames);
+	scene.reset();
+	shaderPrograms.clear();
+	return 0;
+}
+
+
+/*
+	--bench-rays: times TriangleBVH's ray queries on the meshes in entries
+	Every mesh is loaded with loadMeshAsset (so these are the same triangles the window collides with and picks) and
+	the tree is built over them. Then there are two sets of numRays rays:
+	- camera: from where the window's camera starts through random pixels at random yaws, like picking
+	- random: from one random point in the scene's bounding box to another, which is a lot less coherent
+	Each set is traced with closestHit and with occluded, on one thread and then on every worker. Both kinds of query
+	have to agree on which rays hit something, or it bails out.
+	Returns 0 if successful, -1 if a mesh couldn't be loaded, -2 if the queries disagree
+*/
+int benchmarkRays(int numRays, const std::vector<SceneEntry>& entries){
+	struct Ray{
+		glm::vec3 origin, direction;
+		float length;
+	};
+	const size_t RAYS_PER_TASK = 4096;
+
+	WorkStealingPool pool;
+	std::vector<MeshAsset> assets(entries.size());
+	std::vector<int> results(assets.size());
+	pool.run(assets.size(), [&](int i){
+		assets[i].PLYPath = entries[i].PLYPath;
+		assets[i].texturePath = entries[i].texturePath;
+		assets[i].transform = entries[i].transform;
+		results[i] = loadMeshAsset(assets[i]);
+		assets[i].texture.release();
+	});
+	TriangleBVH bvh;
+	AABB bounds;
+	for (size_t i = 0; i < assets.size(); i++){
+		if (results[i] != 0){
+			printf("Couldn't load %s\n", assets[i].PLYPath.data());
+			return -1;
+		}
+		bvh.addMesh(assets[i].mesh, i);
+		const VertexData* vertices = assets[i].mesh.vertexData();
+		for (size_t v = 0; v < assets[i].mesh.vertexCount(); v++){
+			bounds.expand(glm::vec3(vertices[v].x, vertices[v].y, vertices[v].z));
+		}
+	}
+	bvh.build(pool);
+
+	std::vector<Ray> cameraRays(numRays), randomRays(numRays);
+	std::mt19937 random(1);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+	glm::mat4 projection = cameraProjection();
+	for (Ray& ray : cameraRays){
+		glm::mat4 view = cameraView(glm::vec3(0.0f, 0.5f, 0.0f), unit(random) * 360.0f);
+		cameraRay(projection * view, glm::vec2(unit(random), unit(random)) * 2.0f - 1.0f, ray.origin, ray.direction, ray.length);
+	}
+	for (Ray& ray : randomRays){
+		ray.origin = bounds.min + (bounds.max - bounds.min) * glm::vec3(unit(random), unit(random), unit(random));
+		glm::vec3 target = bounds.min + (bounds.max - bounds.min) * glm::vec3(unit(random), unit(random), unit(random));
+		ray.length = std::max(glm::length(target - ray.origin), 1e-6f);
+		ray.direction = (target - ray.origin) / ray.length;
+	}
+
+	// Traces every ray in a set and returns how long it took, counting the rays that hit something
+	auto trace = [&](const std::vector<Ray>& rays, bool closest, bool parallel, size_t& hits){
+		std::atomic<size_t> hitCount(0);
+		auto traceRange = [&](size_t first, size_t last){
+			size_t count = 0;
+			TriangleBVH::Hit hit;
+			for (size_t i = first; i < last; i++){
+				const Ray& ray = rays[i];
+				if (closest ? bvh.closestHit(ray.origin, ray.direction, ray.length, hit) : bvh.occluded(ray.origin, ray.direction, ray.length)){
+					count++;
+				}
+			}
+			hitCount += count;
+		};
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		if (parallel){
+			pool.run((rays.size() + RAYS_PER_TASK - 1) / RAYS_PER_TASK, [&](int task){
+				traceRange(task * RAYS_PER_TASK, std::min((task + 1) * RAYS_PER_TASK, rays.size()));
+			});
+		}
+		else{
+			traceRange(0, rays.size());
+		}
+		hits = hitCount;
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	};
+
+	printf("%-8s %-12s %6s %18s %18s %10s\n", "rays", "query", "hit", "1 thread (Mray/s)", "threads (Mray/s)", "us per ray");
+	const std::pair<const char*, const std::vector<Ray>*> sets[] = {{"camera", &cameraRays}, {"random", &randomRays}};
+	for (const std::pair<const char*, const std::vector<Ray>*>& set : sets){
+		size_t closestHits = 0;
+		for (bool closest : {true, false}){
+			size_t hits, parallelHits;
+			double seconds = trace(*set.second, closest, false, hits);
+			double parallelSeconds = trace(*set.second, closest, true, parallelHits);
+			if (parallelHits != hits || (!closest && hits != closestHits)){
+				printf("%s rays: queries disagree on which rays hit (%zu, %zu, %zu)\n", set.first, closestHits, hits, parallelHits);
+				return -2;
+			}
+			closestHits = hits;
+			printf("%-8s %-12s %5.1f%% %18.2f %18.2f %10.3f\n", set.first, closest ? "closest hit" : "occluded", 100.0 * hits / numRays,
+				numRays / seconds / 1e6, numRays / parallelSeconds / 1e6, seconds * 1e6 / numRays);
+		}
+	}
+	printf("%zu triangles, %zu threads, %s\n", bvh.size(), pool.size(), SoftwareRenderer::simdName());
+	return 0;
+}
+
+int main(int argc, char** argv){
+
+	// --trace <file>, --scene <file> and --software can go with any mode, so take them out before looking at the rest
+	std::string traceFile;
+	std::string sceneFile = SCENE_MANIFEST;
+	bool software = false;
+	std::vector<char*> arguments;
+	for (int i = 0; i < argc; i++){
+		if (std::string(argv[i]) == "--trace" && i + 1 < argc){
+			traceFile = argv[++i];
+		}
+		else if (std::string(argv[i]) == "--scene" && i + 1 < argc){
+			sceneFile = argv[++i];
+		}
+		else if (std::string(argv[i]) == "--software"){
+			software = true;
+		}
+		else{
+			arguments.push_back(argv[i]);
+		}
+	}
+	argc = arguments.size();
+	argv = arguments.data();
+	profiler.tracing = !traceFile.empty();
+
+	// Command line modes that don't need a window
+	if (argc > 1 && std::string(argv[1]) == "--bench-ply"){
+		int iterations = argc > 2 ? atoi(argv[2]) : 50;
+		return benchmarkPLYParsers(iterations > 0 ? iterations : 1);
+	}
+	if (argc > 1 && std::string(argv[1]) == "--bench-images"){
+		int iterations = argc > 2 ? atoi(argv[2]) : 200;
+		return benchmarkImages(iterations > 0 ? iterations : 1, argc > 3 ? argv[3] : "");
+	}
 
-int main(){
+	// Everything else needs the scene
+	std::vector<SceneEntry> sceneEntries;
+	int manifestResult = loadSceneManifest(sceneFile, sceneEntries);
+	if (manifestResult != 0){
+		return manifestResult;
+	}
+	if (argc > 1 && std::string(argv[1]) == "--bench-rays"){
+		int rays = argc > 2 ? atoi(argv[2]) : 1000000;
+		return benchmarkRays(rays > 0 ? rays : 1, sceneEntries);
+	}
+	if (argc > 2 && std::string(argv[1]) == "--benchmark"){
+		int frames = argc > 3 ? atoi(argv[3]) : 600;
+		int result = runBenchmark(argv[2], frames > 0 ? frames : 1, argc > 4 ? argv[4] : "benchmark.json", software, sceneEntries);
+		if (result == 0 && !traceFile.empty()){
+			result = profiler.writeTrace(traceFile);
+		}
+		return result;
+	}
+	if (argc > 6 && std::string(argv[1]) == "--software-render"){
+		glm::vec3 position(atof(argv[2]), atof(argv[3]), atof(argv[4]));
+		SoftwareRenderer renderer(sceneEntries, SCREEN_WIDTH, SCREEN_HEIGHT);
+		renderer.render(cameraProjection(), cameraView(position, atof(argv[5])));
+		int result = renderer.saveBMP(argv[6]);
+		if (result == 0 && !traceFile.empty()){
+			result = profiler.writeTrace(traceFile);
+		}
+		return result;
+	}
+	if (argc > 1 && std::string(argv[1]) == "--bake-lightmaps"){
+		return bakeLightmaps(sceneEntries);
+	}
+	if (argc > 1 && std::string(argv[1]) == "--bake"){
+		int result = 0;
+		for (const SceneEntry& entry : sceneEntries){
+			if (bakeMeshAsset(entry) != 0){
+				result = -1;
+			}
+		}
+		return result;
+	}
 
 	// Initialize window
 	if (!glfwInit()){
 		printf("Failed to initialize GLFW\n");
 		return -1;
 	}
-	glfwWindowHint(GLFW_SAMPLES, 4);
-	window = glfwCreateWindow(SCREEN_WIDTH, SCREEN_HEIGHT, "Assignment 4", NULL, NULL);
-	if (window == NULL){
-		printf("Failed to open window\n");
-		glfwTerminate();
+	// Opens the window with the given number of MSAA samples, and sets up GLEW for its context
+	auto openWindow = [&](int samples){
+		glfwWindowHint(GLFW_SAMPLES, samples);
+		window = glfwCreateWindow(SCREEN_WIDTH, SCREEN_HEIGHT, "Assignment 4", NULL, NULL);
+		if (window == NULL){
+			printf("Failed to open window\n");
+			glfwTerminate();
+			return -1;
+		}
+		glfwMakeContextCurrent(window);
+
+		// Initialize GLEW
+		glewExperimental = true;
+		if (glewInit() != GLEW_OK){
+			printf("Failed to initialize GLEW\n");
+			glfwTerminate();
+			return -1;
+		}
+		return 0;
+	};
+	// The software renderer's frames are blitted in, which only works if the window isn't multisampled. With
+	// DYNAMIC_RESOLUTION the scene gets its MSAA from the offscreen target instead, but whether that can be made isn't
+	// known until there's a context, so without it the window is opened again with MSAA.
+	bool dynamicResolutionOn = DYNAMIC_RESOLUTION && !software;
+	if (openWindow(software || dynamicResolutionOn ? 0 : 4) != 0){
 		return -1;
 	}
-	glfwMakeContextCurrent(window);
+	if (dynamicResolutionOn && !DynamicResolution::isSupported()){
+		printf("Dynamic resolution needs OpenGL 4.3, drawing straight to the window with MSAA instead\n");
+		dynamicResolutionOn = false;
+		glfwDestroyWindow(window);
+		if (openWindow(4) != 0){
+			return -1;
+		}
+	}
 
-	// Initialize GLEW
-	glewExperimental = true;
-	if (glewInit() != GLEW_OK){
-		printf("Failed to initialize GLEW\n");
-		glfwTerminate();
-		return -1;
-	}		
-
-	// Load data from files
-	std::vector<TexturedMesh> meshes;
-	meshes.push_back(TexturedMesh("./assets/Walls.ply", "./assets/walls.bmp"));
-	meshes.push_back(TexturedMesh("./assets/WoodObjects.ply", "./assets/woodobjects.bmp"));
-	meshes.push_back(TexturedMesh("./assets/Table.ply", "./assets/table.bmp"));
-	meshes.push_back(TexturedMesh("./assets/WindowBG.ply", "./assets/windowbg.bmp"));
-	meshes.push_back(TexturedMesh("./assets/Patio.ply", "./assets/patio.bmp"));
-	meshes.push_back(TexturedMesh("./assets/Floor.ply", "./assets/floor.bmp"));
-	meshes.push_back(TexturedMesh("./assets/Bottles.ply", "./assets/bottles.bmp"));
-	
-	meshes.push_back(TexturedMesh("./assets/DoorBG.ply", "./assets/doorbg.bmp"));
-	meshes.push_back(TexturedMesh("./assets/MetalObjects.ply", "./assets/metalobjects.bmp"));
-	meshes.push_back(TexturedMesh("./assets/Curtains.ply", "./assets/curtains.bmp"));
-
-	// Enable depth testing
-	glEnable(GL_DEPTH_TEST);
-	glDepthFunc(GL_LESS);
-	glClearColor(0,0,0,1);
-
-	// Set up initial camera position and direction
-	float yaw = 0.0f;
-	glm::vec3 cameraDirection = {cos(glm::radians(yaw)), 0.0f, sin(glm::radians(yaw))};
-	glm::vec3 cameraPosition = {0.0f, 0.5f, 0.0f};
-	glm::vec3 up = {0.0f, 1.0f, 0.0f};
+	std::unique_ptr<Scene> scene;
+	std::unique_ptr<SoftwareRenderer> softwareRenderer;
+	if (software){
+		softwareRenderer.reset(new SoftwareRenderer(sceneEntries, SCREEN_WIDTH, SCREEN_HEIGHT));
+	}
+	else{
+		scene.reset(new Scene(sceneEntries));
+	}
+
+	// Every triangle in the scene, for camera collision and picking. Built again whenever the scene is reloaded.
+	WorkStealingPool rayPool;
+	auto buildCollisionWorld = [&](){
+		std::shared_ptr<CollisionWorld> world = std::make_shared<CollisionWorld>();
+		size_t numMeshes = softwareRenderer ? softwareRenderer->meshCount() : scene->getMeshes().size();
+		for (size_t i = 0; i < numMeshes; i++){
+			world->bvh.addMesh(softwareRenderer ? softwareRenderer->getMeshData(i) : scene->getMeshes()[i].getMeshData(), i);
+			world->names.push_back(sceneEntries[i].PLYPath);
+		}
+		world->bvh.build(rayPool);
+		return world;
+	};
+	std::shared_ptr<CollisionWorld> collisionWorld = buildCollisionWorld();
+	std::shared_ptr<CollisionWorld> newCollisionWorld;
+	std::mutex collisionMutex;
+
+	// Only the OpenGL renderer hot reloads. The software renderer keeps what it loaded at the start.
+	std::unique_ptr<SceneWatcher> watcher;
+	if (HOT_RELOAD && scene){
+		watcher.reset(new SceneWatcher());
+		watcher->watch(sceneFile, sceneEntries);
+	}
 
 	// Set up perspective projection
-	glm::mat4 projection = glm::perspective(glm::radians(FOV), SCREEN_WIDTH / SCREEN_HEIGHT, 0.001f, 1000.0f);
-	glm::mat4 mvp;
+	glm::mat4 projection = cameraProjection();
+
+	// The first snapshot has the camera at its starting position (see CameraState), standing still
+	const double tickSeconds = 1.0 / SIMULATION_RATE;
+	const std::chrono::steady_clock::duration tickLength = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(tickSeconds));
+	TripleBuffer<SimulationSnapshot> snapshots;
+	snapshots.writing().time = std::chrono::steady_clock::now();
+	snapshots.writing().showOverlay = PROFILER_OVERLAY;
+	snapshots.publish();
+
+	// The render thread puts the title it wants here, since only the main thread can set it
+	std::string windowTitle;
+	std::mutex titleMutex;
+
+	/*
+		The render thread takes the GL context over from the main thread and draws the newest snapshot as fast as it
+		can, so a slow frame only holds up drawing and never the input. It also does the hot reloading, since that
+		needs the context.
+	*/
+	std::atomic<bool> running(true);
+	glfwMakeContextCurrent(NULL);
+	std::thread renderThread([&](){
+		glfwMakeContextCurrent(window);
+		{
+			ProfilerOverlay overlay;
+			std::unique_ptr<DynamicResolution> dynamicResolution;
+			if (dynamicResolutionOn && scene){
+				dynamicResolution.reset(new DynamicResolution(SCREEN_WIDTH, SCREEN_HEIGHT));
+			}
+			std::chrono::steady_clock::time_point lastTitleUpdate = std::chrono::steady_clock::now();
+			std::chrono::steady_clock::time_point lastOverlayUpdate = lastTitleUpdate;
+			while (running){
+				profiler.beginFrame();
+				ProfileZone frameZone("frame");
+
+				// Draw the camera however far it's got between the last two ticks
+				snapshots.update();
+				const SimulationSnapshot& snapshot = snapshots.reading();
+				double sinceTick = std::chrono::duration<double>(std::chrono::steady_clock::now() - snapshot.time).count();
+				CameraState camera = interpolateCamera(snapshot, glm::clamp(float(sinceTick / tickSeconds), 0.0f, 1.0f));
+				glm::mat4 view = cameraView(camera.position, camera.yaw);
+
+				// Reload whatever changed on disk. The streamer could still be filling textures that a reload would
+				// replace, so changes wait until it's done.
+				std::set<std::string> changedFiles;
+				if (watcher && !textureStreamer.busy() && watcher->poll(changedFiles)){
+					std::vector<SceneEntry> newEntries = sceneEntries;
+					if (changedFiles.count(SceneWatcher::normalize(sceneFile)) != 0){
+						std::vector<SceneEntry> manifestEntries;
+						if (loadSceneManifest(sceneFile, manifestEntries) == 0){
+							newEntries = manifestEntries;
+						}
+						else{
+							printf("Keeping the scene as it was\n");
+						}
+					}
+					bool reloaded = scene->reload(newEntries, changedFiles);
+					sceneEntries = scene->getEntries();
+					watcher->watch(sceneFile, sceneEntries);
+					// With GPU_RESIDENT the meshes that weren't reloaded have no CPU copies left to build it from, so
+					// collision and picking keep the old triangles
+					if (reloaded && !GPU_RESIDENT){
+						std::shared_ptr<CollisionWorld> world = buildCollisionWorld();
+						std::lock_guard<std::mutex> lock(collisionMutex);
+						newCollisionWorld = world;
+					}
+				}
 
-	// Main loop
+				// Draw meshes
+				if (softwareRenderer){
+					softwareRenderer->render(projection, view);
+					softwareRenderer->blit();
+				}
+				else if (dynamicResolution){
+					ProfileZone resolutionZone("dynamic resolution", true);
+					dynamicResolution->begin();
+					scene->draw(projection, view);
+					dynamicResolution->end();
+				}
+				else{
+					scene->draw(projection, view);
+				}
+
+				// Draw the profiler overlay, with its text updated twice a second so it's readable
+				if (snapshot.showOverlay){
+					if (std::chrono::steady_clock::now() - lastOverlayUpdate > std::chrono::milliseconds(500)){
+						overlay.update();
+						lastOverlayUpdate = std::chrono::steady_clock::now();
+					}
+					overlay.draw();
+				}
+
+				// Show the culling and state change counters in the title bar, about once a second
+				if (std::chrono::steady_clock::now() - lastTitleUpdate > std::chrono::seconds(1)){
+					char title[256];
+					if (softwareRenderer){
+						snprintf(title, sizeof(title), "Assignment 4 - software, %zu threads, %s, triangles %zu",
+							softwareRenderer->threadCount(), SoftwareRenderer::simdName(), frameCounters.triangles);
+					}
+					else{
+						int length = snprintf(title, sizeof(title), "Assignment 4 - nodes visited %zu, culled %zu, backfacing %zu, drawn %zu, occluded %zu, state changes %zu (%zu skipped)",
+							scene->cullStats.nodesVisited, scene->cullStats.culled, scene->cullStats.backfacing, scene->cullStats.drawn, scene->cullStats.occluded,
+							glState.issued, glState.skipped);
+						if (dynamicResolution && length > 0 && length < (int) sizeof(title)){
+							snprintf(title + length, sizeof(title) - length, ", resolution %d%% %s, GPU %.1f ms", int(round(dynamicResolution->getScale() * 100.0f)),
+								dynamicResolution->isMultisampled() ? "MSAA" : "FXAA", dynamicResolution->getMilliseconds());
+						}
+					}
+					std::lock_guard<std::mutex> lock(titleMutex);
+					windowTitle = title;
+					lastTitleUpdate = std::chrono::steady_clock::now();
+				}
+
+				ProfileZone swapZone("swap buffers");
+				glfwSwapBuffers(window);
+			}
+		}
+		glfwMakeContextCurrent(NULL);
+	});
+
+	/*
+		Main loop, which is the simulation thread
+		GLFW only lets the main thread handle input, so this thread waits for input until the next tick is due, then
+		moves the camera by however many ticks have gone by and publishes where it ended up. If it falls more than a
+		few ticks behind (like while the window is being dragged) it skips ahead instead of catching up all at once.
+	*/
+	CameraState camera;
+	bool showOverlay = PROFILER_OVERLAY;
+	bool overlayKeyDown = false;
+	bool pickButtonDown = false;
+	std::chrono::steady_clock::time_point nextTick = std::chrono::steady_clock::now() + tickLength;
 	while (!glfwWindowShouldClose(window)){
-		glfwPollEvents();
-		// Process keyboard inputs
+		double untilTick = std::chrono::duration<double>(nextTick - std::chrono::steady_clock::now()).count();
+		if (untilTick > 0.0){
+			glfwWaitEventsTimeout(untilTick);
+		}
+		else{
+			glfwPollEvents();
+		}
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		{
+			std::string title;
+			{
+				std::lock_guard<std::mutex> lock(titleMutex);
+				title.swap(windowTitle);
+			}
+			if (!title.empty()){
+				glfwSetWindowTitle(window, title.data());
+			}
+		}
+		if (now < nextTick){
+			continue;
+		}
+		ProfileZone simulateZone("simulate");
+		{
+			std::lock_guard<std::mutex> lock(collisionMutex);
+			if (newCollisionWorld){
+				collisionWorld = std::move(newCollisionWorld);
+			}
+		}
+
+		// Process keyboard inputs, which apply to every tick that's gone by
+		float turn = 0.0f;
 		if (glfwGetKey(window, GLFW_KEY_LEFT) == GLFW_PRESS){
-			yaw -= CAMERA_ROTATION_SPEED;
+			turn -= CAMERA_ROTATION_SPEED;
 		}
 		if (glfwGetKey(window, GLFW_KEY_RIGHT) == GLFW_PRESS){
-			yaw += CAMERA_ROTATION_SPEED;
+			turn += CAMERA_ROTATION_SPEED;
 		}
+		float forward = 0.0f;
 		if (glfwGetKey(window, GLFW_KEY_UP) == GLFW_PRESS){
-			cameraPosition += (cameraDirection * CAMERA_MOVE_SPEED);
+			forward += CAMERA_MOVE_SPEED;
 		}
 		if (glfwGetKey(window, GLFW_KEY_DOWN) == GLFW_PRESS){
-			cameraPosition -= (cameraDirection * CAMERA_MOVE_SPEED);
+			forward -= CAMERA_MOVE_SPEED;
+		}
+		CameraState previous = camera;
+		int ticks = 0;
+		while (nextTick <= now && ticks < 5){
+			previous = camera;
+			camera.yaw += turn * tickSeconds;
+			glm::vec3 cameraDirection = {cos(glm::radians(camera.yaw)), 0.0f, sin(glm::radians(camera.yaw))};
+			glm::vec3 movement = cameraDirection * float(forward * tickSeconds);
+			camera.position = CAMERA_COLLISION ? moveCamera(collisionWorld->bvh, camera.position, movement) : camera.position + movement;
+			nextTick += tickLength;
+			ticks++;
+		}
+		if (nextTick <= now){
+			nextTick = now + tickLength;
 		}
 
-		// Set camera look
-		cameraDirection = {cos(glm::radians(yaw)), 0.0f, sin(glm::radians(yaw))};
-		glm::mat4 view = glm::lookAt(cameraPosition, cameraPosition + cameraDirection, up);
-
-		// Clear screen
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-		
-		glm::mat4 model = glm::mat4(1.0f);
-		mvp = projection * view * model;
+		// Only toggle the overlay when P goes down, not every tick it's held
+		bool overlayKeyPressed = glfwGetKey(window, GLFW_KEY_P) == GLFW_PRESS;
+		if (overlayKeyPressed && !overlayKeyDown){
+			showOverlay = !showOverlay;
+		}
+		overlayKeyDown = overlayKeyPressed;
 
-		// Draw meshes
-		for (int i = 0; i < meshes.size(); i++){
-			meshes[i].draw(mvp);
+		// Print what's under the mouse when the left button goes down
+		bool pickButtonPressed = glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS;
+		if (pickButtonPressed && !pickButtonDown){
+			double cursorX, cursorY;
+			int windowWidth, windowHeight;
+			glfwGetCursorPos(window, &cursorX, &cursorY);
+			glfwGetWindowSize(window, &windowWidth, &windowHeight);
+			glm::vec2 point(2.0f * cursorX / windowWidth - 1.0f, 1.0f - 2.0f * cursorY / windowHeight);
+			glm::vec3 origin, direction;
+			float length;
+			cameraRay(projection * cameraView(camera.position, camera.yaw), point, origin, direction, length);
+			TriangleBVH::Hit hit;
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			bool picked = collisionWorld->bvh.closestHit(origin, direction, length, hit);
+			double microseconds = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+			if (picked){
+				const char* name = hit.mesh < collisionWorld->names.size() ? collisionWorld->names[hit.mesh].data() : "a removed mesh";
+				printf("Picked %s, face %u, %.3f away (%.1f us)\n", name, hit.face, hit.distance, microseconds);
+			}
+			else{
+				printf("Picked nothing (%.1f us)\n", microseconds);
+			}
 		}
+		pickButtonDown = pickButtonPressed;
 
-		glfwSwapBuffers(window);
+		// The last tick was due one tick length before the next one
+		SimulationSnapshot& snapshot = snapshots.writing();
+		snapshot.previous = previous;
+		snapshot.current = camera;
+		snapshot.time = nextTick - tickLength;
+		snapshot.showOverlay = showOverlay;
+		snapshots.publish();
 	}
 
+	// Take the context back so the scene and the shader programs can delete their GL objects
+	running = false;
+	renderThread.join();
+	glfwMakeContextCurrent(window);
+	scene.reset();
+	softwareRenderer.reset();
+	shaderPrograms.clear();
+
+	if (!traceFile.empty()){
+		profiler.writeTrace(traceFile);
+	}
 	return 0;
 }
\ No newline at end of file